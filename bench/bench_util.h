@@ -0,0 +1,65 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : bench_util.h
+ * Description   : 各个基准测试共用的工具：计时、--name=value 参数解析、删除数据库目录、生成 value
+ * *******************************************************/
+#ifndef CUCKOODB_BENCH_UTIL_H_
+#define CUCKOODB_BENCH_UTIL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <chrono>
+#include <random>
+#include <algorithm>
+
+#include "file/file_pool.h"
+
+namespace cdb {
+namespace bench {
+
+inline double NowMicros() {
+  return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//arg 为 --name=value 时返回 true 并取出 value
+inline bool ParseFlag(const char* arg, const char* name, std::string* value) {
+  size_t len = strlen(name);
+  if (strncmp(arg, "--", 2) != 0 || strncmp(arg + 2, name, len) != 0 || arg[2 + len] != '=') return false;
+  *value = arg + 3 + len;
+  return true;
+}
+
+//递归删除数据库目录
+inline void DestroyDB(const std::string& path) {
+  FileUtil::remove_directory(path);
+}
+
+//先生成一段随机数据，value 从中截取，避免生成 value 的开销计入测试
+class RandomGenerator {
+ public:
+  explicit RandomGenerator(size_t max_len) {
+    std::mt19937 rng(301);
+    data_.resize(std::max<size_t>(1 << 20, max_len * 2));
+    for (auto& c: data_) c = ' ' + rng() % 95;
+    pos_ = 0;
+  }
+
+  std::string Generate(size_t len) {
+    if (pos_ + len > data_.size()) pos_ = 0;
+    pos_ += len;
+    return data_.substr(pos_ - len, len);
+  }
+
+ private:
+  std::string data_;
+  size_t pos_;
+};
+
+}  // namespace bench
+}  // namespace cdb
+
+#endif  // CUCKOODB_BENCH_UTIL_H_
@@ -0,0 +1,469 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : cdb_bench.cc
+ * Description   : 类似 LevelDB db_bench 的基准测试，按顺序运行 --benchmarks 中的负载，
+ *                 报告每个负载的 ops/s、MB/s 和延迟百分位数
+ *                 用法: cdb_bench --benchmarks=fillseq,readrandom --num=1000000 --threads=4
+ *                 比较同步和异步日志的延迟: --log_level=info --async_log=1 2>/dev/null
+ * *******************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <condition_variable>
+
+#include "bench/bench_util.h"
+#include "db/cuckoodb.h"
+#include "util/histogram.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/perf_context.h"
+#include "util/status.h"
+
+namespace {
+
+using cdb::bench::NowMicros;
+using cdb::bench::ParseFlag;
+using cdb::bench::DestroyDB;
+using cdb::bench::RandomGenerator;
+
+struct Flags {
+  std::string benchmarks = "fillseq,fillrandom,overwrite,readrandom,readhot,readmissing,deleterandom,mixed";
+  std::string db = "/tmp/cdb_bench";
+  int64_t num = 1000000;         //写操作数，也是 key 的范围
+  int64_t reads = -1;            //读操作数，小于0时等于 num
+  int key_size = 16;
+  int value_size = 100;
+  int threads = 1;
+  double duration = 0;           //大于0时每个负载运行这么多秒，忽略操作数
+  int read_percent = 90;         //mixed 中读的比例
+  double hot_fraction = 0.01;    //readhot 访问的 key 占 num 的比例
+  bool use_existing_db = false;
+  bool histogram = true;
+  bool statistics = false;      //每个负载结束后打印 GetProperty("cdb.stats")
+  int perf_level = 0;           //大于0时各线程启用 PerfContext，每个负载结束后打印所有线程的总和
+  uint64_t seed = 301;
+  uint32_t num_shards = 1;
+  bool fixed_entry_header = false;
+  uint64_t checkpoint_interval = cdb::Options().checkpoint__interval;
+  uint64_t compaction_threshold = cdb::Options().compaction__size_threshold;
+  std::string log_level = "emerg";
+  bool async_log = false;        //使用 AsyncLogger 写日志
+};
+
+Flags FLAGS;
+
+void ParseFlags(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string v;
+    if (ParseFlag(argv[i], "benchmarks", &v)) FLAGS.benchmarks = v;
+    else if (ParseFlag(argv[i], "db", &v)) FLAGS.db = v;
+    else if (ParseFlag(argv[i], "num", &v)) FLAGS.num = atoll(v.c_str());
+    else if (ParseFlag(argv[i], "reads", &v)) FLAGS.reads = atoll(v.c_str());
+    else if (ParseFlag(argv[i], "key_size", &v)) FLAGS.key_size = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "value_size", &v)) FLAGS.value_size = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "threads", &v)) FLAGS.threads = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "duration", &v)) FLAGS.duration = atof(v.c_str());
+    else if (ParseFlag(argv[i], "read_percent", &v)) FLAGS.read_percent = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "hot_fraction", &v)) FLAGS.hot_fraction = atof(v.c_str());
+    else if (ParseFlag(argv[i], "use_existing_db", &v)) FLAGS.use_existing_db = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "histogram", &v)) FLAGS.histogram = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "statistics", &v)) FLAGS.statistics = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "perf_level", &v)) FLAGS.perf_level = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "seed", &v)) FLAGS.seed = strtoull(v.c_str(), nullptr, 10);
+    else if (ParseFlag(argv[i], "num_shards", &v)) FLAGS.num_shards = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "fixed_entry_header", &v)) FLAGS.fixed_entry_header = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "checkpoint_interval", &v)) FLAGS.checkpoint_interval = strtoull(v.c_str(), nullptr, 10);
+    else if (ParseFlag(argv[i], "compaction_threshold", &v)) FLAGS.compaction_threshold = strtoull(v.c_str(), nullptr, 10);
+    else if (ParseFlag(argv[i], "log_level", &v)) FLAGS.log_level = v;
+    else if (ParseFlag(argv[i], "async_log", &v)) FLAGS.async_log = atoi(v.c_str());
+    else {
+      fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (FLAGS.reads < 0) FLAGS.reads = FLAGS.num;
+  if (FLAGS.threads < 1) FLAGS.threads = 1;
+  if (FLAGS.key_size < 1) FLAGS.key_size = 1;
+}
+
+//key 为定长、前补零的十进制数，超过 key_size 时保留低位
+std::string MakeKey(uint64_t k) {
+  char buffer[32];
+  int len = snprintf(buffer, sizeof(buffer), "%020llu", (unsigned long long)k);
+  std::string key(buffer + std::max(0, len - FLAGS.key_size), std::min(len, FLAGS.key_size));
+  if ((int)key.size() < FLAGS.key_size) key.insert(0, FLAGS.key_size - key.size(), '0');
+  return key;
+}
+
+class Stats {
+ public:
+  Stats() { Start(); }
+
+  void Start() {
+    done_ = 0;
+    found_ = 0;
+    bytes_ = 0;
+    hist_.Clear();
+    perf_.Reset();
+    start_ = NowMicros();
+    finish_ = start_;
+    last_op_finish_ = start_;
+  }
+
+  void Merge(const Stats& other) {
+    hist_.Merge(other.hist_);
+    perf_.Add(other.perf_);
+    done_ += other.done_;
+    found_ += other.found_;
+    bytes_ += other.bytes_;
+    //按最早开始、最晚结束计算总时间
+    if (other.start_ < start_) start_ = other.start_;
+    if (other.finish_ > finish_) finish_ = other.finish_;
+  }
+
+  void Stop() {
+    finish_ = NowMicros();
+  }
+
+  void FinishedSingleOp() {
+    double now = NowMicros();
+    hist_.Add(now - last_op_finish_);
+    last_op_finish_ = now;
+    done_++;
+  }
+
+  //计时从这里开始，FinishedSingleOp 之前的其他工作不计入延迟
+  void StartSingleOp() {
+    last_op_finish_ = NowMicros();
+  }
+
+  void SetPerfContext(const cdb::PerfContext& perf) { perf_ = perf; }
+  void AddBytes(int64_t n) { bytes_ += n; }
+  void AddFound() { found_++; }
+  int64_t Done() const { return done_; }
+
+  void Report(const std::string& name, bool has_found) {
+    if (done_ < 1) done_ = 1;
+    double elapsed = (finish_ - start_) * 1e-6;
+    std::string extra;
+    char buffer[100];
+    if (bytes_ > 0) {
+      snprintf(buffer, sizeof(buffer), "%6.1f MB/s", (bytes_ / 1048576.0) / elapsed);
+      extra = buffer;
+    }
+    if (has_found) {
+      snprintf(buffer, sizeof(buffer), "%s(%lld of %lld found)", extra.empty() ? "" : " ",
+               (long long)found_, (long long)done_);
+      extra += buffer;
+    }
+    fprintf(stdout, "%-12s : %11.3f micros/op %10.0f ops/sec; %s\n",
+            name.c_str(), elapsed * 1e6 / done_, done_ / elapsed, extra.c_str());
+    fprintf(stdout, "%-12s   P50 %.2f  P99 %.2f  P99.9 %.2f  Max %.2f micros\n",
+            "", hist_.Percentile(50), hist_.Percentile(99), hist_.Percentile(99.9), hist_.Max());
+    if (FLAGS.perf_level > 0) fprintf(stdout, "%-12s   PerfContext: %s\n", "", perf_.ToString(true).c_str());
+    if (FLAGS.histogram) fprintf(stdout, "Microseconds per op:\n%s\n", hist_.ToString().c_str());
+    fflush(stdout);
+  }
+
+ private:
+  double start_;
+  double finish_;
+  double last_op_finish_;
+  int64_t done_;
+  int64_t found_;
+  int64_t bytes_;
+  cdb::Histogram hist_;
+  cdb::PerfContext perf_;
+};
+
+//所有线程准备好之后同时开始
+struct SharedState {
+  std::mutex mu;
+  std::condition_variable cv;
+  int total;
+  int num_initialized;
+  int num_done;
+  bool start;
+  std::atomic<bool> stop;
+};
+
+struct ThreadState {
+  int tid;
+  std::mt19937_64 rng;
+  Stats stats;
+  SharedState* shared;
+  double start_micros;
+
+  ThreadState(int index, int seed_offset, uint64_t seed)
+    : tid(index), rng(seed + seed_offset), shared(nullptr), start_micros(0) {}
+
+  uint64_t Uniform(uint64_t n) {
+    return n == 0 ? 0 : rng() % n;
+  }
+};
+
+class Benchmark {
+ public:
+  typedef void (Benchmark::*Method)(ThreadState*);
+
+  Benchmark() : db_(nullptr), total_thread_count_(0) {}
+
+  ~Benchmark() {
+    delete db_;
+  }
+
+  void Run() {
+    PrintHeader();
+    if (!FLAGS.use_existing_db) DestroyDB(FLAGS.db);
+    Open();
+
+    size_t start = 0;
+    while (start <= FLAGS.benchmarks.size()) {
+      size_t end = FLAGS.benchmarks.find(',', start);
+      if (end == std::string::npos) end = FLAGS.benchmarks.size();
+      std::string name = FLAGS.benchmarks.substr(start, end - start);
+      start = end + 1;
+      if (name.empty()) continue;
+
+      Method method = nullptr;
+      bool fresh_db = false;
+      bool has_found = false;
+      if (name == "fillseq") {
+        fresh_db = true;
+        method = &Benchmark::WriteSeq;
+      } else if (name == "fillrandom") {
+        fresh_db = true;
+        method = &Benchmark::WriteRandom;
+      } else if (name == "overwrite") {
+        method = &Benchmark::WriteRandom;
+      } else if (name == "readrandom") {
+        has_found = true;
+        method = &Benchmark::ReadRandom;
+      } else if (name == "readhot") {
+        has_found = true;
+        method = &Benchmark::ReadHot;
+      } else if (name == "readmissing") {
+        has_found = true;
+        method = &Benchmark::ReadMissing;
+      } else if (name == "deleterandom") {
+        method = &Benchmark::DeleteRandom;
+      } else if (name == "mixed") {
+        has_found = true;
+        method = &Benchmark::Mixed;
+      } else {
+        fprintf(stderr, "unknown benchmark '%s'\n", name.c_str());
+        continue;
+      }
+
+      if (fresh_db && !FLAGS.use_existing_db) {
+        delete db_;
+        db_ = nullptr;
+        DestroyDB(FLAGS.db);
+        Open();
+      }
+      RunBenchmark(name, method, has_found);
+      if (FLAGS.statistics) {
+        std::string stats;
+        if (db_->GetProperty("cdb.stats", &stats).IsOK()) fprintf(stdout, "%s\n", stats.c_str());
+      }
+    }
+  }
+
+ private:
+  void PrintHeader() {
+    fprintf(stdout, "Keys:       %d bytes each\n", FLAGS.key_size);
+    fprintf(stdout, "Values:     %d bytes each\n", FLAGS.value_size);
+    fprintf(stdout, "Entries:    %lld\n", (long long)FLAGS.num);
+    fprintf(stdout, "Reads:      %lld\n", (long long)FLAGS.reads);
+    fprintf(stdout, "Threads:    %d\n", FLAGS.threads);
+    if (FLAGS.duration > 0) fprintf(stdout, "Duration:   %.1f s per benchmark\n", FLAGS.duration);
+    fprintf(stdout, "Shards:     %u\n", FLAGS.num_shards);
+    fprintf(stdout, "Logging:    %s, %s\n", FLAGS.log_level.c_str(), FLAGS.async_log ? "async" : "sync");
+    fprintf(stdout, "------------------------------------------------\n");
+  }
+
+  void Open() {
+    cdb::Options options;
+    options.storage__num_shards = FLAGS.num_shards;
+    options.storage__fixed_entry_header = FLAGS.fixed_entry_header;
+    options.checkpoint__interval = FLAGS.checkpoint_interval;
+    options.compaction__size_threshold = FLAGS.compaction_threshold;
+    db_ = new cdb::CuckooDB(options, FLAGS.db);
+    cdb::Status s = db_->Open();
+    if (!s.IsOK()) {
+      fprintf(stderr, "open error: %s\n", s.ToString().c_str());
+      exit(1);
+    }
+  }
+
+  void RunBenchmark(const std::string& name, Method method, bool has_found) {
+    SharedState shared;
+    shared.total = FLAGS.threads;
+    shared.num_initialized = 0;
+    shared.num_done = 0;
+    shared.start = false;
+    shared.stop = false;
+
+    std::vector<ThreadState*> states;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < FLAGS.threads; i++) {
+      //每个负载使用不同的随机种子，读不会恰好重复之前写入的 key 序列
+      states.push_back(new ThreadState(i, ++total_thread_count_, FLAGS.seed));
+      states.back()->shared = &shared;
+      threads.push_back(std::thread(&Benchmark::ThreadBody, this, method, states.back()));
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(shared.mu);
+      shared.cv.wait(lock, [&]() { return shared.num_initialized == shared.total; });
+      shared.start = true;
+      shared.cv.notify_all();
+    }
+    for (auto& t: threads) t.join();
+
+    Stats merged = states[0]->stats;
+    for (size_t i = 1; i < states.size(); i++) merged.Merge(states[i]->stats);
+    merged.Report(name, has_found);
+    for (auto state: states) delete state;
+  }
+
+  void ThreadBody(Method method, ThreadState* thread) {
+    SharedState* shared = thread->shared;
+    {
+      std::unique_lock<std::mutex> lock(shared->mu);
+      shared->num_initialized++;
+      shared->cv.notify_all();
+      shared->cv.wait(lock, [&]() { return shared->start; });
+    }
+    cdb::SetPerfLevel(static_cast<cdb::PerfLevel>(FLAGS.perf_level));
+    cdb::GetPerfContext()->Reset();
+    thread->stats.Start();
+    thread->start_micros = NowMicros();
+    (this->*method)(thread);
+    thread->stats.Stop();
+    thread->stats.SetPerfContext(*cdb::GetPerfContext());
+  }
+
+  //--duration 大于0时按时间，否则每个线程执行 num_ops / threads 次
+  bool ShouldContinue(ThreadState* thread, int64_t i, int64_t num_ops) {
+    if (FLAGS.duration <= 0) return i < num_ops / FLAGS.threads;
+    if (thread->shared->stop) return false;
+    if ((i & 0xFF) == 0 && NowMicros() - thread->start_micros >= FLAGS.duration * 1e6) {
+      thread->shared->stop = true;
+      return false;
+    }
+    return true;
+  }
+
+  void Put(ThreadState* thread, uint64_t k, RandomGenerator& gen) {
+    std::string key = MakeKey(k);
+    std::string value = gen.Generate(FLAGS.value_size);
+    thread->stats.StartSingleOp();
+    cdb::Status s = db_->Put(write_options_, key, value);
+    thread->stats.FinishedSingleOp();
+    if (!s.IsOK()) {
+      fprintf(stderr, "put error: %s\n", s.ToString().c_str());
+      exit(1);
+    }
+    thread->stats.AddBytes(key.size() + value.size());
+  }
+
+  void Get(ThreadState* thread, uint64_t k, const char* suffix=nullptr) {
+    std::string key = MakeKey(k);
+    if (suffix != nullptr) key.append(suffix);
+    std::string value;
+    thread->stats.StartSingleOp();
+    cdb::Status s = db_->Get(read_options_, key, &value);
+    thread->stats.FinishedSingleOp();
+    if (s.IsOK()) {
+      thread->stats.AddFound();
+      thread->stats.AddBytes(key.size() + value.size());
+    }
+  }
+
+  void WriteSeq(ThreadState* thread) {
+    RandomGenerator gen(FLAGS.value_size);
+    int64_t per_thread = FLAGS.num / FLAGS.threads;
+    for (int64_t i = 0; ShouldContinue(thread, i, FLAGS.num); i++) {
+      Put(thread, (thread->tid * per_thread + i) % std::max<int64_t>(1, FLAGS.num), gen);
+    }
+  }
+
+  void WriteRandom(ThreadState* thread) {
+    RandomGenerator gen(FLAGS.value_size);
+    for (int64_t i = 0; ShouldContinue(thread, i, FLAGS.num); i++) {
+      Put(thread, thread->Uniform(FLAGS.num), gen);
+    }
+  }
+
+  void ReadRandom(ThreadState* thread) {
+    for (int64_t i = 0; ShouldContinue(thread, i, FLAGS.reads); i++) {
+      Get(thread, thread->Uniform(FLAGS.num));
+    }
+  }
+
+  void ReadHot(ThreadState* thread) {
+    uint64_t range = std::max<uint64_t>(1, FLAGS.num * FLAGS.hot_fraction);
+    for (int64_t i = 0; ShouldContinue(thread, i, FLAGS.reads); i++) {
+      Get(thread, thread->Uniform(range));
+    }
+  }
+
+  //key 加上后缀后一定不存在
+  void ReadMissing(ThreadState* thread) {
+    for (int64_t i = 0; ShouldContinue(thread, i, FLAGS.reads); i++) {
+      Get(thread, thread->Uniform(FLAGS.num), ".");
+    }
+  }
+
+  void DeleteRandom(ThreadState* thread) {
+    for (int64_t i = 0; ShouldContinue(thread, i, FLAGS.num); i++) {
+      std::string key = MakeKey(thread->Uniform(FLAGS.num));
+      thread->stats.StartSingleOp();
+      db_->Delete(write_options_, key);
+      thread->stats.FinishedSingleOp();
+    }
+  }
+
+  void Mixed(ThreadState* thread) {
+    RandomGenerator gen(FLAGS.value_size);
+    for (int64_t i = 0; ShouldContinue(thread, i, FLAGS.reads); i++) {
+      uint64_t k = thread->Uniform(FLAGS.num);
+      if ((int)thread->Uniform(100) < FLAGS.read_percent) {
+        Get(thread, k);
+      } else {
+        Put(thread, k, gen);
+      }
+    }
+  }
+
+  cdb::CuckooDB* db_;
+  cdb::ReadOptions read_options_;
+  cdb::WriteOptions write_options_;
+  int total_thread_count_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  ParseFlags(argc, argv);
+  if (cdb::Logger::set_current_level(FLAGS.log_level.c_str()) < 0) {
+    fprintf(stderr, "Invalid log level '%s'\n", FLAGS.log_level.c_str());
+    exit(1);
+  }
+  cdb::Logger::set_async(FLAGS.async_log);
+  Benchmark benchmark;
+  benchmark.Run();
+  //写出异步日志中剩余的消息
+  cdb::Logger::set_async(false);
+  return 0;
+}
@@ -0,0 +1,489 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : micro_bench.cc
+ * Description   : 核心函数的微基准测试：CRC32C、哈希、varint、Entry 头部、HintData、Event 交接、FilePool、索引、统计
+ *                 每个用例先预热，再按 --min_time 校准迭代次数，重复 --repetitions 次，报告中位数和变异系数
+ *                 用法: micro_bench [--filter=hash] [--min_time=0.2] [--repetitions=5] [--list=1]
+ * *******************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <algorithm>
+#include <random>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench/bench_util.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
+#include "util/hash.h"
+#include "util/entry.h"
+#include "util/event_manager.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/statistics.h"
+#include "storage_engine/data_file_format.h"
+#include "storage_engine/entry_format.h"
+#include "file/file_pool.h"
+
+namespace {
+
+using cdb::bench::NowMicros;
+using cdb::bench::ParseFlag;
+using cdb::bench::DestroyDB;
+
+struct Flags {
+  std::string filter;          //只运行名字中包含 filter 的用例
+  double min_time = 0.2;       //每次重复至少运行的秒数
+  double warmup = 0.05;        //预热的秒数
+  int repetitions = 5;
+  bool list = false;
+  std::string dir = "/tmp/micro_bench";
+};
+
+Flags FLAGS;
+
+void ParseFlags(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string v;
+    if (ParseFlag(argv[i], "filter", &v)) FLAGS.filter = v;
+    else if (ParseFlag(argv[i], "min_time", &v)) FLAGS.min_time = atof(v.c_str());
+    else if (ParseFlag(argv[i], "warmup", &v)) FLAGS.warmup = atof(v.c_str());
+    else if (ParseFlag(argv[i], "repetitions", &v)) FLAGS.repetitions = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "list", &v)) FLAGS.list = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "dir", &v)) FLAGS.dir = v;
+    else {
+      fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (FLAGS.repetitions < 1) FLAGS.repetitions = 1;
+}
+
+//阻止编译器把结果没有被使用的计算优化掉
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+//run(n) 执行 n 次被测操作，setup 在预热之前执行一次，不计入时间
+struct Case {
+  std::string name;
+  std::function<void(uint64_t)> run;
+  std::function<void()> setup;
+};
+
+std::vector<Case>& Cases() {
+  static std::vector<Case> cases;
+  return cases;
+}
+
+void Register(const std::string& name, std::function<void(uint64_t)> run,
+              std::function<void()> setup=nullptr) {
+  Cases().push_back(Case{name, run, setup});
+}
+
+std::string RandomBytes(size_t size, uint64_t seed) {
+  std::mt19937_64 rng(seed);
+  std::string s(size, 0);
+  for (auto& c: s) c = rng();
+  return s;
+}
+
+//======== CRC32C / 哈希 ========
+
+void RegisterChecksumCases() {
+  for (size_t size: {64, 4096}) {
+    std::string data = RandomBytes(size, size);
+    Register("crc32c/Extend/" + std::to_string(size), [data](uint64_t n) {
+      uint32_t crc = 0;
+      for (uint64_t i = 0; i < n; i++) crc = cdb::crc32c::Extend(crc, data.data(), data.size());
+      DoNotOptimize(crc);
+    });
+  }
+
+  for (size_t size: {16, 100, 1024}) {
+    std::string data = RandomBytes(size, size);
+    Register("hash/XXH64/" + std::to_string(size), [data](uint64_t n) {
+      uint64_t h = 0;
+      for (uint64_t i = 0; i < n; i++) h += cdb::HashKeyLegacy(data.data(), data.size());
+      DoNotOptimize(h);
+    });
+    Register("hash/XXH3/" + std::to_string(size), [data](uint64_t n) {
+      uint64_t h = 0;
+      for (uint64_t i = 0; i < n; i++) h += cdb::HashKey(data.data(), data.size());
+      DoNotOptimize(h);
+    });
+  }
+}
+
+//======== varint ========
+
+//值的分布与 HintData 中的 offset_entry 和 Entry 头部的字段相近：1 到 4 字节
+std::vector<uint64_t> MakeVarintValues(size_t num) {
+  std::mt19937_64 rng(301);
+  std::vector<uint64_t> values(num);
+  for (auto& v: values) v = rng() >> (40 + rng() % 24);
+  return values;
+}
+
+void RegisterVarintCases() {
+  const size_t kNum = 1024;
+  std::vector<uint64_t> values = MakeVarintValues(kNum);
+  std::string encoded;
+  for (auto v: values) cdb::PutVarint64(&encoded, v);
+
+  Register("varint/EncodeVarint64", [values](uint64_t n) {
+    char buffer[16];
+    for (uint64_t i = 0; i < n; i++) {
+      char* end = cdb::EncodeVarint64(buffer, values[i % kNum]);
+      DoNotOptimize(end);
+    }
+  });
+
+  Register("varint/GetVarint64Ptr", [encoded](uint64_t n) {
+    const char* limit = encoded.data() + encoded.size();
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i += kNum) {
+      const char* p = encoded.data();
+      for (size_t j = 0; j < kNum && i + j < n; j++) {
+        uint64_t v;
+        p = cdb::GetVarint64Ptr(p, limit, &v);
+        sum += v;
+      }
+    }
+    DoNotOptimize(sum);
+  });
+
+  //与 HintData 一样按 128 个一块解码，每次操作为一个值
+  Register("varint/GetVarint64Array", [encoded](uint64_t n) {
+    const size_t kBlock = 128;
+    const char* limit = encoded.data() + encoded.size();
+    uint64_t block[kBlock];
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i += kNum) {
+      const char* p = encoded.data();
+      for (size_t j = 0; j < kNum && i + j < n; j += kBlock) {
+        p = cdb::GetVarint64Array(p, limit, block, kBlock);
+        sum += block[0];
+      }
+    }
+    DoNotOptimize(sum);
+  });
+}
+
+//======== Entry 头部 / HintData ========
+
+void RegisterFormatCases() {
+  for (uint32_t format_flags: {0u, (uint32_t)cdb::kFormatFixedEntryHeader}) {
+    std::string suffix = format_flags ? "fixed" : "varint";
+    cdb::EntryHeader header;
+    header.crc32 = 0x12345678;
+    header.flags = 0;
+    header.timestamp = 0;
+    header.size_key = 16;
+    header.size_value = 100;
+    header.hash = 0x9E3779B97F4A7C15ULL;
+
+    Register("entry_header/EncodeTo/" + suffix, [header, format_flags](uint64_t n) {
+      cdb::Options options;
+      char buffer[64];
+      uint64_t total = 0;
+      for (uint64_t i = 0; i < n; i++) {
+        total += cdb::EntryHeader::EncodeTo(options, &header, buffer, format_flags);
+        DoNotOptimize(buffer);
+      }
+      DoNotOptimize(total);
+    });
+
+    Register("entry_header/DecodeFrom/" + suffix, [header, format_flags](uint64_t n) {
+      cdb::Options options;
+      cdb::ReadOptions read_options;
+      char buffer[64];
+      cdb::EntryHeader::EncodeTo(options, &header, buffer, format_flags);
+      uint64_t total = 0;
+      for (uint64_t i = 0; i < n; i++) {
+        cdb::EntryHeader out;
+        uint32_t num_bytes_read = 0;
+        cdb::EntryHeader::DecodeFrom(options, read_options, buffer, sizeof(buffer), &out, &num_bytes_read, format_flags);
+        total += out.size_value + num_bytes_read;
+      }
+      DoNotOptimize(total);
+    });
+  }
+
+  const size_t kNumHints = 1024;
+  std::mt19937_64 rng(301);
+  std::vector< std::pair<uint64_t, uint32_t> > hints(kNumHints);
+  for (size_t i = 0; i < kNumHints; i++) hints[i] = std::make_pair(rng(), (uint32_t)(i * 140));
+
+  Register("hint/HintData::EncodeTo", [hints](uint64_t n) {
+    char buffer[16];
+    for (uint64_t i = 0; i < n; i++) {
+      cdb::HintData hint;
+      hint.hashed_key = hints[i % kNumHints].first;
+      hint.offset_entry = hints[i % kNumHints].second;
+      uint32_t size = cdb::HintData::EncodeTo(&hint, buffer);
+      DoNotOptimize(size);
+    }
+  });
+
+  std::string unsorted(kNumHints * 16, 0);
+  char* ptr = &unsorted[0];
+  for (auto& h: hints) {
+    cdb::HintData hint;
+    hint.hashed_key = h.first;
+    hint.offset_entry = h.second;
+    ptr += cdb::HintData::EncodeTo(&hint, ptr);
+  }
+  unsorted.resize(ptr - unsorted.data());
+
+  Register("hint/HintData::DecodeFrom", [unsorted](uint64_t n) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i += kNumHints) {
+      const char* p = unsorted.data();
+      uint64_t remaining = unsorted.size();
+      for (size_t j = 0; j < kNumHints && i + j < n; j++) {
+        cdb::HintData hint;
+        uint32_t num_bytes_read;
+        cdb::HintData::DecodeFrom(p, remaining, &hint, &num_bytes_read);
+        p += num_bytes_read;
+        remaining -= num_bytes_read;
+        sum += hint.offset_entry;
+      }
+    }
+    DoNotOptimize(sum);
+  });
+
+  //排序后的块格式，每次操作为一条 hint
+  std::vector< std::pair<uint64_t, uint32_t> > sorted_hints = hints;
+  std::sort(sorted_hints.begin(), sorted_hints.end());
+  std::string sorted(cdb::SortedHintData::GetMaxEncodedSize(kNumHints), 0);
+  sorted.resize(cdb::SortedHintData::EncodeTo(sorted_hints, &sorted[0]));
+
+  Register("hint/SortedHintData::DecodeFrom", [sorted](uint64_t n) {
+    std::vector< std::pair<uint64_t, uint64_t> > out;
+    out.reserve(kNumHints);
+    for (uint64_t i = 0; i < n; i += kNumHints) {
+      out.clear();
+      cdb::SortedHintData::DecodeFrom(sorted.data(), sorted.size(), kNumHints, 0, out);
+      DoNotOptimize(out.data());
+    }
+  });
+}
+
+//======== Event 交接 ========
+
+//一次操作为 notify_and_wait 把数据交给等待的线程并等到它调用 Done()
+void RegisterEventCases() {
+  Register("event/Event<int>::notify_and_wait", [](uint64_t n) {
+    cdb::Event<int> event;
+    std::thread consumer([&event]() {
+      while (true) {
+        int data = event.Wait();
+        event.Done();
+        if (data < 0) break;
+      }
+    });
+    for (uint64_t i = 0; i < n; i++) {
+      int data = 1;
+      event.notify_and_wait(data);
+    }
+    int stop = -1;
+    event.notify_and_wait(stop);
+    consumer.join();
+  });
+}
+
+//======== FilePool ========
+
+const uint32_t kNumPoolFiles = 64;
+const uint64_t kSizePoolFile = 64 * 1024;
+
+std::string PoolFilePath(uint32_t fileid) {
+  return FLAGS.dir + "/" + std::to_string(fileid);
+}
+
+void CreatePoolFiles() {
+  struct stat st;
+  if (stat(PoolFilePath(kNumPoolFiles - 1).c_str(), &st) == 0 && (uint64_t)st.st_size == kSizePoolFile) return;
+  DestroyDB(FLAGS.dir);
+  mkdir(FLAGS.dir.c_str(), 0755);
+  std::string data = RandomBytes(kSizePoolFile, 1);
+  for (uint32_t fileid = 0; fileid < kNumPoolFiles; fileid++) {
+    int fd = open(PoolFilePath(fileid).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write(fd, data.data(), data.size()) != (ssize_t)data.size()) {
+      fprintf(stderr, "could not create %s\n", PoolFilePath(fileid).c_str());
+      exit(1);
+    }
+    close(fd);
+  }
+}
+
+//文件都已经映射，测的是命中路径在多个线程同时访问时的开销
+void RegisterFilePoolCases() {
+  for (int num_threads: {1, 4}) {
+    Register("file_pool/GetFile/threads:" + std::to_string(num_threads), [num_threads](uint64_t n) {
+      cdb::FilePool pool;
+      std::vector<std::string> paths;
+      for (uint32_t fileid = 0; fileid < kNumPoolFiles; fileid++) paths.push_back(PoolFilePath(fileid));
+      std::vector<std::thread> threads;
+      for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&pool, &paths, n, num_threads, t]() {
+          std::mt19937 rng(t);
+          uint64_t sum = 0;
+          for (uint64_t i = t; i < n; i += num_threads) {
+            uint32_t fileid = rng() % kNumPoolFiles;
+            cdb::FileResource file;
+            if (!pool.GetFile(fileid, paths[fileid], kSizePoolFile, &file).IsOK()) continue;
+            sum += file.mmap[i % kSizePoolFile];
+            pool.ReleaseFile(file);
+          }
+          DoNotOptimize(sum);
+        }));
+      }
+      for (auto& t: threads) t.join();
+    }, CreatePoolFiles);
+  }
+}
+
+//======== 索引 ========
+
+//与 StorageEngine 的索引相同，hashed_key -> (fileid << 32 | offset)
+typedef std::multimap<uint64_t, uint64_t> Index;
+
+void RegisterIndexCases() {
+  Register("index/insert", [](uint64_t n) {
+    std::mt19937_64 rng(301);
+    Index index;
+    for (uint64_t i = 0; i < n; i++) index.insert(std::make_pair(rng(), i));
+    DoNotOptimize(index.size());
+  });
+
+  const size_t kSizeIndex = 1000000;
+  std::shared_ptr<Index> index(new Index());
+  std::shared_ptr< std::vector<uint64_t> > keys(new std::vector<uint64_t>(kSizeIndex));
+  Register("index/lookup/1M", [index, keys](uint64_t n) {
+    std::mt19937_64 rng(7);
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i++) {
+      auto range = index->equal_range((*keys)[rng() % kSizeIndex]);
+      for (auto it = range.first; it != range.second; ++it) sum += it->second;
+    }
+    DoNotOptimize(sum);
+  }, [index, keys]() {
+    //用 --filter 跳过时不建立索引
+    std::mt19937_64 rng(301);
+    for (size_t i = 0; i < kSizeIndex; i++) {
+      (*keys)[i] = rng();
+      index->insert(std::make_pair((*keys)[i], i));
+    }
+  });
+}
+
+//======== 统计 ========
+
+//每个 Get 都会记录几个计数器和直方图，多个线程同时记录时不应该互相影响
+void RegisterStatisticsCases() {
+  std::shared_ptr<cdb::Statistics> statistics(new cdb::Statistics());
+  for (int num_threads: {1, 4}) {
+    Register("statistics/Record/threads:" + std::to_string(num_threads), [statistics, num_threads](uint64_t n) {
+      std::vector<std::thread> threads;
+      for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&statistics, n, num_threads, t]() {
+          for (uint64_t i = t; i < n; i += num_threads) statistics->Record(cdb::kIndexProbes);
+        }));
+      }
+      for (auto& t: threads) t.join();
+    });
+    Register("statistics/MeasureTime/threads:" + std::to_string(num_threads), [statistics, num_threads](uint64_t n) {
+      std::vector<std::thread> threads;
+      for (int t = 0; t < num_threads; t++) {
+        threads.push_back(std::thread([&statistics, n, num_threads, t]() {
+          for (uint64_t i = t; i < n; i += num_threads) statistics->MeasureTime(cdb::kHistGet, i & 0xFFFFF);
+        }));
+      }
+      for (auto& t: threads) t.join();
+    });
+  }
+  //包括两次读取时钟
+  Register("statistics/StopWatch", [statistics](uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+      cdb::StopWatch stop_watch(statistics.get(), cdb::kHistGetEntry);
+    }
+  });
+}
+
+//======== 运行 ========
+
+double RunOnce(const Case& c, uint64_t n) {
+  double start = NowMicros();
+  c.run(n);
+  return NowMicros() - start;
+}
+
+void RunCase(const Case& c) {
+  if (c.setup) c.setup();
+  //预热，同时估计每次操作的时间
+  uint64_t n = 1;
+  double micros = RunOnce(c, n);
+  while (micros < FLAGS.warmup * 1e6) {
+    n *= (micros < 1000) ? 10 : 2;
+    micros = RunOnce(c, n);
+  }
+  uint64_t iterations = std::max<uint64_t>(1, (uint64_t)(n * FLAGS.min_time * 1e6 / std::max(micros, 1.0)));
+
+  std::vector<double> ns_per_op;
+  for (int r = 0; r < FLAGS.repetitions; r++) {
+    ns_per_op.push_back(RunOnce(c, iterations) * 1e3 / iterations);
+  }
+  std::sort(ns_per_op.begin(), ns_per_op.end());
+  double median = ns_per_op[ns_per_op.size() / 2];
+  double mean = 0;
+  for (auto v: ns_per_op) mean += v;
+  mean /= ns_per_op.size();
+  double variance = 0;
+  for (auto v: ns_per_op) variance += (v - mean) * (v - mean);
+  double cv = (ns_per_op.size() > 1) ? sqrt(variance / (ns_per_op.size() - 1)) / mean * 100 : 0;
+
+  printf("%-40s %12llu %12.2f %12.2f %12.2f %7.2f%%\n", c.name.c_str(), (unsigned long long)iterations,
+         median, ns_per_op.front(), ns_per_op.back(), cv);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cdb::Logger::set_current_level("emerg");
+  ParseFlags(argc, argv);
+
+  RegisterChecksumCases();
+  RegisterVarintCases();
+  RegisterFormatCases();
+  RegisterEventCases();
+  RegisterFilePoolCases();
+  RegisterIndexCases();
+  RegisterStatisticsCases();
+
+  if (FLAGS.list) {
+    for (const Case& c: Cases()) printf("%s\n", c.name.c_str());
+    return 0;
+  }
+
+  printf("%-40s %12s %12s %12s %12s %8s\n", "benchmark", "iterations", "median ns/op", "min ns/op", "max ns/op", "cv");
+  for (const Case& c: Cases()) {
+    if (c.name.find(FLAGS.filter) == std::string::npos) continue;
+    RunCase(c);
+  }
+  DestroyDB(FLAGS.dir);
+  return 0;
+}
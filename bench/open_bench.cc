@@ -0,0 +1,288 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : open_bench.cc
+ * Description   : 测量 CuckooDB::Open 的时间：先生成指定大小的数据库，然后分别在有快照、只有 HintData、
+ *                 没有 manifest、数据文件没有 footer (崩溃恢复) 的情况下打开，页缓存为热或冷，
+ *                 报告各阶段 (LoadTiming) 的耗时
+ *                 用法: open_bench --num=1000000 --num_files=64 --repetitions=3
+ * *******************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include "bench/bench_util.h"
+#include "db/cuckoodb.h"
+#include "storage_engine/data_file_format.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+namespace {
+
+using cdb::bench::NowMicros;
+using cdb::bench::ParseFlag;
+using cdb::bench::DestroyDB;
+using cdb::bench::RandomGenerator;
+
+struct Flags {
+  std::string db = "/tmp/open_bench";
+  std::string modes = "checkpoint,hints,scan,recovery";
+  int64_t num = 1000000;
+  int key_size = 16;
+  int value_size = 100;
+  uint32_t datafile_size = 0;     //为0时使用默认大小
+  int num_files = 0;              //大于0时按 num 和 value_size 估算 datafile_size，得到大约这么多个文件
+  uint32_t num_shards = 1;
+  uint32_t num_threads_load = cdb::Options().internal__num_threads_load;
+  int repetitions = 3;
+  bool cold = true;               //同时测量页缓存为冷时的时间
+  bool use_existing_db = false;
+};
+
+Flags FLAGS;
+
+void ParseFlags(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string v;
+    if (ParseFlag(argv[i], "db", &v)) FLAGS.db = v;
+    else if (ParseFlag(argv[i], "modes", &v)) FLAGS.modes = v;
+    else if (ParseFlag(argv[i], "num", &v)) FLAGS.num = atoll(v.c_str());
+    else if (ParseFlag(argv[i], "key_size", &v)) FLAGS.key_size = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "value_size", &v)) FLAGS.value_size = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "datafile_size", &v)) FLAGS.datafile_size = strtoul(v.c_str(), nullptr, 10);
+    else if (ParseFlag(argv[i], "num_files", &v)) FLAGS.num_files = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "num_shards", &v)) FLAGS.num_shards = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "num_threads_load", &v)) FLAGS.num_threads_load = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "repetitions", &v)) FLAGS.repetitions = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "cold", &v)) FLAGS.cold = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "use_existing_db", &v)) FLAGS.use_existing_db = atoi(v.c_str());
+    else {
+      fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (FLAGS.repetitions < 1) FLAGS.repetitions = 1;
+  if (FLAGS.num_files > 0) {
+    uint64_t size_total = (uint64_t)FLAGS.num * (FLAGS.key_size + FLAGS.value_size + 24);
+    FLAGS.datafile_size = std::max<uint64_t>(64 * 1024, size_total / FLAGS.num_files);
+  }
+}
+
+cdb::Options MakeOptions() {
+  cdb::Options options;
+  options.storage__num_shards = FLAGS.num_shards;
+  options.storage__datafile_size = FLAGS.datafile_size;
+  options.internal__num_threads_load = FLAGS.num_threads_load;
+  //测量期间不触发合并
+  options.compaction__size_threshold = ~0ULL;
+  return options;
+}
+
+//======== 数据库目录中的文件 ========
+
+struct DBFiles {
+  std::vector<std::string> datafiles;
+  std::vector<std::string> checkpoints;
+  std::vector<std::string> manifests;
+  std::vector<std::string> all;
+  uint64_t size_total;
+};
+
+DBFiles* g_files;
+
+bool IsHexName(const char* name) {
+  if (*name == 0) return false;
+  for (; *name; name++) {
+    if (!isxdigit(*name)) return false;
+  }
+  return true;
+}
+
+int CollectEntry(const char* path, const struct stat* sb, int typeflag, struct FTW* ftwbuf) {
+  if (typeflag != FTW_F) return 0;
+  const char* name = path + ftwbuf->base;
+  g_files->all.push_back(path);
+  g_files->size_total += sb->st_size;
+  if (strncmp(name, "checkpoint", 10) == 0) g_files->checkpoints.push_back(path);
+  else if (strncmp(name, "manifest", 8) == 0) g_files->manifests.push_back(path);
+  else if (IsHexName(name)) g_files->datafiles.push_back(path);
+  return 0;
+}
+
+DBFiles ListFiles() {
+  DBFiles files;
+  files.size_total = 0;
+  g_files = &files;
+  nftw(FLAGS.db.c_str(), CollectEntry, 64, FTW_PHYS);
+  g_files = nullptr;
+  return files;
+}
+
+void RemoveFiles(const std::vector<std::string>& paths) {
+  for (auto& path: paths) remove(path.c_str());
+}
+
+//模拟写 HintData 之前进程退出：把每个数据文件截断到 HintData 开始的位置
+int TruncateFooters() {
+  int num_truncated = 0;
+  for (auto& path: ListFiles().datafiles) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) continue;
+    struct stat info;
+    char buffer[32];
+    bool ok = fstat(fd, &info) == 0
+           && info.st_size > (off_t)cdb::DateFileFooter::GetFixedSize()
+           && pread(fd, buffer, cdb::DateFileFooter::GetFixedSize(), info.st_size - cdb::DateFileFooter::GetFixedSize())
+              == (ssize_t)cdb::DateFileFooter::GetFixedSize();
+    close(fd);
+    if (!ok) continue;
+    cdb::DateFileFooter footer;
+    cdb::DateFileFooter::DecodeFrom(buffer, cdb::DateFileFooter::GetFixedSize(), &footer);
+    if (footer.offset_indexes <= cdb::DataFileHeader::GetFixedSize() || footer.offset_indexes >= (uint64_t)info.st_size) continue;
+    if (truncate(path.c_str(), footer.offset_indexes) == 0) num_truncated++;
+  }
+  return num_truncated;
+}
+
+//有权限时清空整个页缓存，否则逐个文件 POSIX_FADV_DONTNEED，只能丢弃干净的页
+const char* DropCaches() {
+  sync();
+  int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+  if (fd >= 0) {
+    bool ok = write(fd, "3", 1) == 1;
+    close(fd);
+    if (ok) return "drop_caches";
+  }
+  for (auto& path: ListFiles().all) {
+    int fd_file = open(path.c_str(), O_RDONLY);
+    if (fd_file < 0) continue;
+    fdatasync(fd_file);
+    posix_fadvise(fd_file, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd_file);
+  }
+  return "fadvise";
+}
+
+//======== 生成和测量 ========
+
+void Generate() {
+  DestroyDB(FLAGS.db);
+  cdb::CuckooDB db(MakeOptions(), FLAGS.db);
+  cdb::Status s = db.Open();
+  if (!s.IsOK()) {
+    fprintf(stderr, "open error: %s\n", s.ToString().c_str());
+    exit(1);
+  }
+  RandomGenerator gen(FLAGS.value_size);
+  cdb::WriteOptions write_options;
+  double start = NowMicros();
+  char buffer[32];
+  for (int64_t i = 0; i < FLAGS.num; i++) {
+    snprintf(buffer, sizeof(buffer), "%0*lld", std::min(FLAGS.key_size, 20), (long long)i);
+    std::string key(buffer);
+    if ((int)key.size() < FLAGS.key_size) key.append(FLAGS.key_size - key.size(), 'k');
+    db.Put(write_options, key, gen.Generate(FLAGS.value_size));
+  }
+  db.Close();
+  printf("generated %lld entries in %.2f s\n", (long long)FLAGS.num, (NowMicros() - start) * 1e-6);
+}
+
+struct Result {
+  double micros_open;
+  cdb::LoadTiming timing;
+};
+
+Result OpenOnce() {
+  Result result;
+  cdb::CuckooDB db(MakeOptions(), FLAGS.db);
+  double start = NowMicros();
+  cdb::Status s = db.Open();
+  result.micros_open = NowMicros() - start;
+  if (!s.IsOK()) {
+    fprintf(stderr, "open error: %s\n", s.ToString().c_str());
+    exit(1);
+  }
+  result.timing = db.GetLoadTiming();
+  db.Close();
+  return result;
+}
+
+//每次打开之前按 mode 准备目录：关闭时会重新写快照、manifest 和 footer，所以每次都要重新准备
+void Prepare(const std::string& mode) {
+  DBFiles files = ListFiles();
+  if (mode == "hints") {
+    RemoveFiles(files.checkpoints);
+  } else if (mode == "scan") {
+    RemoveFiles(files.checkpoints);
+    RemoveFiles(files.manifests);
+  } else if (mode == "recovery") {
+    RemoveFiles(files.checkpoints);
+    TruncateFooters();
+  }
+}
+
+void PrintHeader() {
+  printf("%-18s %9s | %8s %8s %8s %8s %8s %8s %8s %8s %8s | %6s %6s %10s\n",
+         "mode", "open(ms)", "total", "cleanup", "scan", "ckpt", "validate", "decode", "recover", "sort", "insert",
+         "files", "recov", "entries");
+}
+
+void Measure(const std::string& mode, bool cold) {
+  double micros_open = 0;
+  cdb::LoadTiming sum;
+  const char* method = "";
+  for (int r = 0; r < FLAGS.repetitions; r++) {
+    Prepare(mode);
+    if (cold) method = DropCaches();
+    Result result = OpenOnce();
+    micros_open += result.micros_open;
+    sum.Add(result.timing);
+  }
+  double n = FLAGS.repetitions;
+  std::string name = mode + (cold ? "/cold" : "/warm");
+  printf("%-18s %9.2f | %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f | %6.0f %6.0f %10.0f %s\n",
+         name.c_str(), micros_open / n / 1000,
+         sum.micros_total / n / 1000, sum.micros_cleanup / n / 1000, sum.micros_scan / n / 1000,
+         sum.micros_checkpoint / n / 1000, sum.micros_validate / n / 1000, sum.micros_decode / n / 1000,
+         sum.micros_recover / n / 1000, sum.micros_sort / n / 1000, sum.micros_index_insert / n / 1000,
+         sum.num_files_loaded / n, sum.num_files_recovered / n, sum.num_entries_loaded / n, method);
+  fflush(stdout);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cdb::Logger::set_current_level("silent");
+  ParseFlags(argc, argv);
+
+  if (!FLAGS.use_existing_db) Generate();
+  DBFiles files = ListFiles();
+  printf("%s: %zu data files, %.1f MB, %u shards, %u load threads\n", FLAGS.db.c_str(), files.datafiles.size(),
+         files.size_total / 1048576.0, FLAGS.num_shards, FLAGS.num_threads_load);
+  printf("times in ms, averaged over %d opens; validate/decode/recover are summed over load threads\n", FLAGS.repetitions);
+  PrintHeader();
+
+  size_t start = 0;
+  while (start <= FLAGS.modes.size()) {
+    size_t end = FLAGS.modes.find(',', start);
+    if (end == std::string::npos) end = FLAGS.modes.size();
+    std::string mode = FLAGS.modes.substr(start, end - start);
+    start = end + 1;
+    if (mode.empty()) continue;
+    if (mode != "checkpoint" && mode != "hints" && mode != "scan" && mode != "recovery") {
+      fprintf(stderr, "unknown mode '%s'\n", mode.c_str());
+      continue;
+    }
+    Measure(mode, false);
+    if (FLAGS.cold) Measure(mode, true);
+  }
+  return 0;
+}
@@ -0,0 +1,224 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : scaling_bench.cc
+ * Description   : 多线程扩展性测试：对只读、只写、混合负载依次使用 1..N 个线程，
+ *                 报告吞吐量、相对单线程的加速比，以及每把 InstrumentedMutex 的竞争次数和等待时间
+ *                 用法: scaling_bench --threads=1,2,4,8 --duration=2 --workloads=readonly,writeonly,mixed
+ * *******************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <algorithm>
+
+#include "bench/bench_util.h"
+#include "db/cuckoodb.h"
+#include "util/logger.h"
+#include "util/mutex.h"
+#include "util/options.h"
+#include "util/status.h"
+
+namespace {
+
+using cdb::bench::NowMicros;
+using cdb::bench::ParseFlag;
+using cdb::bench::DestroyDB;
+using cdb::bench::RandomGenerator;
+
+struct Flags {
+  std::string db = "/tmp/scaling_bench";
+  std::string workloads = "readonly,writeonly,mixed";
+  std::string threads;          //为空时为 1, 2, 4 ... 直到硬件线程数的两倍
+  int64_t num = 200000;         //预先写入的 key 数，也是访问的 key 范围
+  int key_size = 16;
+  int value_size = 100;
+  int read_percent = 90;        //mixed 中读的比例
+  double duration = 2;          //每个线程数运行的秒数
+  uint32_t num_shards = 1;
+  int top = 6;                  //每个点最多列出的锁
+};
+
+Flags FLAGS;
+
+void ParseFlags(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string v;
+    if (ParseFlag(argv[i], "db", &v)) FLAGS.db = v;
+    else if (ParseFlag(argv[i], "workloads", &v)) FLAGS.workloads = v;
+    else if (ParseFlag(argv[i], "threads", &v)) FLAGS.threads = v;
+    else if (ParseFlag(argv[i], "num", &v)) FLAGS.num = atoll(v.c_str());
+    else if (ParseFlag(argv[i], "key_size", &v)) FLAGS.key_size = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "value_size", &v)) FLAGS.value_size = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "read_percent", &v)) FLAGS.read_percent = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "duration", &v)) FLAGS.duration = atof(v.c_str());
+    else if (ParseFlag(argv[i], "num_shards", &v)) FLAGS.num_shards = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "top", &v)) FLAGS.top = atoi(v.c_str());
+    else {
+      fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (FLAGS.num < 1) FLAGS.num = 1;
+}
+
+std::vector<std::string> Split(const std::string& s) {
+  std::vector<std::string> out;
+  size_t start = 0;
+  while (start <= s.size()) {
+    size_t end = s.find(',', start);
+    if (end == std::string::npos) end = s.size();
+    if (end > start) out.push_back(s.substr(start, end - start));
+    start = end + 1;
+  }
+  return out;
+}
+
+std::vector<int> ThreadCounts() {
+  std::vector<int> counts;
+  if (!FLAGS.threads.empty()) {
+    for (auto& t: Split(FLAGS.threads)) counts.push_back(std::max(1, atoi(t.c_str())));
+    return counts;
+  }
+  int max_threads = 2 * std::max(1u, std::thread::hardware_concurrency());
+  for (int t = 1; t < max_threads; t *= 2) counts.push_back(t);
+  counts.push_back(max_threads);
+  return counts;
+}
+
+std::string MakeKey(uint64_t k) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%020llu", (unsigned long long)k);
+  return std::string(buffer + 20 - std::min(FLAGS.key_size, 20));
+}
+
+class Bench {
+ public:
+  Bench() : db_(nullptr) {}
+
+  ~Bench() {
+    delete db_;
+  }
+
+  void Open() {
+    DestroyDB(FLAGS.db);
+    cdb::Options options;
+    options.storage__num_shards = FLAGS.num_shards;
+    db_ = new cdb::CuckooDB(options, FLAGS.db);
+    cdb::Status s = db_->Open();
+    if (!s.IsOK()) {
+      fprintf(stderr, "open error: %s\n", s.ToString().c_str());
+      exit(1);
+    }
+    RandomGenerator gen(FLAGS.value_size);
+    for (int64_t i = 0; i < FLAGS.num; i++) {
+      db_->Put(write_options_, MakeKey(i), gen.Generate(FLAGS.value_size));
+    }
+  }
+
+  void Sweep(const std::string& workload) {
+    int read_percent = (workload == "readonly") ? 100 : (workload == "writeonly") ? 0 : FLAGS.read_percent;
+    printf("\n== %s (%d%% reads, %.1f s per point) ==\n", workload.c_str(), read_percent, FLAGS.duration);
+    printf("%7s %12s %8s %10s\n", "threads", "ops/sec", "speedup", "efficiency");
+    double ops_single = 0;
+    for (int num_threads: ThreadCounts()) {
+      std::map<std::string, cdb::MutexCounters> before = cdb::MutexStats::Snapshot();
+      uint64_t num_ops = 0;
+      double elapsed = Run(num_threads, read_percent, &num_ops);
+      std::map<std::string, cdb::MutexCounters> after = cdb::MutexStats::Snapshot();
+
+      double ops = num_ops / (elapsed * 1e-6);
+      if (ops_single == 0) ops_single = ops * 1.0 / num_threads;
+      printf("%7d %12.0f %7.2fx %9.1f%%\n", num_threads, ops, ops / ops_single, ops / ops_single / num_threads * 100);
+      ReportMutexes(before, after, num_ops, elapsed);
+      fflush(stdout);
+    }
+  }
+
+ private:
+  double Run(int num_threads, int read_percent, uint64_t* num_ops_out) {
+    std::atomic<bool> stop(false);
+    std::atomic<uint64_t> num_ops(0);
+    std::vector<std::thread> threads;
+    double start = NowMicros();
+    for (int t = 0; t < num_threads; t++) {
+      threads.push_back(std::thread([this, t, read_percent, &stop, &num_ops]() {
+        std::mt19937_64 rng(301 + t);
+        RandomGenerator gen(FLAGS.value_size);
+        std::string value;
+        uint64_t n = 0;
+        while (!stop.load(std::memory_order_relaxed)) {
+          std::string key = MakeKey(rng() % FLAGS.num);
+          if ((int)(rng() % 100) < read_percent) {
+            db_->Get(read_options_, key, &value);
+          } else {
+            db_->Put(write_options_, key, gen.Generate(FLAGS.value_size));
+          }
+          n++;
+        }
+        num_ops += n;
+      }));
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(FLAGS.duration * 1e6)));
+    stop = true;
+    for (auto& t: threads) t.join();
+    *num_ops_out = num_ops;
+    return NowMicros() - start;
+  }
+
+  //按等待时间从大到小列出这段时间内有竞争的锁；wait/op 为平均到每个操作上的等待时间
+  void ReportMutexes(const std::map<std::string, cdb::MutexCounters>& before,
+                     const std::map<std::string, cdb::MutexCounters>& after,
+                     uint64_t num_ops, double elapsed) {
+    std::vector< std::pair<std::string, cdb::MutexCounters> > deltas;
+    for (auto& item: after) {
+      cdb::MutexCounters delta = item.second;
+      auto it = before.find(item.first);
+      if (it != before.end()) delta.Subtract(it->second);
+      if (delta.num_contended > 0) deltas.push_back(std::make_pair(item.first, delta));
+    }
+    std::sort(deltas.begin(), deltas.end(), [](const std::pair<std::string, cdb::MutexCounters>& a,
+                                               const std::pair<std::string, cdb::MutexCounters>& b) {
+      return a.second.nanos_wait > b.second.nanos_wait;
+    });
+    if (deltas.size() > (size_t)FLAGS.top) deltas.resize(FLAGS.top);
+    for (auto& item: deltas) {
+      const cdb::MutexCounters& c = item.second;
+      printf("        %-40s acquired %10llu  contended %6.2f%%  wait %9.2f ms (%5.1f%% of run)  wait/op %8.1f ns\n",
+             item.first.c_str(), (unsigned long long)c.num_acquisitions,
+             c.num_acquisitions ? 100.0 * c.num_contended / c.num_acquisitions : 0.0,
+             c.nanos_wait * 1e-6, c.nanos_wait * 1e-3 / elapsed * 100,
+             num_ops ? (double)c.nanos_wait / num_ops : 0.0);
+    }
+  }
+
+  cdb::CuckooDB* db_;
+  cdb::ReadOptions read_options_;
+  cdb::WriteOptions write_options_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cdb::Logger::set_current_level("emerg");
+  ParseFlags(argc, argv);
+  printf("%lld keys, %d byte keys, %d byte values, %u shards, %u hardware threads\n",
+         (long long)FLAGS.num, FLAGS.key_size, FLAGS.value_size, FLAGS.num_shards, std::thread::hardware_concurrency());
+  printf("wait %% of run is summed over threads and can exceed 100%%\n");
+
+  Bench bench;
+  bench.Open();
+  for (auto& workload: Split(FLAGS.workloads)) {
+    if (workload != "readonly" && workload != "writeonly" && workload != "mixed") {
+      fprintf(stderr, "unknown workload '%s'\n", workload.c_str());
+      continue;
+    }
+    bench.Sweep(workload);
+  }
+  return 0;
+}
@@ -0,0 +1,141 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : varint_bench.cc
+ * Description   : 比较批量 varint 解码的各种实现，输入模拟 HintData 块和 Entry 头部
+ *                 用法: varint_bench [num_values] [num_rounds]
+ * *******************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+
+#include "util/coding.h"
+
+namespace {
+
+const char* kDecoderNames[] = { "scalar", "swar", "bmi2" };
+
+struct Workload {
+  const char* name;
+  std::string data;
+  size_t num_values;
+  std::vector<uint64_t> expected;
+};
+
+//排序后 hashed_key 的差值：n 个随机 64 位数的间隔约为 2^64/n
+Workload MakeHashDeltas(size_t num_values, std::mt19937_64& rng) {
+  Workload w;
+  w.name = "hint hash deltas (varint64)";
+  w.num_values = num_values;
+  uint64_t range = ~0ULL / 300000;
+  for (size_t i = 0; i < num_values; ++i) {
+    uint64_t v = rng() % range;
+    w.expected.push_back(v);
+    cdb::PutVarint64(&w.data, v);
+  }
+  return w;
+}
+
+//文件内的偏移，32MB 以内
+Workload MakeOffsets(size_t num_values, std::mt19937_64& rng) {
+  Workload w;
+  w.name = "hint offsets (varint32)";
+  w.num_values = num_values;
+  for (size_t i = 0; i < num_values; ++i) {
+    uint64_t v = rng() % (32 * 1024 * 1024);
+    w.expected.push_back(v);
+    cdb::PutVarint32(&w.data, v);
+  }
+  return w;
+}
+
+//Entry 头部：flags, timestamp, size_key, size_value
+Workload MakeEntryHeaders(size_t num_values, std::mt19937_64& rng) {
+  Workload w;
+  w.name = "entry header fields (varint64)";
+  w.num_values = num_values / 4 * 4;
+  for (size_t i = 0; i < w.num_values; i += 4) {
+    uint64_t fields[4] = { rng() % 2, 0, 8 + rng() % 24, 100 + rng() % 1000 };
+    for (auto v: fields) {
+      w.expected.push_back(v);
+      cdb::PutVarint64(&w.data, v);
+    }
+  }
+  return w;
+}
+
+template <typename T>
+double Run(cdb::VarintDecoder decoder, const Workload& w, int num_rounds, bool* ok) {
+  //与 HintData 一样按 128 个一块解码
+  const size_t kBlock = 128;
+  std::vector<T> values(kBlock);
+  uint64_t checksum = 0;
+  *ok = true;
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < num_rounds; ++r) {
+    const char* p = w.data.data();
+    const char* limit = p + w.data.size();
+    for (size_t i = 0; i < w.num_values; i += kBlock) {
+      size_t n = std::min(kBlock, w.num_values - i);
+      if (sizeof(T) == 4) {
+        p = cdb::GetVarint32ArrayWith(decoder, p, limit, reinterpret_cast<uint32_t*>(values.data()), n);
+      } else {
+        p = cdb::GetVarint64ArrayWith(decoder, p, limit, reinterpret_cast<uint64_t*>(values.data()), n);
+      }
+      if (p == NULL) {
+        *ok = false;
+        return 0;
+      }
+      if (r == 0) {
+        for (size_t j = 0; j < n; ++j) {
+          if (values[j] != static_cast<T>(w.expected[i + j])) *ok = false;
+        }
+      }
+      checksum += values[0];
+    }
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  if (checksum == 42) fprintf(stderr, " ");
+  return ns / (static_cast<double>(w.num_values) * num_rounds);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  size_t num_values = argc > 1 ? atol(argv[1]) : 1000000;
+  int num_rounds = argc > 2 ? atoi(argv[2]) : 20;
+  std::mt19937_64 rng(301);
+
+  std::vector<Workload> workloads;
+  workloads.push_back(MakeHashDeltas(num_values, rng));
+  workloads.push_back(MakeOffsets(num_values, rng));
+  workloads.push_back(MakeEntryHeaders(num_values, rng));
+
+  printf("default decoder: %s\n", kDecoderNames[cdb::GetVarintDecoder()]);
+  for (size_t i = 0; i < workloads.size(); ++i) {
+    const Workload& w = workloads[i];
+    printf("%s: %zu values, %.2f bytes/value\n", w.name, w.num_values, static_cast<double>(w.data.size()) / w.num_values);
+    double ns_scalar = 0;
+    for (int d = cdb::kVarintDecoderScalar; d <= cdb::kVarintDecoderBMI2; ++d) {
+      cdb::VarintDecoder decoder = static_cast<cdb::VarintDecoder>(d);
+      if (!cdb::IsVarintDecoderSupported(decoder)) {
+        printf("  %-8s not supported\n", kDecoderNames[d]);
+        continue;
+      }
+      bool ok;
+      double ns = (i == 1) ? Run<uint32_t>(decoder, w, num_rounds, &ok) : Run<uint64_t>(decoder, w, num_rounds, &ok);
+      if (d == cdb::kVarintDecoderScalar) ns_scalar = ns;
+      printf("  %-8s %7.3f ns/value  %8.1f MB/s  speedup %.2fx%s\n",
+             kDecoderNames[d], ns,
+             w.data.size() * 1e3 / (ns * w.num_values),
+             ns_scalar / ns,
+             ok ? "" : "  MISMATCH");
+      if (!ok) return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,460 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : ycsb_bench.cc
+ * Description   : 通过 DB 接口运行 YCSB 核心负载 A/B/C/D/F，key 的生成方式和分布与 YCSB CoreWorkload 一致
+ *                 没有范围查询接口，不支持负载 E
+ *                 用法: ycsb_bench --workload=a --recordcount=1000000 --operationcount=1000000 --threads=4
+ * *******************************************************/
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <random>
+
+#include "bench/bench_util.h"
+#include "db/cuckoodb.h"
+#include "util/histogram.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+namespace {
+
+using cdb::bench::NowMicros;
+using cdb::bench::ParseFlag;
+using cdb::bench::DestroyDB;
+using cdb::bench::RandomGenerator;
+
+struct Flags {
+  std::string workload = "a";
+  std::string db = "/tmp/ycsb_bench";
+  int64_t recordcount = 1000000;
+  int64_t operationcount = 1000000;
+  int fieldcount = 10;             //YCSB 的每条记录有 fieldcount 个字段，这里拼接成一个 value
+  int fieldlength = 100;
+  int threads = 1;
+  double maxexecutiontime = 0;     //大于0时运行阶段最多执行这么多秒
+  std::string requestdistribution; //为空时使用负载的默认分布
+  bool load = true;
+  bool run = true;
+  bool histogram = false;
+  uint64_t seed = 301;
+  uint32_t num_shards = 1;
+};
+
+Flags FLAGS;
+
+//YCSB 核心负载的操作比例
+struct Workload {
+  const char* name;
+  double read;
+  double update;
+  double insert;
+  double rmw;
+  const char* distribution;
+};
+
+const Workload kWorkloads[] = {
+  { "a", 0.50, 0.50, 0,    0,    "zipfian" },  //更新密集
+  { "b", 0.95, 0.05, 0,    0,    "zipfian" },  //读为主
+  { "c", 1.00, 0,    0,    0,    "zipfian" },  //只读
+  { "d", 0.95, 0,    0.05, 0,    "latest"  },  //读最新插入的记录
+  { "f", 0.50, 0,    0,    0.50, "zipfian" },  //读-改-写
+};
+
+void ParseFlags(int argc, char** argv) {
+  for (int i = 1; i < argc; i++) {
+    std::string v;
+    if (ParseFlag(argv[i], "workload", &v)) FLAGS.workload = v;
+    else if (ParseFlag(argv[i], "db", &v)) FLAGS.db = v;
+    else if (ParseFlag(argv[i], "recordcount", &v)) FLAGS.recordcount = atoll(v.c_str());
+    else if (ParseFlag(argv[i], "operationcount", &v)) FLAGS.operationcount = atoll(v.c_str());
+    else if (ParseFlag(argv[i], "fieldcount", &v)) FLAGS.fieldcount = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "fieldlength", &v)) FLAGS.fieldlength = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "threads", &v)) FLAGS.threads = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "maxexecutiontime", &v)) FLAGS.maxexecutiontime = atof(v.c_str());
+    else if (ParseFlag(argv[i], "requestdistribution", &v)) FLAGS.requestdistribution = v;
+    else if (ParseFlag(argv[i], "load", &v)) FLAGS.load = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "run", &v)) FLAGS.run = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "histogram", &v)) FLAGS.histogram = atoi(v.c_str());
+    else if (ParseFlag(argv[i], "seed", &v)) FLAGS.seed = strtoull(v.c_str(), nullptr, 10);
+    else if (ParseFlag(argv[i], "num_shards", &v)) FLAGS.num_shards = atoi(v.c_str());
+    else {
+      fprintf(stderr, "Invalid flag '%s'\n", argv[i]);
+      exit(1);
+    }
+  }
+  if (FLAGS.threads < 1) FLAGS.threads = 1;
+  if (FLAGS.recordcount < 1) FLAGS.recordcount = 1;
+}
+
+//YCSB Utils.fnvhash64，用于把记录编号打散成 key
+uint64_t FNVHash64(uint64_t val) {
+  int64_t hashval = 0xCBF29CE484222325LL;
+  for (int i = 0; i < 8; i++) {
+    int64_t octet = val & 0x00ff;
+    val = val >> 8;
+    hashval = hashval ^ octet;
+    hashval = (int64_t)((uint64_t)hashval * 1099511628211ULL);
+  }
+  return hashval < 0 ? -(uint64_t)hashval : hashval;
+}
+
+std::string BuildKeyName(uint64_t keynum) {
+  return "user" + std::to_string(FNVHash64(keynum));
+}
+
+//Gray 等人 "Quickly Generating Billion-Record Synthetic Databases" 中的算法，与 YCSB ZipfianGenerator 相同
+//返回 [0, items) 中的值，0 最热。items 只增不减时 zeta 增量计算
+class ZipfianGenerator {
+ public:
+  static constexpr double kZipfianConstant = 0.99;
+
+  explicit ZipfianGenerator(uint64_t items, double zetan=0)
+    : items_(items), theta_(kZipfianConstant) {
+    alpha_ = 1.0 / (1.0 - theta_);
+    zeta2theta_ = Zeta(0, 2, theta_, 0);
+    zetan_ = (zetan > 0) ? zetan : Zeta(0, items_, theta_, 0);
+    count_for_zeta_ = items_;
+    UpdateEta();
+  }
+
+  uint64_t Next(std::mt19937_64& rng) {
+    return Next(rng, items_);
+  }
+
+  uint64_t Next(std::mt19937_64& rng, uint64_t items) {
+    if (items != count_for_zeta_) {
+      //items 变小时重新计算
+      zetan_ = (items > count_for_zeta_) ? Zeta(count_for_zeta_, items, theta_, zetan_)
+                                         : Zeta(0, items, theta_, 0);
+      count_for_zeta_ = items;
+      items_ = items;
+      UpdateEta();
+    }
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    double uz = u * zetan_;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, theta_)) return 1;
+    uint64_t ret = (uint64_t)(items_ * pow(eta_ * u - eta_ + 1, alpha_));
+    return std::min(ret, items_ - 1);
+  }
+
+ private:
+  static double Zeta(uint64_t start, uint64_t n, double theta, double initial_sum) {
+    double sum = initial_sum;
+    for (uint64_t i = start; i < n; i++) {
+      sum += 1 / pow(i + 1, theta);
+    }
+    return sum;
+  }
+
+  void UpdateEta() {
+    eta_ = (1 - pow(2.0 / items_, 1 - theta_)) / (1 - zeta2theta_ / zetan_);
+  }
+
+  uint64_t items_;
+  uint64_t count_for_zeta_;
+  double theta_;
+  double alpha_;
+  double zeta2theta_;
+  double zetan_;
+  double eta_;
+};
+
+//与 YCSB ScrambledZipfianGenerator 相同：在 100 亿个值上取 Zipfian，再用 FNV 打散到 [0, items)
+//这样热点 key 分散在整个 key 空间，而不是集中在编号最小的记录
+class ScrambledZipfianGenerator {
+ public:
+  static constexpr uint64_t kItemCount = 10000000000ULL;
+  static constexpr double kZetan = 26.46902820178302;   //zeta(10^10, 0.99)
+
+  explicit ScrambledZipfianGenerator(uint64_t items)
+    : items_(items), gen_(kItemCount, kZetan) {}
+
+  uint64_t Next(std::mt19937_64& rng) {
+    return FNVHash64(gen_.Next(rng)) % items_;
+  }
+
+ private:
+  uint64_t items_;
+  ZipfianGenerator gen_;
+};
+
+//与 YCSB SkewedLatestGenerator 相同：最近插入的记录最热
+class SkewedLatestGenerator {
+ public:
+  explicit SkewedLatestGenerator(const std::atomic<uint64_t>* basis)
+    : basis_(basis), zipfian_(basis->load()) {}
+
+  uint64_t Next(std::mt19937_64& rng) {
+    uint64_t max = basis_->load();
+    return max - 1 - zipfian_.Next(rng, max);
+  }
+
+ private:
+  const std::atomic<uint64_t>* basis_;
+  ZipfianGenerator zipfian_;
+};
+
+//选择要访问的已有记录
+class KeyChooser {
+ public:
+  KeyChooser(const std::string& distribution, const std::atomic<uint64_t>* num_records)
+    : distribution_(distribution), num_records_(num_records), zipfian_(num_records->load()) {
+    //latest 需要在 recordcount 上计算 zeta，只在使用时创建
+    if (distribution_ == "latest") latest_.reset(new SkewedLatestGenerator(num_records));
+  }
+
+  uint64_t Next(std::mt19937_64& rng) {
+    if (latest_) return latest_->Next(rng);
+    if (distribution_ == "uniform") return rng() % num_records_->load();
+    //zipfian：新插入的记录不在 ScrambledZipfian 的范围内，与 YCSB 一样超出时重新选择
+    uint64_t keynum;
+    do {
+      keynum = zipfian_.Next(rng);
+    } while (keynum >= num_records_->load());
+    return keynum;
+  }
+
+ private:
+  std::string distribution_;
+  const std::atomic<uint64_t>* num_records_;
+  ScrambledZipfianGenerator zipfian_;
+  std::unique_ptr<SkewedLatestGenerator> latest_;
+};
+
+enum Operation {
+  kRead = 0,
+  kUpdate,
+  kInsert,
+  kReadModifyWrite,
+  kNumOperations,
+};
+
+const char* kOperationNames[] = { "READ", "UPDATE", "INSERT", "READ-MODIFY-WRITE" };
+
+//每个线程每种操作各一个直方图，结束后合并
+struct OpStats {
+  cdb::Histogram hist[kNumOperations];
+  uint64_t num_ok[kNumOperations];
+  uint64_t num_not_found[kNumOperations];
+  uint64_t num_error[kNumOperations];
+
+  OpStats() {
+    for (int i = 0; i < kNumOperations; i++) {
+      num_ok[i] = num_not_found[i] = num_error[i] = 0;
+    }
+  }
+
+  void Add(Operation op, const cdb::Status& s, double micros) {
+    hist[op].Add(micros);
+    if (s.IsOK()) num_ok[op]++;
+    else if (s.IsNotFound()) num_not_found[op]++;
+    else num_error[op]++;
+  }
+
+  void Merge(const OpStats& other) {
+    for (int i = 0; i < kNumOperations; i++) {
+      hist[i].Merge(other.hist[i]);
+      num_ok[i] += other.num_ok[i];
+      num_not_found[i] += other.num_not_found[i];
+      num_error[i] += other.num_error[i];
+    }
+  }
+
+  uint64_t Count() const {
+    uint64_t count = 0;
+    for (int i = 0; i < kNumOperations; i++) count += hist[i].Count();
+    return count;
+  }
+};
+
+//与 YCSB 文本输出的格式一致，便于用相同的脚本处理
+void Report(const char* phase, const OpStats& stats, double elapsed_micros) {
+  printf("[OVERALL], Phase, %s\n", phase);
+  printf("[OVERALL], RunTime(ms), %.0f\n", elapsed_micros / 1000);
+  printf("[OVERALL], Throughput(ops/sec), %.2f\n", stats.Count() / (elapsed_micros * 1e-6));
+  for (int i = 0; i < kNumOperations; i++) {
+    const cdb::Histogram& h = stats.hist[i];
+    if (h.Count() == 0) continue;
+    const char* name = kOperationNames[i];
+    printf("[%s], Operations, %llu\n", name, (unsigned long long)h.Count());
+    printf("[%s], AverageLatency(us), %.3f\n", name, h.Average());
+    printf("[%s], MinLatency(us), %.3f\n", name, h.Min());
+    printf("[%s], MaxLatency(us), %.3f\n", name, h.Max());
+    printf("[%s], 50thPercentileLatency(us), %.3f\n", name, h.Percentile(50));
+    printf("[%s], 95thPercentileLatency(us), %.3f\n", name, h.Percentile(95));
+    printf("[%s], 99thPercentileLatency(us), %.3f\n", name, h.Percentile(99));
+    printf("[%s], 99.9thPercentileLatency(us), %.3f\n", name, h.Percentile(99.9));
+    printf("[%s], Return=OK, %llu\n", name, (unsigned long long)stats.num_ok[i]);
+    if (stats.num_not_found[i] > 0) {
+      printf("[%s], Return=NOT_FOUND, %llu\n", name, (unsigned long long)stats.num_not_found[i]);
+    }
+    if (stats.num_error[i] > 0) {
+      printf("[%s], Return=ERROR, %llu\n", name, (unsigned long long)stats.num_error[i]);
+    }
+    if (FLAGS.histogram) printf("%s", h.ToString().c_str());
+  }
+  fflush(stdout);
+}
+
+class YCSB {
+ public:
+  YCSB(cdb::DB* db, const Workload& workload)
+    : db_(db),
+      workload_(workload),
+      num_records_(FLAGS.recordcount),
+      next_insert_(FLAGS.recordcount),
+      stop_(false) {
+    distribution_ = FLAGS.requestdistribution.empty() ? workload.distribution : FLAGS.requestdistribution;
+  }
+
+  //加载阶段：每个线程插入 [begin, end) 的记录
+  void Load() {
+    RunThreads("LOAD", [this](int tid, OpStats* stats) {
+      int64_t per_thread = (FLAGS.recordcount + FLAGS.threads - 1) / FLAGS.threads;
+      int64_t begin = tid * per_thread;
+      int64_t end = std::min<int64_t>(FLAGS.recordcount, begin + per_thread);
+      RandomGenerator gen(ValueSize());
+      for (int64_t keynum = begin; keynum < end; keynum++) {
+        double start = NowMicros();
+        cdb::Status s = db_->Put(write_options_, BuildKeyName(keynum), gen.Generate(ValueSize()));
+        stats->Add(kInsert, s, NowMicros() - start);
+      }
+    });
+  }
+
+  void Run() {
+    double start = NowMicros();
+    RunThreads("RUN", [this, start](int tid, OpStats* stats) {
+      std::mt19937_64 rng(FLAGS.seed + tid);
+      KeyChooser chooser(distribution_, &num_records_);
+      RandomGenerator gen(ValueSize());
+      int64_t num_ops = FLAGS.operationcount / FLAGS.threads + (tid < FLAGS.operationcount % FLAGS.threads ? 1 : 0);
+      for (int64_t i = 0; i < num_ops && !stop_; i++) {
+        if (FLAGS.maxexecutiontime > 0 && (i & 0xFF) == 0
+            && NowMicros() - start > FLAGS.maxexecutiontime * 1e6) {
+          stop_ = true;
+          break;
+        }
+        DoTransaction(rng, chooser, gen, stats);
+      }
+    });
+  }
+
+ private:
+  size_t ValueSize() const {
+    return (size_t)FLAGS.fieldcount * FLAGS.fieldlength;
+  }
+
+  template <typename Body>
+  void RunThreads(const char* phase, Body body) {
+    std::vector<OpStats> stats(FLAGS.threads);
+    std::vector<std::thread> threads;
+    double start = NowMicros();
+    for (int i = 0; i < FLAGS.threads; i++) {
+      threads.push_back(std::thread(body, i, &stats[i]));
+    }
+    for (auto& t: threads) t.join();
+    double elapsed = NowMicros() - start;
+    for (int i = 1; i < FLAGS.threads; i++) stats[0].Merge(stats[i]);
+    Report(phase, stats[0], elapsed);
+  }
+
+  void DoTransaction(std::mt19937_64& rng, KeyChooser& chooser, RandomGenerator& gen, OpStats* stats) {
+    double p = std::uniform_real_distribution<double>(0, 1)(rng);
+    double start = NowMicros();
+    if (p < workload_.read) {
+      std::string value;
+      cdb::Status s = db_->Get(read_options_, BuildKeyName(chooser.Next(rng)), &value);
+      stats->Add(kRead, s, NowMicros() - start);
+    } else if (p < workload_.read + workload_.update) {
+      cdb::Status s = db_->Put(write_options_, BuildKeyName(chooser.Next(rng)), gen.Generate(ValueSize()));
+      stats->Add(kUpdate, s, NowMicros() - start);
+    } else if (p < workload_.read + workload_.update + workload_.insert) {
+      //插入完成后才增加 num_records_，读不会选到尚未插入的记录
+      uint64_t keynum = next_insert_.fetch_add(1);
+      cdb::Status s = db_->Put(write_options_, BuildKeyName(keynum), gen.Generate(ValueSize()));
+      stats->Add(kInsert, s, NowMicros() - start);
+      AcknowledgeInsert(keynum);
+    } else {
+      //与 YCSB 一样，读和写也分别计入 READ 和 UPDATE
+      std::string key = BuildKeyName(chooser.Next(rng));
+      std::string value;
+      cdb::Status s = db_->Get(read_options_, key, &value);
+      double read_done = NowMicros();
+      stats->Add(kRead, s, read_done - start);
+      if (s.IsOK()) {
+        s = db_->Put(write_options_, key, gen.Generate(ValueSize()));
+        stats->Add(kUpdate, s, NowMicros() - read_done);
+      }
+      stats->Add(kReadModifyWrite, s, NowMicros() - start);
+    }
+  }
+
+  //num_records_ 只在所有更小编号的插入都完成后前进
+  void AcknowledgeInsert(uint64_t keynum) {
+    uint64_t expected = keynum;
+    while (!num_records_.compare_exchange_weak(expected, keynum + 1)) {
+      expected = keynum;
+      std::this_thread::yield();
+    }
+  }
+
+  cdb::DB* db_;
+  Workload workload_;
+  std::string distribution_;
+  std::atomic<uint64_t> num_records_;
+  std::atomic<uint64_t> next_insert_;
+  std::atomic<bool> stop_;
+  cdb::ReadOptions read_options_;
+  cdb::WriteOptions write_options_;
+};
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cdb::Logger::set_current_level("emerg");
+  ParseFlags(argc, argv);
+
+  const Workload* workload = nullptr;
+  for (const Workload& w: kWorkloads) {
+    if (FLAGS.workload == w.name) workload = &w;
+  }
+  if (workload == nullptr) {
+    fprintf(stderr, "unsupported workload '%s' (a, b, c, d, f)\n", FLAGS.workload.c_str());
+    return 1;
+  }
+  if (!FLAGS.requestdistribution.empty() && FLAGS.requestdistribution != "zipfian"
+      && FLAGS.requestdistribution != "uniform" && FLAGS.requestdistribution != "latest") {
+    fprintf(stderr, "unknown requestdistribution '%s'\n", FLAGS.requestdistribution.c_str());
+    return 1;
+  }
+
+  if (FLAGS.load) DestroyDB(FLAGS.db);
+  cdb::Options options;
+  options.storage__num_shards = FLAGS.num_shards;
+  cdb::CuckooDB db(options, FLAGS.db);
+  cdb::Status s = db.Open();
+  if (!s.IsOK()) {
+    fprintf(stderr, "open error: %s\n", s.ToString().c_str());
+    return 1;
+  }
+
+  printf("workload %s: read %.2f update %.2f insert %.2f rmw %.2f, %s, %lld records, %d threads\n",
+         workload->name, workload->read, workload->update, workload->insert, workload->rmw,
+         FLAGS.requestdistribution.empty() ? workload->distribution : FLAGS.requestdistribution.c_str(),
+         (long long)FLAGS.recordcount, FLAGS.threads);
+  YCSB ycsb(&db, *workload);
+  if (FLAGS.load) ycsb.Load();
+  if (FLAGS.run) ycsb.Run();
+  db.Close();
+  return 0;
+}
@@ -23,7 +23,7 @@ Cache::Cache(cdb::Options db_options, cdb::EventManager* event_manager){
   db_options_ = db_options;
   thread_cache_ = std::thread(&Cache::Run, this);
   is_closed_ = false;
-  log::trace("Cache::Add()", "Cache::Run");
+  CDB_LOG_TRACE("Cache::Add()", "Cache::Run");
 }
 
 Cache::~Cache(){
@@ -43,7 +43,7 @@ void Cache::Flush() {
     cond_flush.notify_one();
     cv_flush_done_.wait_for(lock_flush, std::chrono::milliseconds(db_options_.internal__close_timeout));
   }
-  log::trace("Cache::Flush()", "end");
+  CDB_LOG_TRACE("Cache::Flush()", "end");
 }
 
 void Cache::Close () {
@@ -56,10 +56,10 @@ void Cache::Close () {
   thread_cache_.join();
 }
 
-Status Cache::Get(ReadOptions& write_options, const std::string &key, std::string* value){
+Status Cache::Get(ReadOptions& write_options, const std::string &key, uint64_t hashed_key, std::string* value){
   if (IsStop()) return Status::IOError("Cannot handle request: Cache is closing");
 
-  log::trace("Cache::Get()","search in live cache");
+  CDB_LOG_TRACE("Cache::Get()","search in live cache");
   //read live cache	
   w_mutex_cache_live_l1.lock();
   mutex_live_size_l3.lock();
@@ -72,7 +72,8 @@ Status Cache::Get(ReadOptions& write_options, const std::string &key, std::strin
   bool found = false;
   Entry entry_found;
   for (auto& entry:cache_live){
-    if (entry.key == key){
+    //先比较 hashed_key，不相等时不用比较字符串
+    if (entry.hashed_key == hashed_key && entry.key == key){
       found = true;
       entry_found = entry;
     }//no break, in order to find the latest item
@@ -80,7 +81,9 @@ Status Cache::Get(ReadOptions& write_options, const std::string &key, std::strin
 
   if (found){
     if (entry_found.op_type == EntryType::Put_Or_Get){
-      log::trace("Cache::Get()","found and op_type is match, can be return value:%s", entry_found.value.c_str());
+      CDB_LOG_TRACE("Cache::Get()","found and op_type is match, can be return value:%s", entry_found.value.c_str());
+      RecordTick(db_options_.statistics.get(), kGetHitLive);
+      PERF_COUNTER_ADD(bytes_copied, entry_found.value.size());
       *value = entry_found.value;
       return Status::OK();
     }else if (entry_found.op_type == EntryType::Delete){
@@ -89,7 +92,7 @@ Status Cache::Get(ReadOptions& write_options, const std::string &key, std::strin
       return Status::NotFound("Unable to find entry");
   }
 
-  log::trace("Cache::Get()","search in swap cache");
+  CDB_LOG_TRACE("Cache::Get()","search in swap cache");
   //read swap cache
   w_mutex_cache_swap_l4.lock();
   r_mutex_cache_swap_l5.lock();
@@ -102,7 +105,7 @@ Status Cache::Get(ReadOptions& write_options, const std::string &key, std::strin
   Status s;
   found = false;
   for (auto& entry:cache_swap){
-    if (entry.key == key){
+    if (entry.hashed_key == hashed_key && entry.key == key){
       found = true;
       entry_found = entry;
     }//no break, in order to find the latest item
@@ -110,18 +113,20 @@ Status Cache::Get(ReadOptions& write_options, const std::string &key, std::strin
 
   if (found){
     if (entry_found.op_type == EntryType::Put_Or_Get){
-      log::trace("Cache::Get()","found and op_type is match, can be return value:%s", entry_found.value.c_str());
+      CDB_LOG_TRACE("Cache::Get()","found and op_type is match, can be return value:%s", entry_found.value.c_str());
+      RecordTick(db_options_.statistics.get(), kGetHitSwap);
+      PERF_COUNTER_ADD(bytes_copied, entry_found.value.size());
       *value = entry_found.value;
       s = Status::OK();
     }else if (entry_found.op_type == EntryType::Delete){
-      log::trace("Cache::Get()","RemoveEntry");
+      CDB_LOG_TRACE("Cache::Get()","RemoveEntry");
       s = Status::RemoveEntry();
     }else{
-      log::trace("Cache::Get()","Unable to find entry in swap cache");
+      CDB_LOG_TRACE("Cache::Get()","Unable to find entry in swap cache");
       s = Status::NotFound("Unable to find entry");
     }
   }else{
-      log::trace("Cache::Get()","Unable to find entry in swap cache");
+      CDB_LOG_TRACE("Cache::Get()","Unable to find entry in swap cache");
       s = Status::NotFound("Unable to find entry");
   }
   
@@ -135,48 +140,52 @@ Status Cache::Get(ReadOptions& write_options, const std::string &key, std::strin
 }
 
 
-Status Cache::Put(WriteOptions& write_options, const std::string &key, const std::string& value){
+Status Cache::Put(WriteOptions& write_options, const std::string &key, uint64_t hashed_key, const std::string& value){
   return Additem(write_options,
         EntryType::Put_Or_Get,
 	      key,
+	      hashed_key,
 	      value);
 }
 
 
-Status Cache::Delete(WriteOptions& write_options, const std::string& key){
+Status Cache::Delete(WriteOptions& write_options, const std::string& key, uint64_t hashed_key){
   std::string value = "";
   return Additem(write_options,
               EntryType::Delete,
               key,
+              hashed_key,
               value);
 
 }
 
 
-Status Cache::Additem(WriteOptions& write_options, const EntryType& op_type, const std::string &key, const std::string& value){
+//hashed_key 由调用者在自己的线程中计算
+Status Cache::Additem(WriteOptions& write_options, const EntryType& op_type, const std::string &key, uint64_t hashed_key, const std::string& value){
   // if (IsStop()) return Status::IOError("Cannot handle request: Cache is closing");
 
   uint64_t kv_size = key.size() + value.size();
-  log::trace("Cache::Add()","kvsize:%d", kv_size);
-  log::trace("Cache::Add()","key %s, value %s", key.c_str(), value.c_str());
+  CDB_LOG_TRACE("Cache::Add()","kvsize:%d", kv_size);
+  CDB_LOG_TRACE("Cache::Add()","key %s, value %s", key.c_str(), value.c_str());
 
-  std::unique_lock<std::mutex> lock_cache_live_(w_mutex_cache_live_l1);
+  std::unique_lock<InstrumentedMutex> lock_cache_live_(w_mutex_cache_live_l1);
   mutex_live_size_l3.lock();
   caches_[index_live_].push_back(Entry{std::this_thread::get_id(),
 		  		write_options,
 		  		op_type,
 		  		key,
-		  		value});
+		  		value,
+		  		hashed_key});
 
   sizes_[index_live_] += kv_size;
   uint64_t cache_live_size = sizes_[index_live_];
-  log::trace("Cache::Add()", "live_size_ %d",cache_live_size);
+  CDB_LOG_TRACE("Cache::Add()", "live_size_ %d",cache_live_size);
   mutex_live_size_l3.unlock();
 
   if (cache_live_size > max_size_){
     mutex_flush_l2.lock();
-    std::unique_lock<std::mutex> lock_swap(mutex_live_size_l3);
-    log::trace("Cache::Add()", "swap and cache");
+    std::unique_lock<InstrumentedMutex> lock_swap(mutex_live_size_l3);
+    CDB_LOG_TRACE("Cache::Add()", "swap and cache");
     cond_flush.notify_one();
     mutex_flush_l2.unlock();
 
@@ -187,7 +196,7 @@ Status Cache::Additem(WriteOptions& write_options, const EntryType& op_type, con
 }
 
 void Cache::Run(){
-  log::trace("Cache::Run", "wait flush condition");
+  CDB_LOG_TRACE("Cache::Run", "wait flush condition");
   while(true){
     std::unique_lock<std::mutex> lock_flush(mutex_flush_l2);
     
@@ -202,31 +211,37 @@ void Cache::Run(){
     //如果 swap cache 大小为0 说明当 live cache满了就可以进行覆盖了 
     if (sizes_[index_copy_] == 0){
       //阻塞，等待live cache 满了就 notify 
-      log::trace("Cache::Run", "swap cahe");
+      CDB_LOG_TRACE("Cache::Run", "swap cahe");
       std::swap(index_live_, index_copy_);
     }
     mutex_live_size_l3.unlock();
 
     //to-do:notify 通知StorageEngine 可以固化swap cache 到硬盘上，并更新索引 
-    log::trace("Cache::Run", " notify 通知StorageEngine 可以固化swap cache 到硬盘上，并更新索引");
-    event_manager_->flush_cache.notify_and_wait(caches_[index_copy_]);
+    CDB_LOG_TRACE("Cache::Run", " notify 通知StorageEngine 可以固化swap cache 到硬盘上，并更新索引");
+    {
+      StopWatch stop_watch(db_options_.statistics.get(), kHistFlushCacheWait);
+      event_manager_->flush_cache.notify_and_wait(caches_[index_copy_]);
+    }
 
-    log::trace("Cache::Run", "wait clear cache ");
+    CDB_LOG_TRACE("Cache::Run", "wait clear cache ");
     event_manager_->clear_cache.Wait();
     event_manager_->clear_cache.Done();
 
     //to-do:等待所有读swap cahce 的线程结束，然后清空swap cache
-    w_mutex_cache_swap_l4.lock();
-    while(true) {
-      std::unique_lock<std::mutex> lock_read(r_mutex_cache_swap_l5);
-      if (num_readers_ == 0) break;
-      cond_reader.wait(lock_read);
+    {
+      StopWatch stop_watch(db_options_.statistics.get(), kHistClearCacheDrain);
+      w_mutex_cache_swap_l4.lock();
+      while(true) {
+        std::unique_lock<std::mutex> lock_read(r_mutex_cache_swap_l5.native());
+        if (num_readers_ == 0) break;
+        cond_reader.wait(lock_read);
+      }
     }
-    log::trace("Cache::Add()", "caches_[index_copy_] size %d",caches_[index_copy_].size());
+    CDB_LOG_TRACE("Cache::Add()", "caches_[index_copy_] size %d",caches_[index_copy_].size());
     sizes_[index_copy_] = 0;
     caches_[index_copy_].clear();
     w_mutex_cache_swap_l4.unlock();
-    log::trace("Cache::Run", "clear cache has benn done");
+    CDB_LOG_TRACE("Cache::Run", "clear cache has benn done");
     
     cv_flush_done_.notify_all();
     if (IsStop() && caches_[index_live_].empty() && caches_[index_copy_].empty()) 
@@ -20,6 +20,9 @@
 #include "util/status.h"
 #include "util/options.h"
 #include "util/event_manager.h"
+#include "util/mutex.h"
+#include "util/statistics.h"
+#include "util/perf_context.h"
 #include <condition_variable>
 
 namespace cdb{
@@ -29,11 +32,11 @@ class Cache{
     Cache(cdb::Options db_options, EventManager* event_manager_);
     ~Cache();
 
-    Status Get(ReadOptions& write_options, const std::string &key, std::string* value);
-    Status Put(WriteOptions& write_options, const std::string &key, const std::string& value);
-    Status Delete(WriteOptions& write_options, const std::string& key);
+    Status Get(ReadOptions& write_options, const std::string &key, uint64_t hashed_key, std::string* value);
+    Status Put(WriteOptions& write_options, const std::string &key, uint64_t hashed_key, const std::string& value);
+    Status Delete(WriteOptions& write_options, const std::string& key, uint64_t hashed_key);
 
-    Status Additem(WriteOptions& write_options, const EntryType& op_type, const std::string &key, const std::string& value);
+    Status Additem(WriteOptions& write_options, const EntryType& op_type, const std::string &key, uint64_t hashed_key, const std::string& value);
     void set_max_size_(int max_size){
       max_size_ = max_size;
     }
@@ -58,11 +61,11 @@ class Cache{
     cdb::EventManager* event_manager_;
 
 
-    std::mutex w_mutex_cache_live_l1;
+    InstrumentedMutex w_mutex_cache_live_l1{"Cache::w_mutex_cache_live_l1"};
     std::mutex mutex_flush_l2;
-    std::mutex mutex_live_size_l3;
-    std::mutex w_mutex_cache_swap_l4;
-    std::mutex r_mutex_cache_swap_l5;
+    InstrumentedMutex mutex_live_size_l3{"Cache::mutex_live_size_l3"};
+    InstrumentedMutex w_mutex_cache_swap_l4{"Cache::w_mutex_cache_swap_l4"};
+    InstrumentedMutex r_mutex_cache_swap_l5{"Cache::r_mutex_cache_swap_l5"};
 
     std::condition_variable cond_flush;
     std::condition_variable cond_reader;
@@ -15,6 +15,7 @@ CuckooDB::CuckooDB(cdb::Options db_options,
   name_(name) {
   is_closed_ = true;
   db_options_ = db_options;
+  if (!db_options_.statistics) db_options_.statistics = std::shared_ptr<Statistics>(new Statistics());
   // event_manager_ = new EventManager();
   // cache_ = new Cache(db_options, event_manager_);
   // stroage_engine_ = new StorageEngine(db_options, name, event_manager_);
@@ -26,40 +27,80 @@ CuckooDB::~CuckooDB(){
 }
 
 Status CuckooDB::Get(ReadOptions& read_options, const std::string &key, std::string* value) {
-  log::trace("CuckooDB::Get()","key:%s", key.c_str());
+  CDB_LOG_TRACE("CuckooDB::Get()","key:%s", key.c_str());
+  Statistics* statistics = db_options_.statistics.get();
+  StopWatch stop_watch(statistics, kHistGet);
 
-  //查找Cache
-  Status s = cache_->Get(read_options, key, value);
+  //hashed_key 只计算一次，选择分片、Cache 和 StorageEngine 共用
+  uint64_t hashed_key = HashKey(key);
+  Shard& shard = GetShard(hashed_key);
+  //查找Cache，live cache 和 swap cache 的命中在 Cache::Get() 中记录
+  Status s;
+  {
+    PERF_TIMER_GUARD(cache_get_nanos);
+    s = shard.cache->Get(read_options, key, hashed_key, value);
+  }
 
   if (s.IsRemoveEntry()){
+    RecordTick(statistics, kGetMiss);
     return Status::NotFound("Has been Remove, Unable to find");
   } else if (s.IsNotFound()){
     //find in StorageEngine
-    log::trace("CuckooDB::Get()", "not found in cahce, search in StorageEngine");
-    s = stroage_engine_->Get(read_options, key, value);
+    CDB_LOG_TRACE("CuckooDB::Get()", "not found in cahce, search in StorageEngine");
+    {
+      PERF_TIMER_GUARD(storage_get_nanos);
+      s = shard.stroage_engine->Get(read_options, key, hashed_key, value);
+    }
     if (s.IsNotFound()) {
-      log::trace("CuckooDB::Get()", "not found in StorageEngine");
+      CDB_LOG_TRACE("CuckooDB::Get()", "not found in StorageEngine");
+      RecordTick(statistics, kGetMiss);
       return s;
     } else if (s.IsOK()){
-      log::trace("CuckooDB::Get()", "found in StorageEngine");
+      CDB_LOG_TRACE("CuckooDB::Get()", "found in StorageEngine");
+      RecordTick(statistics, kGetHitStorage);
+      RecordTick(statistics, kBytesRead, value->size());
       return s;
     }
+    RecordTick(statistics, kGetMiss);
     return Status::NotFound("Unable to find");
   }
 
 
-  log::trace("CuckooDB::Get()", "found key in cahce, return value");
+  CDB_LOG_TRACE("CuckooDB::Get()", "found key in cahce, return value");
+  if (s.IsOK()) RecordTick(statistics, kBytesRead, value->size());
   return s;
 } 
 
 Status CuckooDB::Put(WriteOptions& write_options, const std::string &key, const std::string& value) {
-  log::trace("CuckooDB::Put", "Put key:%s, value:%s", key.c_str(), value.c_str());
-  return cache_->Put(write_options, key, value);
+  CDB_LOG_TRACE("CuckooDB::Put", "Put key:%s, value:%s", key.c_str(), value.c_str());
+  StopWatch stop_watch(db_options_.statistics.get(), kHistPut);
+  uint64_t hashed_key = HashKey(key);
+  Status s;
+  {
+    PERF_TIMER_GUARD(cache_write_nanos);
+    s = GetShard(hashed_key).cache->Put(write_options, key, hashed_key, value);
+  }
+  if (s.IsOK()) {
+    RecordTick(db_options_.statistics.get(), kKeysWritten);
+    RecordTick(db_options_.statistics.get(), kBytesWritten, key.size() + value.size());
+  }
+  return s;
 }
 
 Status CuckooDB::Delete(WriteOptions& write_options, const std::string& key) {
-  log::trace("CuckooDB::Delete()","delete key:%s", key.c_str());
-  return cache_->Delete(write_options, key);
+  CDB_LOG_TRACE("CuckooDB::Delete()","delete key:%s", key.c_str());
+  StopWatch stop_watch(db_options_.statistics.get(), kHistDelete);
+  uint64_t hashed_key = HashKey(key);
+  Status s;
+  {
+    PERF_TIMER_GUARD(cache_write_nanos);
+    s = GetShard(hashed_key).cache->Delete(write_options, key, hashed_key);
+  }
+  if (s.IsOK()) {
+    RecordTick(db_options_.statistics.get(), kKeysDeleted);
+    RecordTick(db_options_.statistics.get(), kBytesWritten, key.size());
+  }
+  return s;
 }
 
 /*
@@ -88,25 +129,171 @@ Status CuckooDB::Open() {
   std::unique_lock<std::mutex> lock(mutex_close_);
   if (!is_closed_) return Status::IOError("The database is already open");
   
-  log::trace("CuckooDB::Open()", "begin to Open");
-  event_manager_ = new EventManager();
-  cache_ = new Cache(db_options_, event_manager_);
-  stroage_engine_ = new StorageEngine(db_options_, name_, event_manager_);
+  Status s = CheckNumShards(db_exists);
+  if (!s.IsOK()) return s;
+
+  CDB_LOG_TRACE("CuckooDB::Open()", "begin to Open");
+  uint32_t num_shards = std::max(1u, db_options_.storage__num_shards);
+  std::vector<std::string> paths;
+  for (uint32_t i = 0; i < num_shards; ++i) {
+    std::string path = GetShardPath(i);
+    if (num_shards > 1 && stat(path.c_str(), &info) != 0 && mkdir(path.c_str(), 0755) < 0) {
+      return Status::IOError("Could not create shard directory", strerror(errno));
+    }
+    paths.push_back(path);
+  }
+
+  //各分片的 StorageEngine 在构造时加载自己的数据文件
+  for (auto& path: paths) {
+    Shard shard;
+    shard.event_manager = new EventManager();
+    shard.cache = new Cache(db_options_, shard.event_manager);
+    shard.stroage_engine = new StorageEngine(db_options_, path, shard.event_manager);
+    shards_.push_back(shard);
+  }
 
   is_closed_ = false;
   return Status::OK(); 
 
 }
 
+LoadTiming CuckooDB::GetLoadTiming() {
+  std::unique_lock<std::mutex> lock(mutex_close_);
+  LoadTiming timing;
+  for (auto& shard: shards_) timing.Add(shard.stroage_engine->GetLoadTiming());
+  return timing;
+}
+
+Status CuckooDB::GetProperty(const std::string& property, std::string* value) {
+  std::unique_lock<std::mutex> lock(mutex_close_);
+  if (is_closed_) return Status::IOError("The database is not open");
+  if (property == "cdb.histograms") {
+    *value = db_options_.statistics->HistogramsToString();
+    return Status::OK();
+  }
+  if (property != "cdb.stats") {
+    uint64_t value_int = 0;
+    Status s = GetIntPropertyLocked(property, &value_int);
+    if (s.IsOK()) *value = std::to_string(value_int);
+    return s;
+  }
+
+  static const char* properties[] = {
+    "cdb.num-entries-index",
+    "cdb.index-memory",
+    "cdb.num-files",
+    "cdb.num-files-mapped",
+    "cdb.db-size-total",
+    "cdb.db-size-uncompacted",
+  };
+  value->clear();
+  char buffer[128];
+  snprintf(buffer, sizeof(buffer), "%-24s %20zu\n", "num-shards", shards_.size());
+  value->append(buffer);
+  for (auto property_int: properties) {
+    uint64_t value_int = 0;
+    GetIntPropertyLocked(property_int, &value_int);
+    snprintf(buffer, sizeof(buffer), "%-24s %20" PRIu64 "\n", property_int + 4, value_int);
+    value->append(buffer);
+  }
+  value->append(db_options_.statistics->ToString());
+  value->append(db_options_.statistics->HistogramsToString());
+  return Status::OK();
+}
+
+Status CuckooDB::GetIntProperty(const std::string& property, uint64_t* value) {
+  std::unique_lock<std::mutex> lock(mutex_close_);
+  if (is_closed_) return Status::IOError("The database is not open");
+  return GetIntPropertyLocked(property, value);
+}
+
+Status CuckooDB::GetIntPropertyLocked(const std::string& property, uint64_t* value) {
+  static const std::string prefix = "cdb.";
+  if (property.compare(0, prefix.size(), prefix) != 0) return Status::NotFound("Unknown property", property);
+  std::string name = property.substr(prefix.size());
+
+  for (uint32_t i = 0; i < kNumTickers; i++) {
+    if (name == Statistics::GetTickerName(static_cast<Ticker>(i))) {
+      *value = db_options_.statistics->Get(static_cast<Ticker>(i));
+      return Status::OK();
+    }
+  }
+
+  uint64_t (StorageEngine::*getter)() = nullptr;
+  if (name == "num-entries-index") getter = &StorageEngine::GetNumEntriesIndex;
+  else if (name == "index-memory") getter = &StorageEngine::GetIndexMemoryUsage;
+  else if (name == "num-files") getter = &StorageEngine::GetNumFiles;
+  else if (name == "num-files-mapped") getter = &StorageEngine::GetNumFilesMapped;
+  else if (name == "db-size-total") getter = &StorageEngine::GetDbSizeTotal;
+  else if (name == "db-size-uncompacted") getter = &StorageEngine::GetDbSizeUncompacted;
+  else return Status::NotFound("Unknown property", property);
+
+  *value = 0;
+  for (auto& shard: shards_) *value += (shard.stroage_engine->*getter)();
+  return Status::OK();
+}
+
+std::string CuckooDB::GetShardPath(uint32_t shard) {
+  if (db_options_.storage__num_shards <= 1) return name_;
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "/shard_%03u", shard);
+  return name_ + buffer;
+}
+
+std::string CuckooDB::GetShardsFilepath() {
+  return name_ + "/shards";
+}
+
+Status CuckooDB::CheckNumShards(bool db_exists) {
+  uint32_t num_shards = std::max(1u, db_options_.storage__num_shards);
+  uint32_t num_shards_stored = 0;
+  FILE* file = fopen(GetShardsFilepath().c_str(), "r");
+  if (file != nullptr) {
+    if (fscanf(file, "%u", &num_shards_stored) != 1) num_shards_stored = 0;
+    fclose(file);
+    if (num_shards_stored == 0) return Status::IOError("Invalid shards file", GetShardsFilepath().c_str());
+  } else if (db_exists) {
+    //没有 shards 文件但目录不为空，是不分片的数据库
+    DIR *directory = opendir(name_.c_str());
+    if (directory == NULL) return Status::IOError("Could not open database directory", name_.c_str());
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+      num_shards_stored = 1;
+      break;
+    }
+    closedir(directory);
+  }
+
+  if (num_shards_stored != 0 && num_shards_stored != num_shards) {
+    CDB_LOG_EMERG("CuckooDB::CheckNumShards()", "database has %u shards, options ask for %u", num_shards_stored, num_shards);
+    return Status::IOError("Number of shards does not match the database");
+  }
+  if (num_shards_stored == 0 && num_shards > 1) {
+    file = fopen(GetShardsFilepath().c_str(), "w");
+    if (file == nullptr) return Status::IOError("Could not create shards file", strerror(errno));
+    fprintf(file, "%u\n", num_shards);
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+      fclose(file);
+      return Status::IOError("Could not write shards file", strerror(errno));
+    }
+    fclose(file);
+  }
+  return Status::OK();
+}
+
 void CuckooDB::Close() {
   std::unique_lock<std::mutex> lock(mutex_close_);
   if (is_closed_) return;
   is_closed_ = true;
-  cache_->Close();
-  stroage_engine_->Close();
-  delete cache_;
-  delete stroage_engine_;
-  delete event_manager_;
+  for (auto& shard: shards_) shard.cache->Close();
+  for (auto& shard: shards_) shard.stroage_engine->Close();
+  for (auto& shard: shards_) {
+    delete shard.cache;
+    delete shard.stroage_engine;
+    delete shard.event_manager;
+  }
+  shards_.clear();
 }
 
 }
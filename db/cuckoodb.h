@@ -14,6 +14,7 @@
 #include <string>
 #include <thread>
 #include <memory>
+#include <vector>
 
 #include "db.h"
 #include "util/entry.h"
@@ -23,6 +24,8 @@
 #include "storage_engine/storage_engine.h"
 #include "util/event_manager.h"
 #include "util/options.h"
+#include "util/statistics.h"
+#include "util/perf_context.h"
 
 namespace cdb{
 
@@ -36,15 +39,47 @@ class CuckooDB:public DB{
     virtual Status Delete(WriteOptions& write_options, const std::string& key) override;
     virtual Status Open() override;
     virtual void Close() override;
+    //属性：
+    //  "cdb.stats"                  所有属性、计数器和直方图的文本
+    //  "cdb.histograms"             各阶段延迟直方图的文本
+    //  "cdb.num-entries-index"      索引条目数
+    //  "cdb.index-memory"           索引占用内存的估计(字节)
+    //  "cdb.num-files"              数据文件数
+    //  "cdb.num-files-mapped"       FilePool 中映射的文件数
+    //  "cdb.db-size-total"          数据文件的总大小(字节)
+    //  "cdb.db-size-uncompacted"    未合并数据文件的大小(字节)
+    //  "cdb.<ticker>"               Statistics 的计数器，例如 "cdb.get-hit-live"
+    //分片的值相加
+    virtual Status GetProperty(const std::string& property, std::string* value) override;
+    virtual Status GetIntProperty(const std::string& property, uint64_t* value) override;
+
+    //Open() 加载数据库各阶段的耗时，各分片依次加载，耗时相加
+    LoadTiming GetLoadTiming();
 
   private:
+    //每个分片有自己的 Cache、StorageEngine 和后台线程，按 hashed_key 选择分片
+    struct Shard {
+      cdb::EventManager *event_manager;
+      cdb::Cache *cache;
+      cdb::StorageEngine *stroage_engine;
+    };
+
+    Shard& GetShard(uint64_t hashed_key) {
+      return shards_[hashed_key % shards_.size()];
+    }
+
+    std::string GetShardPath(uint32_t shard);
+    std::string GetShardsFilepath();
+    //分片数写入 <dbname>/shards，之后打开时分片数必须一致，否则 key 会被分到错误的分片
+    Status CheckNumShards(bool db_exists);
+    //调用者持有 mutex_close_
+    Status GetIntPropertyLocked(const std::string& property, uint64_t* value);
+
     std::string name_;//database name
     std::mutex mutex_;
 
     cdb::Options db_options_;
-    cdb::StorageEngine *stroage_engine_;
-    cdb::Cache *cache_;
-    cdb::EventManager *event_manager_;
+    std::vector<Shard> shards_;
     // cdb::CRC32 crc32_;
 
     bool is_closed_;
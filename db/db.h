@@ -28,6 +28,9 @@ class DB{
     virtual Status Delete(WriteOptions& write_options, const std::string& key) = 0;
     virtual Status Open() = 0;
     virtual void Close() = 0;
+    //读取数据库的属性，例如 "cdb.stats"；不认识的属性回传 NotFound
+    virtual Status GetProperty(const std::string& property, std::string* value) = 0;
+    virtual Status GetIntProperty(const std::string& property, uint64_t* value) = 0;
 
 };
 
@@ -13,135 +13,251 @@
 #include <map>
 #include <mutex>
 #include <vector>
+#include <array>
+#include <atomic>
+#include <thread>
 #include <cinttypes>
+#include <cstring>
 #include <unistd.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <ftw.h>
 #include <sys/resource.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include "util/logger.h"
+#include "util/status.h"
+#include "util/mutex.h"
+#include "util/statistics.h"
+#include "util/perf_context.h"
+
 namespace cdb {
 
+class FileUtil {
+ public:
+
+  static void increase_limit_open_files() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+      // TODO: linux compatibility
+      //rl.rlim_cur = OPEN_MAX;
+      rl.rlim_cur = 4096;
+      if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        fprintf(stderr, "Could not increase the limit of open files for this process");
+      }
+    }
+  }
+
+  static Status remove_files_with_prefix(const char *dirpath, const std::string prefix) {
+    DIR *directory;
+    struct dirent *entry;
+    if ((directory = opendir(dirpath)) == NULL) {
+      return Status::IOError("Could not open directory", dirpath);
+    }
+    char filepath[FileUtil::maximum_path_size()];
+    Status s;
+    struct stat info;
+    while ((entry = readdir(directory)) != NULL) {
+      int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dirpath, entry->d_name);
+      if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
+        CDB_LOG_EMERG("remove_files_with_prefix()",
+                  "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
+        continue;
+      }
+      if (   strncmp(entry->d_name, prefix.c_str(), prefix.size()) != 0
+          || stat(filepath, &info) != 0
+          || !(info.st_mode & S_IFREG)) {
+        continue;
+      }
+      if (std::remove(filepath)) {
+        CDB_LOG_WARN("remove_files_with_prefix()", "Could not remove file [%s]", filepath);
+      }
+    }
+    closedir(directory);
+    return Status::OK();
+  }
+
+  //递归删除目录及其中的所有文件，测试和基准测试用来删除数据库
+  static void remove_directory(const std::string& dirpath) {
+    nftw(dirpath.c_str(), remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+  }
+
+  //madvise 要求起始地址按页对齐，offset 向下对齐到页，mmap 为映射的起始地址
+  static int advise(char* mmap, uint64_t offset, uint64_t length, int advice) {
+    static const uint64_t size_page = sysconf(_SC_PAGESIZE);
+    uint64_t offset_aligned = offset - offset % size_page;
+    int ret = madvise(mmap + offset_aligned, length + offset - offset_aligned, advice);
+    if (ret != 0) {
+      CDB_LOG_TRACE("FileUtil::advise()", "madvise(%d) failed: %s", advice, strerror(errno));
+    }
+    return ret;
+  }
+
+  static int64_t maximum_path_size() {
+    return 4096;
+  }
+
+  static int sync_file(int fd) {
+    int ret;
+#ifdef F_FULLFSYNC
+    // For Mac OS X
+    ret = fcntl(fd, F_FULLFSYNC);
+#else
+    ret = fdatasync(fd);
+#endif // F_FULLFSYNC
+    return ret;
+  }
+
+ private:
+  static int remove_entry(const char* path, const struct stat* /*sb*/, int /*typeflag*/, struct FTW* /*ftwbuf*/) {
+    return remove(path);
+  }
+};
+
+//一个文件的只读映射，引用计数为 0 时 munmap
+struct FileMapping {
+  uint32_t fileid;
+  int fd;
+  uint64_t size_mapped;   //映射的长度，可以超过文件当前的大小
+  char* mmap;
+  std::atomic<int> num_references;
+  std::atomic<bool> is_referenced;   //CLOCK 淘汰使用的访问位
+};
+
+//GetFile() 回传的文件视图，使用完后必须调用 ReleaseFile()
 struct FileResource {
 uint32_t fileid;
 int fd;
 uint64_t filesize;
 char* mmap;
-int num_references;
+FileMapping* mapping;
 };
 
+//fileid 哈希到固定数量的组，每组 kNumWays 个槽，一个文件的映射只会放在它所在组的某个槽中。
+//查找不加锁：读取者先增加组的 num_readers，在组内查找并增加映射的引用计数，再减少 num_readers；
+//从槽中移除映射时只交换指针，不等待读取者：之后观察到组的 num_readers 为 0 时，
+//不会再有读取者拿到旧映射，这时释放槽的引用，旧映射在最后一个引用释放时 munmap。
+//只有未命中时才加锁创建映射，组满或者超过 MaxNumFiles() 时按 CLOCK 淘汰
 class FilePool {
  public:
-  FilePool() {}
-  ~FilePool() {}
-
-  Status GetFile(uint32_t fileid, const std::string& filepath, uint64_t filesize, FileResource* file) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    bool found = false;
-
-    auto it = files_unused.begin();
-    //mmap 共享指针，文件大小改变的话 会导致 mmap访问非法的位置
-    while(it != files_unused.end()) {
-      if (it->fileid != fileid) {
-        ++it;
-      } else if (it->filesize == filesize){
-        break;
-      } else {
-        //同一个 fileid 的文件 他们的大小不一样，那么发生了文件大小的改变，文件变小了
-        //就会法导致mmap严重错误，因此释放该资源
-        munmap(it->mmap, it->filesize);
-        close(it->fd);
-        it = files_unused.erase(it);
-      }
+  //advice 为新建映射的 madvise 参数，statistics 可以为空
+  FilePool(int advice=MADV_NORMAL, Statistics* statistics=nullptr)
+      : advice_(advice),
+        statistics_(statistics) {
+    for (auto& set: sets_) {
+      for (auto& mapping: set.mappings) mapping.store(nullptr, std::memory_order_relaxed);
+      set.num_readers.store(0, std::memory_order_relaxed);
+      set.hand_clock = 0;
     }
-    
-    //在 files_unused 中找到
-    if (it != files_unused.end()) {
-      *file = *it;
-      files_unused.erase(it);
-      file->num_references = 1;
-      files_used.insert(std::pair<uint32_t, FileResource>(fileid, *file));
-      found = true;
+    num_files_ = 0;
+    hand_clock_ = 0;
+  }
 
-    } else {
-    //在file_used 中找
-      auto range = files_used.equal_range(fileid);
-      auto it = range.first;
-      for (; it != range.second; ++it) {
-        if (it->second.filesize == filesize) break;
-      }
+  ~FilePool() {
+    std::unique_lock<InstrumentedMutex> lock(mutex_);
+    for (uint32_t i = 0; i < kNumSets * kNumWays; ++i) Remove(i / kNumWays, i % kNumWays);
+    for (auto& item: mappings_retired_) Unref(item.second);
+    mappings_retired_.clear();
+  }
 
-      if (it != range.second) {
-        it->second.num_references += 1;
-        *file = it->second;
-        found = true;
-      }        
+  //size_map 不为0时按 size_map 映射，用于还在增长的文件：只要读取不超过已写入的 filesize，
+  //映射超出文件末尾的部分是安全的，文件变大后也不需要重新映射
+  Status GetFile(uint32_t fileid, const std::string& filepath, uint64_t filesize, FileResource* file, uint64_t size_map=0) {
+    PERF_COUNTER_ADD(filepool_lookups, 1);
+    uint32_t index_set = GetSetIndex(fileid);
+    FileMapping* mapping = Acquire(sets_[index_set], fileid, filesize);
+    if (mapping != nullptr) {
+      RecordTick(statistics_, kFilePoolHits);
+      Fill(mapping, filesize, file);
+      return Status::OK();
     }
 
-    if (found) return Status::OK();
-
-    //释放
-    if (NumFiles() > MaxNumFiles() && !files_unused.empty()) {
-      auto it = files_unused.begin();
-      munmap(it->mmap, it->filesize);
-      close(it->fd);
-      files_unused.erase(it);  
+    std::unique_lock<InstrumentedMutex> lock(mutex_);
+    //持有 mutex_ 时没有其他线程会修改组中的映射
+    int way = Find(index_set, fileid);
+    if (way >= 0) {
+      mapping = sets_[index_set].mappings[way].load(std::memory_order_acquire);
+      if (mapping->size_mapped >= filesize) {
+        mapping->num_references.fetch_add(1, std::memory_order_acq_rel);
+        mapping->is_referenced.store(true, std::memory_order_relaxed);
+        RecordTick(statistics_, kFilePoolHits);
+        Fill(mapping, filesize, file);
+        return Status::OK();
+      }
     }
 
+    RecordTick(statistics_, kFilePoolMisses);
+    PERF_COUNTER_ADD(filepool_mmaps, 1);
     int fd = 0;
     //打开文件
     if ((fd = open(filepath.c_str(), O_RDONLY)) < 0) {
-      log::emerg("FilePool::Mmap()::ctor()", "Could not open file [%s]: %s", filepath.c_str(), strerror(errno));
+      CDB_LOG_EMERG("FilePool::GetFile()", "Could not open file [%s]: %s", filepath.c_str(), strerror(errno));
       return Status::IOError("Could not open() file");        
     }
     
+    uint64_t size_mapped = std::max(filesize, size_map);
     char* datafile = static_cast<char*>(mmap(0,
-                                             filesize,
+                                             size_mapped,
                                              PROT_READ,
                                              MAP_SHARED,
                                              fd,
                                              0));
 
     if (datafile == MAP_FAILED){
-      log::emerg("Could not mmap() file [%s]: %s", filepath.c_str(), strerror(errno));
+      CDB_LOG_EMERG("FilePool::GetFile()", "Could not mmap() file [%s]: %s", filepath.c_str(), strerror(errno));
+      close(fd);
       return Status::IOError("Could not mmap() file");      
     }
 
-    file->fileid = fileid;
-    file->filesize = filesize;
-    file->fd = fd;
-    file->mmap = datafile;
-    file->num_references = 1;
-    files_used.insert(std::pair<uint32_t, FileResource>(fileid, *file));
+    if (advice_ != MADV_NORMAL) FileUtil::advise(datafile, 0, size_mapped, advice_);
+
+    //一个引用属于槽，一个属于调用者
+    mapping = new FileMapping;
+    mapping->fileid = fileid;
+    mapping->fd = fd;
+    mapping->size_mapped = size_mapped;
+    mapping->mmap = datafile;
+    mapping->num_references.store(2, std::memory_order_relaxed);
+    mapping->is_referenced.store(true, std::memory_order_relaxed);
+    //同一个 fileid 的文件变大了，替换原来的映射；否则放入组中空闲的槽，组满时在组内淘汰
+    if (way < 0) way = FindFreeWay(index_set);
+    Remove(index_set, way);
+    sets_[index_set].mappings[way].store(mapping, std::memory_order_seq_cst);
+    num_files_.fetch_add(1, std::memory_order_acq_rel);
+    if (num_files_ > MaxNumFiles()) Evict();
+    ReclaimRetired();
 
+    Fill(mapping, filesize, file);
     return Status::OK();                                       
   }
 
+  void ReleaseFile(const FileResource& file) {
+    if (file.mapping != nullptr) Unref(file.mapping);
+  }
 
-  void ReleaseFile(uint32_t fileid, uint64_t filesize) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    auto range = files_used.equal_range(fileid);
-    auto it = range.first;
-    for (; it != range.second; ++it) {
-      if (it->second.filesize == filesize) break;
-    }
-    if (it == range.second) return;
+  //文件被删除前调用：移除 fileid 的映射，已经 GetFile() 的调用者仍然可以使用，最后一个引用释放时 munmap
+  void Drop(uint32_t fileid) {
+    std::unique_lock<InstrumentedMutex> lock(mutex_);
+    uint32_t index_set = GetSetIndex(fileid);
+    int way = Find(index_set, fileid);
+    if (way >= 0) Remove(index_set, way);
+    ReclaimRetired();
+  }
 
-    if (it->second.num_references > 1) {
-      it->second.num_references -= 1;
-    } else {
-      it->second.num_references = 0;
-      files_unused.push_back(it->second);
-      files_used.erase(it);
-    }
+  //对 file 中 [offset, offset+length) 的映射设置访问方式，用完后用 GetAdvice() 恢复
+  void Advise(const FileResource& file, uint64_t offset, uint64_t length, int advice) {
+    FileUtil::advise(file.mmap, offset, length, advice);
+  }
+
+  int GetAdvice() {
+    return advice_;
   }
-  
 
   int NumFiles() {
-    return files_unused.size() + files_used.size();
+    return num_files_.load(std::memory_order_acquire);
   }
 
   int MaxNumFiles() {
@@ -149,69 +265,135 @@ class FilePool {
   }
 
   private:
-  std::mutex mutex_;
-  std::vector<FileResource> files_unused;
-  std::unordered_multimap<uint32_t, FileResource> files_used;
-};
+  static const uint32_t kNumWays = 8;
+  static const uint32_t kNumBitsSets = 9;
+  static const uint32_t kNumSets = 1u << kNumBitsSets;
 
-class FileUtil {
- public:
+  struct alignas(64) Set {
+    std::array<std::atomic<FileMapping*>, kNumWays> mappings;
+    std::atomic<uint32_t> num_readers;
+    uint32_t hand_clock;   //组内 CLOCK 的指针，调用者持有 mutex_
+  };
 
-  static void increase_limit_open_files() {
-    struct rlimit rl;
-    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
-      // TODO: linux compatibility
-      //rl.rlim_cur = OPEN_MAX;
-      rl.rlim_cur = 4096;
-      if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
-        fprintf(stderr, "Could not increase the limit of open files for this process");
-      }
+  //相邻的 fileid 分散到不同的组，相差 kNumSets 整数倍的 fileid 也不会落在同一组
+  static uint32_t GetSetIndex(uint32_t fileid) {
+    return (fileid * 2654435761u) >> (32 - kNumBitsSets);
+  }
+
+  //映射更长时也可以使用，文件只会追加
+  static bool IsMatch(FileMapping* mapping, uint32_t fileid, uint64_t filesize) {
+    return mapping != nullptr && mapping->fileid == fileid && mapping->size_mapped >= filesize;
+  }
+
+  //不加锁查找，命中时回传增加了引用计数的映射
+  FileMapping* Acquire(Set& set, uint32_t fileid, uint64_t filesize) {
+    set.num_readers.fetch_add(1, std::memory_order_seq_cst);
+    FileMapping* mapping = nullptr;
+    for (auto& mapping_way: set.mappings) {
+      FileMapping* mapping_current = mapping_way.load(std::memory_order_seq_cst);
+      if (!IsMatch(mapping_current, fileid, filesize)) continue;
+      mapping_current->num_references.fetch_add(1, std::memory_order_acq_rel);
+      mapping = mapping_current;
+      break;
+    }
+    set.num_readers.fetch_sub(1, std::memory_order_seq_cst);
+    if (mapping == nullptr) return nullptr;
+    if (!mapping->is_referenced.load(std::memory_order_relaxed)) {
+      mapping->is_referenced.store(true, std::memory_order_relaxed);
     }
+    return mapping;
   }
 
-  static Status remove_files_with_prefix(const char *dirpath, const std::string prefix) {
-    DIR *directory;
-    struct dirent *entry;
-    if ((directory = opendir(dirpath)) == NULL) {
-      return Status::IOError("Could not open directory", dirpath);
+  void Fill(FileMapping* mapping, uint64_t filesize, FileResource* file) {
+    file->fileid = mapping->fileid;
+    file->fd = mapping->fd;
+    file->filesize = filesize;
+    file->mmap = mapping->mmap;
+    file->mapping = mapping;
+  }
+
+  //调用者持有 mutex_：回传 fileid 所在的槽，不存在时回传 -1
+  int Find(uint32_t index_set, uint32_t fileid) {
+    Set& set = sets_[index_set];
+    for (uint32_t way = 0; way < kNumWays; ++way) {
+      FileMapping* mapping = set.mappings[way].load(std::memory_order_relaxed);
+      if (mapping != nullptr && mapping->fileid == fileid) return way;
     }
-    char filepath[FileUtil::maximum_path_size()];
-    Status s;
-    struct stat info;
-    while ((entry = readdir(directory)) != NULL) {
-      int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dirpath, entry->d_name);
-      if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
-        log::emerg("remove_files_with_prefix()",
-                  "Filepath buffer is too small, could not build the filepath string for file [%s]", entry->d_name); 
-        continue;
-      }
-      if (   strncmp(entry->d_name, prefix.c_str(), prefix.size()) != 0
-          || stat(filepath, &info) != 0
-          || !(info.st_mode & S_IFREG)) {
-        continue;
-      }
-      if (std::remove(filepath)) {
-        log::warn("remove_files_with_prefix()", "Could not remove file [%s]", filepath);
+    return -1;
+  }
+
+  //调用者持有 mutex_：回传组中空闲的槽，没有时用组内的 CLOCK 选出要淘汰的槽
+  uint32_t FindFreeWay(uint32_t index_set) {
+    Set& set = sets_[index_set];
+    for (uint32_t way = 0; way < kNumWays; ++way) {
+      if (set.mappings[way].load(std::memory_order_relaxed) == nullptr) return way;
+    }
+    for (;;) {
+      uint32_t way = set.hand_clock;
+      set.hand_clock = (set.hand_clock + 1) % kNumWays;
+      FileMapping* mapping = set.mappings[way].load(std::memory_order_relaxed);
+      if (mapping->is_referenced.exchange(false, std::memory_order_relaxed)) continue;
+      RecordTick(statistics_, kFilePoolEvictions);
+      return way;
+    }
+  }
+
+  //调用者持有 mutex_：移除槽中的映射。不等待读取者，组中还有读取者时旧映射放入 mappings_retired_
+  void Remove(uint32_t index_set, uint32_t way) {
+    Set& set = sets_[index_set];
+    FileMapping* mapping_old = set.mappings[way].exchange(nullptr, std::memory_order_seq_cst);
+    if (mapping_old == nullptr) return;
+    num_files_.fetch_sub(1, std::memory_order_acq_rel);
+    if (set.num_readers.load(std::memory_order_seq_cst) == 0) {
+      Unref(mapping_old);
+    } else {
+      mappings_retired_.push_back(std::make_pair(index_set, mapping_old));
+    }
+  }
+
+  //调用者持有 mutex_：移除之后组的 num_readers 出现过 0，就不会再有读取者拿到旧映射
+  void ReclaimRetired() {
+    size_t num_kept = 0;
+    for (auto& item: mappings_retired_) {
+      if (sets_[item.first].num_readers.load(std::memory_order_seq_cst) == 0) {
+        Unref(item.second);
+      } else {
+        mappings_retired_[num_kept++] = item;
       }
     }
-    closedir(directory);
-    return Status::OK();
+    mappings_retired_.resize(num_kept);
   }
 
-  static int64_t maximum_path_size() {
-    return 4096;
+  //调用者持有 mutex_：CLOCK，跳过并清除最近访问过的映射，淘汰第一个没有访问过的
+  void Evict() {
+    for (uint32_t i = 0; i < 2 * kNumSets * kNumWays && num_files_ > MaxNumFiles(); ++i) {
+      uint32_t index_set = hand_clock_ / kNumWays;
+      uint32_t way = hand_clock_ % kNumWays;
+      hand_clock_ = (hand_clock_ + 1) % (kNumSets * kNumWays);
+      FileMapping* mapping = sets_[index_set].mappings[way].load(std::memory_order_acquire);
+      if (mapping == nullptr) continue;
+      if (mapping->is_referenced.exchange(false, std::memory_order_relaxed)) continue;
+      Remove(index_set, way);
+      RecordTick(statistics_, kFilePoolEvictions);
+    }
   }
 
-  static int sync_file(int fd) {
-    int ret;
-#ifdef F_FULLFSYNC
-    // For Mac OS X
-    ret = fcntl(fd, F_FULLFSYNC);
-#else
-    ret = fdatasync(fd);
-#endif // F_FULLFSYNC
-    return ret;
+  static void Unref(FileMapping* mapping) {
+    if (mapping->num_references.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+    munmap(mapping->mmap, mapping->size_mapped);
+    close(mapping->fd);
+    delete mapping;
   }
+
+  std::array<Set, kNumSets> sets_;
+  std::atomic<int> num_files_;
+  uint32_t hand_clock_;
+  int advice_;
+  Statistics* statistics_;
+  //从槽中移除但还可能有读取者正在增加引用计数的映射：(组, 映射)
+  std::vector<std::pair<uint32_t, FileMapping*>> mappings_retired_;
+  //只在创建、移除和淘汰映射时使用
+  InstrumentedMutex mutex_{"FilePool::mutex_"};
 };
 
 
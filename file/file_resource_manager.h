@@ -7,6 +7,8 @@
 
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <array>
 #include <chrono>
 #include <vector>
 #include <map>
@@ -25,109 +27,155 @@
 #include <dirent.h>
 
 #include "util/options.h"
+#include "util/mutex.h"
 
 
 
 namespace cdb {
 
+//每个数据文件的元数据，读取的字段都是原子变量，读路径不加锁
+struct FileMetadata {
+  static const uint32_t kFlagHasSize          = 0x1;
+  static const uint32_t kFlagLarge            = 0x2;
+  static const uint32_t kFlagCompacted        = 0x4;
+  static const uint32_t kFlagPaddingInValues  = 0x8;
+  static const uint32_t kFlagActive           = 0x10;   //正在写入的文件
+
+  std::atomic<uint64_t> filesize;
+  std::atomic<uint64_t> timestamp;
+  std::atomic<uint64_t> epoch_last_activity;
+  std::atomic<uint32_t> num_writes_in_progress;
+  std::atomic<uint32_t> flags;
+  //HintData 只有写线程访问，用单个文件的锁保护
+  std::mutex mutex_hints;
+  std::vector< std::pair<uint64_t, uint32_t> > hints;
+
+  FileMetadata() {
+    filesize = 0;
+    timestamp = 0;
+    epoch_last_activity = 0;
+    num_writes_in_progress = 0;
+    flags = 0;
+  }
+
+  bool HasFlag(uint32_t flag) const {
+    return (flags.load(std::memory_order_acquire) & flag);
+  }
+};
+
+//fileid 到 FileMetadata 的三级基数表：fileid 的高 12 位、中间 10 位、低 10 位各一级。
+//下级的表第一次写入时分配并用 CAS 发布，之后直到析构都不会释放或移动，
+//因此读取者拿到的指针一直有效，查找只需要几次原子读取。
+//写入按 fileid 分到 kNumStripes 把锁上，只用于保持多个字段和数据库大小统计之间的一致
 class FileResourceManager {
  public:
   FileResourceManager() {
-    Reset();
+    for (auto& level: table_) level.store(nullptr, std::memory_order_relaxed);
+    dbsize_total_ = 0;
+    dbsize_uncompacted_ = 0;
+  }
+
+  ~FileResourceManager() {
+    for (auto& level: table_) {
+      Level2* l2 = level.load(std::memory_order_acquire);
+      if (l2 == nullptr) continue;
+      for (auto& block: l2->blocks) delete[] block.load(std::memory_order_acquire);
+      delete l2;
+    }
   }
 
   void Reset() {
-    std::unique_lock<std::mutex> lock(mutex_);
+    std::unique_lock<InstrumentedMutex> lock(mutex_fileids_);
+    for (auto fileid: fileids_) ClearAllDataForFileIdLocked(fileid);
+    fileids_.clear();
     dbsize_total_ = 0;
     dbsize_uncompacted_ = 0;
-    filesizes_.clear();
-    largefiles_.clear();
-    compactedfiles_.clear();
-    num_writes_in_progress_.clear();
-    offarrays_.clear();
-    has_padding_in_values_.clear();
-    epoch_last_activity_.clear();
   }
 
   void ClearTemporaryDataForFileId(uint32_t fileid) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    num_writes_in_progress_.erase(fileid);
-    offarrays_.erase(fileid);
-    has_padding_in_values_.erase(fileid);
-    epoch_last_activity_.erase(fileid);
+    FileMetadata* file = Find(fileid);
+    if (file == nullptr) return;
+    std::unique_lock<InstrumentedMutex> lock(GetStripe(fileid));
+    file->num_writes_in_progress = 0;
+    file->epoch_last_activity = 0;
+    file->flags &= ~FileMetadata::kFlagPaddingInValues;
+    std::unique_lock<std::mutex> lock_hints(file->mutex_hints);
+    std::vector< std::pair<uint64_t, uint32_t> >().swap(file->hints);
   }
 
   void ClearAllDataForFileId(uint32_t fileid) {
-    ClearTemporaryDataForFileId(fileid);
-    std::unique_lock<std::mutex> lock(mutex_);
-    uint64_t filesize = 0;
-    if (filesizes_.find(fileid) != filesizes_.end()) {
-      filesize = filesizes_[fileid];
-    }
-    IncrementDbSizeTotal(-filesize);
-    if (compactedfiles_.find(fileid) == compactedfiles_.end()) {
-      IncrementDbSizeUncompacted(-filesize);
-    }
-    filesizes_.erase(fileid);
-    largefiles_.erase(fileid);
-    compactedfiles_.erase(fileid);
+    std::unique_lock<InstrumentedMutex> lock(mutex_fileids_);
+    ClearAllDataForFileIdLocked(fileid);
+    fileids_.erase(fileid);
+  }
+
+  std::vector<uint32_t> GetFileIds() {
+    std::unique_lock<InstrumentedMutex> lock(mutex_fileids_);
+    return std::vector<uint32_t>(fileids_.begin(), fileids_.end());
   }
 
   uint64_t GetFileSize(uint32_t fileid) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    return filesizes_[fileid];
+    FileMetadata* file = Find(fileid);
+    return file == nullptr ? 0 : file->filesize.load(std::memory_order_acquire);
   }
 
   void SetFileSize(uint32_t fileid, uint64_t filesize) {
-    std::unique_lock<std::mutex> lock(mutex_);
-
-    uint64_t filesize_before = 0;
-    if (filesizes_.find(fileid) != filesizes_.end()) {
-      filesize_before = filesizes_[fileid];
-    }
-    IncrementDbSizeTotal(filesize - filesize_before);
-    if (compactedfiles_.find(fileid) == compactedfiles_.end()) {
-      IncrementDbSizeUncompacted(filesize - filesize_before);
+    FileMetadata* file = GetOrCreate(fileid);
+    {
+      std::unique_lock<InstrumentedMutex> lock(GetStripe(fileid));
+      uint64_t filesize_before = file->filesize.exchange(filesize, std::memory_order_acq_rel);
+      IncrementDbSizeTotal(filesize - filesize_before);
+      if (!file->HasFlag(FileMetadata::kFlagCompacted)) {
+        IncrementDbSizeUncompacted(filesize - filesize_before);
+      }
+      if (file->HasFlag(FileMetadata::kFlagHasSize)) return;
+      file->flags |= FileMetadata::kFlagHasSize;
     }
+    std::unique_lock<InstrumentedMutex> lock(mutex_fileids_);
+    fileids_.insert(fileid);
+  }
+
+  uint64_t GetFileTimestamp(uint32_t fileid) {
+    FileMetadata* file = Find(fileid);
+    return file == nullptr ? 0 : file->timestamp.load(std::memory_order_acquire);
+  }
 
-    filesizes_[fileid] = filesize;
+  void SetFileTimestamp(uint32_t fileid, uint64_t timestamp) {
+    GetOrCreate(fileid)->timestamp.store(timestamp, std::memory_order_release);
   }
 
   bool IsFileLarge(uint32_t fileid) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    return (largefiles_.find(fileid) != largefiles_.end());
+    FileMetadata* file = Find(fileid);
+    return file != nullptr && file->HasFlag(FileMetadata::kFlagLarge);
   }
 
   void SetFileLarge(uint32_t fileid) {
-    mutex_.lock();
-    largefiles_.insert(fileid);
-    mutex_.unlock();
+    GetOrCreate(fileid)->flags |= FileMetadata::kFlagLarge;
     SetFileCompacted(fileid);
   }
 
   bool IsFileCompacted(uint32_t fileid) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    return (compactedfiles_.find(fileid) != compactedfiles_.end());
+    FileMetadata* file = Find(fileid);
+    return file != nullptr && file->HasFlag(FileMetadata::kFlagCompacted);
   }
 
   void SetFileCompacted(uint32_t fileid) {
     // NOTE: the compacted files are all the ones before the fileid at which the
     // compaction process is currently waiting. Thus technically, there is no
-    // need for a std::set to know which HSTables are compacted and which
+    // need for a per-file flag to know which HSTables are compacted and which
     // aren't. This could be optimized at some point.
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (compactedfiles_.find(fileid) != compactedfiles_.end()) return;
-    compactedfiles_.insert(fileid);
-    if (filesizes_.find(fileid) != filesizes_.end()) {
-      // The size for this file was already set, thus the size of uncompacted
-      // files needs to be updated.
-      IncrementDbSizeUncompacted(-filesizes_[fileid]);
-    }
+    FileMetadata* file = GetOrCreate(fileid);
+    std::unique_lock<InstrumentedMutex> lock(GetStripe(fileid));
+    if (file->HasFlag(FileMetadata::kFlagCompacted)) return;
+    file->flags |= FileMetadata::kFlagCompacted;
+    // The size for this file may already be set, thus the size of uncompacted
+    // files needs to be updated.
+    IncrementDbSizeUncompacted(-file->filesize.load(std::memory_order_acquire));
   }
 
   uint32_t GetNumWritesInProgress(uint32_t fileid) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    return num_writes_in_progress_[fileid];
+    FileMetadata* file = Find(fileid);
+    return file == nullptr ? 0 : file->num_writes_in_progress.load(std::memory_order_acquire);
   }
 
   uint32_t SetNumWritesInProgress(uint32_t fileid, int inc) {
@@ -136,13 +184,9 @@ class FileResourceManager {
     // entry, we don't write the footer yet. That way, if any crash happens,
     // the file will have no footer, which will force a recovery and discover
     // which entries have corrupted data.
-    std::unique_lock<std::mutex> lock(mutex_);
-    if (num_writes_in_progress_.find(fileid) == num_writes_in_progress_.end()) {
-      num_writes_in_progress_[fileid] = 0;
-    }
-    num_writes_in_progress_[fileid] += inc;
-    epoch_last_activity_[fileid] = GetEpochNow();
-    return num_writes_in_progress_[fileid];
+    FileMetadata* file = GetOrCreate(fileid);
+    file->epoch_last_activity.store(GetEpochNow(), std::memory_order_release);
+    return file->num_writes_in_progress.fetch_add(inc, std::memory_order_acq_rel) + inc;
   }
 
   uint64_t GetEpochNow() {
@@ -154,67 +198,149 @@ class FileResourceManager {
   }
 
   uint64_t GetEpochLastActivity(uint32_t fileid) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    return epoch_last_activity_[fileid];
+    FileMetadata* file = Find(fileid);
+    return file == nullptr ? 0 : file->epoch_last_activity.load(std::memory_order_acquire);
   }
 
   const std::vector< std::pair<uint64_t, uint32_t> > GetHintData(uint32_t fileid) {
-    return offarrays_[fileid];
+    FileMetadata* file = Find(fileid);
+    if (file == nullptr) return std::vector< std::pair<uint64_t, uint32_t> >();
+    std::unique_lock<std::mutex> lock(file->mutex_hints);
+    return file->hints;
   }
 
   void AddHintData(uint32_t fileid, std::pair<uint64_t, uint32_t> p) {
-    offarrays_[fileid].push_back(p);
+    FileMetadata* file = GetOrCreate(fileid);
+    std::unique_lock<std::mutex> lock(file->mutex_hints);
+    file->hints.push_back(p);
+  }
+
+  //正在写入的文件大小一直在变化，读取时按最大长度映射，filesize 是已写入数据的水位
+  bool IsFileActive(uint32_t fileid) {
+    FileMetadata* file = Find(fileid);
+    return file != nullptr && file->HasFlag(FileMetadata::kFlagActive);
+  }
+
+  void SetFileActive(uint32_t fileid, bool flag) {
+    FileMetadata* file = GetOrCreate(fileid);
+    if (flag) {
+      file->flags |= FileMetadata::kFlagActive;
+    } else {
+      file->flags &= ~FileMetadata::kFlagActive;
+    }
   }
 
   bool HasPaddingInValues(uint32_t fileid) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    return (has_padding_in_values_.find(fileid) != has_padding_in_values_.end());
+    FileMetadata* file = Find(fileid);
+    return file != nullptr && file->HasFlag(FileMetadata::kFlagPaddingInValues);
   }
 
   void SetHasPaddingInValues(uint32_t fileid, bool flag) {
-    std::unique_lock<std::mutex> lock(mutex_);
+    FileMetadata* file = GetOrCreate(fileid);
     if (flag) {
-      has_padding_in_values_.insert(fileid);
+      file->flags |= FileMetadata::kFlagPaddingInValues;
     } else {
-      has_padding_in_values_.erase(fileid);
+      file->flags &= ~FileMetadata::kFlagPaddingInValues;
     }
   }
 
   uint64_t GetDbSizeTotal() {
-    std::unique_lock<std::mutex> lock(mutex_dbsize_);
-    return dbsize_total_;
+    return dbsize_total_.load(std::memory_order_acquire);
   }
 
   uint64_t GetDbSizeUncompacted() {
-    std::unique_lock<std::mutex> lock(mutex_dbsize_);
-    return dbsize_uncompacted_;
+    return dbsize_uncompacted_.load(std::memory_order_acquire);
   }
 
   void IncrementDbSizeTotal(int64_t inc) {
-    std::unique_lock<std::mutex> lock(mutex_dbsize_);
-    assert(dbsize_total_ + inc >= 0);
-    dbsize_total_ += inc;
+    uint64_t before = dbsize_total_.fetch_add(inc, std::memory_order_acq_rel);
+    assert((int64_t)(before + inc) >= 0);
   }
 
   void IncrementDbSizeUncompacted(int64_t inc) {
-    std::unique_lock<std::mutex> lock(mutex_dbsize_);
-    assert(dbsize_uncompacted_ + inc >= 0);
-    dbsize_uncompacted_ += inc;
+    uint64_t before = dbsize_uncompacted_.fetch_add(inc, std::memory_order_acq_rel);
+    assert((int64_t)(before + inc) >= 0);
   }
 
  private:
-  // NOTE: all files go through the same mutexes -- this can easily be sharded
-  std::mutex mutex_;
-  std::mutex mutex_dbsize_;
-  std::map<uint32_t, uint64_t> filesizes_;
-  std::set<uint32_t> largefiles_;
-  std::set<uint32_t> compactedfiles_;
-  std::map<uint32_t, uint64_t> num_writes_in_progress_;
-  std::map<uint32_t, std::vector< std::pair<uint64_t, uint32_t> > > offarrays_;
-  std::set<uint32_t> has_padding_in_values_;
-  std::map<uint32_t, uint64_t> epoch_last_activity_;
-  uint64_t dbsize_total_;
-  uint64_t dbsize_uncompacted_;
+  static const uint32_t kBitsLevel1 = 12;
+  static const uint32_t kBitsLevel2 = 10;
+  static const uint32_t kBitsBlock  = 10;
+  static const uint32_t kNumStripes = 64;
+
+  struct Level2 {
+    std::array<std::atomic<FileMetadata*>, (1 << kBitsLevel2)> blocks;
+    Level2() {
+      for (auto& block: blocks) block.store(nullptr, std::memory_order_relaxed);
+    }
+  };
+
+  FileMetadata* Find(uint32_t fileid) {
+    Level2* l2 = table_[fileid >> (kBitsLevel2 + kBitsBlock)].load(std::memory_order_acquire);
+    if (l2 == nullptr) return nullptr;
+    FileMetadata* block = l2->blocks[(fileid >> kBitsBlock) & ((1 << kBitsLevel2) - 1)].load(std::memory_order_acquire);
+    if (block == nullptr) return nullptr;
+    return &block[fileid & ((1 << kBitsBlock) - 1)];
+  }
+
+  FileMetadata* GetOrCreate(uint32_t fileid) {
+    FileMetadata* file = Find(fileid);
+    if (file != nullptr) return file;
+
+    std::atomic<Level2*>& slot_l2 = table_[fileid >> (kBitsLevel2 + kBitsBlock)];
+    Level2* l2 = slot_l2.load(std::memory_order_acquire);
+    if (l2 == nullptr) {
+      Level2* l2_new = new Level2();
+      if (slot_l2.compare_exchange_strong(l2, l2_new, std::memory_order_acq_rel)) {
+        l2 = l2_new;
+      } else {
+        delete l2_new;
+      }
+    }
+
+    std::atomic<FileMetadata*>& slot_block = l2->blocks[(fileid >> kBitsBlock) & ((1 << kBitsLevel2) - 1)];
+    FileMetadata* block = slot_block.load(std::memory_order_acquire);
+    if (block == nullptr) {
+      FileMetadata* block_new = new FileMetadata[1 << kBitsBlock];
+      if (slot_block.compare_exchange_strong(block, block_new, std::memory_order_acq_rel)) {
+        block = block_new;
+      } else {
+        delete[] block_new;
+      }
+    }
+    return &block[fileid & ((1 << kBitsBlock) - 1)];
+  }
+
+  InstrumentedMutex& GetStripe(uint32_t fileid) {
+    return mutexes_stripe_[fileid % kNumStripes];
+  }
+
+  //调用者持有 mutex_fileids_
+  void ClearAllDataForFileIdLocked(uint32_t fileid) {
+    FileMetadata* file = Find(fileid);
+    if (file == nullptr) return;
+    ClearTemporaryDataForFileId(fileid);
+    std::unique_lock<InstrumentedMutex> lock(GetStripe(fileid));
+    uint64_t filesize = file->filesize.exchange(0, std::memory_order_acq_rel);
+    IncrementDbSizeTotal(-filesize);
+    if (!file->HasFlag(FileMetadata::kFlagCompacted)) {
+      IncrementDbSizeUncompacted(-filesize);
+    }
+    file->timestamp = 0;
+    file->flags = 0;
+  }
+
+  std::array<std::atomic<Level2*>, (1 << kBitsLevel1)> table_;
+  //std::array 的元素只能默认构造，用子类给每把锁同一个名字
+  struct StripeMutex : public InstrumentedMutex {
+    StripeMutex() : InstrumentedMutex("FileResourceManager::mutexes_stripe_") {}
+  };
+  std::array<StripeMutex, kNumStripes> mutexes_stripe_;
+  //GetFileIds() 需要遍历的已设置大小的文件，只在写入元数据时更新
+  InstrumentedMutex mutex_fileids_{"FileResourceManager::mutex_fileids_"};
+  std::set<uint32_t> fileids_;
+  std::atomic<uint64_t> dbsize_total_;
+  std::atomic<uint64_t> dbsize_uncompacted_;
 };
 
 } // namespace kdb
@@ -11,6 +11,8 @@
 
 #include <thread>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #include "util/status.h"
 #include "util/coding.h"
@@ -27,6 +29,17 @@ enum FileType {
   kCompactedRegularType   = 0x2,
 };
 
+//DataFileHeader::version 的高16位为 kVersionMagic，低16位为格式特性标志，
+//其他值都视为旧格式（按写入顺序保存的 HintData）
+const uint32_t kVersionMagic = 0xCDB0;
+
+enum FormatFlag {
+  kFormatSortedHints = 0x1,   //HintData 按 hashed_key 排序，分块差分编码
+  kFormatFixedEntryHeader = 0x2,   //Entry 头部定长 32 字节，Entry 补齐到 8 字节
+  kFormatHashXXH3 = 0x4,           //hashed_key 为 XXH3-64，没有此标志的文件为 XXH64，加载时重新计算
+  kFormatEntryChecksum = 0x8,      //Entry 的 crc32 为 crc32c 校验和，没有此标志的文件中该字段未初始化
+};
+
 //数据文件 头部格式
 struct DataFileHeader {
   //data
@@ -38,12 +51,34 @@ struct DataFileHeader {
 
   DataFileHeader() {
     filetype = 0;
+    version = 0;
+  }
+
+  static uint32_t MakeVersion(uint32_t format_flags) {
+    return (kVersionMagic << 16) | format_flags;
+  }
+
+  //旧格式的文件没有任何特性标志
+  uint32_t GetFormatFlags() const {
+    if ((version >> 16) != kVersionMagic) return 0;
+    return version & 0xFFFF;
+  }
+
+  bool HasSortedHints() const {
+    return (GetFormatFlags() & kFormatSortedHints);
   }
 
   static uint32_t GetFixedSize() {
     return 20;
   }
 
+  //直接从映射的文件开头读取格式特性标志，不校验 CRC32，用于读取路径
+  static uint32_t GetFormatFlags(const char* buffer) {
+    struct DataFileHeader header;
+    header.version = DecodeFixed32(buffer + 4);
+    return header.GetFormatFlags();
+  }
+
   //data geter and setter
   bool IsTypeCompacted() {
     return (filetype & kCompactedRegularType);
@@ -115,7 +150,7 @@ struct DateFileFooter {
     GetFixed64(buffer_in +  8, &(output->offset_indexes));
     GetFixed64(buffer_in + 16, &(output->num_entries));
     GetFixed32(buffer_in + 24, &(output->crc32));
-    log::trace("DecodeFrom0", "offset_indexes %llu, num_entries%llu, crc32%d", output->offset_indexes, output->num_entries, output->crc32);
+    CDB_LOG_TRACE("DecodeFrom0", "offset_indexes %llu, num_entries%llu, crc32%d", output->offset_indexes, output->num_entries, output->crc32);
     return Status::OK();
   }
 
@@ -165,7 +200,103 @@ struct HintData {
     ptr = EncodeVarint64(buffer, input->hashed_key);
     ptr = EncodeVarint32(ptr, input->offset_entry);
     return (ptr - buffer);
-  }    
+  }
+};
+
+// 排序后的 HintData，每 kHintsPerBlock 条为一块：
+//   块:       varint64 (hashed_key - 前一个 hashed_key，块内第一个为0) * n | varint32 offset_entry * n
+//   块索引:   (fixed64 第一个 hashed_key | fixed32 块相对 HintData 起点的偏移 | fixed32 条数) * num_blocks
+//   尾部:     fixed64 块索引相对 HintData 起点的偏移 | fixed32 num_blocks
+// hashed_key 相同的条目按 offset_entry 递增排列，保持写入的先后顺序
+struct SortedHintData {
+  static const uint32_t kHintsPerBlock = 128;
+  static const uint32_t kSizeBlockIndex = 16;
+  static const uint32_t kSizeTrailer = 12;
+
+  static uint64_t GetMaxEncodedSize(uint64_t num_hints) {
+    uint64_t num_blocks = (num_hints + kHintsPerBlock - 1) / kHintsPerBlock;
+    return num_hints * 15 + num_blocks * kSizeBlockIndex + kSizeTrailer;
+  }
+
+  //hints 必须已经按 (hashed_key, offset_entry) 排序
+  static uint64_t EncodeTo(const std::vector< std::pair<uint64_t, uint32_t> >& hints, char* buffer) {
+    char *ptr = buffer;
+    std::vector<uint64_t> offsets_block;
+    for (size_t begin = 0; begin < hints.size(); begin += kHintsPerBlock) {
+      size_t end = std::min<size_t>(begin + kHintsPerBlock, hints.size());
+      offsets_block.push_back(ptr - buffer);
+      uint64_t hashed_key_last = hints[begin].first;
+      for (size_t i = begin; i < end; ++i) {
+        ptr = EncodeVarint64(ptr, hints[i].first - hashed_key_last);
+        hashed_key_last = hints[i].first;
+      }
+      for (size_t i = begin; i < end; ++i) ptr = EncodeVarint32(ptr, hints[i].second);
+    }
+
+    uint64_t offset_block_index = ptr - buffer;
+    for (size_t b = 0; b < offsets_block.size(); ++b) {
+      size_t begin = b * kHintsPerBlock;
+      EncodeFixed64(ptr,      hints[begin].first);
+      EncodeFixed32(ptr +  8, offsets_block[b]);
+      EncodeFixed32(ptr + 12, std::min<size_t>(kHintsPerBlock, hints.size() - begin));
+      ptr += kSizeBlockIndex;
+    }
+    EncodeFixed64(ptr,     offset_block_index);
+    EncodeFixed32(ptr + 8, offsets_block.size());
+    ptr += kSizeTrailer;
+    return ptr - buffer;
+  }
+
+  //解码 buffer 中所有块，按顺序追加 (hashed_key, location_high | offset_entry)
+  static Status DecodeFrom(const char* buffer,
+                           uint64_t size,
+                           uint64_t num_entries,
+                           uint64_t location_high,
+                           std::vector< std::pair<uint64_t, uint64_t> >& hints_out) {
+    if (size < kSizeTrailer) return Status::IOError("Decoding error");
+    uint64_t offset_block_index;
+    uint32_t num_blocks;
+    GetFixed64(buffer + size - kSizeTrailer, &offset_block_index);
+    GetFixed32(buffer + size - kSizeTrailer + 8, &num_blocks);
+    if (   offset_block_index > size
+        || offset_block_index + (uint64_t)num_blocks * kSizeBlockIndex + kSizeTrailer != size) {
+      return Status::IOError("Decoding error");
+    }
+
+    size_t start = hints_out.size();
+    hints_out.resize(start + num_entries);
+    std::pair<uint64_t, uint64_t> *out = hints_out.data() + start;
+    uint64_t num_decoded = 0;
+    const char *limit = buffer + offset_block_index;
+    const char *index = buffer + offset_block_index;
+    for (uint32_t b = 0; b < num_blocks; ++b, index += kSizeBlockIndex) {
+      uint64_t hashed_key = DecodeFixed64(index);
+      uint32_t offset_block = DecodeFixed32(index + 8);
+      uint32_t num_hints = DecodeFixed32(index + 12);
+      if (num_hints > kHintsPerBlock || num_decoded + num_hints > num_entries || offset_block > offset_block_index) break;
+
+      //整块批量解码，再做前缀和还原 hashed_key
+      uint64_t deltas[kHintsPerBlock];
+      uint32_t offsets_entry[kHintsPerBlock];
+      const char *ptr = buffer + offset_block;
+      ptr = GetVarint64Array(ptr, limit, deltas, num_hints);
+      if (ptr == nullptr) break;
+      ptr = GetVarint32Array(ptr, limit, offsets_entry, num_hints);
+      if (ptr == nullptr) break;
+      for (uint32_t i = 0; i < num_hints; ++i) {
+        hashed_key += deltas[i];
+        out[num_decoded + i].first = hashed_key;
+        out[num_decoded + i].second = location_high | offsets_entry[i];
+      }
+      num_decoded += num_hints;
+    }
+
+    if (num_decoded != num_entries) {
+      hints_out.resize(start);
+      return Status::IOError("Decoding error");
+    }
+    return Status::OK();
+  }
 };
 
 
@@ -13,6 +13,7 @@
 
 #include <thread>
 #include <mutex>
+#include <map>
 #include <unordered_map>
 #include <unistd.h>
 #include <sys/types.h>
@@ -27,6 +28,7 @@
 #include <set>
 #include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <cinttypes>
 
 #include "file/file_resource_manager.h"
@@ -37,16 +39,58 @@
 #include "util/entry.h"
 #include "util/status.h"
 #include "util/logger.h"
-#include "util/xxhash.h"
+#include "util/hash.h"
+#include "util/statistics.h"
+#include "util/threadpool.h"
 #include "util/const_value.h"
 #include "data_file_format.h"
 #include "entry_format.h"
+#include "index_checkpoint.h"
+#include "manifest.h"
 
 
 
 
 namespace cdb{
 
+//打开数据库时各阶段的耗时(微秒)。validate、decode、recover 是各个文件的耗时之和，
+//多线程加载时可能大于实际经过的时间
+struct LoadTiming {
+  uint64_t micros_total;          //LoadDatabase 的总时间
+  uint64_t micros_cleanup;        //清理锁文件和合并的残留文件
+  uint64_t micros_scan;           //读取 manifest 或扫描目录
+  uint64_t micros_checkpoint;     //加载索引快照
+  uint64_t micros_validate;       //校验 footer、HintData 的 CRC32 和文件头部
+  uint64_t micros_decode;         //解码 HintData，旧格式的文件包括重新计算 hashed_key
+  uint64_t micros_recover;        //从没有有效 footer 的文件中恢复
+  uint64_t micros_sort;           //按分区排序和归并
+  uint64_t micros_index_insert;   //插入索引
+  uint64_t num_files_loaded;       //从 HintData 或恢复加载的文件数，不包括快照覆盖的文件
+  uint64_t num_files_recovered;
+  uint64_t num_entries_loaded;     //加载完成后索引中的条目数
+
+  LoadTiming() { memset(this, 0, sizeof(*this)); }
+
+  static uint64_t NowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  void Add(const LoadTiming& other) {
+    micros_total += other.micros_total;
+    micros_cleanup += other.micros_cleanup;
+    micros_scan += other.micros_scan;
+    micros_checkpoint += other.micros_checkpoint;
+    micros_validate += other.micros_validate;
+    micros_decode += other.micros_decode;
+    micros_recover += other.micros_recover;
+    micros_sort += other.micros_sort;
+    micros_index_insert += other.micros_index_insert;
+    num_files_loaded += other.num_files_loaded;
+    num_files_recovered += other.num_files_recovered;
+    num_entries_loaded += other.num_entries_loaded;
+  }
+};
+
 class DateFileManager {
   public:
     DateFileManager(cdb::Options& db_options,
@@ -61,13 +105,18 @@ class DateFileManager {
               sequence_timestamp_(0),
               filetype_default_(filetype_default) {
       
-      size_block_ = SIZE_DATA_FILE;
+      size_block_ = db_options.storage__datafile_size > 0 ? db_options.storage__datafile_size : SIZE_DATA_FILE;
       has_file_ = false;
       buffer_has_items_ = false;
       has_sync_option_ = false;
       prefix_ = "";
       prefix_compaction_ = "compaction_";
       dirpath_locks_ = dbname + "/locks";
+      filename_checkpoint_ = "checkpoint";
+      filename_manifest_ = "manifest";
+      uint32_t format_flags = kFormatSortedHints | kFormatHashXXH3 | kFormatEntryChecksum;
+      if (db_options_.storage__fixed_entry_header) format_flags |= kFormatFixedEntryHeader;
+      version_ = DataFileHeader::MakeVersion(format_flags);
 
       is_closed_ = false;
       is_locked_sequence_timestamp_ = false;
@@ -91,6 +140,7 @@ class DateFileManager {
       is_closed_ = true;
       FlushCurrentFile();
       CloseFile();
+      manifest.Close();
       if (!is_read_only_) {
         delete[] buffer_raw_;
         delete[] buffer_index_;
@@ -112,7 +162,7 @@ class DateFileManager {
     //文件 ID 原子的加
     uint32_t IncrementSequenceFileId(uint32_t inc) {
         std::unique_lock<std::mutex> lock(mutex_sequence_fileid_);
-        log::trace("DateFileManager::IncrementSequenceFileId", "sequence_fileid_:%u, inc:%u", sequence_fileid_, inc);
+        CDB_LOG_TRACE("DateFileManager::IncrementSequenceFileId", "sequence_fileid_:%u, inc:%u", sequence_fileid_, inc);
         sequence_fileid_ += inc;
         return sequence_fileid_;
     }
@@ -139,27 +189,71 @@ class DateFileManager {
       if (!is_locked_sequence_timestamp_) sequence_timestamp_ = seq;
     }
 
+    //合并时 输出文件沿用被合并文件的时间戳，保证重新加载时排在更新的文件之前
+    void LockSequenceTimestamp(uint64_t seq) {
+      std::unique_lock<std::mutex> lock(mutex_sequence_timestamp_);
+      sequence_timestamp_ = seq;
+      is_locked_sequence_timestamp_ = true;
+    }
+
     uint64_t GetSequenceTimestamp() {
       std::unique_lock<std::mutex> lock(mutex_sequence_timestamp_);
       return sequence_timestamp_;
     }
 
+    //当前正在写入的文件，没有打开的文件时返回 0
+    uint32_t GetFileIdActive() {
+      return has_file_ ? fileid_ : 0;
+    }
+
+    //数据文件的最大长度：Entry 不会超过写缓冲的 2*size_block_，再加上 HintData 和 footer
+    uint64_t GetMaxFileSize() {
+      return (uint64_t)size_block_ * 4;
+    }
+
     std::string GetPrefix() {
       return prefix_;
     }
 
+    void SetPrefix(const std::string& prefix) {
+      prefix_ = prefix;
+    }
+
+    std::string GetPrefixCompaction() {
+      return prefix_compaction_;
+    }
+
     std::string GetFilepath(uint32_t fileid) {
       return dbname_ + "/" + prefix_ + DateFileManager::num_to_hex(fileid); // TODO: optimize here
     }
 
+    std::string GetCheckpointFilepath() {
+      return dbname_ + "/" + filename_checkpoint_;
+    }
+
+    std::string GetManifestFilepath() {
+      return dbname_ + "/" + filename_manifest_;
+    }
+
     std::string GetLockFilepath(uint32_t fileid) {
       return dirpath_locks_ + "/" + DateFileManager::num_to_hex(fileid); // TODO: optimize here
     }    
 
-    Status LoadDatabase(std::string& dbname,
-                        std::multimap<uint64_t, uint64_t>& index_se) {
-      log::trace("DateFileManager::LoadDatabase()", " load %s", dbname.c_str());
+    //最近一次 LoadDatabase 各阶段的耗时
+    const LoadTiming& GetLoadTiming() const {
+      return load_timing_;
+    }
 
+    //fileids_pending 不为空时只扫描目录和加载快照，快照之外的文件按时间顺序回传，由调用者稍后加载
+    Status LoadDatabase(std::string& dbname,
+                        std::multimap<uint64_t, uint64_t>& index_se,
+                        std::vector<uint32_t>* fileids_pending=nullptr,
+                        std::set<uint32_t>* fileids_checkpoint_out=nullptr) {
+      CDB_LOG_TRACE("DateFileManager::LoadDatabase()", " load %s", dbname.c_str());
+
+      load_timing_ = LoadTiming();
+      uint64_t micros_start = LoadTiming::NowMicros();
+      uint64_t micros_phase = micros_start;
       Status s;
       struct stat info;
       if (!is_read_only_) {
@@ -177,170 +271,586 @@ class DateFileManager {
         if (!s.IsOK()) return Status::IOError("Could not clean up locks");
 
       }    
+      load_timing_.micros_cleanup = LoadTiming::NowMicros() - micros_phase;
+      micros_phase = LoadTiming::NowMicros();
+
+      //优先重放 manifest 得到文件集合，manifest 不存在或无效时才扫描目录
+      ManifestState state;
+      s = Manifest::Read(GetManifestFilepath(), &state);
+      if (s.IsOK()) {
+        if (!is_read_only_) RemoveFilesLeftByCompaction(state);
+      } else {
+        CDB_LOG_TRACE("DateFileManager::LoadDatabase()", "manifest not used: %s", s.ToString().c_str());
+        state = ManifestState();
+        s = ScanDirectory(&state);
+        if (!s.IsOK()) return s;
+      }
+      load_timing_.micros_scan = LoadTiming::NowMicros() - micros_phase;
 
+      //必须按 timestamp 排序加载，合并后的文件 fileid 更大但时间戳更早
+      std::map<std::string, uint32_t> timestamp_fileid_to_fileid;
+      std::map<uint32_t, uint64_t> fileid_to_timestamp;
+      std::map<uint32_t, uint64_t> fileid_to_filesize;
+      //恢复 原来的时间轴和fileid  让加载后，新加入的文件从此处id和时间增加
+      uint32_t fileid_max = state.fileid_max;
+      uint64_t timestamp_max = 0;
+      for (auto& item: state.files) {
+        //构造 timestamp+fileid 的字符串  然后直接加入map中 自动排序
+        char buffer_key[64];
+        sprintf(buffer_key, "%016" PRIx64 "-%016x", item.second.timestamp, item.first);
+        std::string key(buffer_key);
+        timestamp_fileid_to_fileid[key] = item.first;
+        fileid_to_timestamp[item.first] = item.second.timestamp;
+        if (item.second.IsClosed()) fileid_to_filesize[item.first] = item.second.filesize;
+        fileid_max = std::max(fileid_max, item.first);
+        timestamp_max = std::max(timestamp_max, item.second.timestamp);
+      }
+
+      //先加载索引快照，只需要重放快照之后的文件
+      std::set<uint32_t> fileids_checkpoint;
+      micros_phase = LoadTiming::NowMicros();
+      s = LoadCheckpoint(timestamp_fileid_to_fileid, fileid_to_timestamp, fileid_to_filesize, index_se, &fileids_checkpoint);
+      if (!s.IsOK()) {
+        CDB_LOG_TRACE("DateFileManager::LoadDatabase()", "checkpoint not used: %s", s.ToString().c_str());
+      }
+      load_timing_.micros_checkpoint = LoadTiming::NowMicros() - micros_phase;
+
+      std::vector<uint32_t> fileids;
+      for (auto& item: timestamp_fileid_to_fileid) {
+        if (fileids_checkpoint.find(item.second) != fileids_checkpoint.end()) continue;
+        fileids.push_back(item.second);
+      }
+      if (fileids_checkpoint_out != nullptr) *fileids_checkpoint_out = fileids_checkpoint;
+      if (fileids_pending != nullptr) {
+        for (auto fileid: fileids) {
+          file_resource_manager.SetFileTimestamp(fileid, fileid_to_timestamp[fileid]);
+        }
+        fileids_pending->swap(fileids);
+      } else {
+        LoadFiles(fileids, fileid_to_timestamp, index_se);
+        //加载后所有文件都有了有效的 footer，无法加载的文件从 manifest 中去掉
+        for (auto fileid: fileids) {
+          uint64_t filesize = file_resource_manager.GetFileSize(fileid);
+          if (filesize == 0) {
+            state.files.erase(fileid);
+            continue;
+          }
+          state.files[fileid].flags |= ManifestFile::kFlagClosed;
+          state.files[fileid].filesize = filesize;
+        }
+      }
+
+      if (fileid_max > 0) {
+        SetSequenceFileId(fileid_max);
+        SetSequenceTimestamp(timestamp_max);
+      }
+
+      //重写 manifest，之后只追加新的记录
+      if (!is_read_only_) {
+        state.fileid_max = fileid_max;
+        s = manifest.Open(GetManifestFilepath(), state);
+        if (!s.IsOK()) return s;
+      }
+      load_timing_.num_entries_loaded = index_se.size();
+      load_timing_.micros_total = LoadTiming::NowMicros() - micros_start;
+      return Status::OK();
+
+    }
+
+    //没有可用的 manifest 时扫描目录，读取每个数据文件的头部得到时间戳
+    Status ScanDirectory(ManifestState* state) {
       DIR *directory;
       struct dirent *entry;
       directory = opendir(dbname_.c_str());
       if (directory == NULL) {
-              return Status::IOError("Could not open database directory", dbname.c_str());
+              return Status::IOError("Could not open database directory", dbname_.c_str());
       }
 
       char filepath[FileUtil::maximum_path_size()];
-      uint32_t fileid = 0;
-      std::unordered_map<std::string, uint32_t> timestamp_fileid_to_fileid;
-      //恢复 原来的时间轴和fileid  让加载后，新加入的文件从此处id和时间增加
-      uint32_t fileid_max = 0;
-      uint64_t timestamp_max = 0;
-
-      //读取目录下的所有数据文件
+      struct stat info;
       while ((entry = readdir(directory)) != NULL) {
-        if (strcmp(entry->d_name, prefix_compaction_.c_str()) == 0) continue;
+        if (strncmp(entry->d_name, prefix_compaction_.c_str(), prefix_compaction_.size()) == 0) continue;
+        if (strncmp(entry->d_name, filename_checkpoint_.c_str(), filename_checkpoint_.size()) == 0) continue;
+        if (strncmp(entry->d_name, filename_manifest_.c_str(), filename_manifest_.size()) == 0) continue;
         //文件路径
-        int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dbname.c_str(), entry->d_name);
+        int ret = snprintf(filepath, FileUtil::maximum_path_size(), "%s/%s", dbname_.c_str(), entry->d_name);
         if (ret < 0 || ret >= FileUtil::maximum_path_size()) {
-          log::trace("DateFileManager::LoadDatabase()", "FilePath buffer too small : %s ", entry->d_name);
+          CDB_LOG_TRACE("DateFileManager::ScanDirectory()", "FilePath buffer too small : %s ", entry->d_name);
           continue;
         }
 
         if (stat(filepath, &info) != 0 || !(info.st_mode & S_IFREG)) continue;
         if (info.st_size <= (off_t)db_options_.internal__datafile_header_size) {
-          log::trace("DateFileManager::LoadDatabase()",
+          CDB_LOG_TRACE("DateFileManager::ScanDirectory()",
                     "file: [%s] only has a header or less, skipping\n", entry->d_name);
           continue;
         }
-        log::trace("DateFileManager::LoadDatabase()", " filepath %s", filepath);
-        
-        
+        CDB_LOG_TRACE("DateFileManager::ScanDirectory()", " filepath %s", filepath);
         
         //读取文件 fileid 开始处理
-        fileid = DateFileManager::hex_to_num(entry->d_name);
-        char *datafile;
-        if ((fd_ = open(filepath, O_RDONLY)) < 0) {
-          log::emerg("DateFileManager::LoadDatabase()", "Could not open file [%s]: %s", filepath, strerror(errno));
-          return s;
+        uint32_t fileid = DateFileManager::hex_to_num(entry->d_name);
+        int fd;
+        if ((fd = open(filepath, O_RDONLY)) < 0) {
+          CDB_LOG_EMERG("DateFileManager::ScanDirectory()", "Could not open file [%s]: %s", filepath, strerror(errno));
+          continue;
         }
-        
-        datafile = static_cast<char*>(mmap(0,
-                                          info.st_size, 
-                                          PROT_READ,
-                                          MAP_SHARED,
-                                          fd_,
-                                          0));
-        if (datafile == MAP_FAILED) {
-          log::emerg("Could not mmap() file [%s]: %s", filepath_.c_str(), strerror(errno));
-          return s;
-        }  
+        char buffer_header[DataFileHeader::GetFixedSize()];
+        ssize_t size_read = pread(fd, buffer_header, DataFileHeader::GetFixedSize(), 0);
+        close(fd);
 
         struct DataFileHeader hstheader;
-        Status s = DataFileHeader::DecodeFrom(datafile, info.st_size, &hstheader);              
-        if (!s.IsOK()) {
-          log::trace("DateFileManager::LoadDatabase()",
+        if (   size_read != (ssize_t)DataFileHeader::GetFixedSize()
+            || !DataFileHeader::DecodeFrom(buffer_header, size_read, &hstheader).IsOK()) {
+          CDB_LOG_TRACE("DateFileManager::ScanDirectory()",
                     "file: [%s] has an invalid header, skipping\n", entry->d_name);
           continue;
         }
-        //构造 timestamp+fileid 的字符串  然后直接加入map中 自动排序
-        char buffer_key[64];
-        sprintf(buffer_key, "%016" PRIx64 "-%016x", hstheader.timestamp, fileid);
-        std::string key(buffer_key);
-        timestamp_fileid_to_fileid[key] = fileid;
-        fileid_max = std::max(fileid_max, fileid);
-        timestamp_max = std::max(timestamp_max, hstheader.timestamp);   
+        ManifestFile file;
+        file.fileid = fileid;
+        file.timestamp = hstheader.timestamp;
+        if (hstheader.IsTypeCompacted()) file.flags |= ManifestFile::kFlagCompacted;
+        state->files[fileid] = file;
+        state->fileid_max = std::max(state->fileid_max, fileid);
       }
+      closedir(directory);
+      return Status::OK();
+    }
 
-      for (auto& item: timestamp_fileid_to_fileid) {
-        uint32_t fileid = item.second;
-        std::string filepath = GetFilepath(fileid);
-        log::trace("DateFileManager::LoadDatabase()", "1Loading file:[%s] with key:[%s]", filepath.c_str(), item.first.c_str());
-        if (stat(filepath.c_str(), &info) != 0) continue;
-        char *datafile;
-        if ((fd_ = open(filepath.c_str(), O_RDONLY)) < 0) {
-          log::emerg("DateFileManager::LoadDatabase()", "Could not open file [%s]: %s", filepath, strerror(errno));
-          return s;
-        }
-        datafile = static_cast<char*>(mmap(0,
-                                          info.st_size, 
-                                          PROT_READ,
-                                          MAP_SHARED,
-                                          fd_,
-                                          0));
-        if (datafile == MAP_FAILED) {
-          log::emerg("Could not mmap() file [%s]: %s", filepath_.c_str(), strerror(errno));
-          return s; 
+    //进程在合并过程中退出时，删除没有完成替换的输出文件，以及完成替换但还没删除的输入文件
+    void RemoveFilesLeftByCompaction(const ManifestState& state) {
+      std::set<uint32_t> fileids;
+      for (auto& reservation: state.reservations) {
+        for (uint32_t fileid = reservation.first; fileid <= reservation.second && fileid != 0; ++fileid) fileids.insert(fileid);
+      }
+      fileids.insert(state.fileids_removed.begin(), state.fileids_removed.end());
+      for (auto fileid: fileids) {
+        if (state.files.find(fileid) != state.files.end()) continue;
+        if (std::remove(GetFilepath(fileid).c_str()) == 0) {
+          CDB_LOG_TRACE("DateFileManager::RemoveFilesLeftByCompaction()", "removed [%s]", GetFilepath(fileid).c_str());
         }
+      }
+    }
 
-        uint64_t filesize;
-        bool is_file_compacted;
-        s = LoadFile(datafile, info.st_size, filepath, fileid, index_se, &filesize, &is_file_compacted);
+    //并行加载多个文件的 HintData，fileids 按时间排序：
+    //  1. 每个文件一个 task，解码 HintData 并按 hashed_key 的高位分到各个分区
+    //  2. 每个分区一个 task，按文件顺序收集该分区的条目后稳定排序
+    //  3. 分区之间 hashed_key 不重叠且有序，依次插入索引，同一个 key 保持时间顺序
+    void LoadFiles(const std::vector<uint32_t>& fileids,
+                   std::map<uint32_t, uint64_t>& fileid_to_timestamp,
+                   std::multimap<uint64_t, uint64_t>& index_se) {
+      if (fileids.empty()) return;
+      int num_threads = std::max(1, std::min<int>(db_options_.internal__num_threads_load, fileids.size()));
+      int bits_partitions = 0;
+      while ((1 << bits_partitions) < num_threads * 4) ++bits_partitions;
+
+      std::vector<LoadedFile> files(fileids.size());
+      ThreadPool pool(num_threads);
+      pool.Start();
+      for (size_t i = 0; i < fileids.size(); ++i) {
+        files[i].fileid = fileids[i];
+        files[i].filepath = GetFilepath(fileids[i]);
+        pool.Append(new LoadFileTask(&db_options_, is_read_only_, &files[i], bits_partitions));
+      }
+      pool.Wait();
+
+      for (auto& file: files) {
+        load_timing_.Add(file.timing);
+        if (!file.status.IsOK()) continue;
+        load_timing_.num_files_loaded++;
+        file_resource_manager.SetFileSize(file.fileid, file.filesize);
+        file_resource_manager.SetFileTimestamp(file.fileid, fileid_to_timestamp[file.fileid]);
+        if (file.is_compacted) file_resource_manager.SetFileCompacted(file.fileid);
+      }
 
-        if (s.IsOK()) {
-          file_resource_manager.SetFileSize(fileid, filesize);
-          if (is_file_compacted) file_resource_manager.SetFileCompacted(fileid);
+      uint64_t micros_phase = LoadTiming::NowMicros();
+      std::vector< std::vector< std::pair<uint64_t, uint64_t> > > partitions(1 << bits_partitions);
+      for (size_t p = 0; p < partitions.size(); ++p) {
+        pool.Append(new BuildPartitionTask(&files, p, &partitions[p]));
+      }
+      pool.Wait();
+      pool.Stop();
+      load_timing_.micros_sort = LoadTiming::NowMicros() - micros_phase;
+      micros_phase = LoadTiming::NowMicros();
+
+      //索引为空时直接在末尾插入；否则已有快照中的条目，同一个 key 的新条目插在旧条目之后
+      bool is_index_empty = index_se.empty();
+      for (auto& partition: partitions) {
+        auto hint = index_se.end();
+        uint64_t hashed_key_last = 0;
+        for (size_t i = 0; i < partition.size(); ++i) {
+          if (!is_index_empty && (i == 0 || partition[i].first != hashed_key_last)) {
+            hint = index_se.upper_bound(partition[i].first);
+            hashed_key_last = partition[i].first;
+          }
+          index_se.insert(hint, partition[i]);
         }
+        std::vector< std::pair<uint64_t, uint64_t> >().swap(partition);
+      }
+      load_timing_.micros_index_insert = LoadTiming::NowMicros() - micros_phase;
+    }
 
+    //快照有效的条件：快照覆盖的文件都还存在且大小不变，并且正好是按时间排序后的前几个文件
+    //否则快照之后有文件被合并过，只能完整加载
+    Status LoadCheckpoint(const std::map<std::string, uint32_t>& timestamp_fileid_to_fileid,
+                          std::map<uint32_t, uint64_t>& fileid_to_timestamp,
+                          std::map<uint32_t, uint64_t>& fileid_to_filesize,
+                          std::multimap<uint64_t, uint64_t>& index_se,
+                          std::set<uint32_t>* fileids_out) {
+      uint32_t fileid_last;
+      std::vector<CheckpointFile> files;
+      Status s = IndexCheckpoint::Read(GetCheckpointFilepath(), &fileid_last, &files, &index_se);
+      if (!s.IsOK()) return s;
 
+      std::set<uint32_t> fileids;
+      struct stat info;
+      for (auto& file: files) {
+        auto it = fileid_to_timestamp.find(file.fileid);
+        //manifest 中记录了关闭时的大小就不再 stat 文件
+        auto it_size = fileid_to_filesize.find(file.fileid);
+        uint64_t filesize = 0;
+        if (it_size != fileid_to_filesize.end()) {
+          filesize = it_size->second;
+        } else if (stat(GetFilepath(file.fileid).c_str(), &info) == 0) {
+          filesize = info.st_size;
+        }
+        if (   it == fileid_to_timestamp.end()
+            || it->second != file.timestamp
+            || filesize != file.filesize) {
+          index_se.clear();
+          return Status::IOError("Checkpoint does not match the data files");
+        }
+        fileids.insert(file.fileid);
       }
 
-      if (fileid_max > 0) {
-        SetSequenceFileId(fileid_max);
-        SetSequenceTimestamp(timestamp_max);
+      auto it = timestamp_fileid_to_fileid.begin();
+      for (size_t i = 0; i < files.size(); ++i, ++it) {
+        if (fileids.find(it->second) == fileids.end()) {
+          index_se.clear();
+          return Status::IOError("Checkpoint is not a prefix of the data files");
+        }
       }
-      closedir(directory);
-      return Status::OK();
 
+      for (auto& file: files) {
+        file_resource_manager.SetFileSize(file.fileid, file.filesize);
+        file_resource_manager.SetFileTimestamp(file.fileid, file.timestamp);
+        if (file.flags & CheckpointFile::kFlagCompacted) file_resource_manager.SetFileCompacted(file.fileid);
+      }
+      fileids_out->swap(fileids);
+      CDB_LOG_TRACE("DateFileManager::LoadCheckpoint()", "fileid_last:%u num_files:%zu num_entries:%zu", fileid_last, files.size(), index_se.size());
+      return Status::OK();
     }
 
+    //解码 HintData 回传 (hashed_key, location)：旧格式按写入顺序，新格式按 hashed_key 排序，
+    //两种情况下同一个 key 的条目都保持写入的先后顺序，is_sorted_out 回传是否已经排序。
+    //没有 kFormatHashXXH3 标志的文件按 key 重新计算 hashed_key
     static Status LoadFile (char* datafile,
                             uint32_t filesize,
                             std::string& filepath,
                             uint32_t fileid,
-                            std::multimap<uint64_t, uint64_t>& index_se,
+                            std::vector< std::pair<uint64_t, uint64_t> >& hints_out,
                             uint64_t *filesize_out=nullptr,
-                            bool *is_file_compacted_out=nullptr) {
+                            bool *is_file_compacted_out=nullptr,
+                            bool *is_sorted_out=nullptr,
+                            LoadTiming *timing=nullptr) {
 
-      log::trace("LoadFile()", "Loading [%s] of size:%u, sizeof(DateFileFooter):%u", filepath.c_str(), filesize, DateFileFooter::GetFixedSize());
+      uint64_t micros_start = (timing != nullptr) ? LoadTiming::NowMicros() : 0;
+      CDB_LOG_TRACE("LoadFile()", "Loading [%s] of size:%u, sizeof(DateFileFooter):%u", filepath.c_str(), filesize, DateFileFooter::GetFixedSize());
       //读取footer 获取 index 的位置
       struct DateFileFooter footer;
+      if (filesize < DateFileFooter::GetFixedSize()) return Status::IOError("Invalid footer");
       Status s = DateFileFooter::DecodeFrom(datafile + filesize - DateFileFooter::GetFixedSize(), DateFileFooter::GetFixedSize(), &footer);
-      if (!s.IsOK()) {
-        log::trace("DateFileManager::LoadDatabase()",
+      if (!s.IsOK() || footer.offset_indexes > filesize - DateFileFooter::GetFixedSize()) {
+        CDB_LOG_TRACE("DateFileManager::LoadDatabase()",
                   "file: has an invalid footer, skipping\n");
-        return s;
+        return Status::IOError("Invalid footer");
       }  
 
-      log::trace("DateFileManager::LoadDatabase()", "footer: footer.offset_indexes-> %d", footer.offset_indexes);
+      CDB_LOG_TRACE("DateFileManager::LoadDatabase()", "footer: footer.offset_indexes-> %d", footer.offset_indexes);
 
       uint32_t crc32_computed = crc32c::Value(datafile + footer.offset_indexes, filesize - footer.offset_indexes - 4);
       if (crc32_computed != footer.crc32) {
-        log::trace("DateFileManager::LoadDatabase()", "Skipping [%s] - Invalid CRC32:[%08x/%08x]", filepath.c_str(), footer.crc32, crc32_computed);
+        CDB_LOG_TRACE("DateFileManager::LoadDatabase()", "Skipping [%s] - Invalid CRC32:[%08x/%08x]", filepath.c_str(), footer.crc32, crc32_computed);
         return Status::IOError("Invalid footer");
       }              
 
       uint64_t offset_index = footer.offset_indexes;
       struct HintData index;
+      uint64_t file_id_hight = fileid;
+      file_id_hight <<= 32;
+
+      //新格式的 HintData 已经按 hashed_key 排序并分块编码
+      struct DataFileHeader header;
+      uint32_t format_flags = 0;
+      if (DataFileHeader::DecodeFrom(datafile, filesize, &header).IsOK()) format_flags = header.GetFormatFlags();
+      uint64_t micros_validated = (timing != nullptr) ? LoadTiming::NowMicros() : 0;
+      if (timing != nullptr) timing->micros_validate += micros_validated - micros_start;
+      size_t start = hints_out.size();
+      bool is_sorted = false;
+      if (format_flags & kFormatSortedHints) {
+        s = SortedHintData::DecodeFrom(datafile + footer.offset_indexes,
+                                       filesize - DateFileFooter::GetFixedSize() - footer.offset_indexes,
+                                       footer.num_entries, file_id_hight, hints_out);
+        if (!s.IsOK()) return s;
+        is_sorted = true;
+      } else {
+        hints_out.reserve(hints_out.size() + footer.num_entries);
+
+        for (int i = 0; i < footer.num_entries; ++i) {
+          uint32_t length = 0;
+          s = HintData::DecodeFrom(datafile + offset_index, filesize - offset_index,  &index, &length);
+          if (!s.IsOK()) return s;
+          
+          hints_out.push_back(std::pair<uint64_t, uint64_t>(index.hashed_key, file_id_hight | index.offset_entry));
+
+          CDB_LOG_TRACE("DateFileManager::LoadDatabase()",
+                    "Add item to index -- hashed_key:[0x%" PRIx64 "] offset:[%u] -- offset_index:[%" PRIu64 "]",
+                    index.hashed_key, index.offset_entry, offset_index); 
+
+          offset_index += length;
+        }
+      }
+
+      //旧文件的 hashed_key 是 XXH64，按 key 重新计算后不再有序
+      if (!(format_flags & kFormatHashXXH3)) {
+        s = RehashLegacyHints(datafile, footer.offset_indexes, format_flags, hints_out, start);
+        if (!s.IsOK()) {
+          hints_out.resize(start);
+          return s;
+        }
+        is_sorted = false;
+      }
+
+      if (timing != nullptr) timing->micros_decode += LoadTiming::NowMicros() - micros_validated;
+      if (filesize_out != nullptr) *filesize_out = filesize;
+      if (is_file_compacted_out != nullptr) *is_file_compacted_out = footer.IsTypeCompacted() ? true : false;
+      if (is_sorted_out != nullptr) *is_sorted_out = is_sorted;
+      CDB_LOG_TRACE("DateFileManager::LoadDatabase()", "Loaded [%s] num_entries:[%" PRIu64 "]", filepath.c_str(), footer.num_entries);
 
-      for (int i = 0; i < footer.num_entries; ++i) {
-        uint32_t length = 0;
-        s = HintData::DecodeFrom(datafile + offset_index, filesize - footer.offset_indexes,  &index, &length);
+      return Status::OK();
+    }
+
+    //读取 hints_out 中 start 之后每个条目的 key，用 XXH3 替换原来的 hashed_key
+    static Status RehashLegacyHints(const char* datafile,
+                                    uint64_t size_entries,
+                                    uint32_t format_flags,
+                                    std::vector< std::pair<uint64_t, uint64_t> >& hints_out,
+                                    size_t start) {
+      Options db_options;
+      ReadOptions read_options;
+      for (size_t i = start; i < hints_out.size(); ++i) {
+        uint32_t offset_in_file = hints_out[i].second & 0x00000000FFFFFFFF;
+        if (offset_in_file >= size_entries) return Status::IOError("Invalid hint offset");
+        struct EntryHeader entry_header;
+        uint32_t size_header;
+        Status s = EntryHeader::DecodeFrom(db_options, read_options, datafile + offset_in_file, size_entries - offset_in_file,
+                                           &entry_header, &size_header, format_flags);
         if (!s.IsOK()) return s;
-        
-        
-        uint64_t file_id_hight = fileid;
-        file_id_hight <<= 32;
-        index_se.insert(std::pair<uint64_t, uint64_t>(index.hashed_key, file_id_hight | index.offset_entry));
+        if (offset_in_file + size_header + entry_header.size_key > size_entries) return Status::IOError("Invalid entry");
+        hints_out[i].first = HashKey(datafile + offset_in_file + size_header, entry_header.size_key);
+      }
+      return Status::OK();
+    }
 
-        log::trace("DateFileManager::LoadDatabase()",
-                  "Add item to index -- hashed_key:[0x%" PRIx64 "] offset:[%u] -- offset_index:[%" PRIu64 "]",
-                  index.hashed_key, index.offset_entry, offset_index); 
+    //读取一个数据文件的 HintData，footer 无效时从 Entry 中恢复
+    static Status ReadFile(const Options& db_options,
+                           bool is_read_only,
+                           std::string& filepath,
+                           uint32_t fileid,
+                           std::vector< std::pair<uint64_t, uint64_t> >& hints_out,
+                           uint64_t *filesize_out,
+                           bool *is_file_compacted_out,
+                           bool *is_sorted_out=nullptr,
+                           LoadTiming *timing=nullptr) {
+      struct stat info;
+      if (stat(filepath.c_str(), &info) != 0) return Status::IOError("Could not stat file", strerror(errno));
+      int fd = open(filepath.c_str(), O_RDONLY);
+      if (fd < 0) {
+        CDB_LOG_EMERG("DateFileManager::ReadFile()", "Could not open file [%s]: %s", filepath.c_str(), strerror(errno));
+        return Status::IOError("Could not open file", strerror(errno));
+      }
+      char *datafile = static_cast<char*>(mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0));
+      close(fd);
+      if (datafile == MAP_FAILED) {
+        CDB_LOG_EMERG("DateFileManager::ReadFile()", "Could not mmap() file [%s]: %s", filepath.c_str(), strerror(errno));
+        return Status::IOError("Could not mmap file", strerror(errno));
+      }
+      //加载只顺序读取文件末尾的 HintData 和 footer，只对这一段预读
+      struct DateFileFooter footer;
+      if (   db_options.storage__advise_sequential_scans
+          && info.st_size >= DateFileFooter::GetFixedSize()
+          && DateFileFooter::DecodeFrom(datafile + info.st_size - DateFileFooter::GetFixedSize(), DateFileFooter::GetFixedSize(), &footer).IsOK()
+          && footer.offset_indexes < (uint64_t)info.st_size) {
+        FileUtil::advise(datafile, 0, info.st_size, MADV_SEQUENTIAL);
+        FileUtil::advise(datafile, footer.offset_indexes, info.st_size - footer.offset_indexes, MADV_WILLNEED);
+      }
 
-        offset_index += length;
+      Status s = LoadFile(datafile, info.st_size, filepath, fileid, hints_out, filesize_out, is_file_compacted_out, is_sorted_out, timing);
+      if (!s.IsOK()) {
+        struct DataFileHeader header;
+        DataFileHeader::DecodeFrom(datafile, info.st_size, &header);
+        *is_file_compacted_out = header.IsTypeCompacted();
+      }
+      munmap(datafile, info.st_size);
+      if (!s.IsOK()) {
+        hints_out.clear();
+        if (is_sorted_out != nullptr) *is_sorted_out = false;
+        uint64_t micros_start = (timing != nullptr) ? LoadTiming::NowMicros() : 0;
+        s = RecoverFile(db_options, filepath, fileid, is_read_only, hints_out, filesize_out);
+        if (timing != nullptr) {
+          timing->micros_recover += LoadTiming::NowMicros() - micros_start;
+          if (s.IsOK()) timing->num_files_recovered++;
+        }
       }
-      *filesize_out = filesize;
-      *is_file_compacted_out = footer.IsTypeCompacted() ? true : false;
-      log::trace("DateFileManager::LoadDatabase()", "Loaded [%s] num_entries:[%" PRIu64 "]", filepath.c_str(), footer.num_entries);
+      return s;
+    }
 
+    //延迟加载时读取单个文件的 HintData，同时登记文件的元数据
+    Status LoadFileHints(uint32_t fileid, std::vector< std::pair<uint64_t, uint64_t> >& hints_out) {
+      std::string filepath = GetFilepath(fileid);
+      uint64_t filesize = 0;
+      bool is_compacted = false;
+      Status s = ReadFile(db_options_, is_read_only_, filepath, fileid, hints_out, &filesize, &is_compacted);
+      if (!s.IsOK()) return s;
+      file_resource_manager.SetFileSize(fileid, filesize);
+      if (is_compacted) file_resource_manager.SetFileCompacted(fileid);
       return Status::OK();
     }
 
+    //进程在写入 HintData 之前退出时，数据文件没有有效的 footer
+    //从头部之后顺序扫描并校验每个 Entry，在第一个损坏的 Entry 处截断，然后重建 HintData 和 footer。
+    //没有 kFormatEntryChecksum 的旧文件无法校验 Entry，只在内存中恢复，不修改文件
+    static Status RecoverFile(const Options& db_options,
+                              std::string& filepath,
+                              uint32_t fileid,
+                              bool is_read_only,
+                              std::vector< std::pair<uint64_t, uint64_t> >& hints_out,
+                              uint64_t *filesize_out) {
+      int fd = open(filepath.c_str(), is_read_only ? O_RDONLY : O_RDWR);
+      if (fd < 0) return Status::IOError("Could not open file", strerror(errno));
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+      const uint64_t size_read = 4 * 1024 * 1024;
+      const uint32_t size_header_max = 64;
+      std::vector<char> buffer(size_read);
+      uint64_t offset_buffer = 0;    //buffer[0] 在文件中的偏移
+      uint64_t size_buffer = 0;      //buffer 中有效数据的长度
+      bool is_eof = false;
+
+      char buffer_header[DataFileHeader::GetFixedSize()];
+      struct DataFileHeader header;
+      if (   pread(fd, buffer_header, DataFileHeader::GetFixedSize(), 0) != (ssize_t)DataFileHeader::GetFixedSize()
+          || !DataFileHeader::DecodeFrom(buffer_header, DataFileHeader::GetFixedSize(), &header).IsOK()) {
+        close(fd);
+        return Status::IOError("Invalid header");
+      }
+
+      ReadOptions read_options;
+      uint32_t format_flags = header.GetFormatFlags();
+      bool is_hash_xxh3 = (format_flags & kFormatHashXXH3);
+      bool has_checksum = (format_flags & kFormatEntryChecksum);
+      std::vector< std::pair<uint64_t, uint32_t> > hints;
+      std::vector<uint64_t> hashed_keys_out;
+      uint64_t offset = db_options.internal__datafile_header_size;
+      offset_buffer = offset;
+      if (lseek(fd, offset, SEEK_SET) < 0) {
+        close(fd);
+        return Status::IOError("Could not seek file", strerror(errno));
+      }
+
+      while (true) {
+        //保证 buffer 中至少有一个完整的头部，读到文件末尾时除外
+        uint64_t pos = offset - offset_buffer;
+        if (!is_eof && size_buffer - pos < size_header_max) {
+          if (!FillBuffer(fd, buffer, &offset_buffer, &size_buffer, offset, 0, &is_eof)) break;
+          pos = 0;
+        }
+        if (pos + 4 > size_buffer) break;
+
+        struct EntryHeader entry_header;
+        uint32_t size_header;
+        Status s = EntryHeader::DecodeFrom(db_options, read_options, buffer.data() + pos, size_buffer - pos, &entry_header, &size_header, format_flags);
+        if (!s.IsOK()) break;
+        uint64_t size_entry = size_header + entry_header.size_key + entry_header.size_value;
+        if (entry_header.size_key + entry_header.size_value > UINT32_MAX || offset + size_entry > UINT32_MAX) break;
+
+        if (size_buffer - pos < size_entry) {
+          if (is_eof || !FillBuffer(fd, buffer, &offset_buffer, &size_buffer, offset, size_entry, &is_eof)) break;
+          pos = 0;
+          if (size_buffer < size_entry) break;
+        }
+
+        const char *data = buffer.data() + pos;
+        if (has_checksum && EntryHeader::ComputeChecksum(data, size_entry) != entry_header.crc32) break;
+        //旧版本的删除条目没有写入 hash，统一按 key 重新计算。
+        //重建的 HintData 使用文件自身格式的 hash，回传的条目总是 XXH3
+        const char *key = data + size_header;
+        uint64_t hashed_key = is_hash_xxh3 ? HashKey(key, entry_header.size_key) : HashKeyLegacy(key, entry_header.size_key);
+        hints.push_back(std::pair<uint64_t, uint32_t>(hashed_key, offset));
+        hashed_keys_out.push_back(is_hash_xxh3 ? hashed_key : HashKey(key, entry_header.size_key));
+        offset += EntryHeader::GetPaddedSize(format_flags, size_entry);
+      }
+
+      CDB_LOG_INFO("DateFileManager::RecoverFile()", "Recovered [%s]: %zu entries, valid size %" PRIu64, filepath.c_str(), hints.size(), offset);
+      if (!has_checksum && !is_read_only) {
+        CDB_LOG_WARN("DateFileManager::RecoverFile()", "[%s] has no entry checksums, recovered in memory only", filepath.c_str());
+      }
+
+      Status s;
+      uint64_t filesize = offset;
+      if (!is_read_only && has_checksum) {
+        if (ftruncate(fd, offset) < 0) {
+          s = Status::IOError("Could not truncate file", strerror(errno));
+        } else {
+          std::vector<char> buffer_index(SortedHintData::GetMaxEncodedSize(hints.size()) + DateFileFooter::GetFixedSize());
+          uint64_t size_hints = 0;
+          FileType filetype = header.IsTypeCompacted() ? kCompactedRegularType : kUncompactedRegularType;
+          s = WriteHintData(fd, hints, &size_hints, filetype, header.version, false, false, buffer_index.data());
+          if (s.IsOK() && fdatasync(fd) < 0) s = Status::IOError("Could not sync file", strerror(errno));
+          filesize += size_hints;
+        }
+      }
+      close(fd);
+      if (!s.IsOK()) return s;
+
+      uint64_t file_id_hight = fileid;
+      file_id_hight <<= 32;
+      hints_out.reserve(hints_out.size() + hints.size());
+      for (size_t i = 0; i < hints.size(); ++i) {
+        hints_out.push_back(std::pair<uint64_t, uint64_t>(hashed_keys_out[i], file_id_hight | hints[i].second));
+      }
+      if (filesize_out != nullptr) *filesize_out = filesize;
+      return Status::OK();
+    }
+
+    //把 buffer 中 offset 之后的数据移到开头，再顺序读取后续数据，size_min 大于 buffer 时扩大 buffer
+    static bool FillBuffer(int fd,
+                           std::vector<char>& buffer,
+                           uint64_t *offset_buffer,
+                           uint64_t *size_buffer,
+                           uint64_t offset,
+                           uint64_t size_min,
+                           bool *is_eof) {
+      uint64_t pos = offset - *offset_buffer;
+      uint64_t size_remaining = *size_buffer > pos ? *size_buffer - pos : 0;
+      if (size_remaining > 0) memmove(buffer.data(), buffer.data() + pos, size_remaining);
+      if (size_min > buffer.size()) buffer.resize(size_min);
+      *offset_buffer = offset;
+      *size_buffer = size_remaining;
+      while (*size_buffer < buffer.size()) {
+        ssize_t ret = read(fd, buffer.data() + *size_buffer, buffer.size() - *size_buffer);
+        if (ret < 0) {
+          if (errno == EINTR) continue;
+          return false;
+        }
+        if (ret == 0) {
+          *is_eof = true;
+          break;
+        }
+        *size_buffer += ret;
+      }
+      return true;
+    }
+
     Status DeleteAllLockedFiles(std::string& dbname) {
       std::set<uint32_t> fileids;
       DIR *directory;
@@ -360,7 +870,7 @@ class DateFileManager {
 
       for (auto& fileid: fileids) {
         if (std::remove(GetFilepath(fileid).c_str()) != 0) {
-          log::emerg("DeleteAllLockedFiles()", "Could not remove data file [%s]", GetFilepath(fileid).c_str());
+          CDB_LOG_EMERG("DeleteAllLockedFiles()", "Could not remove data file [%s]", GetFilepath(fileid).c_str());
         }
       }
 
@@ -373,11 +883,24 @@ class DateFileManager {
         IncrementSequenceTimestamp(1);      
 
         filepath_ = GetFilepath(GetSequenceFileId());
-        log::trace("DateFileManager::OpenNewFile()", "Opening file [%s]: %u", filepath_.c_str(), GetSequenceFileId());
-        
+        CDB_LOG_TRACE("DateFileManager::OpenNewFile()", "Opening file [%s]: %u", filepath_.c_str(), GetSequenceFileId());
+
+        //先记录到 manifest 再创建文件：manifest 中没有的文件下次打开时不会加载，
+        //fileid 还会被重用，所以记录失败时不能写入这个文件，和 open() 失败一样等待后重试
+        while (true) {
+          Status s = manifest.AddFile(GetSequenceFileId(), GetSequenceTimestamp());
+          if (!s.IsOK()) {
+            CDB_LOG_EMERG("DateFileManager::OpenNewFile()", "Could not write manifest: %s", s.ToString().c_str());
+            wait_until_can_open_new_files_ = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(5000));
+            continue;
+          }
+          break;
+        }
+
         while (true) {
           if ((fd_ = open(filepath_.c_str(), O_WRONLY|O_CREAT, 0644)) < 0) {
-            log::emerg("DateFileManager::OpenNewFile()", "Could not open file [%s]: %s", filepath_.c_str(), strerror(errno));
+            CDB_LOG_EMERG("DateFileManager::OpenNewFile()", "Could not open file [%s]: %s", filepath_.c_str(), strerror(errno));
             wait_until_can_open_new_files_ = true;
             std::this_thread::sleep_for(std::chrono::milliseconds(5000));
             continue;
@@ -387,8 +910,11 @@ class DateFileManager {
         }
 
         has_file_ = true;
+        RecordTick(db_options_.statistics.get(), kFilesCreated);
         fileid_ = GetSequenceFileId();
         timestamp_ = GetSequenceTimestamp();
+        file_resource_manager.SetFileTimestamp(fileid_, timestamp_);
+        file_resource_manager.SetFileActive(fileid_, true);
 
         // 为头部 预留空间
         offset_start_ = 0;
@@ -397,17 +923,20 @@ class DateFileManager {
         // 填充 文件固定头部
         struct DataFileHeader datafileheader;
         datafileheader.filetype  = filetype_default_;
+        datafileheader.version   = version_;
         datafileheader.timestamp = timestamp_;
         DataFileHeader::EncodeTo(&datafileheader, &db_options_, buffer_raw_);    
-        log::trace("DateFileManager::OpenNewFile()", "Opening file [%s]: %u success", filepath_.c_str(), GetSequenceFileId());    
+        CDB_LOG_TRACE("DateFileManager::OpenNewFile()", "Opening file [%s]: %u success", filepath_.c_str(), GetSequenceFileId());    
     }
 
 
     void CloseFile() {
       if (!has_file_) return;
-      log::trace("DateFileManager::CloseFile()", "ENTER - fileid_:%d", fileid_);
+      CDB_LOG_TRACE("DateFileManager::CloseFile()", "ENTER - fileid_:%d", fileid_);
 
       FlushHintDate();
+      file_resource_manager.SetFileActive(fileid_, false);
+      manifest.CloseFile(fileid_, file_resource_manager.GetFileSize(fileid_));
 
       close(fd_);
       buffer_has_items_ = false;
@@ -417,7 +946,7 @@ class DateFileManager {
     Status FlushHintDate() {
       if (!has_file_) return Status::OK();
       uint32_t num = file_resource_manager.GetNumWritesInProgress(fileid_);
-      log::trace("DateFileManager::FlushHintArray()", "ENTER - fileid_:%d - num_writes_in_progress:%u", fileid_, num);
+      CDB_LOG_TRACE("DateFileManager::FlushHintArray()", "ENTER - fileid_:%d - num_writes_in_progress:%u", fileid_, num);
       if (file_resource_manager.GetNumWritesInProgress(fileid_) == 0) {
         uint64_t size_offarray;
         file_resource_manager.SetFileSize(fileid_, offset_end_);
@@ -443,16 +972,36 @@ class DateFileManager {
                           FileType filetype,
                           bool has_padding_in_values,
                           bool has_invalid_entries) {
+      return WriteHintData(fd, offarray_current, size_out, filetype, version_, has_padding_in_values, has_invalid_entries, buffer_index_);
+    }
+
+    //buffer_index 需要能容纳所有 HintData 和 footer，version 为该文件头部中的版本，决定 HintData 的格式
+    static Status WriteHintData(int fd,
+                                const std::vector< std::pair<uint64_t, uint32_t> >& offarray_current,
+                                uint64_t* size_out,
+                                FileType filetype,
+                                uint32_t version,
+                                bool /*has_padding_in_values*/,
+                                bool has_invalid_entries,
+                                char* buffer_index_) {
       uint64_t offset = 0;
       struct HintData row;
+      struct DataFileHeader header;
+      header.version = version;
 
       //添加 HintDate 固化索引
-      for (auto& p:offarray_current) {
-        row.hashed_key = p.first;
-        row.offset_entry = p.second;
-        uint32_t length = HintData::EncodeTo(&row, buffer_index_ + offset);
-        offset += length;
-        log::trace("DateFileManager::WriteHintData()", "hashed_key:[0x%" PRIx64 "] offset:[0x%08x]", p.first, p.second);
+      if (header.HasSortedHints()) {
+        std::vector< std::pair<uint64_t, uint32_t> > hints_sorted(offarray_current);
+        std::sort(hints_sorted.begin(), hints_sorted.end());
+        offset = SortedHintData::EncodeTo(hints_sorted, buffer_index_);
+      } else {
+        for (auto& p:offarray_current) {
+          row.hashed_key = p.first;
+          row.offset_entry = p.second;
+          uint32_t length = HintData::EncodeTo(&row, buffer_index_ + offset);
+          offset += length;
+          CDB_LOG_TRACE("DateFileManager::WriteHintData()", "hashed_key:[0x%" PRIx64 "] offset:[0x%08x]", p.first, p.second);
+        }
       }
 
       //记录文件末尾（索引开始写入位置） 然后 构造Footer 最后 写入 HintDate和Footer
@@ -460,7 +1009,7 @@ class DateFileManager {
       if (position < 0) {
         return Status::IOError("DateFileManager::WriteHintData()", strerror(errno));
       }
-      log::trace("DateFileManager::WriteHintData()", "file position:[%" PRIu64 "]", position);    
+      CDB_LOG_TRACE("DateFileManager::WriteHintData()", "file position:[%" PRIu64 "]", position);    
 
       struct DateFileFooter footer;
       footer.filetype = filetype;
@@ -475,7 +1024,7 @@ class DateFileManager {
       EncodeFixed32(buffer_index_ + offset - 4, crc32);
 
       if (write(fd, buffer_index_, offset) < 0) {
-        log::trace("DateFileManager::WriteHintData()", "Error write(): %s", strerror(errno));
+        CDB_LOG_TRACE("DateFileManager::WriteHintData()", "Error write(): %s", strerror(errno));
       }
 
       // ftruncate() is necessary in case the file system space for the file was pre-allocated 
@@ -484,7 +1033,7 @@ class DateFileManager {
       } 
 
       *size_out = offset;
-      log::trace("DateFileManager::WriteHintData()", "offset_indexes:%u, num_entries:[%lu]", position, offarray_current.size());
+      CDB_LOG_TRACE("DateFileManager::WriteHintData()", "offset_indexes:%u, num_entries:[%lu]", position, offarray_current.size());
       return Status::OK();     
 
     }
@@ -494,41 +1043,45 @@ class DateFileManager {
       if (!has_file_)
         return 0;
       uint32_t fileid_out = fileid_;
-      log::trace("DateFileManager::FlushCurrentFile()", "ENTER - fileid_:%d, has_file_:%d, buffer_has_items_:%d", fileid_, has_file_, buffer_has_items_);
+      CDB_LOG_TRACE("DateFileManager::FlushCurrentFile()", "ENTER - fileid_:%d, has_file_:%d, buffer_has_items_:%d", fileid_, has_file_, buffer_has_items_);
       
       if (has_file_ && buffer_has_items_) {
-        log::trace("DateFileManager::FlushCurrentFile()", "has_files && buffer_has_items_ - fileid_:%d", fileid_);
+        CDB_LOG_TRACE("DateFileManager::FlushCurrentFile()", "has_files && buffer_has_items_ - fileid_:%d", fileid_);
         if (write(fd_, buffer_raw_ + offset_start_, offset_end_ - offset_start_) < 0) {
-          log::emerg("DateFileManager::FlushCurrentFile()", "Error write(): %s", strerror(errno));
+          CDB_LOG_EMERG("DateFileManager::FlushCurrentFile()", "Error write(): %s", strerror(errno));
           return 0;
         }
+        RecordTick(db_options_.statistics.get(), kFlushes);
+        RecordTick(db_options_.statistics.get(), kBytesFlushed, offset_end_ - offset_start_);
         //写入文件后 更新文件大小 （元数据）
         file_resource_manager.SetFileSize(fileid_, offset_end_);
         offset_start_ = offset_end_;
         buffer_has_items_ = false;
-        log::trace("DateFileManager::FlushCurrentFile()", "items written - offset_end_:%d | size_block_:%d | force_new_file:%d", offset_end_, size_block_, force_new_file);
+        CDB_LOG_TRACE("DateFileManager::FlushCurrentFile()", "items written - offset_end_:%d | size_block_:%d | force_new_file:%d", offset_end_, size_block_, force_new_file);
       }
 
       //强制操作系统立即直接刷新到硬盘上
       if (has_sync_option_) {
         has_sync_option_ = false;
+        StopWatch stop_watch(db_options_.statistics.get(), kHistFsync);
         if (fdatasync(fd_) < 0) {
-          log::emerg("DateFileManager::FlushCurrentFile()", "Error sync_file(): %s", strerror(errno));
+          CDB_LOG_EMERG("DateFileManager::FlushCurrentFile()", "Error sync_file(): %s", strerror(errno));
         }
+        RecordTick(db_options_.statistics.get(), kFsyncs);
       }  
 
       //文件超出 规定大小 或者 强制新建文件 则关闭当前文件，write会自己新建文件
       if (offset_end_ >= size_block_ || (force_new_file && offset_end_ > db_options_.internal__datafile_header_size)) {
-        log::trace("DateFileManager::FlushCurrentFile()", "file renewed - force_new_file:%d", force_new_file);
+        CDB_LOG_TRACE("DateFileManager::FlushCurrentFile()", "file renewed - force_new_file:%d", force_new_file);
         file_resource_manager.SetFileSize(fileid_, offset_end_);
         CloseFile();
       } 
-      log::trace("DateFileManager::FlushCurrentFile()", "done!");
+      CDB_LOG_TRACE("DateFileManager::FlushCurrentFile()", "done!");
       return fileid_out;
     }   
 
     uint64_t Write(Entry& entry, uint64_t hashed_key) {
-      log::trace("DataFileManager::Write()", "entry key: %s, hashed_key: %llu", entry.key.c_str(), hashed_key);
+      CDB_LOG_TRACE("DataFileManager::Write()", "entry key: %s, hashed_key: %llu", entry.key.c_str(), hashed_key);
       struct EntryHeader entry_header;
       uint64_t index = 0;
 
@@ -539,7 +1092,7 @@ class DateFileManager {
       if (entry.op_type == EntryType::Put_Or_Get){
 
         entry_header.SetPut();
-        entry_header.crc32 = entry.crc32;
+        entry_header.crc32 = 0;
         entry_header.size_key = entry.key.size();
         entry_header.size_value = entry.value.size();
         entry_header.hash = hashed_key;
@@ -547,7 +1100,7 @@ class DateFileManager {
         entry_header.SetMerge(false);
 
         //序列化 写入Entry 头部
-        uint32_t size_header = EntryHeader::EncodeTo(db_options_, &entry_header, buffer_raw_ + offset_end_);
+        uint32_t size_header = EntryHeader::EncodeTo(db_options_, &entry_header, buffer_raw_ + offset_end_, GetFormatFlags());
         //写入 key 和 value
         memcpy(buffer_raw_ + offset_end_ + size_header, entry.key.data(), entry.key.size());
         memcpy(buffer_raw_ + offset_end_ + size_header + entry.key.size(), entry.value.data(), entry.value.size());
@@ -556,21 +1109,22 @@ class DateFileManager {
         uint64_t file_id_hight = fileid_;
         file_id_hight = file_id_hight << 32;
         index = file_id_hight | offset_end_;
-        log::trace("DataFileManager::Write()", "entry key: %s, offset_end_ % llu", entry.key.c_str(), offset_end_);
+        CDB_LOG_TRACE("DataFileManager::Write()", "entry key: %s, offset_end_ % llu", entry.key.c_str(), offset_end_);
         //记录  索引数据  准备固化到硬盘
         file_resource_manager.AddHintData(fileid_, std::pair<uint64_t, uint32_t>(hashed_key, offset_end_));
+        EntryHeader::UpdateChecksum(buffer_raw_ + offset_end_, size_header + entry.key.size() + entry.value.size());
         //更新 偏移
-        offset_end_ += size_header + entry.key.size() + entry.value.size();
+        offset_end_ += PadEntry(size_header + entry.key.size() + entry.value.size());
       } else {
         entry_header.SetDelete();
         entry_header.size_key = entry.key.size();
         entry_header.size_value = 0;
-        // entry_header.hash = hashed_key;
-        entry_header.crc32 = entry.crc32;
+        entry_header.hash = hashed_key;
+        entry_header.crc32 = 0;
         entry_header.SetMerge(false);
 
         //序列化 写入Entry 头部
-        uint32_t size_header = EntryHeader::EncodeTo(db_options_, &entry_header, buffer_raw_ + offset_end_);
+        uint32_t size_header = EntryHeader::EncodeTo(db_options_, &entry_header, buffer_raw_ + offset_end_, GetFormatFlags());
         //写入 key
         memcpy(buffer_raw_ + offset_end_ + size_header, entry.key.c_str(), entry.key.size());
 
@@ -578,31 +1132,49 @@ class DateFileManager {
         uint64_t file_id_hight = fileid_;
         file_id_hight = file_id_hight << 32;
         index = file_id_hight | offset_end_;
-        log::trace("DataFileManager::Write()", "entry key: %s, offset_end_ % llu", entry.key.c_str(), offset_end_);
+        CDB_LOG_TRACE("DataFileManager::Write()", "entry key: %s, offset_end_ % llu", entry.key.c_str(), offset_end_);
         
         //记录  索引数据  准备固化到硬盘
         file_resource_manager.AddHintData(fileid_, std::pair<uint64_t, uint32_t>(hashed_key, offset_end_));
+        EntryHeader::UpdateChecksum(buffer_raw_ + offset_end_, size_header + entry.key.size());
         //更新 偏移
-        offset_end_ += size_header + entry.key.size() + entry.value.size();
+        offset_end_ += PadEntry(size_header + entry.key.size());
       }
 
       return index;
     }
 
-    void WriteEntrys(std::vector<Entry>& entrys, std::multimap<uint64_t, uint64_t>& map_index_out) {
-      log::trace("DateFileManager::WriteEntrys()", "got entrys size: %d", entrys.size());
-      for (auto& entry:entrys){
-          if (! has_file_) OpenNewFile();
+    //新建文件使用的格式特性标志
+    uint32_t GetFormatFlags() {
+      struct DataFileHeader header;
+      header.version = version_;
+      return header.GetFormatFlags();
+    }
 
-          //文件大小 大于最大限制则 刷新
-          if (offset_end_ > size_block_) {
-            log::trace("DateFileManager::WriteEntrys()", "About to flush - offset_end_: %llu | size_block_: %llu", offset_end_, size_block_);
+    //定长头部格式下 在 offset_end_ 处的 Entry 之后补零对齐，返回 Entry 占用的长度
+    uint64_t PadEntry(uint64_t size_entry) {
+      uint64_t size_padded = EntryHeader::GetPaddedSize(GetFormatFlags(), size_entry);
+      if (size_padded > size_entry) memset(buffer_raw_ + offset_end_ + size_entry, 0, size_padded - size_entry);
+      return size_padded;
+    }
+
+    //locations_out 不为空时 按 entrys 的顺序回传每个 Entry 写入的位置
+    void WriteEntrys(std::vector<Entry>& entrys,
+                     std::multimap<uint64_t, uint64_t>& map_index_out,
+                     std::vector<uint64_t>* locations_out=nullptr) {
+      CDB_LOG_TRACE("DateFileManager::WriteEntrys()", "got entrys size: %d", entrys.size());
+      for (auto& entry:entrys){
+          //文件大小 大于最大限制则 刷新，刷新会关闭当前文件，因此要在打开新文件之前检查
+          if (has_file_ && offset_end_ > size_block_) {
+            CDB_LOG_TRACE("DateFileManager::WriteEntrys()", "About to flush - offset_end_: %llu | size_block_: %llu", offset_end_, size_block_);
             FlushCurrentFile(true, 0);        
           }
 
+          if (! has_file_) OpenNewFile();
+
           //只考虑 小文件的情况下
-          log::trace("DateFileManager::WriteEntrys()", "key: [%s] size_value:%llu", entry.key.c_str(), entry.value.size());
-          uint64_t hashed_key = XXH64(entry.key.data(), entry.key.size(), 0);
+          CDB_LOG_TRACE("DateFileManager::WriteEntrys()", "key: [%s] size_value:%llu", entry.key.c_str(), entry.value.size());
+          uint64_t hashed_key = entry.hashed_key;
 
           buffer_has_items_ = true;
           uint64_t index = 0;
@@ -611,16 +1183,116 @@ class DateFileManager {
           if (index != 0 ) {
             map_index_out.insert(std::pair<uint64_t, uint64_t>(hashed_key, index));
           } else {
-            log::trace("DateFileManager::WriteEntrys()", "Avoided catastrophic location error"); 
+            CDB_LOG_TRACE("DateFileManager::WriteEntrys()", "Avoided catastrophic location error"); 
           }
+          if (locations_out != nullptr) locations_out->push_back(index);
 
       }
 
-      log::trace("DateFileManager::WriteEntrys()", "end flush");
+      CDB_LOG_TRACE("DateFileManager::WriteEntrys()", "end flush");
       FlushCurrentFile(false, 0);
     }
 
   private:
+    //并行加载时 每个文件的加载结果
+    struct LoadedFile {
+      uint32_t fileid;
+      std::string filepath;
+      Status status;
+      uint64_t filesize;
+      bool is_compacted;
+      bool is_sorted;
+      LoadTiming timing;
+      std::vector< std::vector< std::pair<uint64_t, uint64_t> > > partitions;
+    };
+
+    class LoadFileTask : public Task {
+     public:
+      LoadFileTask(const Options* db_options, bool is_read_only, LoadedFile* file, int bits_partitions)
+          : db_options_(db_options),
+            is_read_only_(is_read_only),
+            file_(file),
+            bits_partitions_(bits_partitions) {
+      }
+
+      virtual void Run(std::thread::id /*tid*/) override {
+        file_->status = Load();
+      }
+
+      Status Load() {
+        std::vector< std::pair<uint64_t, uint64_t> > hints;
+        Status s = DateFileManager::ReadFile(*db_options_, is_read_only_, file_->filepath, file_->fileid,
+                                             hints, &file_->filesize, &file_->is_compacted, &file_->is_sorted,
+                                             &file_->timing);
+        if (!s.IsOK()) return s;
+
+        file_->partitions.resize(1 << bits_partitions_);
+        for (auto& hint: hints) {
+          file_->partitions[Partition(hint.first)].push_back(hint);
+        }
+        return Status::OK();
+      }
+
+      uint64_t Partition(uint64_t hashed_key) {
+        return bits_partitions_ == 0 ? 0 : hashed_key >> (64 - bits_partitions_);
+      }
+
+     private:
+      const Options* db_options_;
+      bool is_read_only_;
+      LoadedFile* file_;
+      int bits_partitions_;
+    };
+
+    class BuildPartitionTask : public Task {
+     public:
+      BuildPartitionTask(std::vector<LoadedFile>* files,
+                         size_t partition,
+                         std::vector< std::pair<uint64_t, uint64_t> >* entries_out)
+          : files_(files),
+            partition_(partition),
+            entries_out_(entries_out) {
+      }
+
+      virtual void Run(std::thread::id /*tid*/) override {
+        size_t num_entries = 0;
+        for (auto& file: *files_) {
+          if (file.status.IsOK()) num_entries += file.partitions[partition_].size();
+        }
+        entries_out_->reserve(num_entries);
+        //每个文件为一段，旧格式的文件先单独排序，然后两两归并，
+        //归并和稳定排序都保持同一个 key 的条目在文件和写入上的先后顺序
+        std::vector<size_t> runs;
+        for (auto& file: *files_) {
+          if (!file.status.IsOK()) continue;
+          runs.push_back(entries_out_->size());
+          entries_out_->insert(entries_out_->end(), file.partitions[partition_].begin(), file.partitions[partition_].end());
+          std::vector< std::pair<uint64_t, uint64_t> >().swap(file.partitions[partition_]);
+          if (!file.is_sorted) std::stable_sort(entries_out_->begin() + runs.back(), entries_out_->end(), CompareHashedKey);
+        }
+        runs.push_back(entries_out_->size());
+
+        for (size_t width = 1; width + 1 < runs.size(); width *= 2) {
+          for (size_t i = 0; i + width + 1 < runs.size(); i += 2 * width) {
+            size_t last = std::min(i + 2 * width, runs.size() - 1);
+            std::inplace_merge(entries_out_->begin() + runs[i],
+                               entries_out_->begin() + runs[i + width],
+                               entries_out_->begin() + runs[last],
+                               CompareHashedKey);
+          }
+        }
+      }
+
+      static bool CompareHashedKey(const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) {
+        return a.first < b.first;
+      }
+
+     private:
+      std::vector<LoadedFile>* files_;
+      size_t partition_;
+      std::vector< std::pair<uint64_t, uint64_t> >* entries_out_;
+    };
+
     cdb::Options db_options_;
     std::string dbname_;
     bool is_read_only_;
@@ -639,7 +1311,8 @@ class DateFileManager {
     std::string prefix_;
     std::string prefix_compaction_;
     std::string dirpath_locks_;
-
+    std::string filename_checkpoint_;
+    std::string filename_manifest_;
 
     char *buffer_raw_;
     char *buffer_index_;
@@ -653,10 +1326,15 @@ class DateFileManager {
     bool wait_until_can_open_new_files_;
 
     FileType filetype_default_;
+    //新建文件使用的格式版本
+    uint32_t version_;
     bool has_sync_option_;
+    LoadTiming load_timing_;
     
  public:
     cdb::FileResourceManager file_resource_manager;
+    //只有主 DateFileManager 会打开 manifest，合并用的实例中所有记录都被忽略
+    cdb::Manifest manifest;
 
   
 
@@ -18,6 +18,7 @@
 #include "util/crc32c.h"
 #include "util/logger.h"
 #include "util/options.h"
+#include "storage_engine/data_file_format.h"
 
 namespace cdb {  
 
@@ -28,7 +29,7 @@ enum HeaderFlag {
 };    
 
   struct EntryHeader {
-    EntryHeader() { flags = 0; }
+    EntryHeader() { flags = 0; timestamp = 0; }
     //crc32 校验
     uint32_t crc32;
     //entry的状态
@@ -41,12 +42,25 @@ enum HeaderFlag {
     // key
     // value
 
+    //kFormatFixedEntryHeader 格式的头部：定长 32 字节，字段都按自身大小对齐，
+    //Entry 整体补齐到 8 字节，下一个 Entry 的头部也是对齐的，可以直接按结构体读取
+    struct Fixed {
+      uint32_t crc32;
+      uint32_t flags;
+      uint32_t size_key;
+      uint32_t size_value;
+      uint64_t timestamp;
+      uint64_t hash;
+    };
+    static const uint32_t kSizeFixed = 32;
+    static const uint32_t kAlignmentFixed = 8;
+
     void SetDelete() {
       flags |= Delete;
     }
 
     bool IsTypeDelete() {
-      log::trace("IsTypeDelete()", "flags %u", flags);
+      CDB_LOG_TRACE("IsTypeDelete()", "flags %u", flags);
       return (flags & Delete);
     }
 
@@ -70,9 +84,31 @@ enum HeaderFlag {
 
     int32_t size_header_serialized;
 
+    static bool IsFixed(uint32_t format_flags) {
+        return (format_flags & kFormatFixedEntryHeader);
+    }
+
+    //Entry 在文件中实际占用的长度，定长格式下包括末尾补齐的字节
+    static uint64_t GetPaddedSize(uint32_t format_flags, uint64_t size_entry) {
+        if (!IsFixed(format_flags)) return size_entry;
+        return (size_entry + kAlignmentFixed - 1) & ~(uint64_t)(kAlignmentFixed - 1);
+    }
+
+    //format_flags 为该文件头部中的格式特性标志
     static uint32_t EncodeTo(const Options& db_options,
                             const struct EntryHeader *input,
-                            char* buffer) {
+                            char* buffer,
+                            uint32_t format_flags=0) {
+
+        if (IsFixed(format_flags)) {
+          EncodeFixed32(buffer,      input->crc32);
+          EncodeFixed32(buffer +  4, input->flags);
+          EncodeFixed32(buffer +  8, input->size_key);
+          EncodeFixed32(buffer + 12, input->size_value);
+          EncodeFixed64(buffer + 16, input->timestamp);
+          EncodeFixed64(buffer + 24, input->hash);
+          return kSizeFixed;
+        }
 
         char *ptr = buffer;
         EncodeFixed32(ptr, input->crc32);
@@ -87,14 +123,48 @@ enum HeaderFlag {
         return (ptr - buffer);
     }
 
+    //校验码覆盖 crc32 字段之后的头部以及 key 和 value，buffer 指向序列化后的整个 Entry
+    static uint32_t ComputeChecksum(const char* buffer, uint64_t size_entry) {
+        return crc32c::Value(buffer + 4, size_entry - 4);
+    }
+
+    static void UpdateChecksum(char* buffer, uint64_t size_entry) {
+        EncodeFixed32(buffer, ComputeChecksum(buffer, size_entry));
+    }
+
     static Status DecodeFrom(const Options& db_options,
                             const ReadOptions& read_options,
                             const char* buffer_in,
                             uint64_t num_bytes_max,
                             struct EntryHeader *output,
-                            uint32_t *num_bytes_read) {
+                            uint32_t *num_bytes_read,
+                            uint32_t format_flags=0) {
+
+        //定长格式不需要逐个字段解码，小端机器上直接拷贝整个结构体
+        if (IsFixed(format_flags)) {
+          if (num_bytes_max < kSizeFixed) return Status::IOError("Decoding error");
+          struct Fixed fixed;
+          if (kLittleEndian) {
+            memcpy(&fixed, buffer_in, kSizeFixed);
+          } else {
+            fixed.crc32      = DecodeFixed32(buffer_in);
+            fixed.flags      = DecodeFixed32(buffer_in +  4);
+            fixed.size_key   = DecodeFixed32(buffer_in +  8);
+            fixed.size_value = DecodeFixed32(buffer_in + 12);
+            fixed.timestamp  = DecodeFixed64(buffer_in + 16);
+            fixed.hash       = DecodeFixed64(buffer_in + 24);
+          }
+          output->crc32 = fixed.crc32;
+          output->flags = fixed.flags;
+          output->size_key = fixed.size_key;
+          output->size_value = fixed.size_value;
+          output->timestamp = fixed.timestamp;
+          output->hash = fixed.hash;
+          *num_bytes_read = kSizeFixed;
+          output->size_header_serialized = kSizeFixed;
+          return Status::OK();
+        }
 
-        int length;
         char *buffer = const_cast<char*>(buffer_in);
         char *ptr = buffer;
         int size = num_bytes_max;
@@ -103,26 +173,16 @@ enum HeaderFlag {
         ptr += 4;
         size -= 4;
 
-        length = GetVarint32(ptr, size, &(output->flags));
-        if (length == -1) return Status::IOError("Decoding error");
-        ptr += length;
-        size -= length;
-
-
-        length = GetVarint64(ptr, size, &(output->timestamp));
-        if (length == -1) return Status::IOError("Decoding error");
-        ptr += length;
-        size -= length;
-
-        length = GetVarint64(ptr, size, &(output->size_key));
-        if (length == -1) return Status::IOError("Decoding error");
-        ptr += length;
-        size -= length;
-
-        length = GetVarint64(ptr, size, &(output->size_value));
-        if (length == -1) return Status::IOError("Decoding error");
-        ptr += length;
-        size -= length;
+        //flags, timestamp, size_key, size_value 连续存放，一次批量解码
+        uint64_t fields[4];
+        const char *end = GetVarint64Array(ptr, ptr + size, fields, 4);
+        if (end == nullptr) return Status::IOError("Decoding error");
+        output->flags = fields[0];
+        output->timestamp = fields[1];
+        output->size_key = fields[2];
+        output->size_value = fields[3];
+        size -= end - ptr;
+        ptr += end - ptr;
 
         if (size < 8) return Status::IOError("Decoding error");
         GetFixed64(ptr, &(output->hash));
@@ -132,11 +192,13 @@ enum HeaderFlag {
         *num_bytes_read = num_bytes_max - size;
         output->size_header_serialized = *num_bytes_read;
 
-        log::trace("EntryHeader::DecodeFrom", "size:%u", *num_bytes_read);
+        CDB_LOG_TRACE("EntryHeader::DecodeFrom", "size:%u", *num_bytes_read);
         return Status::OK();
     }  
 
   };
+
+  static_assert(sizeof(EntryHeader::Fixed) == EntryHeader::kSizeFixed, "EntryHeader::Fixed must have no padding");
 }// end namespace cdb
 
 #endif // CUCKOODB_ENTRY_ORMAT_H_
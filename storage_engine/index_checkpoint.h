@@ -0,0 +1,188 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : index_checkpoint.h
+ * Description   : 内存索引的快照文件，重启时直接加载快照，
+ *                 只需要重放快照之后新增文件的 HintData
+ *                 格式: Header | CheckpointFile * num_files | (hashed_key, location) * num_entries | crc32
+ * *******************************************************/
+#ifndef CUCKOODB_INDEX_CHECKPOINT_H_
+#define CUCKOODB_INDEX_CHECKPOINT_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "util/status.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
+#include "util/logger.h"
+#include "file/file_pool.h"
+
+namespace cdb {
+
+//快照覆盖的数据文件
+struct CheckpointFile {
+  uint32_t fileid;
+  uint32_t flags;
+  uint64_t timestamp;
+  uint64_t filesize;
+
+  static const uint32_t kFlagCompacted = 0x1;
+
+  static uint32_t GetFixedSize() {
+    return 24;
+  }
+};
+
+class IndexCheckpoint {
+ public:
+  static const uint32_t kMagic = 0x49424443; // "CDBI"
+  //版本 2 起快照中的 hashed_key 为 XXH3-64，旧版本的快照直接丢弃
+  static const uint32_t kVersion = 2;
+
+  //magic, version, fileid_last, num_files, num_entries
+  static uint32_t GetHeaderSize() {
+    return 28;
+  }
+
+  //先写入临时文件，落盘后再 rename，保证快照文件总是完整的
+  static Status Write(const std::string& filepath,
+                      uint32_t fileid_last,
+                      const std::vector<CheckpointFile>& files,
+                      const std::vector< std::pair<uint64_t, uint64_t> >& entries) {
+    std::string filepath_tmp = filepath + ".tmp";
+    int fd = open(filepath_tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) return Status::IOError("IndexCheckpoint::Write()", strerror(errno));
+
+    const uint64_t size_buffer = 1024 * 1024;
+    std::vector<char> buffer(size_buffer);
+    char *ptr = buffer.data();
+    uint32_t crc32 = 0;
+    Status s;
+
+    EncodeFixed32(ptr,      kMagic);
+    EncodeFixed32(ptr +  4, kVersion);
+    EncodeFixed32(ptr +  8, fileid_last);
+    EncodeFixed64(ptr + 12, files.size());
+    EncodeFixed64(ptr + 20, entries.size());
+    ptr += GetHeaderSize();
+
+    for (auto& file: files) {
+      if (!FlushBuffer(fd, buffer.data(), &ptr, CheckpointFile::GetFixedSize(), &crc32, &s)) break;
+      EncodeFixed32(ptr,      file.fileid);
+      EncodeFixed32(ptr +  4, file.flags);
+      EncodeFixed64(ptr +  8, file.timestamp);
+      EncodeFixed64(ptr + 16, file.filesize);
+      ptr += CheckpointFile::GetFixedSize();
+    }
+
+    for (auto& entry: entries) {
+      if (!s.IsOK() || !FlushBuffer(fd, buffer.data(), &ptr, 16, &crc32, &s)) break;
+      EncodeFixed64(ptr,     entry.first);
+      EncodeFixed64(ptr + 8, entry.second);
+      ptr += 16;
+    }
+
+    if (s.IsOK() && FlushBuffer(fd, buffer.data(), &ptr, size_buffer, &crc32, &s)) {
+      char buffer_crc32[4];
+      EncodeFixed32(buffer_crc32, crc32);
+      if (write(fd, buffer_crc32, 4) != 4 || FileUtil::sync_file(fd) < 0) {
+        s = Status::IOError("IndexCheckpoint::Write()", strerror(errno));
+      }
+    }
+    close(fd);
+
+    if (s.IsOK() && rename(filepath_tmp.c_str(), filepath.c_str()) < 0) {
+      s = Status::IOError("IndexCheckpoint::Write()", strerror(errno));
+    }
+    if (!s.IsOK()) std::remove(filepath_tmp.c_str());
+    CDB_LOG_TRACE("IndexCheckpoint::Write()", "fileid_last:%u num_files:%zu num_entries:%zu", fileid_last, files.size(), entries.size());
+    return s;
+  }
+
+  //快照中的条目已经按索引的顺序排列，直接在末尾插入，整体为线性时间
+  static Status Read(const std::string& filepath,
+                     uint32_t *fileid_last,
+                     std::vector<CheckpointFile> *files,
+                     std::multimap<uint64_t, uint64_t> *index) {
+    struct stat info;
+    if (stat(filepath.c_str(), &info) != 0) return Status::NotFound("No checkpoint");
+    if (info.st_size < (off_t)(GetHeaderSize() + 4)) return Status::IOError("Checkpoint too small");
+
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) return Status::IOError("IndexCheckpoint::Read()", strerror(errno));
+    char *data = static_cast<char*>(mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0));
+    close(fd);
+    if (data == MAP_FAILED) return Status::IOError("IndexCheckpoint::Read()", strerror(errno));
+    madvise(data, info.st_size, MADV_SEQUENTIAL);
+
+    Status s = Decode(data, info.st_size, fileid_last, files, index);
+    munmap(data, info.st_size);
+    return s;
+  }
+
+ private:
+  static Status Decode(const char* data,
+                       uint64_t size,
+                       uint32_t *fileid_last,
+                       std::vector<CheckpointFile> *files,
+                       std::multimap<uint64_t, uint64_t> *index) {
+    uint32_t magic, version, crc32;
+    uint64_t num_files, num_entries;
+    GetFixed32(data,      &magic);
+    GetFixed32(data +  4, &version);
+    GetFixed32(data +  8, fileid_last);
+    GetFixed64(data + 12, &num_files);
+    GetFixed64(data + 20, &num_entries);
+    if (magic != kMagic || version != kVersion) return Status::IOError("Invalid checkpoint header");
+    if (GetHeaderSize() + num_files * CheckpointFile::GetFixedSize() + num_entries * 16 + 4 != size) {
+      return Status::IOError("Invalid checkpoint size");
+    }
+
+    GetFixed32(data + size - 4, &crc32);
+    if (crc32c::Value(data, size - 4) != crc32) return Status::IOError("Invalid checkpoint checksum");
+
+    const char *ptr = data + GetHeaderSize();
+    files->resize(num_files);
+    for (auto& file: *files) {
+      GetFixed32(ptr,      &file.fileid);
+      GetFixed32(ptr +  4, &file.flags);
+      GetFixed64(ptr +  8, &file.timestamp);
+      GetFixed64(ptr + 16, &file.filesize);
+      ptr += CheckpointFile::GetFixedSize();
+    }
+
+    index->clear();
+    for (uint64_t i = 0; i < num_entries; ++i) {
+      index->insert(index->end(), std::pair<uint64_t, uint64_t>(DecodeFixed64(ptr), DecodeFixed64(ptr + 8)));
+      ptr += 16;
+    }
+    return Status::OK();
+  }
+
+  //缓冲区剩余空间不足 size 时写出缓冲区
+  static bool FlushBuffer(int fd, char* buffer, char** ptr, uint64_t size, uint32_t* crc32, Status* s) {
+    const uint64_t size_buffer = 1024 * 1024;
+    if (*ptr + size <= buffer + size_buffer) return true;
+    uint64_t length = *ptr - buffer;
+    if (write(fd, buffer, length) != (ssize_t)length) {
+      *s = Status::IOError("IndexCheckpoint::Write()", strerror(errno));
+      return false;
+    }
+    *crc32 = crc32c::Extend(*crc32, buffer, length);
+    *ptr = buffer;
+    return true;
+  }
+};
+
+}
+
+#endif // CUCKOODB_INDEX_CHECKPOINT_H_
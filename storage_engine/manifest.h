@@ -0,0 +1,339 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : manifest.h
+ * Description   : 只追加的 manifest 日志，记录数据文件的创建、关闭、合并替换以及时间戳，
+ *                 打开数据库时重放 manifest 即可得到有序的文件集合，无需扫描目录和读取文件头部
+ *                 格式: magic | version | (crc32 | size | type | payload) * n
+ * *******************************************************/
+#ifndef CUCKOODB_MANIFEST_H_
+#define CUCKOODB_MANIFEST_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <algorithm>
+#include <cinttypes>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "util/status.h"
+#include "util/coding.h"
+#include "util/crc32c.h"
+#include "util/logger.h"
+#include "file/file_pool.h"
+
+namespace cdb {
+
+//manifest 中记录的数据文件
+struct ManifestFile {
+  uint32_t fileid;
+  uint32_t flags;
+  uint64_t timestamp;
+  uint64_t filesize;  //文件关闭后才有效
+
+  static const uint32_t kFlagClosed    = 0x1;
+  static const uint32_t kFlagCompacted = 0x2;
+
+  ManifestFile() : fileid(0), flags(0), timestamp(0), filesize(0) {}
+
+  bool IsClosed() const {
+    return (flags & kFlagClosed);
+  }
+};
+
+//重放 manifest 得到的状态
+struct ManifestState {
+  std::map<uint32_t, ManifestFile> files;
+  uint32_t fileid_max;
+  //已经预留但没有完成替换的 fileid 区间，这些 fileid 上不在 files 中的文件都是合并留下的残余
+  std::map<uint32_t, uint32_t> reservations;
+  //合并替换后应当删除的输入文件
+  std::set<uint32_t> fileids_removed;
+
+  ManifestState() : fileid_max(0) {}
+};
+
+class Manifest {
+ public:
+  static const uint32_t kMagic = 0x4d424443; // "CDBM"
+  static const uint32_t kVersion = 1;
+
+  enum RecordType {
+    kAddFile         = 0x1,
+    kCloseFile       = 0x2,
+    kReserveFileIds  = 0x3,
+    kCompaction      = 0x4,
+    kSequenceFileId  = 0x5,
+  };
+
+  Manifest() : fd_(-1), size_valid_(0), is_size_valid_(true) {}
+
+  ~Manifest() {
+    Close();
+  }
+
+  //重放整个 manifest，遇到损坏或不完整的记录时停止（进程退出时最后一条记录可能只写了一半）
+  static Status Read(const std::string& filepath, ManifestState* state) {
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) return Status::NotFound("No manifest");
+    std::string data;
+    char buffer[64 * 1024];
+    while (true) {
+      ssize_t ret = read(fd, buffer, sizeof(buffer));
+      if (ret < 0 && errno == EINTR) continue;
+      if (ret <= 0) break;
+      data.append(buffer, ret);
+    }
+    close(fd);
+
+    if (data.size() < 8 || DecodeFixed32(data.data()) != kMagic || DecodeFixed32(data.data() + 4) != kVersion) {
+      return Status::IOError("Invalid manifest header");
+    }
+
+    uint64_t offset = 8;
+    while (offset + 8 <= data.size()) {
+      uint32_t crc32 = DecodeFixed32(data.data() + offset);
+      uint32_t size = DecodeFixed32(data.data() + offset + 4);
+      if (offset + 8 + size > data.size()) break;
+      if (crc32c::Value(data.data() + offset + 4, size + 4) != crc32) break;
+      if (!Apply(data.data() + offset + 8, size, state).IsOK()) break;
+      offset += 8 + size;
+    }
+    if (offset != data.size()) {
+      CDB_LOG_EMERG("Manifest::Read()", "Ignoring %" PRIu64 " bytes at the end of the manifest", data.size() - offset);
+    }
+    return Status::OK();
+  }
+
+  //用当前状态重写 manifest（先写临时文件再 rename），然后打开以追加新的记录
+  Status Open(const std::string& filepath, const ManifestState& state) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::string filepath_tmp = filepath + ".tmp";
+    int fd = open(filepath_tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) return Status::IOError("Manifest::Open()", strerror(errno));
+
+    std::string data;
+    PutFixed32(&data, kMagic);
+    PutFixed32(&data, kVersion);
+    for (auto& item: state.files) {
+      AppendRecord(&data, EncodeAddFile(item.second));
+    }
+    std::string payload;
+    PutVarint32(&payload, kSequenceFileId);
+    PutVarint32(&payload, state.fileid_max);
+    AppendRecord(&data, payload);
+
+    Status s;
+    if (write(fd, data.data(), data.size()) != (ssize_t)data.size() || FileUtil::sync_file(fd) < 0) {
+      s = Status::IOError("Manifest::Open()", strerror(errno));
+    }
+    close(fd);
+    if (s.IsOK() && rename(filepath_tmp.c_str(), filepath.c_str()) < 0) {
+      s = Status::IOError("Manifest::Open()", strerror(errno));
+    }
+    if (!s.IsOK()) {
+      std::remove(filepath_tmp.c_str());
+      return s;
+    }
+
+    fd_ = open(filepath.c_str(), O_WRONLY|O_APPEND);
+    if (fd_ < 0) return Status::IOError("Manifest::Open()", strerror(errno));
+    size_valid_ = data.size();
+    is_size_valid_ = true;
+    CDB_LOG_TRACE("Manifest::Open()", "num_files:%zu fileid_max:%u", state.files.size(), state.fileid_max);
+    return Status::OK();
+  }
+
+  void Close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1;
+  }
+
+  //以下记录在 manifest 没有打开时直接忽略（只读模式以及合并用的 DateFileManager）
+
+  //在创建数据文件之前记录并落盘，保证磁盘上的数据文件总能在 manifest 中找到
+  Status AddFile(uint32_t fileid, uint64_t timestamp) {
+    ManifestFile file;
+    file.fileid = fileid;
+    file.timestamp = timestamp;
+    return Append(EncodeAddFile(file), true);
+  }
+
+  Status CloseFile(uint32_t fileid, uint64_t filesize) {
+    std::string payload;
+    PutVarint32(&payload, kCloseFile);
+    PutVarint32(&payload, fileid);
+    PutVarint64(&payload, filesize);
+    return Append(payload, false);
+  }
+
+  //合并开始前记录预留的 fileid 区间 [fileid_begin, fileid_end]
+  Status ReserveFileIds(uint32_t fileid_begin, uint32_t fileid_end) {
+    std::string payload;
+    PutVarint32(&payload, kReserveFileIds);
+    PutVarint32(&payload, fileid_begin);
+    PutVarint32(&payload, fileid_end);
+    return Append(payload, true);
+  }
+
+  //合并的输出文件落盘并改名之后，原子地加入输出文件并移除输入文件
+  Status Compaction(uint32_t fileid_begin,
+                    const std::vector<ManifestFile>& files_added,
+                    const std::vector<uint32_t>& fileids_removed) {
+    std::string payload;
+    PutVarint32(&payload, kCompaction);
+    PutVarint32(&payload, fileid_begin);
+    PutVarint32(&payload, files_added.size());
+    for (auto& file: files_added) {
+      PutVarint32(&payload, file.fileid);
+      PutVarint32(&payload, file.flags);
+      PutVarint64(&payload, file.timestamp);
+      PutVarint64(&payload, file.filesize);
+    }
+    PutVarint32(&payload, fileids_removed.size());
+    for (auto fileid: fileids_removed) {
+      PutVarint32(&payload, fileid);
+    }
+    return Append(payload, true);
+  }
+
+ private:
+  static std::string EncodeAddFile(const ManifestFile& file) {
+    std::string payload;
+    PutVarint32(&payload, kAddFile);
+    PutVarint32(&payload, file.fileid);
+    PutVarint32(&payload, file.flags);
+    PutVarint64(&payload, file.timestamp);
+    PutVarint64(&payload, file.filesize);
+    return payload;
+  }
+
+  static void AppendRecord(std::string* data, const std::string& payload) {
+    std::string record;
+    PutFixed32(&record, payload.size());
+    record.append(payload);
+    PutFixed32(data, crc32c::Value(record.data(), record.size()));
+    data->append(record);
+  }
+
+  //写入失败时截断到最后一条完整记录的末尾，调用者可以重试。Read() 遇到不完整的记录就停止，
+  //不截断的话之后追加的记录都会被忽略；截断失败时之后的每次追加都先重新截断
+  Status Append(const std::string& payload, bool sync) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fd_ < 0) return Status::OK();
+    if (!is_size_valid_) {
+      if (ftruncate(fd_, size_valid_) < 0 || fdatasync(fd_) < 0) {
+        return Status::IOError("Manifest::Append() could not roll back", strerror(errno));
+      }
+      is_size_valid_ = true;
+    }
+    std::string data;
+    AppendRecord(&data, payload);
+    if (   write(fd_, data.data(), data.size()) != (ssize_t)data.size()
+        || (sync && fdatasync(fd_) < 0)) {
+      Status s = Status::IOError("Manifest::Append()", strerror(errno));
+      is_size_valid_ = ftruncate(fd_, size_valid_) == 0 && fdatasync(fd_) == 0;
+      return s;
+    }
+    size_valid_ += data.size();
+    return Status::OK();
+  }
+
+  static Status Apply(const char* payload, uint32_t size, ManifestState* state) {
+    const char *ptr = payload;
+    const char *limit = payload + size;
+    uint32_t type;
+    if ((ptr = GetVarint32Ptr(ptr, limit, &type)) == nullptr) return Status::IOError("Invalid manifest record");
+
+    if (type == kAddFile) {
+      ManifestFile file;
+      if (   (ptr = GetVarint32Ptr(ptr, limit, &file.fileid)) == nullptr
+          || (ptr = GetVarint32Ptr(ptr, limit, &file.flags)) == nullptr
+          || (ptr = GetVarint64Ptr(ptr, limit, &file.timestamp)) == nullptr
+          || (ptr = GetVarint64Ptr(ptr, limit, &file.filesize)) == nullptr) {
+        return Status::IOError("Invalid manifest record");
+      }
+      state->files[file.fileid] = file;
+      state->fileid_max = std::max(state->fileid_max, file.fileid);
+    } else if (type == kCloseFile) {
+      uint32_t fileid;
+      uint64_t filesize;
+      if (   (ptr = GetVarint32Ptr(ptr, limit, &fileid)) == nullptr
+          || (ptr = GetVarint64Ptr(ptr, limit, &filesize)) == nullptr) {
+        return Status::IOError("Invalid manifest record");
+      }
+      auto it = state->files.find(fileid);
+      if (it != state->files.end()) {
+        it->second.flags |= ManifestFile::kFlagClosed;
+        it->second.filesize = filesize;
+      }
+    } else if (type == kReserveFileIds) {
+      uint32_t fileid_begin, fileid_end;
+      if (   (ptr = GetVarint32Ptr(ptr, limit, &fileid_begin)) == nullptr
+          || (ptr = GetVarint32Ptr(ptr, limit, &fileid_end)) == nullptr) {
+        return Status::IOError("Invalid manifest record");
+      }
+      state->reservations[fileid_begin] = fileid_end;
+      state->fileid_max = std::max(state->fileid_max, fileid_end);
+    } else if (type == kCompaction) {
+      uint32_t fileid_begin, num_added, num_removed;
+      std::vector<ManifestFile> files_added;
+      std::vector<uint32_t> fileids_removed;
+      if (   (ptr = GetVarint32Ptr(ptr, limit, &fileid_begin)) == nullptr
+          || (ptr = GetVarint32Ptr(ptr, limit, &num_added)) == nullptr) {
+        return Status::IOError("Invalid manifest record");
+      }
+      for (uint32_t i = 0; i < num_added; ++i) {
+        ManifestFile file;
+        if (   (ptr = GetVarint32Ptr(ptr, limit, &file.fileid)) == nullptr
+            || (ptr = GetVarint32Ptr(ptr, limit, &file.flags)) == nullptr
+            || (ptr = GetVarint64Ptr(ptr, limit, &file.timestamp)) == nullptr
+            || (ptr = GetVarint64Ptr(ptr, limit, &file.filesize)) == nullptr) {
+          return Status::IOError("Invalid manifest record");
+        }
+        files_added.push_back(file);
+      }
+      if ((ptr = GetVarint32Ptr(ptr, limit, &num_removed)) == nullptr) return Status::IOError("Invalid manifest record");
+      for (uint32_t i = 0; i < num_removed; ++i) {
+        uint32_t fileid;
+        if ((ptr = GetVarint32Ptr(ptr, limit, &fileid)) == nullptr) return Status::IOError("Invalid manifest record");
+        fileids_removed.push_back(fileid);
+      }
+
+      //整条记录解码成功后才修改状态
+      for (auto& file: files_added) {
+        state->files[file.fileid] = file;
+        state->fileid_max = std::max(state->fileid_max, file.fileid);
+      }
+      for (auto fileid: fileids_removed) {
+        state->files.erase(fileid);
+        state->fileids_removed.insert(fileid);
+      }
+      state->reservations.erase(fileid_begin);
+    } else if (type == kSequenceFileId) {
+      uint32_t fileid_max;
+      if ((ptr = GetVarint32Ptr(ptr, limit, &fileid_max)) == nullptr) return Status::IOError("Invalid manifest record");
+      state->fileid_max = std::max(state->fileid_max, fileid_max);
+    } else {
+      return Status::IOError("Unknown manifest record type");
+    }
+    return Status::OK();
+  }
+
+  std::mutex mutex_;
+  int fd_;
+  uint64_t size_valid_;   //最后一条完整记录的末尾
+  bool is_size_valid_;    //为 false 时文件末尾可能有写失败留下的不完整记录
+};
+
+}
+
+#endif // CUCKOODB_MANIFEST_H_
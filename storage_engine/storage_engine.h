@@ -14,6 +14,13 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+#include <tuple>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <set>
 
 #include "date_file_manager.h"
 #include "util/event_manager.h"
@@ -25,7 +32,10 @@
 #include "util/entry.h"
 #include "util/status.h"
 #include "util/logger.h"
-#include "util/xxhash.h"
+#include "util/mutex.h"
+#include "util/hash.h"
+#include "util/statistics.h"
+#include "util/perf_context.h"
 #include "util/const_value.h"
 #include "entry_format.h"
 
@@ -44,22 +54,49 @@ class StorageEngine{
        event_manager_(event_manager),
        date_file_manager_(db_options, dbname, kUncompactedRegularType, false) {
       
-      log::trace("StorageEngine:StorageEngine()", "dbname: %s", dbname_.c_str());
+      CDB_LOG_TRACE("StorageEngine:StorageEngine()", "dbname: %s", dbname_.c_str());
       stop_ = false;
+      stop_background_ = false;
       is_closed_ = false;
+      is_compaction_in_progress_ = false;
+      is_loaded_ = false;
+      is_loading_ = false;
+      fileid_last_checkpoint_ = 0;
+      num_files_checkpoint_ = 0;
       num_readers_ = 0;
-      file_pool_ = std::make_shared<FilePool>();
+      file_pool_ = std::make_shared<FilePool>(db_options_.storage__advise_random_reads ? MADV_RANDOM : MADV_NORMAL,
+                                              db_options_.statistics.get());
       
       //启动事件循环 
       thread_data_ = std::thread(&StorageEngine::RunData, this);
       thread_index_ = std::thread(&StorageEngine::RunIndex, this);
 
 
+      if (db_options_.internal__lazy_load) {
+        is_loading_ = true;
+        Status s = date_file_manager_.LoadDatabase(dbname, index_, &fileids_pending_, &fileids_checkpoint_);
+        if (!s.IsOK()) {
+          CDB_LOG_EMERG("StorageEngine", "Could not load database: [%s]", s.ToString().c_str());
+          is_loading_ = false;
+          Close();
+          return;
+        }
+        //后台线程先加载剩余的文件，再开始合并和保存快照
+        thread_background_ = std::thread(&StorageEngine::RunLoad, this);
+        return;
+      }
+
       Status s = date_file_manager_.LoadDatabase(dbname, index_);
       if (!s.IsOK()) {
-        log::emerg("StorageEngine", "Could not load database: [%s]", s.ToString().c_str());
+        CDB_LOG_EMERG("StorageEngine", "Could not load database: [%s]", s.ToString().c_str());
         Close();
+        return;
       }      
+
+      is_loaded_ = true;
+
+      //索引加载完毕后 才能开始合并和保存快照
+      thread_background_ = std::thread(&StorageEngine::RunBackground, this);
     
     };
 
@@ -72,21 +109,36 @@ class StorageEngine{
       if (is_closed_) return;
       is_closed_ = true;
 
+      //先停止后台线程，合并过程中会检查 stop_background_ 并提前退出
+      mutex_background_.lock();
+      stop_background_ = true;
+      mutex_background_.unlock();
+      cond_background_.notify_one();
+      if (thread_background_.joinable()) thread_background_.join();
+
       // Wait for readers to exit
       AcquireWriteLock();
       date_file_manager_.Close();
       SetStop();
       ReleaseWriteLock();
 
+      //所有文件都已关闭，快照可以覆盖整个数据库，下次打开时无需重放任何文件
+      if (is_loaded_ && db_options_.checkpoint__interval > 0) {
+        Status s = WriteCheckpoint();
+        if (!s.IsOK()) {
+          CDB_LOG_EMERG("StorageEngine::Close()", "Could not write checkpoint: [%s]", s.ToString().c_str());
+        }
+      }
 
-      log::trace("StorageEngine::Close()", "join start");
+
+      CDB_LOG_TRACE("StorageEngine::Close()", "join start");
       //通知线程，子线程判断stop后返回
       event_manager_->update_index.Notify(); 
       event_manager_->flush_cache.Notify(); 
       thread_index_.join();
       thread_data_.join();
 
-      log::trace("StorageEngine::Close()", "end");
+      CDB_LOG_TRACE("StorageEngine::Close()", "end");
 
     } 
 
@@ -97,22 +149,65 @@ class StorageEngine{
       stop_ = true;
     }
 
+    //构造时加载数据库各阶段的耗时，延迟加载时不包括后台加载的文件
+    const LoadTiming& GetLoadTiming() {
+      return date_file_manager_.GetLoadTiming();
+    }
+
+    //索引中的条目数，合并期间包括合并索引中的条目
+    uint64_t GetNumEntriesIndex() {
+      AcquireReadLock();
+      uint64_t num_entries = index_.size() + index_compaction_.size();
+      ReleaseReadLock();
+      return num_entries;
+    }
+
+    //索引占用内存的估计：std::multimap 的每个节点有父、左、右三个指针和颜色，加上 key/value，
+    //再加上 malloc 的头部
+    uint64_t GetIndexMemoryUsage() {
+      static const uint64_t size_node = 4 * sizeof(void*) + 2 * sizeof(uint64_t) + 16;
+      return GetNumEntriesIndex() * size_node;
+    }
+
+    uint64_t GetNumFiles() {
+      return date_file_manager_.file_resource_manager.GetFileIds().size();
+    }
+
+    uint64_t GetDbSizeTotal() {
+      return date_file_manager_.file_resource_manager.GetDbSizeTotal();
+    }
+
+    uint64_t GetDbSizeUncompacted() {
+      return date_file_manager_.file_resource_manager.GetDbSizeUncompacted();
+    }
+
+    //FilePool 中当前映射的文件数
+    uint64_t GetNumFilesMapped() {
+      return file_pool_->NumFiles();
+    }
+
     //处理数据写入的事件循环
     void RunData() {
-      log::trace("StorageEngine::RunData()", "start to wait for handle data flush");
+      CDB_LOG_TRACE("StorageEngine::RunData()", "start to wait for handle data flush");
       //等待 swap cache 满了 通过 事件驱动器通知 进行处理
       while(true){
         //阻塞等待
         std::vector<Entry> entrys = event_manager_-> flush_cache.Wait();
         if (IsStop()) return;
-        log::trace("StorageEngine::RunData()", "got %d entry", entrys.size());
+        CDB_LOG_TRACE("StorageEngine::RunData()", "got %d entry", entrys.size());
 
+        //写入文件和更新索引的整个过程中持有 mutex_flush_，
+        //合并线程借此确认已关闭的文件都已经进入索引
+        std::unique_lock<std::mutex> lock_flush(mutex_flush_);
         //获取写f
         AcquireWriteLock();
         //哈希表，存储索引
         std::multimap<uint64_t, uint64_t> indexs;
         //处理数据写入文件之中
-        date_file_manager_.WriteEntrys(entrys, indexs);
+        {
+          StopWatch stop_watch(db_options_.statistics.get(), kHistWriteEntrys);
+          date_file_manager_.WriteEntrys(entrys, indexs);
+        }
 
         ReleaseWriteLock();
 
@@ -124,34 +219,37 @@ class StorageEngine{
     }
 
     void RunIndex() {
-      log::trace("StorageEngine::RunIndex()", "start to wait for handle index");
+      CDB_LOG_TRACE("StorageEngine::RunIndex()", "start to wait for handle index");
 
       while(true) {
         //阻塞等待
         std::multimap<uint64_t, uint64_t> index_entrys = event_manager_-> update_index.Wait();
         if (IsStop()) return;
-        log::trace("StorageEngine::RunIndex()", "got %d to update", index_entrys.size());
+        CDB_LOG_TRACE("StorageEngine::RunIndex()", "got %d to update", index_entrys.size());
         
-        //允许其他线程获取写锁
-        int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
-        int counter_iterations = 0;
-        for (auto& index:index_entrys){
-          if (counter_iterations == 0) {
-            AcquireWriteLock();
+        {
+          StopWatch stop_watch(db_options_.statistics.get(), kHistIndexUpdate);
+          //允许其他线程获取写锁
+          int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
+          int counter_iterations = 0;
+          for (auto& index:index_entrys){
+            if (counter_iterations == 0) {
+              AcquireWriteLock();
+            }
+            ++counter_iterations;
+            index_.insert(std::pair<uint64_t, uint64_t>(index.first, index.second));
+            if (counter_iterations >= num_iterations_per_lock){
+              ReleaseWriteLock();
+              counter_iterations = 0;
+            }
           }
-          ++counter_iterations;
-          index_.insert(std::pair<uint64_t, uint64_t>(index.first, index.second));
-          if (counter_iterations >= num_iterations_per_lock){
-            ReleaseWriteLock();
-            counter_iterations = 0;
-          }
-        }
 
-        if (counter_iterations) ReleaseWriteLock();
+          if (counter_iterations) ReleaseWriteLock();
+        }
 
         event_manager_->update_index.Done();
         //写操作完成 通知 清除swap cache
-        log::trace("StorageEngine::RunIndex()", "update index Done  then notify to clear cache");
+        CDB_LOG_TRACE("StorageEngine::RunIndex()", "update index Done  then notify to clear cache");
         int tmp = 1;
         event_manager_->clear_cache.notify_and_wait(tmp);
 
@@ -161,14 +259,10 @@ class StorageEngine{
                
     Status Get(ReadOptions& read_option,
                const std::string& key,
+               uint64_t hashed_key,
                std::string* value) {
-      // uint64_t hasked_key = XXH64(key.data(), key.size(), 0);
-      log::trace("StroageEngine::Get()", "key str : %s", key.c_str());
-      mutex_write_.lock();
-      mutex_read_.lock();
-      num_readers_ += 1;
-      mutex_read_.unlock();
-      mutex_write_.unlock();
+      CDB_LOG_TRACE("StroageEngine::Get()", "key str : %s", key.c_str());
+      AcquireReadLock();
 
       bool has_compaction_index = false;
       mutex_compaction_.lock();
@@ -176,21 +270,26 @@ class StorageEngine{
       mutex_compaction_.unlock();
       
       Status s;
-      if (!has_compaction_index){
+      if (is_loading_) {
+        //找到的版本来自快照时，未加载的文件中可能还有更新的版本
+        uint64_t location = 0;
+        s = GetWithIndex(read_option, index_, key, hashed_key, value, &location);
+        uint32_t fileid = (location & 0xFFFFFFFF00000000) >> 32;
+        if (s.IsNotFound() || fileids_checkpoint_.find(fileid) != fileids_checkpoint_.end()) {
+          Status s_pending = GetWithPendingFiles(read_option, key, hashed_key, value);
+          if (s_pending.IsOK() || s_pending.IsRemoveEntry()) s = s_pending;
+        }
+      } else if (!has_compaction_index){
         //不在合并中
-        s = GetWithIndex(read_option, index_, key, value);
+        s = GetWithIndex(read_option, index_, key, hashed_key, value);
       } else {
-        s = GetWithIndex(read_option, index_compaction_, key, value);
+        s = GetWithIndex(read_option, index_compaction_, key, hashed_key, value);
         if (!s.IsOK() && !s.IsRemoveEntry()){
-          s =GetWithIndex(read_option, index_, key, value);
+          s =GetWithIndex(read_option, index_, key, hashed_key, value);
         }
       }
 
-      mutex_read_.lock();
-      num_readers_ -= 1;
-      log::trace("StroageEngine::Get()", "num_readers_ : %d", num_readers_);
-      mutex_read_.unlock();
-      cond_read_complete_.notify_one();
+      ReleaseReadLock();
 
       return s;
     }
@@ -198,11 +297,12 @@ class StorageEngine{
     Status GetWithIndex(ReadOptions& read_option, 
                         std::multimap<uint64_t, uint64_t>& index,
                         const std::string& key,
-                        std::string* value) {
-      log::trace("StroageEngine::GetWithIndex()", "key str : %s, index size: %d", key.c_str(), index.size());
-      uint64_t hashed_key = XXH64(key.data(), key.size(), 0);
+                        uint64_t hashed_key,
+                        std::string* value,
+                        uint64_t* location_out=nullptr) {
+      CDB_LOG_TRACE("StroageEngine::GetWithIndex()", "key str : %s, index size: %d", key.c_str(), index.size());
 
-      log::trace("StroageEngine::GetWithIndex()","hashed_key : %llu", hashed_key);
+      CDB_LOG_TRACE("StroageEngine::GetWithIndex()","hashed_key : %llu", hashed_key);
       //查找键值
       auto range = index.equal_range(hashed_key);
       //直接读取最近对该key的操作
@@ -212,38 +312,158 @@ class StorageEngine{
           --cur;
           std::string key_cmp;
           Status s = GetEntry(read_option, cur->second, &key_cmp, value);
+          RecordTick(db_options_.statistics.get(), kIndexProbes);
+          PERF_COUNTER_ADD(index_probes, 1);
           //如果 这个位置 存的就是这个键值 就返回，否则是hash冲突，继续往前找
           if (key_cmp == key && (s.IsOK() || s.IsRemoveEntry())){
-            log::trace("StroageEngine::GetWithIndex()", "find  ");
+            CDB_LOG_TRACE("StroageEngine::GetWithIndex()", "find  ");
+            if (location_out != nullptr) *location_out = cur->second;
             return s;
           }
-          log::trace("StroageEngine::GetWithIndex()", "not match");   
+          if (s.IsOK() || s.IsRemoveEntry()) {
+            RecordTick(db_options_.statistics.get(), kHashCollisions);
+            PERF_COUNTER_ADD(hash_collisions, 1);
+          }
+          CDB_LOG_TRACE("StroageEngine::GetWithIndex()", "not match");   
         } while(cur != range.first);
       }
       return Status::NotFound("Unable to find the entry in the storage engine");
     }
 
-    //传指针避免拷贝
+    //延迟加载期间，从新到旧查找尚未进入索引的文件
+    Status GetWithPendingFiles(ReadOptions& read_option,
+                               const std::string& key,
+                               uint64_t hashed_key,
+                               std::string* value) {
+      std::vector<uint32_t> fileids;
+      mutex_pending_.lock();
+      fileids = fileids_pending_;
+      mutex_pending_.unlock();
+
+      for (auto it = fileids.rbegin(); it != fileids.rend(); ++it) {
+        std::shared_ptr< std::vector< std::pair<uint64_t, uint64_t> > > hints;
+        if (!GetPendingHints(*it, &hints).IsOK()) continue;
+        auto range = std::equal_range(hints->begin(), hints->end(), std::pair<uint64_t, uint64_t>(hashed_key, 0),
+                                      [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) { return a.first < b.first; });
+        //同一个 key 在文件中越靠后越新
+        for (auto cur = range.second; cur != range.first;) {
+          --cur;
+          std::string key_cmp;
+          Status s = GetEntry(read_option, cur->second, &key_cmp, value);
+          if (key_cmp == key && (s.IsOK() || s.IsRemoveEntry())) return s;
+        }
+      }
+      return Status::NotFound("Unable to find the entry in the storage engine");
+    }
+
+    //返回未加载文件按 hashed_key 排序的 HintData，第一次访问时读取并缓存，文件已经加载时返回 NotFound。
+    //读取在 mutex_pending_ 之外进行，只有访问同一个文件的线程等待这次读取
+    Status GetPendingHints(uint32_t fileid,
+                           std::shared_ptr< std::vector< std::pair<uint64_t, uint64_t> > >* hints_out) {
+      std::shared_ptr<PendingHints> pending;
+      {
+        std::unique_lock<std::mutex> lock(mutex_pending_);
+        if (std::find(fileids_pending_.begin(), fileids_pending_.end(), fileid) == fileids_pending_.end()) {
+          return Status::NotFound("File already loaded");
+        }
+        std::shared_ptr<PendingHints>& slot = hints_pending_[fileid];
+        if (!slot) slot = std::make_shared<PendingHints>();
+        pending = slot;
+      }
+
+      std::unique_lock<std::mutex> lock(pending->mutex);
+      if (!pending->is_loaded) {
+        Status s = date_file_manager_.LoadFileHints(fileid, pending->hints);
+        if (!s.IsOK()) {
+          pending->hints.clear();
+          return s;
+        }
+        //新格式文件的 HintData 本身已经有序
+        auto compare = [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) { return a.first < b.first; };
+        if (!std::is_sorted(pending->hints.begin(), pending->hints.end(), compare)) {
+          std::stable_sort(pending->hints.begin(), pending->hints.end(), compare);
+        }
+        pending->is_loaded = true;
+      }
+      //加载完成后 hints 不再修改，与 pending 共享所有权
+      *hints_out = std::shared_ptr< std::vector< std::pair<uint64_t, uint64_t> > >(pending, &pending->hints);
+      return Status::OK();
+    }
+
+    //延迟加载：从新到旧把文件加入索引。同一个 key 的条目排在快照条目之后、已加载的更新条目之前，
+    //因此每个文件的条目倒序插入到第一个不属于快照的条目之前
+    void RunLoad() {
+      CDB_LOG_TRACE("StorageEngine::RunLoad()", "start to load %zu files", fileids_pending_.size());
+      std::vector<uint32_t> fileids;
+      mutex_pending_.lock();
+      fileids = fileids_pending_;
+      mutex_pending_.unlock();
+
+      int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
+      for (auto it = fileids.rbegin(); it != fileids.rend(); ++it) {
+        if (stop_background_) return;
+        std::shared_ptr< std::vector< std::pair<uint64_t, uint64_t> > > hints;
+        Status s = GetPendingHints(*it, &hints);
+        if (!s.IsOK()) {
+          CDB_LOG_EMERG("StorageEngine::RunLoad()", "Could not load file [%u]: [%s]", *it, s.ToString().c_str());
+        } else {
+          int counter_iterations = 0;
+          for (auto hint = hints->rbegin(); hint != hints->rend(); ++hint) {
+            if (counter_iterations == 0) AcquireWriteLock();
+            ++counter_iterations;
+            auto range = index_.equal_range(hint->first);
+            auto pos = range.first;
+            while (pos != range.second && fileids_checkpoint_.find((pos->second & 0xFFFFFFFF00000000) >> 32) != fileids_checkpoint_.end()) ++pos;
+            index_.insert(pos, *hint);
+            if (counter_iterations >= num_iterations_per_lock) {
+              ReleaseWriteLock();
+              counter_iterations = 0;
+            }
+          }
+          if (counter_iterations) ReleaseWriteLock();
+        }
+
+        mutex_pending_.lock();
+        fileids_pending_.erase(std::find(fileids_pending_.begin(), fileids_pending_.end(), *it));
+        hints_pending_.erase(*it);
+        mutex_pending_.unlock();
+      }
+
+      is_loading_ = false;
+      is_loaded_ = true;
+      CDB_LOG_TRACE("StorageEngine::RunLoad()", "done");
+      RunBackground();
+    }
+
+    //传指针避免拷贝, value 为空时不拷贝 value
     Status GetEntry(ReadOptions& read_option,
                     uint64_t location,
                     std::string* key,
                     std::string* value) {              
+      StopWatch stop_watch(db_options_.statistics.get(), kHistGetEntry);
+      PERF_TIMER_GUARD(get_entry_nanos);
+      //Entry 直接从映射中读取，缺页发生在解码和拷贝时
+      PerfPageFaultGuard perf_page_faults;
       Status s = Status::OK();
       
       uint32_t fileid = (location & 0xFFFFFFFF00000000) >> 32;
       uint32_t offset_in_file = location & 0x00000000FFFFFFFF;
-      log::trace("StroageEngine::GetEntry()", "fileid : %d", fileid); 
-      log::trace("StroageEngine::GetEntry()", "offset_in_file : %d", offset_in_file);       
+      CDB_LOG_TRACE("StroageEngine::GetEntry()", "fileid : %d", fileid); 
+      CDB_LOG_TRACE("StroageEngine::GetEntry()", "offset_in_file : %d", offset_in_file);       
       //文件结尾偏移
       uint64_t filesize = 0;
       filesize = date_file_manager_.file_resource_manager.GetFileSize(fileid);
 
       //文件路径
       std::string filepath = date_file_manager_.GetFilepath(fileid);
-      log::trace("StroageEngine::GetEntry()", "filepath : %s", filepath.c_str()); 
+      CDB_LOG_TRACE("StroageEngine::GetEntry()", "filepath : %s", filepath.c_str()); 
       //实现文件池  用于管理读写的文件
       FileResource file_resource_;
-      file_pool_->GetFile(fileid, filepath, filesize, &file_resource_);
+      //正在写入的文件一次按最大长度映射，之后新写入的数据不会导致重新映射
+      uint64_t size_map = 0;
+      if (date_file_manager_.file_resource_manager.IsFileActive(fileid)) size_map = date_file_manager_.GetMaxFileSize();
+      s = file_pool_->GetFile(fileid, filepath, filesize, &file_resource_, size_map);
+      if (!s.IsOK()) return s;
 
       struct EntryHeader entry_header;
       uint32_t size_header;
@@ -252,26 +472,466 @@ class StorageEngine{
                                   file_resource_.mmap + offset_in_file, 
                                   filesize - offset_in_file, 
                                   &entry_header, 
-                                  &size_header);
+                                  &size_header,
+                                  DataFileHeader::GetFormatFlags(file_resource_.mmap));
       if (!s.IsOK()) {
+        CDB_LOG_TRACE("StroageEngine::GetEntry()", "not find"); 
+        file_pool_->ReleaseFile(file_resource_);
         return s;
-        log::trace("StroageEngine::GetEntry()", "not find"); 
       }
       std::string key_out = std::string(file_resource_.mmap + offset_in_file + size_header, entry_header.size_key);
-      std::string value_out = std::string(file_resource_.mmap + offset_in_file + size_header + entry_header.size_key, entry_header.size_value);
       
       if (entry_header.IsTypeDelete()) {
         s = Status::RemoveEntry();
-        log::trace("StroageEngine::GetEntry()", "RemoveEntry"); 
+        CDB_LOG_TRACE("StroageEngine::GetEntry()", "RemoveEntry"); 
       }      
       
-      log::trace("StroageEngine::GetEntry()", "key_out : %s", key_out.c_str()); 
+      CDB_LOG_TRACE("StroageEngine::GetEntry()", "key_out : %s", key_out.c_str()); 
       *key = key_out;
-      *value = value_out;
+      if (value != nullptr) {
+        value->assign(file_resource_.mmap + offset_in_file + size_header + entry_header.size_key, entry_header.size_value);
+        PERF_COUNTER_ADD(bytes_copied, entry_header.size_value);
+      }
+      PERF_COUNTER_ADD(bytes_copied, entry_header.size_key);
+      file_pool_->ReleaseFile(file_resource_);
+
+      return s;
+    }
+
+    //后台线程：定期检查未合并的数据量，以及保存索引快照
+    void RunBackground() {
+      CDB_LOG_TRACE("StorageEngine::RunBackground()", "start to wait for compaction and checkpoint");
+      uint64_t interval = db_options_.compaction__check_interval;
+      if (db_options_.checkpoint__interval > 0) interval = std::min(interval, db_options_.checkpoint__interval);
+      FileResourceManager& frm = date_file_manager_.file_resource_manager;
+      uint64_t epoch_checkpoint = frm.GetEpochNow();
+
+      while (true) {
+        std::unique_lock<std::mutex> lock(mutex_background_);
+        cond_background_.wait_for(lock,
+                                  std::chrono::milliseconds(interval),
+                                  [this]() { return stop_background_.load(); });
+        if (stop_background_) return;
+        lock.unlock();
+
+        bool has_compacted = false;
+        uint64_t size_uncompacted = frm.GetDbSizeUncompacted();
+        if (size_uncompacted >= db_options_.compaction__size_threshold) {
+          CDB_LOG_TRACE("StorageEngine::RunBackground()", "size_uncompacted:%" PRIu64, size_uncompacted);
+          Status s = Compaction();
+          if (!s.IsOK()) {
+            CDB_LOG_EMERG("StorageEngine::RunBackground()", "Compaction failed: [%s]", s.ToString().c_str());
+          }
+          has_compacted = s.IsOK();
+        }
+
+        //合并之后旧的快照已经失效，需要立即重新保存
+        if (   db_options_.checkpoint__interval > 0
+            && (has_compacted || frm.GetEpochNow() - epoch_checkpoint >= db_options_.checkpoint__interval)) {
+          Status s = WriteCheckpoint();
+          if (!s.IsOK()) {
+            CDB_LOG_EMERG("StorageEngine::RunBackground()", "Could not write checkpoint: [%s]", s.ToString().c_str());
+          }
+          epoch_checkpoint = frm.GetEpochNow();
+        }
+      }
+    }
+
+    //保存所有已关闭文件对应的索引，正在写入的文件不在快照中，打开时重放
+    Status WriteCheckpoint() {
+      FileResourceManager& frm = date_file_manager_.file_resource_manager;
+      std::vector<CheckpointFile> files;
+      uint32_t fileid_last = 0;
+
+      mutex_flush_.lock();
+      uint32_t fileid_active = date_file_manager_.GetFileIdActive();
+      //之后新建的文件的 fileid 都大于 fileid_sequence
+      uint32_t fileid_sequence = date_file_manager_.GetSequenceFileId();
+      for (auto fileid: frm.GetFileIds()) {
+        if (fileid == fileid_active) continue;
+        CheckpointFile file;
+        file.fileid = fileid;
+        file.flags = frm.IsFileCompacted(fileid) ? CheckpointFile::kFlagCompacted : 0;
+        file.timestamp = frm.GetFileTimestamp(fileid);
+        file.filesize = frm.GetFileSize(fileid);
+        files.push_back(file);
+        fileid_last = std::max(fileid_last, fileid);
+      }
+      mutex_flush_.unlock();
+
+      //没有新关闭的文件，也没有合并，快照不变
+      if (fileid_last == fileid_last_checkpoint_ && files.size() == num_files_checkpoint_) return Status::OK();
+
+      //分批拷贝索引，每批之间释放读锁，写线程不会在整个拷贝期间被阻塞。
+      //合并和快照都在后台线程中执行，拷贝期间索引只会插入新的条目，它们属于 fileid_active 或更新的文件。
+      //同一个 hashed_key 的条目在一批中拷贝完，下一批从下一个 hashed_key 开始
+      std::vector< std::pair<uint64_t, uint64_t> > entries;
+      int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
+      bool is_done = false;
+      uint64_t hashed_key_last = 0;
+      AcquireReadLock();
+      entries.reserve(index_.size());
+      auto it = index_.begin();
+      while (!is_done) {
+        int counter_iterations = 0;
+        while (it != index_.end() && (counter_iterations < num_iterations_per_lock || it->first == hashed_key_last)) {
+          uint32_t fileid = (it->second & 0xFFFFFFFF00000000) >> 32;
+          if (fileid != fileid_active && fileid <= fileid_sequence) entries.push_back(*it);
+          hashed_key_last = it->first;
+          ++it;
+          ++counter_iterations;
+        }
+        is_done = (it == index_.end());
+        ReleaseReadLock();
+        if (is_done) break;
+        AcquireReadLock();
+        it = index_.upper_bound(hashed_key_last);
+      }
 
+      Status s = IndexCheckpoint::Write(date_file_manager_.GetCheckpointFilepath(), fileid_last, files, entries);
+      if (s.IsOK()) {
+        RecordTick(db_options_.statistics.get(), kCheckpoints);
+        fileid_last_checkpoint_ = fileid_last;
+        num_files_checkpoint_ = files.size();
+      }
       return s;
     }
 
+    //合并所有已关闭且未合并的文件：
+    //  只保留每个 key 的最新版本；
+    //  墓碑(Delete)只有在参与合并的文件之外还存在该 key 更早的版本时才保留，
+    //  否则(包括从未持久化过的 key)直接丢弃，索引中对应的条目也一并删除；
+    //  墓碑的更早版本所在的已合并文件也加入本次合并，使墓碑和旧版本能一起被丢弃
+    Status Compaction() {
+      FileResourceManager& frm = date_file_manager_.file_resource_manager;
+
+      //确定参与合并的文件，此时已关闭的文件都已经进入索引
+      std::vector<uint32_t> fileids;
+      std::unordered_set<uint32_t> fileids_closed;
+      mutex_flush_.lock();
+      uint32_t fileid_active = date_file_manager_.GetFileIdActive();
+      for (auto fileid: frm.GetFileIds()) {
+        if (fileid == fileid_active) continue;
+        fileids_closed.insert(fileid);
+        if (!frm.IsFileCompacted(fileid)) fileids.push_back(fileid);
+      }
+      mutex_flush_.unlock();
+      if (fileids.empty()) return Status::OK();
+      AddFilesShadowedByTombstones(fileids_closed, fileids);
+      if (stop_background_) return Status::IOError("Compaction interrupted");
+
+      //为输出文件预留 fileid，输出的文件数不会超过输入的文件数加一
+      uint32_t num_fileids = fileids.size() + 1;
+      uint32_t fileid_end = date_file_manager_.IncrementSequenceFileId(num_fileids);
+      Status s = date_file_manager_.manifest.ReserveFileIds(fileid_end - num_fileids + 1, fileid_end);
+      if (!s.IsOK()) return s;
+      DateFileManager dfm_compaction(db_options_, dbname_, kCompactedRegularType);
+      dfm_compaction.SetPrefix(date_file_manager_.GetPrefixCompaction());
+      dfm_compaction.SetSequenceFileId(fileid_end - num_fileids);
+
+      ReadOptions read_options;
+      std::unordered_set<uint32_t> fileids_compaction;
+      std::vector<FileResource> files;
+      uint64_t timestamp_max = 0;
+      for (auto fileid: fileids) {
+        FileResource file_resource;
+        uint64_t filesize = frm.GetFileSize(fileid);
+        Status s = file_pool_->GetFile(fileid, date_file_manager_.GetFilepath(fileid), filesize, &file_resource);
+        if (!s.IsOK()) continue;
+        struct DataFileHeader header;
+        s = DataFileHeader::DecodeFrom(file_resource.mmap, filesize, &header);
+        if (!s.IsOK()) {
+          file_pool_->ReleaseFile(file_resource);
+          continue;
+        }
+        timestamp_max = std::max(timestamp_max, header.timestamp);
+        fileids_compaction.insert(fileid);
+        files.push_back(file_resource);
+      }
+      dfm_compaction.LockSequenceTimestamp(timestamp_max);
+
+      //hashed_key, 原位置, 新位置(为0表示丢弃)
+      std::vector< std::tuple<uint64_t, uint64_t, uint64_t> > relocations;
+      for (auto& file_resource: files) {
+        if (stop_background_) {
+          s = Status::IOError("Compaction interrupted");
+          break;
+        }
+        //合并按位置顺序读取整个文件，读完之后这个文件很快会被删除，不再需要它的页
+        if (db_options_.storage__advise_sequential_scans) {
+          file_pool_->Advise(file_resource, 0, file_resource.filesize, MADV_SEQUENTIAL);
+          file_pool_->Advise(file_resource, 0, file_resource.filesize, MADV_WILLNEED);
+        }
+        s = CompactFile(read_options, file_resource, fileids_compaction, dfm_compaction, relocations);
+        if (db_options_.storage__advise_dontneed_after_compaction) {
+          file_pool_->Advise(file_resource, 0, file_resource.filesize, MADV_DONTNEED);
+        }
+        if (db_options_.storage__advise_sequential_scans) {
+          file_pool_->Advise(file_resource, 0, file_resource.filesize, file_pool_->GetAdvice());
+        }
+        if (!s.IsOK()) break;
+        if (dfm_compaction.GetSequenceFileId() > fileid_end) {
+          s = Status::IOError("Compaction ran out of reserved fileids");
+          break;
+        }
+      }
+      dfm_compaction.Close();
+
+      std::vector<uint32_t> fileids_out = dfm_compaction.file_resource_manager.GetFileIds();
+      if (s.IsOK()) {
+        //输出文件落盘后 去掉前缀 成为正式的数据文件
+        for (auto fileid: fileids_out) {
+          std::string filepath_compaction = dfm_compaction.GetFilepath(fileid);
+          int fd = open(filepath_compaction.c_str(), O_RDONLY);
+          if (fd < 0 || FileUtil::sync_file(fd) < 0 || rename(filepath_compaction.c_str(), date_file_manager_.GetFilepath(fileid).c_str()) < 0) {
+            s = Status::IOError("Could not install compacted file", strerror(errno));
+          }
+          if (fd >= 0) close(fd);
+          if (!s.IsOK()) break;
+          frm.SetFileCompacted(fileid);
+          frm.SetFileSize(fileid, dfm_compaction.file_resource_manager.GetFileSize(fileid));
+          frm.SetFileTimestamp(fileid, timestamp_max);
+        }
+      }
+
+      //输出文件全部就位后，在 manifest 中一次性替换输入文件
+      if (s.IsOK()) {
+        std::vector<ManifestFile> files_added;
+        for (auto fileid: fileids_out) {
+          ManifestFile file;
+          file.fileid = fileid;
+          file.flags = ManifestFile::kFlagClosed | ManifestFile::kFlagCompacted;
+          file.timestamp = timestamp_max;
+          file.filesize = frm.GetFileSize(fileid);
+          files_added.push_back(file);
+        }
+        std::vector<uint32_t> fileids_removed(fileids_compaction.begin(), fileids_compaction.end());
+        s = date_file_manager_.manifest.Compaction(fileid_end - num_fileids + 1, files_added, fileids_removed);
+      }
+
+      for (auto& file_resource: files) {
+        file_pool_->ReleaseFile(file_resource);
+      }
+
+      if (!s.IsOK()) {
+        for (auto fileid: fileids_out) {
+          file_pool_->Drop(fileid);
+          std::remove(dfm_compaction.GetFilepath(fileid).c_str());
+          std::remove(date_file_manager_.GetFilepath(fileid).c_str());
+          frm.ClearAllDataForFileId(fileid);
+        }
+        return s;
+      }
+
+      //更新索引：先迁移和删除旧版本，最后删除墓碑，读者不会看到被删除的 key 又重新出现
+      std::stable_partition(relocations.begin(), relocations.end(),
+                            [](const std::tuple<uint64_t, uint64_t, uint64_t>& r) { return std::get<2>(r) != 0; });
+      int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
+      int counter_iterations = 0;
+      for (auto& relocation: relocations) {
+        if (counter_iterations == 0) AcquireWriteLock();
+        ++counter_iterations;
+        auto range = index_.equal_range(std::get<0>(relocation));
+        for (auto it = range.first; it != range.second; ++it) {
+          if (it->second != std::get<1>(relocation)) continue;
+          if (std::get<2>(relocation) != 0) {
+            it->second = std::get<2>(relocation);
+          } else {
+            index_.erase(it);
+          }
+          break;
+        }
+        if (counter_iterations >= num_iterations_per_lock) {
+          ReleaseWriteLock();
+          counter_iterations = 0;
+        }
+      }
+      if (counter_iterations) ReleaseWriteLock();
+
+      for (auto fileid: fileids_compaction) {
+        file_pool_->Drop(fileid);
+        if (std::remove(date_file_manager_.GetFilepath(fileid).c_str()) != 0) {
+          CDB_LOG_EMERG("StorageEngine::Compaction()", "Could not remove data file [%s]", date_file_manager_.GetFilepath(fileid).c_str());
+        }
+        frm.ClearAllDataForFileId(fileid);
+      }
+
+      CDB_LOG_TRACE("StorageEngine::Compaction()", "compacted %d files into %d files, %d entries processed",
+                 fileids_compaction.size(), fileids_out.size(), relocations.size());
+      RecordTick(db_options_.statistics.get(), kCompactions);
+      return Status::OK();
+    }
+
+    //fileids 中的有效墓碑如果在 fileids 之外还有更早的版本，把这些版本所在的已关闭文件追加到 fileids，
+    //追加的文件同样检查。否则墓碑只能写入新的已合并文件，而已合并文件不会再被选中，
+    //墓碑和被它覆盖的旧版本都永远不会被清除
+    void AddFilesShadowedByTombstones(const std::unordered_set<uint32_t>& fileids_closed,
+                                      std::vector<uint32_t>& fileids) {
+      FileResourceManager& frm = date_file_manager_.file_resource_manager;
+      ReadOptions read_options;
+      std::unordered_set<uint32_t> fileids_compaction(fileids.begin(), fileids.end());
+      int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
+      for (size_t i = 0; i < fileids.size(); ++i) {
+        if (stop_background_) return;
+        uint32_t fileid = fileids[i];
+        std::string filepath = date_file_manager_.GetFilepath(fileid);
+        FileResource file_resource;
+        Status s = file_pool_->GetFile(fileid, filepath, frm.GetFileSize(fileid), &file_resource);
+        if (!s.IsOK()) continue;
+        std::vector< std::pair<uint64_t, uint64_t> > hints;
+        s = DateFileManager::LoadFile(file_resource.mmap, file_resource.filesize, filepath, fileid, hints);
+        if (!s.IsOK()) {
+          hints.clear();
+          s = DateFileManager::RecoverFile(db_options_, filepath, fileid, true, hints, nullptr);
+        }
+        if (!s.IsOK()) {
+          file_pool_->ReleaseFile(file_resource);
+          continue;
+        }
+
+        uint32_t format_flags = DataFileHeader::GetFormatFlags(file_resource.mmap);
+        std::vector<uint32_t> fileids_older;
+        int counter_iterations = 0;
+        for (auto& hint: hints) {
+          uint32_t offset_in_file = hint.second & 0x00000000FFFFFFFF;
+          struct EntryHeader entry_header;
+          uint32_t size_header;
+          s = EntryHeader::DecodeFrom(db_options_, read_options, file_resource.mmap + offset_in_file,
+                                      file_resource.filesize - offset_in_file, &entry_header, &size_header, format_flags);
+          if (!s.IsOK() || !entry_header.IsTypeDelete()) continue;
+          std::string key(file_resource.mmap + offset_in_file + size_header, entry_header.size_key);
+
+          if (counter_iterations == 0) AcquireReadLock();
+          ++counter_iterations;
+          bool has_older_outside = false;
+          IsLatestEntry(read_options, hint.first, key, hint.second, fileids_compaction, &has_older_outside, &fileids_older);
+          if (counter_iterations >= num_iterations_per_lock) {
+            ReleaseReadLock();
+            counter_iterations = 0;
+          }
+        }
+        if (counter_iterations) ReleaseReadLock();
+        file_pool_->ReleaseFile(file_resource);
+
+        for (auto fileid_older: fileids_older) {
+          if (   fileids_closed.find(fileid_older) == fileids_closed.end()
+              || fileids_compaction.find(fileid_older) != fileids_compaction.end()) continue;
+          CDB_LOG_TRACE("StorageEngine::AddFilesShadowedByTombstones()", "add file [%u] shadowed by [%u]", fileid_older, fileid);
+          fileids_compaction.insert(fileid_older);
+          fileids.push_back(fileid_older);
+        }
+      }
+    }
+
+    //将一个文件中仍然有效的 Entry 写入合并文件，并记录每个 Entry 的新位置
+    Status CompactFile(ReadOptions& read_options,
+                       FileResource& file_resource,
+                       const std::unordered_set<uint32_t>& fileids_compaction,
+                       DateFileManager& dfm_compaction,
+                       std::vector< std::tuple<uint64_t, uint64_t, uint64_t> >& relocations) {
+      std::string filepath = date_file_manager_.GetFilepath(file_resource.fileid);
+      std::vector< std::pair<uint64_t, uint64_t> > hints;
+      Status s = DateFileManager::LoadFile(file_resource.mmap, file_resource.filesize, filepath,
+                                           file_resource.fileid, hints);
+      if (!s.IsOK()) {
+        //没有校验和的旧文件恢复时没有重建 footer，重新扫描其中的 Entry
+        hints.clear();
+        s = DateFileManager::RecoverFile(db_options_, filepath, file_resource.fileid, true, hints, nullptr);
+      }
+      if (!s.IsOK()) return s;
+
+      //按文件中的位置排序，保持写入的先后顺序
+      std::sort(hints.begin(), hints.end(),
+                [](const std::pair<uint64_t, uint64_t>& a, const std::pair<uint64_t, uint64_t>& b) { return a.second < b.second; });
+
+      uint32_t format_flags = DataFileHeader::GetFormatFlags(file_resource.mmap);
+      std::vector<Entry> entrys;
+      std::vector<uint64_t> hashed_keys;
+      std::vector<uint64_t> locations;
+      int num_iterations_per_lock = db_options_.internal__num_iterations_per_lock;
+      int counter_iterations = 0;
+      for (auto& hint: hints) {
+        uint32_t offset_in_file = hint.second & 0x00000000FFFFFFFF;
+        struct EntryHeader entry_header;
+        uint32_t size_header;
+        s = EntryHeader::DecodeFrom(db_options_, read_options, file_resource.mmap + offset_in_file,
+                                    file_resource.filesize - offset_in_file, &entry_header, &size_header, format_flags);
+        if (!s.IsOK()) return s;
+        std::string key(file_resource.mmap + offset_in_file + size_header, entry_header.size_key);
+
+        if (counter_iterations == 0) AcquireReadLock();
+        ++counter_iterations;
+        bool has_older_outside = false;
+        bool is_live = IsLatestEntry(read_options, hint.first, key, hint.second, fileids_compaction, &has_older_outside);
+        if (counter_iterations >= num_iterations_per_lock) {
+          ReleaseReadLock();
+          counter_iterations = 0;
+        }
+
+        if (!is_live || (entry_header.IsTypeDelete() && !has_older_outside)) {
+          relocations.push_back(std::make_tuple(hint.first, hint.second, 0));
+          continue;
+        }
+
+        Entry entry;
+        entry.op_type = entry_header.IsTypeDelete() ? EntryType::Delete : EntryType::Put_Or_Get;
+        entry.key = key;
+        entry.hashed_key = hint.first;
+        entry.value.assign(file_resource.mmap + offset_in_file + size_header + entry_header.size_key, entry_header.size_value);
+        entry.crc32 = entry_header.crc32;
+        entrys.push_back(entry);
+        hashed_keys.push_back(hint.first);
+        locations.push_back(hint.second);
+      }
+      if (counter_iterations) ReleaseReadLock();
+
+      if (entrys.empty()) return Status::OK();
+      std::multimap<uint64_t, uint64_t> indexs;
+      std::vector<uint64_t> locations_new;
+      dfm_compaction.WriteEntrys(entrys, indexs, &locations_new);
+      for (size_t i = 0; i < locations.size(); ++i) {
+        relocations.push_back(std::make_tuple(hashed_keys[i], locations[i], locations_new[i]));
+      }
+      return Status::OK();
+    }
+
+    //location 处的 Entry 是否为该 key 在索引中的最新版本，
+    //has_older_outside 回传在参与合并的文件之外是否还存在该 key 更早的版本，
+    //fileids_older_out 不为空时追加所有这些版本所在的文件
+    //不在索引中的 Entry 保守地视为有效
+    bool IsLatestEntry(ReadOptions& read_options,
+                       uint64_t hashed_key,
+                       const std::string& key,
+                       uint64_t location,
+                       const std::unordered_set<uint32_t>& fileids_compaction,
+                       bool *has_older_outside,
+                       std::vector<uint32_t>* fileids_older_out=nullptr) {
+      *has_older_outside = false;
+      auto range = index_.equal_range(hashed_key);
+      if (range.first == range.second) return true;
+
+      bool found_latest = false;
+      auto cur = range.second;
+      do {
+        --cur;
+        std::string key_cmp;
+        Status s = GetEntry(read_options, cur->second, &key_cmp, nullptr);
+        if ((!s.IsOK() && !s.IsRemoveEntry()) || key_cmp != key) continue;
+        if (!found_latest) {
+          if (cur->second != location) return false;
+          found_latest = true;
+          continue;
+        }
+        uint32_t fileid = (cur->second & 0xFFFFFFFF00000000) >> 32;
+        if (fileids_compaction.find(fileid) == fileids_compaction.end()) {
+          *has_older_outside = true;
+          if (fileids_older_out == nullptr) return true;
+          fileids_older_out->push_back(fileid);
+        }
+      } while (cur != range.first);
+      return true;
+    }
+
 
 
 
@@ -286,11 +946,32 @@ class StorageEngine{
     //事件循环线程
     std::thread thread_data_;
     std::thread thread_index_;
+    std::thread thread_background_;
+
+    std::mutex mutex_flush_;
+    std::mutex mutex_background_;
+    std::condition_variable cond_background_;
+    //Close() 在 mutex_background_ 中设置，合并和延迟加载不加锁读取
+    std::atomic<bool> stop_background_;
+    bool is_loaded_;
+    //延迟加载：尚未进入索引的文件(按时间排序)，以及读取时缓存的 HintData
+    std::atomic<bool> is_loading_;
+    std::mutex mutex_pending_;
+    std::vector<uint32_t> fileids_pending_;
+    struct PendingHints {
+      std::mutex mutex;       //读取 HintData 期间持有
+      bool is_loaded = false;
+      std::vector< std::pair<uint64_t, uint64_t> > hints;
+    };
+    std::map<uint32_t, std::shared_ptr<PendingHints> > hints_pending_;
+    std::set<uint32_t> fileids_checkpoint_;
+    uint32_t fileid_last_checkpoint_;
+    size_t num_files_checkpoint_;
 
     //读写锁
     //to-do : 实现读写锁类
-    std::mutex mutex_read_;
-    std::mutex mutex_write_;
+    InstrumentedMutex mutex_read_{"StorageEngine::mutex_read_"};
+    InstrumentedMutex mutex_write_{"StorageEngine::mutex_write_"};
     int num_readers_;
     std::condition_variable cond_read_complete_;//读线程 全部结束
     std::mutex mutex_compaction_;
@@ -305,7 +986,7 @@ class StorageEngine{
     void AcquireWriteLock() {
       mutex_write_.lock();
       while(true) {
-        std::unique_lock<std::mutex> lock_read(mutex_read_);
+        std::unique_lock<std::mutex> lock_read(mutex_read_.native());
         if (num_readers_ == 0) break;
         cond_read_complete_.wait(lock_read);
       }
@@ -315,6 +996,21 @@ class StorageEngine{
         mutex_write_.unlock();
     }
 
+    void AcquireReadLock() {
+      mutex_write_.lock();
+      mutex_read_.lock();
+      num_readers_ += 1;
+      mutex_read_.unlock();
+      mutex_write_.unlock();
+    }
+
+    void ReleaseReadLock() {
+      mutex_read_.lock();
+      num_readers_ -= 1;
+      mutex_read_.unlock();
+      cond_read_complete_.notify_one();
+    }
+
 
     bool is_closed_;
     std::mutex mutex_close_;
@@ -0,0 +1,121 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : async_logger_test.cc
+ * Description   : 异步日志的测试：多个线程同时写日志，包括很快退出的线程(缓冲区在写空后释放)，
+ *                 以及一个线程连续写入使缓冲区溢出。Flush() 之后写出和丢弃的条数之和等于调用次数，
+ *                 Flush() 之前的消息都已经写出。日志重定向到文件，按行统计
+ * *******************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <fstream>
+
+#include "test/test_util.h"
+#include "util/async_logger.h"
+#include "util/logger.h"
+
+namespace {
+
+const char* kLogFilepath = "/tmp/cdb_async_logger_test.log";
+const char* kLogname = "AsyncLoggerTest";
+const int kNumThreads = 4;
+const int kNumMessagesPerThread = 2000;
+const int kNumShortThreads = 50;
+const int kNumMessagesPerShortThread = 10;
+//远超一个线程的缓冲区大小，后台线程来不及写出
+const int kNumMessagesBurst = 100000;
+
+//回传日志文件中包含 pattern 的行数
+int CountLines(const char* pattern) {
+  std::ifstream in(kLogFilepath);
+  std::string line;
+  int num_lines = 0;
+  while (std::getline(in, line)) {
+    if (line.find(pattern) != std::string::npos) num_lines++;
+  }
+  return num_lines;
+}
+
+}  // namespace
+
+int main() {
+  cdb::test::Checker checker;
+  cdb::AsyncLogger& logger = cdb::AsyncLogger::Instance();
+  cdb::Logger::set_current_level("info");
+
+  //日志写到文件，结束后恢复 stderr 输出检查结果
+  fflush(stderr);
+  int fd_stderr = dup(fileno(stderr));
+  checker.Check(freopen(kLogFilepath, "w", stderr) != nullptr, "redirect stderr");
+
+  cdb::Logger::set_async(true);
+  uint64_t num_calls = 0;
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.push_back(std::thread([t]() {
+      for (int i = 0; i < kNumMessagesPerThread; i++) {
+        CDB_LOG_INFO(kLogname, "worker %d message %d", t, i);
+        if (i % 100 == 99) usleep(1000);
+      }
+    }));
+  }
+  for (int t = 0; t < kNumShortThreads; t++) {
+    std::thread thread_short([t]() {
+      for (int i = 0; i < kNumMessagesPerShortThread; i++) {
+        CDB_LOG_INFO(kLogname, "short %d message %d", t, i);
+      }
+    });
+    thread_short.join();
+  }
+  for (auto& thread: threads) thread.join();
+  num_calls += kNumThreads * kNumMessagesPerThread + kNumShortThreads * kNumMessagesPerShortThread;
+
+  //一个很快退出的线程连续写入，缓冲区溢出后丢弃，之后释放这个缓冲区时要保留丢弃的条数
+  std::thread thread_burst([]() {
+    for (int i = 0; i < kNumMessagesBurst; i++) {
+      CDB_LOG_INFO(kLogname, "burst message %d", i);
+    }
+  });
+  thread_burst.join();
+  num_calls += kNumMessagesBurst;
+
+  CDB_LOG_INFO(kLogname, "last message before flush");
+  num_calls++;
+  logger.Flush();
+  fflush(stderr);
+
+  uint64_t num_written = logger.GetNumWritten();
+  uint64_t num_dropped = logger.GetNumDropped();
+  int num_lines_message = CountLines(kLogname);
+  int num_lines_last = CountLines("last message before flush");
+  //等待一段时间，释放缓冲区之后计数不变
+  usleep(100 * 1000);
+  logger.Flush();
+  uint64_t num_written_later = logger.GetNumWritten();
+  uint64_t num_dropped_later = logger.GetNumDropped();
+  cdb::Logger::set_async(false);
+
+  fflush(stderr);
+  dup2(fd_stderr, fileno(stderr));
+  close(fd_stderr);
+
+  checker.Check(num_written + num_dropped == num_calls, "written %llu + dropped %llu, expected %llu",
+                (unsigned long long)num_written, (unsigned long long)num_dropped, (unsigned long long)num_calls);
+  checker.Check(num_dropped > 0, "burst did not overflow the ring");
+  checker.Check(num_lines_message == (int)num_written, "lines in log %d, written %llu",
+                num_lines_message, (unsigned long long)num_written);
+  checker.Check(num_lines_last == 1, "message before flush not written");
+  checker.Check(num_written_later == num_written && num_dropped_later == num_dropped,
+                "counts changed after rings were released: written %llu, dropped %llu",
+                (unsigned long long)num_written_later, (unsigned long long)num_dropped_later);
+
+  remove(kLogFilepath);
+  return checker.Report("async_logger_test");
+}
@@ -0,0 +1,121 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : checkpoint_test.cc
+ * Description   : 索引快照的测试：
+ *                 1. 关闭时保存的快照覆盖所有文件，重新打开时不加载任何文件的 HintData
+ *                 2. 写入期间定期保存的快照(分批拷贝索引)，重新打开后内容正确
+ *                 3. 合并之后恢复旧的快照，快照失效，完整加载后内容正确
+ * *******************************************************/
+#include <stdio.h>
+#include <string>
+#include <map>
+
+#include "test/test_util.h"
+#include "db/cuckoodb.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+using cdb::test::MakeKey;
+using cdb::test::MakeValue;
+using cdb::test::WaitForProperty;
+using cdb::test::Verify;
+using cdb::test::CopyFile;
+
+namespace {
+
+const char* kDBName = "/tmp/cdb_checkpoint_test";
+const int kNumKeys = 4000;
+
+std::string CheckpointFilepath() {
+  return std::string(kDBName) + "/checkpoint";
+}
+
+cdb::Options CheckpointOptions() {
+  cdb::Options options = cdb::test::SmallFileOptions();
+  options.compaction__size_threshold = 1ULL << 40;
+  return options;
+}
+
+}  // namespace
+
+int main() {
+  cdb::Logger::set_current_level("emerg");
+  cdb::test::Checker checker;
+  cdb::test::DestroyDB(kDBName);
+  cdb::WriteOptions write_options;
+  std::map<std::string, std::string> ref;
+  std::map<std::string, std::string> keys_deleted;
+
+  //写入期间每 20 毫秒保存一次快照
+  {
+    cdb::Options options = CheckpointOptions();
+    options.checkpoint__interval = 20;
+    options.compaction__check_interval = 20;
+    cdb::CuckooDB db(options, kDBName);
+    checker.Check(db.Open().IsOK(), "open");
+    for (int i = 0; i < kNumKeys; i++) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 0));
+      ref[MakeKey(i)] = MakeValue(i, 0);
+      if (i % 1000 == 999) usleep(50 * 1000);
+    }
+    for (int i = 0; i < kNumKeys; i += 3) {
+      db.Delete(write_options, MakeKey(i));
+      ref.erase(MakeKey(i));
+      keys_deleted[MakeKey(i)] = "";
+    }
+    checker.Check(WaitForProperty(db, "cdb.checkpoints", 1), "no periodic checkpoint");
+  }
+
+  //关闭时保存的快照覆盖所有文件
+  {
+    cdb::CuckooDB db(CheckpointOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "reopen");
+    checker.Check(db.GetLoadTiming().num_files_loaded == 0,
+                  "files loaded with a full checkpoint: %llu", (unsigned long long)db.GetLoadTiming().num_files_loaded);
+    checker.Check(Verify(db, ref, keys_deleted) == 0, "content with checkpoint");
+  }
+
+  //不使用快照时内容相同
+  {
+    cdb::Options options = CheckpointOptions();
+    options.checkpoint__interval = 0;
+    remove(CheckpointFilepath().c_str());
+    cdb::CuckooDB db(options, kDBName);
+    checker.Check(db.Open().IsOK(), "reopen without checkpoint");
+    checker.Check(db.GetLoadTiming().num_files_loaded > 0, "no files loaded without checkpoint");
+    checker.Check(Verify(db, ref, keys_deleted) == 0, "content without checkpoint");
+  }
+
+  //合并之后恢复旧的快照
+  {
+    cdb::CuckooDB db(CheckpointOptions(), kDBName);
+    db.Open();
+  }
+  std::string checkpoint_old = std::string(kDBName) + ".checkpoint";
+  checker.Check(CopyFile(CheckpointFilepath(), checkpoint_old), "copy checkpoint");
+  {
+    cdb::Options options = CheckpointOptions();
+    options.compaction__check_interval = 100;
+    options.compaction__size_threshold = 1;
+    cdb::CuckooDB db(options, kDBName);
+    db.Open();
+    for (int i = 0; i < kNumKeys; i += 5) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 1));
+      ref[MakeKey(i)] = MakeValue(i, 1);
+    }
+    checker.Check(WaitForProperty(db, "cdb.compactions", 1), "compaction did not run");
+  }
+  checker.Check(CopyFile(checkpoint_old, CheckpointFilepath()), "restore checkpoint");
+  {
+    cdb::CuckooDB db(CheckpointOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "reopen with stale checkpoint");
+    checker.Check(Verify(db, ref, keys_deleted) == 0, "content with stale checkpoint");
+  }
+
+  remove(checkpoint_old.c_str());
+  cdb::test::DestroyDB(kDBName);
+  return checker.Report("checkpoint_test");
+}
@@ -0,0 +1,167 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : coding_test.cc
+ * Description   : 批量 varint 解码的测试：CPU 支持的每种实现都与逐字节解码的结果比较，
+ *                 包括 9、10 字节的 varint64，最高字节溢出的 5 字节 varint32，在 limit 附近
+ *                 每个长度处截断的输入，以及连续的延续字节等错误输入。
+ *                 输入拷贝到长度正好的堆内存中，越界读取可以被 AddressSanitizer 发现
+ * *******************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <random>
+
+#include "test/test_util.h"
+#include "util/coding.h"
+
+namespace {
+
+const cdb::VarintDecoder kDecoders[] = { cdb::kVarintDecoderSWAR, cdb::kVarintDecoderBMI2 };
+const char* kDecoderNames[] = { "scalar", "swar", "bmi2" };
+
+const char* DecodeWith(cdb::VarintDecoder decoder, const char* p, const char* limit, uint32_t* values, size_t n) {
+  return cdb::GetVarint32ArrayWith(decoder, p, limit, values, n);
+}
+
+const char* DecodeWith(cdb::VarintDecoder decoder, const char* p, const char* limit, uint64_t* values, size_t n) {
+  return cdb::GetVarint64ArrayWith(decoder, p, limit, values, n);
+}
+
+//data 的前 size 个字节中解码 n 个值，每种实现回传的位置和值都必须与逐字节解码相同
+template <typename T>
+void Compare(const std::string& data, size_t size, size_t n, const char* what, cdb::test::Checker* checker) {
+  std::vector<char> input(data.begin(), data.begin() + size);
+  //size 为 0 时 vector 可能没有分配内存，解码不应读取任何字节
+  const char* p = input.empty() ? nullptr : input.data();
+  const char* limit = p + size;
+  std::vector<T> values_expected(n);
+  const char* end_expected = DecodeWith(cdb::kVarintDecoderScalar, p, limit, values_expected.data(), n);
+  for (auto decoder: kDecoders) {
+    if (!cdb::IsVarintDecoderSupported(decoder)) continue;
+    std::vector<T> values(n);
+    const char* end = DecodeWith(decoder, p, limit, values.data(), n);
+    checker->Check(end == end_expected, "%s %s: size %zu, n %zu, end %td, expected %td",
+                   kDecoderNames[decoder], what, size, n,
+                   end == nullptr ? -1 : end - p, end_expected == nullptr ? -1 : end_expected - p);
+    if (end == nullptr || end != end_expected) continue;
+    for (size_t i = 0; i < n; ++i) {
+      if (values[i] == values_expected[i]) continue;
+      checker->Check(false, "%s %s: size %zu, value %zu is %llu, expected %llu", kDecoderNames[decoder], what,
+                     size, i, (unsigned long long)values[i], (unsigned long long)values_expected[i]);
+      break;
+    }
+  }
+}
+
+//完整输入，以及在 limit 附近每个长度处截断的输入
+template <typename T>
+void CompareTruncated(const std::string& data, size_t n, const char* what, cdb::test::Checker* checker) {
+  size_t size_min = data.size() > 32 ? data.size() - 32 : 0;
+  for (size_t size = size_min; size <= data.size(); ++size) {
+    Compare<T>(data, size, n, what, checker);
+  }
+}
+
+//每种长度的边界值：2^(7k)-1 和 2^(7k)，以及全 1
+std::vector<uint64_t> BoundaryValues(int num_bits) {
+  std::vector<uint64_t> values = { 0, 1 };
+  for (int bits = 7; bits < num_bits; bits += 7) {
+    values.push_back((1ULL << bits) - 1);
+    values.push_back(1ULL << bits);
+  }
+  values.push_back(num_bits == 64 ? ~0ULL : (1ULL << num_bits) - 1);
+  return values;
+}
+
+void TestBoundaryValues(cdb::test::Checker* checker) {
+  std::string data64;
+  std::vector<uint64_t> values64 = BoundaryValues(64);
+  for (auto v: values64) cdb::PutVarint64(&data64, v);
+  std::vector<uint64_t> decoded64(values64.size());
+  const char* end = cdb::GetVarint64Array(data64.data(), data64.data() + data64.size(), decoded64.data(), values64.size());
+  checker->Check(end == data64.data() + data64.size() && decoded64 == values64, "varint64 boundary values");
+  CompareTruncated<uint64_t>(data64, values64.size(), "varint64 boundaries", checker);
+
+  std::string data32;
+  std::vector<uint64_t> values32 = BoundaryValues(32);
+  for (auto v: values32) cdb::PutVarint32(&data32, v);
+  CompareTruncated<uint32_t>(data32, values32.size(), "varint32 boundaries", checker);
+
+  //9 和 10 字节的 varint64 单独出现在输入末尾
+  for (uint64_t v: { 1ULL << 56, (1ULL << 63) - 1, 1ULL << 63, ~0ULL }) {
+    std::string data;
+    cdb::PutVarint64(&data, v);
+    CompareTruncated<uint64_t>(data, 1, "single long varint64", checker);
+  }
+}
+
+//5 字节 varint32 最高字节超过 4 位：逐字节解码截掉溢出的位，其他实现必须相同
+void TestVarint32Overflow(cdb::test::Checker* checker) {
+  for (int byte_last = 0x10; byte_last <= 0x7f; byte_last += 0x0f) {
+    std::string data;
+    for (int i = 0; i < 3; i++) cdb::PutVarint32(&data, 300 * i);
+    data.append("\xff\xff\xff\xff", 4);
+    data.push_back((char)byte_last);
+    for (int i = 0; i < 20; i++) cdb::PutVarint32(&data, 1u << i);
+    CompareTruncated<uint32_t>(data, 24, "varint32 overflow", checker);
+    CompareTruncated<uint64_t>(data, 24, "varint32 overflow as varint64", checker);
+  }
+}
+
+//连续的延续字节：varint32 超过 5 字节、varint64 超过 10 字节时为错误
+void TestContinuationRuns(cdb::test::Checker* checker) {
+  for (size_t length_run = 1; length_run <= 20; ++length_run) {
+    for (bool has_stop: { false, true }) {
+      std::string data;
+      cdb::PutVarint64(&data, 12345);
+      data.append(length_run, (char)0x80);
+      if (has_stop) data.push_back(0x01);
+      for (int i = 0; i < 30; i++) cdb::PutVarint64(&data, 1ULL << (2 * i));
+      CompareTruncated<uint32_t>(data, 32, "continuation run (varint32)", checker);
+      CompareTruncated<uint64_t>(data, 32, "continuation run (varint64)", checker);
+    }
+  }
+}
+
+//随机长度的值以及随机字节：覆盖 SSE2 窗口内外的各种边界
+void TestRandom(cdb::test::Checker* checker) {
+  std::mt19937_64 rng(301);
+  for (int round = 0; round < 300; ++round) {
+    std::string data;
+    size_t n = 1 + rng() % 64;
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t v = rng() >> (rng() % 64);
+      cdb::PutVarint64(&data, v);
+    }
+    CompareTruncated<uint64_t>(data, n, "random varint64", checker);
+    CompareTruncated<uint32_t>(data, n, "random as varint32", checker);
+
+    std::string bytes;
+    size_t size = 1 + rng() % 48;
+    for (size_t i = 0; i < size; ++i) {
+      //大多数字节带延续位，更容易出现长的和错误的 varint
+      uint8_t byte = rng() & 0xff;
+      if (rng() % 4 != 0) byte |= 0x80;
+      bytes.push_back((char)byte);
+    }
+    for (size_t count = 1; count <= 8; ++count) {
+      Compare<uint32_t>(bytes, bytes.size(), count, "random bytes (varint32)", checker);
+      Compare<uint64_t>(bytes, bytes.size(), count, "random bytes (varint64)", checker);
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  cdb::test::Checker checker;
+  TestBoundaryValues(&checker);
+  TestVarint32Overflow(&checker);
+  TestContinuationRuns(&checker);
+  TestRandom(&checker);
+  return checker.Report("coding_test");
+}
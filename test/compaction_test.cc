@@ -0,0 +1,126 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : compaction_test.cc
+ * Description   : 合并的测试：
+ *                 1. 覆盖写和删除之后合并，合并前后以及重新打开后内容不变
+ *                 2. 写入、合并、全部删除、再合并：墓碑和被它覆盖的旧版本都被清除，重新打开后仍然不存在
+ * *******************************************************/
+#include <stdio.h>
+#include <string>
+#include <map>
+
+#include "test/test_util.h"
+#include "db/cuckoodb.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+using cdb::test::MakeKey;
+using cdb::test::MakeValue;
+using cdb::test::GetIntProperty;
+using cdb::test::WaitForProperty;
+using cdb::test::Verify;
+
+namespace {
+
+const char* kDBName = "/tmp/cdb_compaction_test";
+
+cdb::Options CompactionOptions() {
+  cdb::Options options = cdb::test::SmallFileOptions();
+  options.compaction__check_interval = 100;
+  options.compaction__size_threshold = 1;
+  return options;
+}
+
+void TestReopenAfterCompaction(cdb::test::Checker* checker) {
+  cdb::test::DestroyDB(kDBName);
+  cdb::WriteOptions write_options;
+  std::map<std::string, std::string> ref;
+  std::map<std::string, std::string> keys_deleted;
+  {
+    cdb::CuckooDB db(CompactionOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "open");
+    for (int i = 0; i < 3000; i++) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 0));
+      ref[MakeKey(i)] = MakeValue(i, 0);
+    }
+    for (int i = 0; i < 3000; i += 2) {
+      db.Delete(write_options, MakeKey(i));
+      ref.erase(MakeKey(i));
+      keys_deleted[MakeKey(i)] = "";
+    }
+    for (int i = 1; i < 3000; i += 4) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 1));
+      ref[MakeKey(i)] = MakeValue(i, 1);
+    }
+    //从未写入过的 key 的墓碑
+    for (int i = 3000; i < 3200; i++) {
+      db.Delete(write_options, MakeKey(i));
+      keys_deleted[MakeKey(i)] = "";
+    }
+    checker->Check(WaitForProperty(db, "cdb.compactions", 1), "compaction did not run");
+    checker->Check(Verify(db, ref, keys_deleted) == 0, "content after compaction");
+  }
+  {
+    cdb::CuckooDB db(CompactionOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "reopen");
+    checker->Check(Verify(db, ref, keys_deleted) == 0, "content after reopen");
+  }
+}
+
+void TestTombstonesDropped(cdb::test::Checker* checker) {
+  cdb::test::DestroyDB(kDBName);
+  cdb::WriteOptions write_options;
+  const int num_keys = 3000;
+  std::map<std::string, std::string> keys_deleted;
+  for (int i = 0; i < num_keys; i++) keys_deleted[MakeKey(i)] = "";
+
+  //每个阶段结束时关闭数据库，正在写入的文件随之关闭，下次打开后可以参与合并
+  {
+    cdb::CuckooDB db(CompactionOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "open");
+    for (int i = 0; i < num_keys; i++) db.Put(write_options, MakeKey(i), MakeValue(i, 0));
+  }
+  {
+    cdb::CuckooDB db(CompactionOptions(), kDBName);
+    db.Open();
+    checker->Check(WaitForProperty(db, "cdb.compactions", 1), "first compaction did not run");
+    checker->Check(GetIntProperty(db, "cdb.num-entries-index") == num_keys,
+                   "entries after first compaction: %llu", (unsigned long long)GetIntProperty(db, "cdb.num-entries-index"));
+    for (int i = 0; i < num_keys; i++) db.Delete(write_options, MakeKey(i));
+  }
+  uint64_t size_with_tombstones = 0;
+  {
+    cdb::CuckooDB db(CompactionOptions(), kDBName);
+    db.Open();
+    size_with_tombstones = GetIntProperty(db, "cdb.db-size-total");
+    checker->Check(WaitForProperty(db, "cdb.compactions", 1), "second compaction did not run");
+    //墓碑所在的文件和旧版本所在的已合并文件一起合并，两者都被丢弃
+    checker->Check(GetIntProperty(db, "cdb.num-entries-index") == 0,
+                   "entries after second compaction: %llu", (unsigned long long)GetIntProperty(db, "cdb.num-entries-index"));
+    checker->Check(GetIntProperty(db, "cdb.db-size-total") < size_with_tombstones / 4,
+                   "size after second compaction: %llu, before: %llu",
+                   (unsigned long long)GetIntProperty(db, "cdb.db-size-total"), (unsigned long long)size_with_tombstones);
+    checker->Check(Verify(db, std::map<std::string, std::string>(), keys_deleted) == 0, "deleted keys after compaction");
+  }
+  {
+    cdb::CuckooDB db(CompactionOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "reopen");
+    checker->Check(GetIntProperty(db, "cdb.num-entries-index") == 0,
+                   "entries after reopen: %llu", (unsigned long long)GetIntProperty(db, "cdb.num-entries-index"));
+    checker->Check(Verify(db, std::map<std::string, std::string>(), keys_deleted) == 0, "deleted keys after reopen");
+  }
+}
+
+}  // namespace
+
+int main() {
+  cdb::Logger::set_current_level("emerg");
+  cdb::test::Checker checker;
+  TestReopenAfterCompaction(&checker);
+  TestTombstonesDropped(&checker);
+  cdb::test::DestroyDB(kDBName);
+  return checker.Report("compaction_test");
+}
@@ -0,0 +1,143 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : file_pool_test.cc
+ * Description   : FilePool 的测试：
+ *                 1. fileid 相差 4096 整数倍的文件同时保持映射，再次访问都命中
+ *                 2. 文件变大后替换同一个 fileid 的映射
+ *                 3. Drop() 之后已经拿到的文件仍然可读，再次访问重新映射
+ *                 4. 多个线程读取时另一个线程不断 Drop()
+ * *******************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include "test/test_util.h"
+#include "file/file_pool.h"
+#include "util/logger.h"
+#include "util/statistics.h"
+#include "util/status.h"
+
+namespace {
+
+const char* kDirName = "/tmp/cdb_file_pool_test";
+const uint32_t kNumFiles = 16;
+const uint32_t kStrideFileId = 4096;
+const uint64_t kSizeFile = 4096;
+
+std::string GetPath(uint32_t fileid) {
+  return std::string(kDirName) + "/" + std::to_string(fileid);
+}
+
+//文件内容为重复的 fileid 低 8 位，读取时可以校验拿到的是哪个文件
+bool CreateFile(uint32_t fileid, uint64_t size) {
+  std::string data(size, (char)(fileid & 0xff));
+  int fd = open(GetPath(fileid).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return false;
+  bool is_written = write(fd, data.data(), data.size()) == (ssize_t)data.size();
+  close(fd);
+  return is_written;
+}
+
+//读取整个文件并校验内容
+bool ReadAndCheck(cdb::FilePool* pool, uint32_t fileid, uint64_t filesize) {
+  cdb::FileResource file;
+  if (!pool->GetFile(fileid, GetPath(fileid), filesize, &file).IsOK()) return false;
+  bool is_valid = file.fileid == fileid && file.filesize == filesize;
+  for (uint64_t i = 0; i < filesize && is_valid; i += 512) {
+    is_valid = file.mmap[i] == (char)(fileid & 0xff);
+  }
+  pool->ReleaseFile(file);
+  return is_valid;
+}
+
+void TestStrideFileIds(cdb::test::Checker* checker) {
+  cdb::Statistics statistics;
+  cdb::FilePool pool(MADV_NORMAL, &statistics);
+  for (int round = 0; round < 3; round++) {
+    for (uint32_t i = 0; i < kNumFiles; i++) {
+      checker->Check(ReadAndCheck(&pool, i * kStrideFileId + 1, kSizeFile), "read file %u", i * kStrideFileId + 1);
+    }
+  }
+  checker->Check(pool.NumFiles() == (int)kNumFiles, "files mapped: %d", pool.NumFiles());
+  checker->Check(statistics.Get(cdb::kFilePoolMisses) == kNumFiles,
+                 "misses: %llu", (unsigned long long)statistics.Get(cdb::kFilePoolMisses));
+  checker->Check(statistics.Get(cdb::kFilePoolEvictions) == 0,
+                 "evictions: %llu", (unsigned long long)statistics.Get(cdb::kFilePoolEvictions));
+}
+
+void TestGrowingFile(cdb::test::Checker* checker) {
+  cdb::FilePool pool;
+  checker->Check(CreateFile(1, kSizeFile), "create file");
+  checker->Check(ReadAndCheck(&pool, 1, kSizeFile), "read file");
+  checker->Check(CreateFile(1, 4 * kSizeFile), "grow file");
+  checker->Check(ReadAndCheck(&pool, 1, 4 * kSizeFile), "read grown file");
+  checker->Check(pool.NumFiles() == 1, "files mapped after growing: %d", pool.NumFiles());
+}
+
+void TestDrop(cdb::test::Checker* checker) {
+  cdb::Statistics statistics;
+  cdb::FilePool pool(MADV_NORMAL, &statistics);
+  checker->Check(CreateFile(1, kSizeFile), "create file");
+  cdb::FileResource file;
+  checker->Check(pool.GetFile(1, GetPath(1), kSizeFile, &file).IsOK(), "get file");
+  pool.Drop(1);
+  pool.Drop(2);
+  checker->Check(pool.NumFiles() == 0, "files mapped after drop: %d", pool.NumFiles());
+  remove(GetPath(1).c_str());
+  checker->Check(file.mmap[kSizeFile - 1] == 1, "file unreadable after drop");
+  pool.ReleaseFile(file);
+
+  checker->Check(CreateFile(1, kSizeFile), "create file again");
+  checker->Check(ReadAndCheck(&pool, 1, kSizeFile), "read file after drop");
+  checker->Check(statistics.Get(cdb::kFilePoolMisses) == 2,
+                 "misses after drop: %llu", (unsigned long long)statistics.Get(cdb::kFilePoolMisses));
+}
+
+void TestConcurrentDrop(cdb::test::Checker* checker) {
+  cdb::FilePool pool;
+  std::atomic<bool> is_stopped(false);
+  std::atomic<int> num_bad(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.push_back(std::thread([&pool, &is_stopped, &num_bad, t]() {
+      for (uint32_t i = 0; !is_stopped.load(); i++) {
+        uint32_t fileid = ((i + t) % kNumFiles) * kStrideFileId + 1;
+        if (!ReadAndCheck(&pool, fileid, kSizeFile)) num_bad++;
+      }
+    }));
+  }
+  for (int i = 0; i < 20000; i++) {
+    pool.Drop((i % kNumFiles) * kStrideFileId + 1);
+  }
+  is_stopped = true;
+  for (auto& reader: readers) reader.join();
+  checker->Check(num_bad == 0, "bad reads with concurrent drops: %d", num_bad.load());
+}
+
+}  // namespace
+
+int main() {
+  cdb::Logger::set_current_level("emerg");
+  cdb::test::Checker checker;
+  cdb::test::DestroyDB(kDirName);
+  mkdir(kDirName, 0755);
+  for (uint32_t i = 0; i < kNumFiles; i++) {
+    checker.Check(CreateFile(i * kStrideFileId + 1, kSizeFile), "create file %u", i * kStrideFileId + 1);
+  }
+
+  TestStrideFileIds(&checker);
+  TestConcurrentDrop(&checker);
+  TestGrowingFile(&checker);
+  TestDrop(&checker);
+
+  cdb::test::DestroyDB(kDirName);
+  return checker.Report("file_pool_test");
+}
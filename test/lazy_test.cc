@@ -0,0 +1,119 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : lazy_test.cc
+ * Description   : 延迟加载的测试：快照覆盖第一批写入，之后的覆盖写和删除不在快照中。
+ *                 延迟打开后立即由多个线程读取，加载期间写入，加载完成后、重新打开后以及
+ *                 加载过程中关闭之后内容都正确
+ * *******************************************************/
+#include <stdio.h>
+#include <string>
+#include <map>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+#include "test/test_util.h"
+#include "db/cuckoodb.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+using cdb::test::MakeKey;
+using cdb::test::MakeValue;
+using cdb::test::Verify;
+
+namespace {
+
+const char* kDBName = "/tmp/cdb_lazy_test";
+const int kNumKeys = 6000;
+const int kNumReaders = 4;
+
+cdb::Options LazyOptions() {
+  cdb::Options options = cdb::test::SmallFileOptions();
+  options.compaction__size_threshold = 1ULL << 40;
+  options.internal__lazy_load = true;
+  //每插入一个条目就释放一次锁，读取更容易与加载交错
+  options.internal__num_iterations_per_lock = 1;
+  return options;
+}
+
+}  // namespace
+
+int main() {
+  cdb::Logger::set_current_level("emerg");
+  cdb::test::Checker checker;
+  cdb::test::DestroyDB(kDBName);
+  cdb::WriteOptions write_options;
+  std::map<std::string, std::string> ref;
+  std::map<std::string, std::string> keys_deleted;
+
+  {
+    cdb::CuckooDB db(cdb::test::SmallFileOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "open");
+    for (int i = 0; i < kNumKeys; i++) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 0));
+      ref[MakeKey(i)] = MakeValue(i, 0);
+    }
+  }
+  //不保存快照，这些文件在延迟打开时需要从 HintData 加载
+  {
+    cdb::Options options = cdb::test::SmallFileOptions();
+    options.checkpoint__interval = 0;
+    cdb::CuckooDB db(options, kDBName);
+    checker.Check(db.Open().IsOK(), "open without checkpoint");
+    for (int i = 0; i < kNumKeys; i += 2) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 1));
+      ref[MakeKey(i)] = MakeValue(i, 1);
+    }
+    for (int i = 0; i < kNumKeys; i += 3) {
+      db.Delete(write_options, MakeKey(i));
+      ref.erase(MakeKey(i));
+      keys_deleted[MakeKey(i)] = "";
+    }
+  }
+
+  {
+    cdb::CuckooDB db(LazyOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "lazy open");
+    std::atomic<int> num_bad(0);
+    std::vector<std::thread> readers;
+    for (int t = 0; t < kNumReaders; t++) {
+      readers.push_back(std::thread([&db, &ref, &keys_deleted, &num_bad]() {
+        num_bad += Verify(db, ref, keys_deleted);
+      }));
+    }
+    for (auto& reader: readers) reader.join();
+    checker.Check(num_bad == 0, "content during load: %d", num_bad.load());
+
+    for (int i = 0; i < kNumKeys; i += 7) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 2));
+      ref[MakeKey(i)] = MakeValue(i, 2);
+    }
+    checker.Check(Verify(db, ref, keys_deleted) == 0, "content with writes during load");
+    //等待后台加载完成
+    usleep(1000 * 1000);
+    checker.Check(Verify(db, ref, keys_deleted) == 0, "content after load");
+  }
+
+  {
+    cdb::CuckooDB db(cdb::test::SmallFileOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "reopen");
+    checker.Check(Verify(db, ref, keys_deleted) == 0, "content after reopen");
+  }
+
+  //加载过程中关闭
+  {
+    cdb::CuckooDB db(LazyOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "lazy open before close");
+  }
+  {
+    cdb::CuckooDB db(LazyOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "lazy reopen");
+    checker.Check(Verify(db, ref, keys_deleted) == 0, "content after lazy reopen");
+  }
+
+  cdb::test::DestroyDB(kDBName);
+  return checker.Report("lazy_test");
+}
@@ -0,0 +1,203 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : manifest_test.cc
+ * Description   : manifest 的测试：
+ *                 1. manifest 最后一条记录只写了一半，并且目录中有不在 manifest 中的数据文件
+ *                 2. 没有 manifest 时扫描目录，之后重写 manifest
+ *                 3. 只读扫描目录时跳过合并留下的 compaction_ 文件
+ *                 4. 写 manifest 失败(只写了一半、fdatasync 失败)时不使用新文件，重试成功后再写入，
+ *                    重新打开后内容完整
+ * *******************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <string>
+#include <map>
+#include <atomic>
+
+#include "test/test_util.h"
+#include "db/cuckoodb.h"
+#include "storage_engine/date_file_manager.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+using cdb::test::MakeKey;
+using cdb::test::MakeValue;
+using cdb::test::GetIntProperty;
+using cdb::test::WaitForProperty;
+using cdb::test::Verify;
+using cdb::test::CopyFile;
+using cdb::test::GetFileSize;
+
+//注入写 manifest 的错误：测试程序中定义的 write() 和 fdatasync() 覆盖 libc 的版本，
+//计数不为 0 时对 manifest 的调用失败一次，其他文件不受影响
+static std::atomic<int> num_failures_write(0);
+static std::atomic<int> num_failures_sync(0);
+
+static bool IsManifest(int fd) {
+  char path_link[64];
+  char path[4096];
+  snprintf(path_link, sizeof(path_link), "/proc/self/fd/%d", fd);
+  ssize_t size = readlink(path_link, path, sizeof(path) - 1);
+  if (size <= 0) return false;
+  path[size] = '\0';
+  size_t size_suffix = strlen("/manifest");
+  return (size_t)size > size_suffix && strcmp(path + size - size_suffix, "/manifest") == 0;
+}
+
+//计数大于 0 且 fd 是 manifest 时减一并回传 true
+static bool ShouldFail(std::atomic<int>& num_failures, int fd) {
+  if (num_failures.load() <= 0 || !IsManifest(fd)) return false;
+  return num_failures.fetch_sub(1) > 0;
+}
+
+//只写入一半，模拟磁盘写满
+extern "C" ssize_t write(int fd, const void* buf, size_t count) {
+  static ssize_t (*write_real)(int, const void*, size_t)
+      = (ssize_t (*)(int, const void*, size_t))dlsym(RTLD_NEXT, "write");
+  if (count > 1 && ShouldFail(num_failures_write, fd)) {
+    write_real(fd, buf, count / 2);
+    errno = ENOSPC;
+    return -1;
+  }
+  return write_real(fd, buf, count);
+}
+
+extern "C" int fdatasync(int fd) {
+  static int (*fdatasync_real)(int) = (int (*)(int))dlsym(RTLD_NEXT, "fdatasync");
+  if (ShouldFail(num_failures_sync, fd)) {
+    errno = EIO;
+    return -1;
+  }
+  return fdatasync_real(fd);
+}
+
+namespace {
+
+const char* kDBName = "/tmp/cdb_manifest_test";
+const int kNumKeys = 3000;
+
+cdb::Options ManifestOptions() {
+  cdb::Options options = cdb::test::SmallFileOptions();
+  options.checkpoint__interval = 0;
+  options.compaction__size_threshold = 1ULL << 40;
+  return options;
+}
+
+std::string GetPath(const std::string& filename) {
+  return std::string(kDBName) + "/" + filename;
+}
+
+//打开数据库并校验内容，回传数据文件数
+int OpenAndVerify(const std::map<std::string, std::string>& ref, uint64_t* num_files) {
+  cdb::CuckooDB db(ManifestOptions(), kDBName);
+  if (!db.Open().IsOK()) return -1;
+  *num_files = GetIntProperty(db, "cdb.num-files");
+  return Verify(db, ref);
+}
+
+//只读加载，回传索引中的条目数和加载后的 fileid 序号
+size_t LoadReadOnly(uint32_t* fileid_sequence) {
+  std::string dbname = kDBName;
+  cdb::Options options = ManifestOptions();
+  cdb::DateFileManager date_file_manager(options, dbname, cdb::kUncompactedRegularType, true);
+  std::multimap<uint64_t, uint64_t> index;
+  if (!date_file_manager.LoadDatabase(dbname, index).IsOK()) return 0;
+  *fileid_sequence = date_file_manager.GetSequenceFileId();
+  return index.size();
+}
+
+//写入 [begin, end) 的 key，写入前注入 manifest 的错误，等待所有条目写入文件后关闭
+void WriteWithManifestFailure(int begin, int end, int failures_write, int failures_sync,
+                              std::map<std::string, std::string>* ref, cdb::test::Checker* checker) {
+  cdb::WriteOptions write_options;
+  cdb::CuckooDB db(ManifestOptions(), kDBName);
+  checker->Check(db.Open().IsOK(), "open before manifest failure");
+  num_failures_write = failures_write;
+  num_failures_sync = failures_sync;
+  for (int i = begin; i < end; i++) {
+    db.Put(write_options, MakeKey(i), MakeValue(i, 0));
+    (*ref)[MakeKey(i)] = MakeValue(i, 0);
+  }
+  checker->Check(WaitForProperty(db, "cdb.num-entries-index", ref->size(), 30000), "writes not flushed");
+  checker->Check(num_failures_write <= 0 && num_failures_sync <= 0, "manifest failure not injected");
+  num_failures_write = 0;
+  num_failures_sync = 0;
+}
+
+void TestManifestWriteFailure(cdb::test::Checker* checker) {
+  cdb::test::DestroyDB(kDBName);
+  std::map<std::string, std::string> ref;
+  WriteWithManifestFailure(0, 1000, 1, 0, &ref, checker);
+  WriteWithManifestFailure(1000, 2000, 0, 1, &ref, checker);
+  uint64_t num_files = 0;
+  checker->Check(OpenAndVerify(ref, &num_files) == 0, "content after manifest failures");
+
+  //之后新建的文件不能覆盖写失败时创建的文件
+  WriteWithManifestFailure(2000, 3000, 0, 0, &ref, checker);
+  checker->Check(OpenAndVerify(ref, &num_files) == 0, "content after writing past manifest failures");
+}
+
+}  // namespace
+
+int main() {
+  cdb::Logger::set_current_level("emerg");
+  cdb::test::Checker checker;
+  cdb::test::DestroyDB(kDBName);
+  cdb::WriteOptions write_options;
+  std::map<std::string, std::string> ref;
+  {
+    cdb::CuckooDB db(ManifestOptions(), kDBName);
+    checker.Check(db.Open().IsOK(), "open");
+    for (int i = 0; i < kNumKeys; i++) {
+      db.Put(write_options, MakeKey(i), MakeValue(i, 0));
+      ref[MakeKey(i)] = MakeValue(i, 0);
+    }
+  }
+  uint64_t num_files = 0;
+  checker.Check(OpenAndVerify(ref, &num_files) == 0, "content with manifest");
+  checker.Check(num_files > 1, "expected several data files, got %llu", (unsigned long long)num_files);
+
+  //不在 manifest 中的文件被忽略，最后一条不完整的记录被丢弃
+  checker.Check(CopyFile(GetPath("00000002"), GetPath("00000063")), "copy orphan file");
+  checker.Check(truncate(GetPath("manifest").c_str(), GetFileSize(GetPath("manifest")) - 3) == 0, "truncate manifest");
+  uint64_t num_files_torn = 0;
+  checker.Check(OpenAndVerify(ref, &num_files_torn) == 0, "content with torn manifest");
+  checker.Check(num_files_torn == num_files, "files with torn manifest: %llu, expected %llu",
+                (unsigned long long)num_files_torn, (unsigned long long)num_files);
+
+  //没有 manifest 时扫描目录
+  remove(GetPath("00000063").c_str());
+  remove(GetPath("manifest").c_str());
+  uint64_t num_files_scan = 0;
+  checker.Check(OpenAndVerify(ref, &num_files_scan) == 0, "content without manifest");
+  checker.Check(num_files_scan == num_files, "files without manifest: %llu", (unsigned long long)num_files_scan);
+  checker.Check(access(GetPath("manifest").c_str(), F_OK) == 0, "manifest not rewritten");
+  uint64_t num_files_rewritten = 0;
+  checker.Check(OpenAndVerify(ref, &num_files_rewritten) == 0, "content with rewritten manifest");
+
+  //只读加载不删除合并留下的文件，扫描目录时必须跳过它们
+  //文件名按十六进制解析时 "compaction_" 会被当作 fileid 0xc，大于现有的所有文件
+  uint32_t fileid_sequence = 0;
+  size_t num_entries = LoadReadOnly(&fileid_sequence);
+  checker.Check(num_entries == (size_t)kNumKeys, "entries loaded read-only: %zu", num_entries);
+  checker.Check(fileid_sequence < 0xc, "too many data files for this test: %u", fileid_sequence);
+  checker.Check(CopyFile(GetPath("00000002"), GetPath("compaction_00000002")), "copy compaction file");
+  remove(GetPath("manifest").c_str());
+  uint32_t fileid_sequence_compaction = 0;
+  num_entries = LoadReadOnly(&fileid_sequence_compaction);
+  checker.Check(num_entries == (size_t)kNumKeys, "entries loaded read-only with a compaction file: %zu", num_entries);
+  checker.Check(fileid_sequence_compaction == fileid_sequence, "fileid sequence with a compaction file: %u, expected %u",
+                fileid_sequence_compaction, fileid_sequence);
+
+  TestManifestWriteFailure(&checker);
+
+  cdb::test::DestroyDB(kDBName);
+  return checker.Report("manifest_test");
+}
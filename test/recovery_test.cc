@@ -0,0 +1,177 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : recovery_test.cc
+ * Description   : 没有 Close() 就退出之后的恢复：
+ *                 1. 子进程写入后直接退出，最新的文件末尾追加垃圾数据，重新打开后截断并重建 footer
+ *                 2. 没有 Entry 校验和的旧格式文件：crc 字段无效时仍然恢复全部 Entry，并且不修改文件，
+ *                    之后可以正常合并
+ * *******************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <string>
+#include <map>
+
+#include "test/test_util.h"
+#include "db/cuckoodb.h"
+#include "storage_engine/data_file_format.h"
+#include "util/coding.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+using cdb::test::MakeKey;
+using cdb::test::MakeValue;
+using cdb::test::WaitForProperty;
+using cdb::test::Verify;
+using cdb::test::GetFileSize;
+
+namespace {
+
+const char* kDBName = "/tmp/cdb_recovery_test";
+const int kNumKeys = 3000;
+
+cdb::Options RecoveryOptions() {
+  cdb::Options options = cdb::test::SmallFileOptions();
+  options.checkpoint__interval = 0;
+  options.compaction__size_threshold = 1ULL << 40;
+  return options;
+}
+
+//子进程写入并等待所有条目进入索引(即已经写入文件)，然后不关闭数据库直接退出
+void WriteAndCrash(std::map<std::string, std::string>* ref, std::map<std::string, std::string>* keys_deleted) {
+  for (int i = 0; i < kNumKeys; i++) (*ref)[MakeKey(i)] = MakeValue(i, 0);
+  for (int i = 0; i < kNumKeys; i += 3) {
+    ref->erase(MakeKey(i));
+    (*keys_deleted)[MakeKey(i)] = "";
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    cdb::WriteOptions write_options;
+    cdb::CuckooDB* db = new cdb::CuckooDB(RecoveryOptions(), kDBName);
+    db->Open();
+    for (int i = 0; i < kNumKeys; i++) db->Put(write_options, MakeKey(i), MakeValue(i, 0));
+    for (int i = 0; i < kNumKeys; i += 3) db->Delete(write_options, MakeKey(i));
+    bool is_flushed = WaitForProperty(*db, "cdb.num-entries-index", kNumKeys + (kNumKeys + 2) / 3);
+    _exit(is_flushed ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) fprintf(stderr, "child did not flush its writes\n");
+}
+
+//fileid 最大的数据文件，即崩溃时正在写入的文件
+std::string GetNewestDataFile() {
+  std::string name_newest;
+  DIR* directory = opendir(kDBName);
+  if (directory == NULL) return "";
+  struct dirent* entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (strlen(entry->d_name) != 8 || strspn(entry->d_name, "0123456789abcdefABCDEF") != 8) continue;
+    if (name_newest.empty() || strcmp(entry->d_name, name_newest.c_str()) > 0) name_newest = entry->d_name;
+  }
+  closedir(directory);
+  return name_newest.empty() ? "" : std::string(kDBName) + "/" + name_newest;
+}
+
+void TestTruncateTornTail(cdb::test::Checker* checker) {
+  cdb::test::DestroyDB(kDBName);
+  std::map<std::string, std::string> ref;
+  std::map<std::string, std::string> keys_deleted;
+  WriteAndCrash(&ref, &keys_deleted);
+
+  std::string filepath = GetNewestDataFile();
+  checker->Check(!filepath.empty(), "no data file after crash");
+  uint64_t size_crashed = GetFileSize(filepath);
+  int fd = open(filepath.c_str(), O_WRONLY | O_APPEND);
+  char garbage[100];
+  for (size_t i = 0; i < sizeof(garbage); i++) garbage[i] = (char)(i * 37 + 11);
+  checker->Check(fd >= 0 && write(fd, garbage, sizeof(garbage)) == (ssize_t)sizeof(garbage), "append garbage");
+  if (fd >= 0) close(fd);
+
+  {
+    cdb::CuckooDB db(RecoveryOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "open after crash");
+    checker->Check(db.GetLoadTiming().num_files_recovered >= 1, "no file recovered");
+    checker->Check(Verify(db, ref, keys_deleted) == 0, "content after crash");
+  }
+  //垃圾数据被截断，并写入了 HintData 和 footer
+  checker->Check(GetFileSize(filepath) != size_crashed + sizeof(garbage), "file not rewritten by recovery");
+  {
+    cdb::CuckooDB db(RecoveryOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "reopen");
+    checker->Check(db.GetLoadTiming().num_files_recovered == 0,
+                   "files recovered again: %llu", (unsigned long long)db.GetLoadTiming().num_files_recovered);
+    checker->Check(Verify(db, ref, keys_deleted) == 0, "content after reopen");
+  }
+}
+
+void TestLegacyFileWithoutChecksums(cdb::test::Checker* checker) {
+  cdb::test::DestroyDB(kDBName);
+  std::map<std::string, std::string> ref;
+  std::map<std::string, std::string> keys_deleted;
+  WriteAndCrash(&ref, &keys_deleted);
+
+  //去掉 kFormatEntryChecksum，并破坏第一个 Entry 的 crc 字段，模拟 crc 字段未初始化的旧文件
+  std::string filepath = GetNewestDataFile();
+  int fd = open(filepath.c_str(), O_RDWR);
+  char buffer[cdb::DataFileHeader::GetFixedSize()];
+  struct cdb::DataFileHeader header;
+  bool is_patched = fd >= 0
+                    && pread(fd, buffer, sizeof(buffer), 0) == (ssize_t)sizeof(buffer)
+                    && cdb::DataFileHeader::DecodeFrom(buffer, sizeof(buffer), &header).IsOK();
+  if (is_patched) {
+    header.version = cdb::DataFileHeader::MakeVersion(header.GetFormatFlags() & ~cdb::kFormatEntryChecksum);
+    cdb::DataFileHeader::EncodeTo(&header, nullptr, buffer);
+    char crc_invalid[4];
+    cdb::EncodeFixed32(crc_invalid, 0xDEADBEEF);
+    cdb::Options options = RecoveryOptions();
+    is_patched =    pwrite(fd, buffer, sizeof(buffer), 0) == (ssize_t)sizeof(buffer)
+                 && pwrite(fd, crc_invalid, 4, options.internal__datafile_header_size) == 4;
+  }
+  if (fd >= 0) close(fd);
+  checker->Check(is_patched, "patch data file");
+  uint64_t size_crashed = GetFileSize(filepath);
+
+  for (int i = 0; i < 2; i++) {
+    cdb::CuckooDB db(RecoveryOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "open legacy file");
+    checker->Check(Verify(db, ref, keys_deleted) == 0, "content of legacy file, open %d", i);
+    checker->Check(GetFileSize(filepath) == size_crashed, "legacy file modified, open %d", i);
+  }
+
+  //合并重新扫描没有 footer 的旧文件，输出带校验和的文件
+  {
+    cdb::Options options = RecoveryOptions();
+    options.compaction__check_interval = 100;
+    options.compaction__size_threshold = 1;
+    cdb::CuckooDB db(options, kDBName);
+    checker->Check(db.Open().IsOK(), "open for compaction");
+    checker->Check(WaitForProperty(db, "cdb.compactions", 1), "compaction did not run");
+    checker->Check(Verify(db, ref, keys_deleted) == 0, "content after compacting legacy file");
+  }
+  {
+    cdb::CuckooDB db(RecoveryOptions(), kDBName);
+    checker->Check(db.Open().IsOK(), "reopen after compaction");
+    checker->Check(db.GetLoadTiming().num_files_recovered == 0, "files recovered after compaction");
+    checker->Check(Verify(db, ref, keys_deleted) == 0, "content after reopen");
+  }
+}
+
+}  // namespace
+
+int main() {
+  cdb::Logger::set_current_level("emerg");
+  cdb::test::Checker checker;
+  TestTruncateTornTail(&checker);
+  TestLegacyFileWithoutChecksums(&checker);
+  cdb::test::DestroyDB(kDBName);
+  return checker.Report("recovery_test");
+}
@@ -0,0 +1,87 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : shard_test.cc
+ * Description   : 分片的测试：
+ *                 1. 分片数据库重新打开后内容正确，分片数与创建时不同则打开失败，且不修改数据库
+ *                 2. 不分片的数据库不能以分片方式打开
+ * *******************************************************/
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+#include <map>
+
+#include "test/test_util.h"
+#include "db/cuckoodb.h"
+#include "util/logger.h"
+#include "util/options.h"
+#include "util/status.h"
+
+using cdb::test::MakeKey;
+using cdb::test::MakeValue;
+using cdb::test::Verify;
+
+namespace {
+
+const char* kDBName = "/tmp/cdb_shard_test";
+const int kNumKeys = 4000;
+const uint32_t kNumShards = 4;
+
+cdb::Options ShardOptions(uint32_t num_shards) {
+  cdb::Options options = cdb::test::SmallFileOptions();
+  options.compaction__size_threshold = 1ULL << 40;
+  options.storage__num_shards = num_shards;
+  return options;
+}
+
+//以 num_shards 个分片打开，回传 Open() 是否成功
+bool CanOpen(uint32_t num_shards) {
+  cdb::CuckooDB db(ShardOptions(num_shards), kDBName);
+  return db.Open().IsOK();
+}
+
+void Fill(uint32_t num_shards, int version, std::map<std::string, std::string>* ref) {
+  cdb::WriteOptions write_options;
+  cdb::CuckooDB db(ShardOptions(num_shards), kDBName);
+  db.Open();
+  for (int i = 0; i < kNumKeys; i++) {
+    db.Put(write_options, MakeKey(i), MakeValue(i, version));
+    (*ref)[MakeKey(i)] = MakeValue(i, version);
+  }
+}
+
+int OpenAndVerify(uint32_t num_shards, const std::map<std::string, std::string>& ref) {
+  cdb::CuckooDB db(ShardOptions(num_shards), kDBName);
+  if (!db.Open().IsOK()) return -1;
+  return Verify(db, ref);
+}
+
+}  // namespace
+
+int main() {
+  cdb::Logger::set_current_level("emerg");
+  cdb::test::Checker checker;
+  std::map<std::string, std::string> ref;
+
+  cdb::test::DestroyDB(kDBName);
+  Fill(kNumShards, 0, &ref);
+  checker.Check(access((std::string(kDBName) + "/shards").c_str(), F_OK) == 0, "shards file not written");
+  checker.Check(access((std::string(kDBName) + "/shard_003").c_str(), F_OK) == 0, "shard directory not created");
+  checker.Check(OpenAndVerify(kNumShards, ref) == 0, "content with %u shards", kNumShards);
+  checker.Check(!CanOpen(kNumShards / 2), "opened with %u shards", kNumShards / 2);
+  checker.Check(!CanOpen(kNumShards * 2), "opened with %u shards", kNumShards * 2);
+  checker.Check(!CanOpen(1), "opened without shards");
+  checker.Check(OpenAndVerify(kNumShards, ref) == 0, "content after mismatched opens");
+
+  ref.clear();
+  cdb::test::DestroyDB(kDBName);
+  Fill(1, 1, &ref);
+  checker.Check(access((std::string(kDBName) + "/shards").c_str(), F_OK) != 0, "shards file written without shards");
+  checker.Check(!CanOpen(kNumShards), "unsharded database opened with %u shards", kNumShards);
+  checker.Check(OpenAndVerify(1, ref) == 0, "content without shards");
+
+  cdb::test::DestroyDB(kDBName);
+  return checker.Report("shard_test");
+}
@@ -0,0 +1,137 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : test_util.h
+ * Description   : 各个测试程序共用的工具：删除数据库目录、拷贝文件、等待后台任务、按参考 map 校验数据库内容
+ * *******************************************************/
+#ifndef CUCKOODB_TEST_UTIL_H_
+#define CUCKOODB_TEST_UTIL_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <cstdarg>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <map>
+#include <fstream>
+
+#include "db/cuckoodb.h"
+#include "file/file_pool.h"
+#include "util/options.h"
+#include "util/status.h"
+
+namespace cdb {
+namespace test {
+
+//递归删除数据库目录
+inline void DestroyDB(const std::string& path) {
+  FileUtil::remove_directory(path);
+}
+
+//文件不存在时回传 0
+inline uint64_t GetFileSize(const std::string& filepath) {
+  struct stat info;
+  if (stat(filepath.c_str(), &info) != 0) return 0;
+  return info.st_size;
+}
+
+inline bool CopyFile(const std::string& from, const std::string& to) {
+  std::ifstream in(from, std::ios::binary);
+  std::ofstream out(to, std::ios::binary | std::ios::trunc);
+  if (!in || !out) return false;
+  out << in.rdbuf();
+  return out.good();
+}
+
+//测试使用小的数据文件，少量数据就能产生多个已关闭的文件
+inline Options SmallFileOptions() {
+  Options options;
+  options.storage__datafile_size = 64 * 1024;
+  return options;
+}
+
+inline std::string MakeKey(int i) {
+  return "key" + std::to_string(i);
+}
+
+inline std::string MakeValue(int i, int version) {
+  return std::string(100, 'a' + (i + version) % 26) + std::to_string(version);
+}
+
+inline uint64_t GetIntProperty(CuckooDB& db, const std::string& property) {
+  uint64_t value = 0;
+  db.GetIntProperty(property, &value);
+  return value;
+}
+
+//等待计数器属性 (例如 "cdb.compactions") 达到 target，超时返回 false
+inline bool WaitForProperty(CuckooDB& db, const std::string& property, uint64_t target, int timeout_millis=10000) {
+  for (int waited = 0; waited < timeout_millis; waited += 10) {
+    if (GetIntProperty(db, property) >= target) return true;
+    usleep(10 * 1000);
+  }
+  return false;
+}
+
+//ref 中的 key 必须读到相同的 value，keys_deleted 中的 key 必须读不到，返回不一致的 key 数
+inline int Verify(CuckooDB& db,
+                  const std::map<std::string, std::string>& ref,
+                  const std::map<std::string, std::string>& keys_deleted=std::map<std::string, std::string>()) {
+  ReadOptions read_options;
+  int num_bad = 0;
+  for (auto& item: ref) {
+    std::string value;
+    Status s = db.Get(read_options, item.first, &value);
+    if (!s.IsOK() || value != item.second) {
+      if (num_bad < 5) fprintf(stderr, "key %s: expected value, got %s\n", item.first.c_str(), s.ToString().c_str());
+      num_bad++;
+    }
+  }
+  for (auto& item: keys_deleted) {
+    if (ref.find(item.first) != ref.end()) continue;
+    std::string value;
+    Status s = db.Get(read_options, item.first, &value);
+    if (s.IsOK()) {
+      if (num_bad < 5) fprintf(stderr, "key %s: expected not found, got a value\n", item.first.c_str());
+      num_bad++;
+    }
+  }
+  return num_bad;
+}
+
+//每个测试程序的检查：失败时输出原因并计数
+class Checker {
+ public:
+  Checker() : num_failed_(0) {}
+
+  void Check(bool condition, const char* format, ...) {
+    if (condition) return;
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "FAILED: ");
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    num_failed_++;
+  }
+
+  //输出结果，作为 main() 的返回值
+  int Report(const char* name) {
+    if (num_failed_ == 0) {
+      fprintf(stdout, "success %s\n", name);
+      return 0;
+    }
+    fprintf(stdout, "faild %s: %d checks failed\n", name, num_failed_);
+    return 1;
+  }
+
+ private:
+  int num_failed_;
+};
+
+}  // namespace test
+}  // namespace cdb
+
+#endif  // CUCKOODB_TEST_UTIL_H_
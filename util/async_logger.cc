@@ -0,0 +1,279 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : async_logger.cc
+ * Description   : 异步日志的实现：写日志的线程把记录放入自己的环形缓冲区，后台线程按时间排序后
+ *                 格式化并写出，缓冲区满时丢弃的条数由后台线程补记
+ * *******************************************************/
+#include "util/async_logger.h"
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+
+#include "util/logger.h"
+
+namespace cdb {
+
+namespace {
+
+//线程的 RingHolder 已经析构，之后这个线程的消息直接丢弃
+thread_local bool ring_retired = false;
+
+void FlushAtExit() {
+  AsyncLogger::Instance().Flush();
+}
+
+}  // namespace
+
+void AsyncLogAppend(int level_syslog, const char* logname, const char* format, va_list args) {
+  AsyncLogger::Instance().Append(level_syslog, logname, format, args);
+}
+
+void Logger::set_async(bool async) {
+  if (async) {
+    AsyncLogger::Instance().Start();
+    async_.store(true, std::memory_order_release);
+  } else {
+    //之后的消息同步写出，先写出已经缓冲的消息以保持顺序
+    async_.store(false, std::memory_order_release);
+    AsyncLogger::Instance().Flush();
+  }
+}
+
+AsyncLogger& AsyncLogger::Instance() {
+  static AsyncLogger* instance = new AsyncLogger();
+  return *instance;
+}
+
+AsyncLogger::AsyncLogger()
+    : num_dropped_retired_(0),
+      num_drains_(0),
+      is_started_(false),
+      num_written_(0),
+      num_dropped_without_ring_(0),
+      seconds_cached_(-1) {
+  prefix_cached_[0] = '\0';
+}
+
+void AsyncLogger::Start() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (is_started_) return;
+  is_started_ = true;
+  thread_ = std::thread(&AsyncLogger::Run, this);
+  thread_.detach();
+  atexit(FlushAtExit);
+}
+
+AsyncLogger::RingHolder::~RingHolder() {
+  ring_retired = true;
+  if (ring != nullptr) ring->is_retired.store(true, std::memory_order_release);
+}
+
+AsyncLogger::Ring* AsyncLogger::GetRing() {
+  if (ring_retired) return nullptr;
+  static thread_local RingHolder holder = { nullptr };
+  if (holder.ring != nullptr) return holder.ring;
+
+  Ring* ring = new Ring();
+  ring->head.store(0, std::memory_order_relaxed);
+  ring->tail.store(0, std::memory_order_relaxed);
+  ring->num_dropped.store(0, std::memory_order_relaxed);
+  ring->num_dropped_reported = 0;
+  ring->thread_id = static_cast<uint64_t>(pthread_self());
+  ring->is_retired.store(false, std::memory_order_relaxed);
+  {
+    std::unique_lock<std::mutex> lock(mutex_rings_);
+    rings_.push_back(ring);
+  }
+  holder.ring = ring;
+  return ring;
+}
+
+void AsyncLogger::Append(int level_syslog, const char* logname, const char* format, va_list args) {
+  Ring* ring = GetRing();
+  if (ring == nullptr) {
+    num_dropped_without_ring_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  uint64_t tail = ring->tail.load(std::memory_order_acquire);
+  if (head - tail >= kNumRecords) {
+    //只有当前线程写 num_dropped，不需要原子的加法
+    ring->num_dropped.store(ring->num_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    cond_.notify_one();
+    return;
+  }
+
+  Record& record = ring->records[head & (kNumRecords - 1)];
+  struct timeval now_tv;
+  gettimeofday(&now_tv, NULL);
+  record.micros = static_cast<uint64_t>(now_tv.tv_sec) * 1000000 + now_tv.tv_usec;
+  record.thread_id = ring->thread_id;
+  record.level_syslog = level_syslog;
+  snprintf(record.logname, kSizeLogname, "%s", logname);
+
+  //va_list 引用调用者栈上的参数，只能在这里格式化
+  va_list backup_args;
+  va_copy(backup_args, args);
+  int size = vsnprintf(record.message, kSizeMessage, format, backup_args);
+  va_end(backup_args);
+  if (size < 0) {
+    size = 0;
+    record.message[0] = '\0';
+  } else if (size >= (int)kSizeMessage) {
+    size = kSizeMessage - 1;
+    memcpy(record.message + size - 3, "...", 3);
+  }
+  record.size_message = size;
+
+  ring->head.store(head + 1, std::memory_order_release);
+  //缓冲区过半时提前唤醒后台线程，减少丢弃
+  if (head + 1 - tail == kNumRecords / 2) cond_.notify_one();
+}
+
+void AsyncLogger::Flush() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!is_started_) return;
+  //正在进行的 Drain() 可能在调用之前就读取了 head，需要等待下一次完整的 Drain()
+  uint64_t target = num_drains_ + 2;
+  while (num_drains_ < target) {
+    cond_.notify_one();
+    cond_drained_.wait_for(lock, std::chrono::milliseconds(kIntervalMillis));
+  }
+}
+
+uint64_t AsyncLogger::GetNumDropped() {
+  std::unique_lock<std::mutex> lock(mutex_rings_);
+  uint64_t num_dropped = num_dropped_retired_ + num_dropped_without_ring_.load(std::memory_order_relaxed);
+  for (auto ring: rings_) {
+    num_dropped += ring->num_dropped.load(std::memory_order_relaxed);
+  }
+  return num_dropped;
+}
+
+uint64_t AsyncLogger::GetNumWritten() {
+  return num_written_.load(std::memory_order_relaxed);
+}
+
+void AsyncLogger::Run() {
+  std::string buffer;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait_for(lock, std::chrono::milliseconds(kIntervalMillis));
+    }
+    Drain(&buffer);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      num_drains_++;
+    }
+    cond_drained_.notify_all();
+  }
+}
+
+size_t AsyncLogger::Drain(std::string* buffer) {
+  std::vector<Ring*> rings;
+  {
+    std::unique_lock<std::mutex> lock(mutex_rings_);
+    rings = rings_;
+  }
+
+  //只有这个线程释放缓冲区，rings 中的指针在本次 Drain() 中一直有效
+  std::vector<uint64_t> heads(rings.size());
+  std::vector<const Record*> records;
+  for (size_t i = 0; i < rings.size(); i++) {
+    uint64_t tail = rings[i]->tail.load(std::memory_order_relaxed);
+    heads[i] = rings[i]->head.load(std::memory_order_acquire);
+    for (uint64_t j = tail; j < heads[i]; j++) {
+      records.push_back(&rings[i]->records[j & (kNumRecords - 1)]);
+    }
+  }
+  std::stable_sort(records.begin(), records.end(), [](const Record* a, const Record* b) {
+    return a->micros < b->micros;
+  });
+
+  buffer->clear();
+  for (auto ring: rings) WriteDropped(ring, buffer);
+  for (auto record: records) Write(*record, buffer);
+  if (!buffer->empty()) {
+    fwrite(buffer->data(), 1, buffer->size(), stderr);
+    fflush(stderr);
+  }
+
+  for (size_t i = 0; i < rings.size(); i++) {
+    rings[i]->tail.store(heads[i], std::memory_order_release);
+  }
+  num_written_.fetch_add(records.size(), std::memory_order_relaxed);
+
+  //释放已经退出的线程的缓冲区，线程退出后不会再写入
+  std::unique_lock<std::mutex> lock(mutex_rings_);
+  for (auto it = rings_.begin(); it != rings_.end();) {
+    Ring* ring = *it;
+    if (ring->is_retired.load(std::memory_order_acquire)
+        && ring->head.load(std::memory_order_acquire) == ring->tail.load(std::memory_order_relaxed)) {
+      num_dropped_retired_ += ring->num_dropped.load(std::memory_order_relaxed);
+      delete ring;
+      it = rings_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  return records.size();
+}
+
+void AsyncLogger::Write(const Record& record, std::string* buffer) {
+  if (Logger::target() == Logger::kLogTargetSyslog) {
+    char base[kSizeMessage + 32];
+    snprintf(base, sizeof(base), "%" PRIu64 " %s", record.thread_id, record.message);
+    Logger::WriteSyslog(record.level_syslog, base);
+    return;
+  }
+
+  //与同步模式的格式相同，同一秒内的记录复用 localtime_r() 的结果
+  int64_t seconds = record.micros / 1000000;
+  if (seconds != seconds_cached_) {
+    const time_t t_seconds = seconds;
+    struct tm t;
+    localtime_r(&t_seconds, &t);
+    snprintf(prefix_cached_, sizeof(prefix_cached_),
+             "%04d/%02d/%02d-%02d:%02d:%02d",
+             t.tm_year + 1900,
+             t.tm_mon + 1,
+             t.tm_mday,
+             t.tm_hour,
+             t.tm_min,
+             t.tm_sec);
+    seconds_cached_ = seconds;
+  }
+  char prefix[sizeof(prefix_cached_) + kSizeLogname + 16];
+  int size = snprintf(prefix, sizeof(prefix), "%s.%06d %s ",
+                      prefix_cached_, static_cast<int>(record.micros % 1000000), record.logname);
+  buffer->append(prefix, std::min(size, (int)sizeof(prefix) - 1));
+  buffer->append(record.message, record.size_message);
+  buffer->push_back('\n');
+}
+
+void AsyncLogger::WriteDropped(Ring* ring, std::string* buffer) {
+  uint64_t num_dropped = ring->num_dropped.load(std::memory_order_relaxed);
+  if (num_dropped == ring->num_dropped_reported) return;
+  char message[128];
+  snprintf(message, sizeof(message), "AsyncLogger: thread %" PRIu64 " dropped %" PRIu64 " messages, buffer full",
+           ring->thread_id, num_dropped - ring->num_dropped_reported);
+  ring->num_dropped_reported = num_dropped;
+  if (Logger::target() == Logger::kLogTargetSyslog) {
+    Logger::WriteSyslog(LOG_WARNING, message);
+  } else {
+    buffer->append(message);
+    buffer->push_back('\n');
+  }
+}
+
+}  // namespace cdb
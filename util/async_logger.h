@@ -0,0 +1,118 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : async_logger.h
+ * Description   : 异步日志。每个写日志的线程有一个单生产者单消费者的环形缓冲区，调用者只把消息
+ *                 vsnprintf 到缓冲区的一条记录中，不加锁、不做系统调用；后台线程收集所有缓冲区的记录，
+ *                 按时间排序，格式化时间戳后一次写出。缓冲区满时丢弃消息并计数，后台线程写出丢弃的条数。
+ *                 通过 Logger::set_async(true) 启用
+ * *******************************************************/
+#ifndef CUCKOODB_ASYNC_LOGGER_H_
+#define CUCKOODB_ASYNC_LOGGER_H_
+
+#include <stdint.h>
+#include <cstdarg>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cdb {
+
+class AsyncLogger {
+ public:
+  //进程内唯一的实例，不析构，进程退出时由 atexit 写出剩余的消息
+  static AsyncLogger& Instance();
+
+  //启动后台线程，可以重复调用
+  void Start();
+
+  //由 Logger::Logv() 在调用者的线程中调用
+  void Append(int level_syslog, const char* logname, const char* format, va_list args);
+
+  //等待调用之前写入的消息全部写出
+  void Flush();
+
+  //缓冲区满时丢弃的消息数，以及已经写出的消息数
+  uint64_t GetNumDropped();
+  uint64_t GetNumWritten();
+
+ private:
+  static const uint32_t kNumRecords = 256;       //每个线程的缓冲区的记录数，必须是 2 的幂
+  static const uint32_t kSizeLogname = 48;
+  static const uint32_t kSizeMessage = 440;      //更长的消息被截断
+  //后台线程没有被唤醒时检查缓冲区的间隔
+  static const uint32_t kIntervalMillis = 10;
+
+  struct Record {
+    uint64_t micros;          //gettimeofday() 的时间，后台线程格式化
+    uint64_t thread_id;
+    int32_t level_syslog;
+    uint32_t size_message;
+    char logname[kSizeLogname];
+    char message[kSizeMessage];
+  };
+
+  //head 只由生产者写，tail 只由后台线程写，分别在不同的缓存行上
+  struct Ring {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> num_dropped;
+    uint64_t num_dropped_reported;      //只由后台线程使用
+    uint64_t thread_id;
+    std::atomic<bool> is_retired;       //线程已经退出，缓冲区写空后释放
+    Record records[kNumRecords];
+
+    //C++11 的 new 不保证 alignas(64) 的对齐
+    static void* operator new(size_t size) {
+      void* p = nullptr;
+      if (posix_memalign(&p, 64, size) != 0) throw std::bad_alloc();
+      return p;
+    }
+
+    static void operator delete(void* p) {
+      free(p);
+    }
+  };
+
+  //线程退出时标记自己的缓冲区
+  struct RingHolder {
+    Ring* ring;
+    ~RingHolder();
+  };
+
+  AsyncLogger();
+
+  Ring* GetRing();
+  void Run();
+  //写出所有缓冲区中的记录，回传写出的条数
+  size_t Drain(std::string* buffer);
+  void Write(const Record& record, std::string* buffer);
+  void WriteDropped(Ring* ring, std::string* buffer);
+
+  std::mutex mutex_rings_;
+  std::vector<Ring*> rings_;
+  uint64_t num_dropped_retired_;       //已释放的缓冲区丢弃的消息数，持有 mutex_rings_ 时访问
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  //每次 Drain() 结束后加一，Flush() 等待它前进
+  std::condition_variable cond_drained_;
+  uint64_t num_drains_;
+  bool is_started_;
+  std::thread thread_;
+  std::atomic<uint64_t> num_written_;
+  std::atomic<uint64_t> num_dropped_without_ring_;
+  //时间戳按秒缓存 localtime_r() 的结果，大小按 6 个 int 都取最长的 11 个字符计算
+  int64_t seconds_cached_;
+  char prefix_cached_[80];
+};
+
+}  // namespace cdb
+
+#endif  // CUCKOODB_ASYNC_LOGGER_H_
@@ -6,6 +6,12 @@
 
 #include "util/coding.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#define CUCKOODB_HAVE_BMI2_DECODER 1
+#endif
+
 namespace cdb {
 
 void EncodeFixed32(char* buf, uint32_t value) {
@@ -193,4 +199,181 @@ int GetVarint64(char* data, uint64_t size, uint64_t* value) {
   }
 }
 
+namespace {
+
+inline const char* GetVarintPtr(const char* p, const char* limit, uint32_t* value) {
+  return GetVarint32Ptr(p, limit, value);
+}
+
+inline const char* GetVarintPtr(const char* p, const char* limit, uint64_t* value) {
+  return GetVarint64Ptr(p, limit, value);
+}
+
+// Maximum encoded length of a value of type T
+template <typename T>
+struct VarintTraits;
+
+template <>
+struct VarintTraits<uint32_t> {
+  static const int kMaxBytes = 5;
+};
+
+template <>
+struct VarintTraits<uint64_t> {
+  static const int kMaxBytes = 10;
+};
+
+const uint64_t kVarintPayloadBits = 0x7f7f7f7f7f7f7f7fULL;
+const uint64_t kVarintContinuationBits = 0x8080808080808080ULL;
+
+inline uint64_t LoadUnaligned64(const char* p) {
+  uint64_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+// Mask of the first "length" bytes of a little-endian word, 1 <= length <= 8
+inline uint64_t LowBytesMask(int length) {
+  return (length == 8) ? ~0ULL : ((1ULL << (length * 8)) - 1);
+}
+
+template <typename T>
+const char* DecodeArrayScalar(const char* p, const char* limit, T* values, size_t n) {
+  for (size_t i = 0; i < n && p != NULL; ++i) {
+    p = GetVarintPtr(p, limit, &values[i]);
+  }
+  return p;
+}
+
+// Packs the 7-bit groups of a little-endian word into the low 56 bits
+inline uint64_t CompactVarintGroups(uint64_t x) {
+  x = (x & 0x007f007f007f007fULL) | ((x & 0x7f007f007f007f00ULL) >> 1);
+  x = (x & 0x00003fff00003fffULL) | ((x & 0x3fff00003fff0000ULL) >> 2);
+  x = (x & 0x000000000fffffffULL) | ((x & 0x0fffffff00000000ULL) >> 4);
+  return x;
+}
+
+template <typename T>
+const char* DecodeArraySWAR(const char* p, const char* limit, T* values, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    if (limit - p >= 8) {
+      uint64_t word = LoadUnaligned64(p);
+      if ((word & 0x80) == 0) {
+        values[i] = static_cast<T>(word & 0x7f);
+        p += 1;
+        continue;
+      }
+      uint64_t stops = ~word & kVarintContinuationBits;
+      if (stops != 0) {
+        int length = (__builtin_ctzll(stops) >> 3) + 1;
+        if (length > VarintTraits<T>::kMaxBytes) return NULL;
+        values[i] = static_cast<T>(CompactVarintGroups(word & LowBytesMask(length) & kVarintPayloadBits));
+        p += length;
+        continue;
+      }
+    }
+    // Values longer than 8 bytes and the last bytes of the input
+    p = GetVarintPtr(p, limit, &values[i]);
+    if (p == NULL) return NULL;
+  }
+  return p;
+}
+
+#ifdef CUCKOODB_HAVE_BMI2_DECODER
+template <typename T>
+__attribute__((target("sse2,bmi,bmi2")))
+const char* DecodeArrayBMI2(const char* p, const char* limit, T* values, size_t n) {
+  size_t i = 0;
+  while (i < n) {
+    if (limit - p >= 24) {
+      // One bit per byte of the window, set where a value ends
+      __m128i window = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      uint32_t stops = ~static_cast<uint32_t>(_mm_movemask_epi8(window)) & 0xffff;
+      // Every value ending inside the window can be read with one 64-bit load
+      int position = 0;
+      while (i < n && position < 16) {
+        uint32_t stops_remaining = stops >> position;
+        if (stops_remaining == 0) break;
+        int length = _tzcnt_u32(stops_remaining) + 1;
+        if (length == 1) {
+          values[i++] = static_cast<T>(static_cast<unsigned char>(p[position]));
+          position += 1;
+          continue;
+        }
+        if (length > 8) break;
+        if (length > VarintTraits<T>::kMaxBytes) return NULL;
+        uint64_t word = LoadUnaligned64(p + position);
+        values[i++] = static_cast<T>(_pext_u64(word, kVarintPayloadBits & LowBytesMask(length)));
+        position += length;
+      }
+      if (position > 0) {
+        p += position;
+        continue;
+      }
+    }
+    p = GetVarintPtr(p, limit, &values[i++]);
+    if (p == NULL) return NULL;
+  }
+  return p;
+}
+#endif
+
+VarintDecoder DetectVarintDecoder() {
+#ifdef CUCKOODB_HAVE_BMI2_DECODER
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("bmi2")) return kVarintDecoderBMI2;
+#endif
+  if (kLittleEndian) return kVarintDecoderSWAR;
+  return kVarintDecoderScalar;
+}
+
+template <typename T>
+const char* DecodeArrayWith(VarintDecoder decoder, const char* p, const char* limit, T* values, size_t n) {
+  switch (decoder) {
+#ifdef CUCKOODB_HAVE_BMI2_DECODER
+    case kVarintDecoderBMI2:
+      return DecodeArrayBMI2(p, limit, values, n);
+#endif
+    case kVarintDecoderSWAR:
+      return DecodeArraySWAR(p, limit, values, n);
+    default:
+      return DecodeArrayScalar(p, limit, values, n);
+  }
+}
+
+}  // namespace
+
+VarintDecoder GetVarintDecoder() {
+  static const VarintDecoder decoder = DetectVarintDecoder();
+  return decoder;
+}
+
+bool IsVarintDecoderSupported(VarintDecoder decoder) {
+  switch (decoder) {
+    case kVarintDecoderScalar:
+      return true;
+    case kVarintDecoderSWAR:
+      return kLittleEndian;
+    case kVarintDecoderBMI2:
+      return GetVarintDecoder() == kVarintDecoderBMI2;
+  }
+  return false;
+}
+
+const char* GetVarint32ArrayWith(VarintDecoder decoder, const char* p, const char* limit, uint32_t* values, size_t n) {
+  return DecodeArrayWith(decoder, p, limit, values, n);
+}
+
+const char* GetVarint64ArrayWith(VarintDecoder decoder, const char* p, const char* limit, uint64_t* values, size_t n) {
+  return DecodeArrayWith(decoder, p, limit, values, n);
+}
+
+const char* GetVarint32Array(const char* p, const char* limit, uint32_t* values, size_t n) {
+  return DecodeArrayWith(GetVarintDecoder(), p, limit, values, n);
+}
+
+const char* GetVarint64Array(const char* p, const char* limit, uint64_t* values, size_t n) {
+  return DecodeArrayWith(GetVarintDecoder(), p, limit, values, n);
+}
+
 }  // namespace cdb
@@ -37,6 +37,33 @@ extern int GetVarint64(char* input, uint64_t size, uint64_t* value);
 extern const char* GetVarint32Ptr(const char* p,const char* limit, uint32_t* v);
 extern const char* GetVarint64Ptr(const char* p,const char* limit, uint64_t* v);
 
+// Bulk variants: decode "n" consecutive varints starting at "p" into
+// "values".  Return a pointer just past the last parsed value, or NULL if
+// the input is truncated or malformed.  Only bytes in [p..limit-1] are read.
+// The implementation is selected once at runtime from what the CPU supports.
+extern const char* GetVarint32Array(const char* p, const char* limit, uint32_t* values, size_t n);
+extern const char* GetVarint64Array(const char* p, const char* limit, uint64_t* values, size_t n);
+
+// Implementations of the bulk decoders:
+// * kVarintDecoderScalar: one byte at a time, same as GetVarint64Ptr
+// * kVarintDecoderSWAR:   one 64-bit load per value, 7-bit groups compacted with shifts and masks
+// * kVarintDecoderBMI2:   SSE2 movemask finds the value boundaries in a 16-byte window,
+//                         BMI2 pext extracts each value (x86-64 only)
+enum VarintDecoder {
+  kVarintDecoderScalar = 0,
+  kVarintDecoderSWAR   = 1,
+  kVarintDecoderBMI2   = 2,
+};
+
+// Returns the decoder used by GetVarint32Array() and GetVarint64Array()
+extern VarintDecoder GetVarintDecoder();
+// Returns false if "decoder" is not supported by this CPU
+extern bool IsVarintDecoderSupported(VarintDecoder decoder);
+// Same as the bulk variants above with an explicit decoder, used by benchmarks
+// REQUIRES: IsVarintDecoderSupported(decoder)
+extern const char* GetVarint32ArrayWith(VarintDecoder decoder, const char* p, const char* limit, uint32_t* values, size_t n);
+extern const char* GetVarint64ArrayWith(VarintDecoder decoder, const char* p, const char* limit, uint64_t* values, size_t n);
+
 // Returns the length of the varint32 or varint64 encoding of "v"
 extern int VarintLength(uint64_t v);
 
@@ -31,6 +31,8 @@ struct Entry{
   EntryType op_type;
   std::string key;
   std::string value;//可能过大被拆分
+  //在调用者线程中计算一次，Cache、写入和索引都使用这个值
+  uint64_t hashed_key;
 
   //TO-DO 支持大value的写 可以作拆分
   // uint64_t offset;//该entry对于其所属的某个大value的偏移
@@ -0,0 +1,35 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : hash.h
+ * Description   : key 的哈希函数。新文件使用 XXH3-64，旧格式的文件使用 XXH64
+ *                 xxh3.h 以 XXH_INLINE_ALL 方式包含 xxhash.h，同一个编译单元中不要再包含 util/xxhash.h
+ * *******************************************************/
+#ifndef CUCKOODB_HASH_H_
+#define CUCKOODB_HASH_H_
+
+#include <stdint.h>
+#include <string>
+
+#include "util/xxh3.h"
+
+namespace cdb {
+
+//索引、HintData 和 Cache 中使用的 hashed_key
+inline uint64_t HashKey(const char* data, size_t size) {
+  return XXH3_64bits(data, size);
+}
+
+inline uint64_t HashKey(const std::string& key) {
+  return HashKey(key.data(), key.size());
+}
+
+//没有 kFormatHashXXH3 标志的旧文件中 HintData 和 Entry 头部记录的 hash
+inline uint64_t HashKeyLegacy(const char* data, size_t size) {
+  return XXH64(data, size, 0);
+}
+
+}  // namespace cdb
+
+#endif  // CUCKOODB_HASH_H_
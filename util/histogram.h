@@ -0,0 +1,158 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : histogram.h
+ * Description   : 延迟直方图，桶的上界按约 1.25 倍递增，用于统计百分位数
+ *                 不是线程安全的，每个线程使用自己的 Histogram，结束后 Merge
+ * *******************************************************/
+#ifndef CUCKOODB_HISTOGRAM_H_
+#define CUCKOODB_HISTOGRAM_H_
+
+#include <stdint.h>
+#include <math.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace cdb {
+
+class Histogram {
+ public:
+  Histogram() {
+    Clear();
+  }
+
+  void Clear() {
+    min_ = GetBucketLimits().back();
+    max_ = 0;
+    num_ = 0;
+    sum_ = 0;
+    sum_squares_ = 0;
+    buckets_.assign(GetBucketLimits().size(), 0);
+  }
+
+  void Add(double value) {
+    const std::vector<double>& limits = GetBucketLimits();
+    size_t b = std::upper_bound(limits.begin(), limits.end() - 1, value) - limits.begin();
+    buckets_[b] += 1;
+    if (min_ > value) min_ = value;
+    if (max_ < value) max_ = value;
+    num_++;
+    sum_ += value;
+    sum_squares_ += value * value;
+  }
+
+  void Merge(const Histogram& other) {
+    if (other.min_ < min_) min_ = other.min_;
+    if (other.max_ > max_) max_ = other.max_;
+    num_ += other.num_;
+    sum_ += other.sum_;
+    sum_squares_ += other.sum_squares_;
+    for (size_t b = 0; b < buckets_.size(); b++) {
+      buckets_[b] += other.buckets_[b];
+    }
+  }
+
+  uint64_t Count() const { return num_; }
+  double Min() const { return num_ == 0 ? 0 : min_; }
+  double Max() const { return max_; }
+
+  double Average() const {
+    if (num_ == 0) return 0;
+    return sum_ / num_;
+  }
+
+  double StandardDeviation() const {
+    if (num_ == 0) return 0;
+    double variance = (sum_squares_ * num_ - sum_ * sum_) / ((double)num_ * num_);
+    return sqrt(std::max(0.0, variance));
+  }
+
+  //在桶内做线性插值
+  double Percentile(double p) const {
+    if (num_ == 0) return 0;
+    const std::vector<double>& limits = GetBucketLimits();
+    double threshold = num_ * (p / 100.0);
+    double sum = 0;
+    for (size_t b = 0; b < buckets_.size(); b++) {
+      sum += buckets_[b];
+      if (sum >= threshold) {
+        double left_point = (b == 0) ? 0 : limits[b - 1];
+        double right_point = limits[b];
+        double left_sum = sum - buckets_[b];
+        double pos = buckets_[b] == 0 ? 0 : (threshold - left_sum) / buckets_[b];
+        double r = left_point + (right_point - left_point) * pos;
+        return std::max(Min(), std::min(max_, r));
+      }
+    }
+    return max_;
+  }
+
+  double Median() const {
+    return Percentile(50.0);
+  }
+
+  std::string ToString() const {
+    std::string r;
+    char buf[200];
+    snprintf(buf, sizeof(buf), "Count: %llu  Average: %.4f  StdDev: %.2f\n",
+             (unsigned long long)num_, Average(), StandardDeviation());
+    r.append(buf);
+    snprintf(buf, sizeof(buf), "Min: %.4f  Median: %.4f  Max: %.4f\n", Min(), Median(), max_);
+    r.append(buf);
+    snprintf(buf, sizeof(buf), "Percentiles: P50: %.2f  P90: %.2f  P99: %.2f  P99.9: %.2f  P99.99: %.2f\n",
+             Percentile(50), Percentile(90), Percentile(99), Percentile(99.9), Percentile(99.99));
+    r.append(buf);
+    r.append("------------------------------------------------------\n");
+    if (num_ == 0) return r;
+
+    const std::vector<double>& limits = GetBucketLimits();
+    const double mult = 100.0 / num_;
+    double sum = 0;
+    for (size_t b = 0; b < buckets_.size(); b++) {
+      if (buckets_[b] == 0) continue;
+      sum += buckets_[b];
+      snprintf(buf, sizeof(buf), "[ %9.0f, %9.0f ) %8llu %7.3f%% %7.3f%% ",
+               (b == 0) ? 0.0 : limits[b - 1], limits[b],
+               (unsigned long long)buckets_[b], mult * buckets_[b], mult * sum);
+      r.append(buf);
+      //每 20 个 # 表示 100%
+      int marks = static_cast<int>(20 * (buckets_[b] / (double)num_) + 0.5);
+      r.append(marks, '#');
+      r.push_back('\n');
+    }
+    return r;
+  }
+
+ private:
+  //1, 2, 3, ... 每个上界约为前一个的 1.25 倍并取整，最后一个桶没有上界
+  static const std::vector<double>& GetBucketLimits() {
+    static const std::vector<double> limits = MakeBucketLimits();
+    return limits;
+  }
+
+  static std::vector<double> MakeBucketLimits() {
+    std::vector<double> limits;
+    double limit = 1;
+    while (limit < 1e13) {
+      limits.push_back(limit);
+      double next = floor(limit * 1.25);
+      limit = std::max(next, limit + 1);
+    }
+    limits.push_back(1e200);
+    return limits;
+  }
+
+  double min_;
+  double max_;
+  uint64_t num_;
+  double sum_;
+  double sum_squares_;
+  std::vector<uint64_t> buckets_;
+};
+
+}  // namespace cdb
+
+#endif  // CUCKOODB_HISTOGRAM_H_
@@ -12,6 +12,7 @@
 namespace cdb {
 
 bool Logger::is_syslog_open_ = false;
+std::atomic<bool> Logger::async_(false);
 int Logger::level_ = Logger::kLogLevelSILENT;
 int Logger::log_target_ = Logger::kLogTargetStderr;
 std::string Logger::syslog_ident_ = "cdb";
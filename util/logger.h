@@ -22,14 +22,24 @@
 #include <sstream>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <iostream>
 #include <iomanip>
 #include <cstdarg>
 #include <utility>
 
 
+//编译时保留的最高日志级别，取值同 Logger::Loglevel。级别更高 (更详细) 的 CDB_LOG_* 调用的条件
+//在编译时为假，调用和参数的求值都会被删除，参数仍然会做类型检查。Makefile 中通过 LOG_LEVEL_MAX 设置
+#ifndef CDB_LOG_LEVEL_MAX
+#define CDB_LOG_LEVEL_MAX 9
+#endif
+
 namespace cdb{
 
+//异步模式下 Logv() 把消息交给 AsyncLogger，定义在 async_logger.cc
+void AsyncLogAppend(int level_syslog, const char* logname, const char* format, va_list args);
+
 class Logger {
  public:
   Logger(std::string name) { }
@@ -53,10 +63,12 @@ class Logger {
                    const char* logname,
                    const char* format,
                    va_list args) {
-    if (log_target_ == Logger::kLogTargetStderr) {
-      if (level > current_level()) return;
-      if (thread_safe) mutex_.lock();
+    if (!IsEnabled(level)) return;
+    if (is_async()) {
+      AsyncLogAppend(level_syslog, logname, format, args);
+      return;
     }
+    if (log_target_ == Logger::kLogTargetStderr && thread_safe) mutex_.lock();
 
     char buffer[512];
     for (int iter = 0; iter < 2; iter++) {
@@ -119,11 +131,7 @@ class Logger {
       if (log_target_ == Logger::kLogTargetStderr) {
         fprintf(stderr, "%s\n", base);
       } else if (log_target_ == Logger::kLogTargetSyslog) {
-        if (!Logger::is_syslog_open_) {
-          openlog(syslog_ident_.c_str(), 0, LOG_USER);
-          Logger::is_syslog_open_ = true;
-        }
-        syslog(LOG_USER | level_syslog, "%s", base);
+        WriteSyslog(level_syslog, base);
       }
 
       if (base != buffer) {
@@ -137,6 +145,23 @@ class Logger {
     }
   }
 
+  static void WriteSyslog(int level_syslog, const char* message) {
+    if (!Logger::is_syslog_open_) {
+      openlog(syslog_ident_.c_str(), 0, LOG_USER);
+      Logger::is_syslog_open_ = true;
+    }
+    syslog(LOG_USER | level_syslog, "%s", message);
+  }
+
+  //异步模式：调用者只把消息格式化到当前线程的环形缓冲区，时间戳的格式化和写入由后台线程批量完成，
+  //缓冲区满时丢弃消息并计数。关闭时先写出已经缓冲的消息。定义在 async_logger.cc
+  static void set_async(bool async);
+  static bool is_async() { return async_.load(std::memory_order_relaxed); }
+
+  static int target() { return log_target_; }
+
+  //内联的级别检查，CDB_LOG_* 在求值参数之前调用
+  static bool IsEnabled(int level) { return level <= CDB_LOG_LEVEL_MAX && level <= level_; }
   static int current_level() { return level_; }
   static void set_current_level(int l) { level_ = l; }
   static int set_current_level(const char* l_in) {
@@ -197,6 +222,7 @@ class Logger {
 
  private:
   static bool is_syslog_open_;
+  static std::atomic<bool> async_;
   static int level_;
   static std::mutex mutex_;
   static int log_target_;
@@ -204,9 +230,11 @@ class Logger {
 };
 
 
+//函数形式的日志，参数总是会被求值。热路径上使用下面的 CDB_LOG_* 宏
 class log {
  public:
   static void emerg(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelEMERG)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(false, Logger::kLogLevelEMERG, LOG_EMERG, logname, format, args);
@@ -214,6 +242,7 @@ class log {
   }
 
   static void alert(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelALERT)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(true, Logger::kLogLevelALERT, LOG_ALERT, logname, format, args);
@@ -221,6 +250,7 @@ class log {
   }
 
   static void crit(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelCRIT)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(true, Logger::kLogLevelCRIT, LOG_CRIT, logname, format, args);
@@ -228,6 +258,7 @@ class log {
   }
 
   static void error(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelERROR)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(true, Logger::kLogLevelERROR, LOG_ERR, logname, format, args);
@@ -235,6 +266,7 @@ class log {
   }
 
   static void warn(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelWARN)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(true, Logger::kLogLevelWARN, LOG_WARNING, logname, format, args);
@@ -242,6 +274,7 @@ class log {
   }
 
   static void notice(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelNOTICE)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(true, Logger::kLogLevelNOTICE, LOG_NOTICE, logname, format, args);
@@ -249,6 +282,7 @@ class log {
   }
 
     static void info(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelINFO)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(true, Logger::kLogLevelINFO, LOG_INFO, logname, format, args);
@@ -256,6 +290,7 @@ class log {
   }
 
   static void debug(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelDEBUG)) return;
     va_list args;
     va_start(args, format);
     Logger::Logv(true, Logger::kLogLevelDEBUG, LOG_DEBUG, logname, format, args);
@@ -263,6 +298,7 @@ class log {
   }
 
   static void trace(const char* logname, const char* format, ...) {
+    if (!Logger::IsEnabled(Logger::kLogLevelTRACE)) return;
     va_list args;
     va_start(args, format);
     // No TRACE level in syslog, so using DEBUG instead
@@ -274,4 +310,23 @@ class log {
 
 }
 
+//先做内联的级别检查，禁用的级别不求值参数，也不调用 Logv()。emerg 不加锁，与 log::emerg() 相同
+#define CDB_LOG(level, level_syslog, thread_safe, logname, ...)                        \
+  do {                                                                                \
+    if (cdb::Logger::IsEnabled(level)) {                                              \
+      cdb::Logger::Logv(thread_safe, level, level_syslog, logname, __VA_ARGS__);      \
+    }                                                                                 \
+  } while (0)
+
+#define CDB_LOG_EMERG(logname, ...)  CDB_LOG(cdb::Logger::kLogLevelEMERG, LOG_EMERG, false, logname, __VA_ARGS__)
+#define CDB_LOG_ALERT(logname, ...)  CDB_LOG(cdb::Logger::kLogLevelALERT, LOG_ALERT, true, logname, __VA_ARGS__)
+#define CDB_LOG_CRIT(logname, ...)   CDB_LOG(cdb::Logger::kLogLevelCRIT, LOG_CRIT, true, logname, __VA_ARGS__)
+#define CDB_LOG_ERROR(logname, ...)  CDB_LOG(cdb::Logger::kLogLevelERROR, LOG_ERR, true, logname, __VA_ARGS__)
+#define CDB_LOG_WARN(logname, ...)   CDB_LOG(cdb::Logger::kLogLevelWARN, LOG_WARNING, true, logname, __VA_ARGS__)
+#define CDB_LOG_NOTICE(logname, ...) CDB_LOG(cdb::Logger::kLogLevelNOTICE, LOG_NOTICE, true, logname, __VA_ARGS__)
+#define CDB_LOG_INFO(logname, ...)   CDB_LOG(cdb::Logger::kLogLevelINFO, LOG_INFO, true, logname, __VA_ARGS__)
+#define CDB_LOG_DEBUG(logname, ...)  CDB_LOG(cdb::Logger::kLogLevelDEBUG, LOG_DEBUG, true, logname, __VA_ARGS__)
+// No TRACE level in syslog, so using DEBUG instead
+#define CDB_LOG_TRACE(logname, ...)  CDB_LOG(cdb::Logger::kLogLevelTRACE, LOG_DEBUG, true, logname, __VA_ARGS__)
+
 #endif
@@ -0,0 +1,167 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : mutex.h
+ * Description   : 带竞争统计的互斥锁。先 try_lock，失败时才计时等待，没有竞争时只多一次计数；
+ *                 计数在持有锁时更新，不需要原子的读-改-写。
+ *                 每个实例有名字并登记到 MutexStats，同名的实例 (例如每个分片的同一把锁) 汇总在一起；
+ *                 等待也计入当前线程的 PerfContext
+ * *******************************************************/
+#ifndef CUCKOODB_MUTEX_H_
+#define CUCKOODB_MUTEX_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "util/perf_context.h"
+
+namespace cdb {
+
+struct MutexCounters {
+  uint64_t num_acquisitions;
+  uint64_t num_contended;     //try_lock 失败、需要等待的次数
+  uint64_t nanos_wait;        //等待的总时间
+
+  MutexCounters() : num_acquisitions(0), num_contended(0), nanos_wait(0) {}
+
+  void Add(const MutexCounters& other) {
+    num_acquisitions += other.num_acquisitions;
+    num_contended += other.num_contended;
+    nanos_wait += other.nanos_wait;
+  }
+
+  void Subtract(const MutexCounters& other) {
+    num_acquisitions -= other.num_acquisitions;
+    num_contended -= other.num_contended;
+    nanos_wait -= other.nanos_wait;
+  }
+};
+
+class InstrumentedMutex;
+
+//所有 InstrumentedMutex 的登记表，已析构的实例的计数累加到 retired_ 中
+class MutexStats {
+ public:
+  //按名字汇总的计数，从进程启动开始累计，两次快照相减得到一段时间内的计数
+  static std::map<std::string, MutexCounters> Snapshot();
+
+  static void Register(InstrumentedMutex* mutex);
+  static void Unregister(InstrumentedMutex* mutex);
+
+ private:
+  static MutexStats& Instance() {
+    static MutexStats* stats = new MutexStats();
+    return *stats;
+  }
+
+  std::mutex mutex_;
+  std::vector<InstrumentedMutex*> mutexes_;
+  std::map<std::string, MutexCounters> retired_;
+};
+
+//满足 Lockable，可以用于 std::unique_lock<InstrumentedMutex>。
+//与 std::condition_variable 一起使用时通过 native() 加锁，这样的加锁不计入统计
+class InstrumentedMutex {
+ public:
+  explicit InstrumentedMutex(const char* name) : name_(name) {
+    num_acquisitions_.store(0, std::memory_order_relaxed);
+    num_contended_.store(0, std::memory_order_relaxed);
+    nanos_wait_.store(0, std::memory_order_relaxed);
+    MutexStats::Register(this);
+  }
+
+  ~InstrumentedMutex() {
+    MutexStats::Unregister(this);
+  }
+
+  InstrumentedMutex(const InstrumentedMutex&) = delete;
+  InstrumentedMutex& operator=(const InstrumentedMutex&) = delete;
+
+  void lock() {
+    if (mutex_.try_lock()) {
+      Increment(num_acquisitions_, 1);
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    mutex_.lock();
+    uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    Increment(num_acquisitions_, 1);
+    Increment(num_contended_, 1);
+    Increment(nanos_wait_, nanos);
+    PERF_COUNTER_ADD(lock_waits, 1);
+    PERF_COUNTER_ADD(lock_wait_nanos, nanos);
+  }
+
+  bool try_lock() {
+    if (!mutex_.try_lock()) return false;
+    Increment(num_acquisitions_, 1);
+    return true;
+  }
+
+  void unlock() {
+    mutex_.unlock();
+  }
+
+  std::mutex& native() {
+    return mutex_;
+  }
+
+  const char* name() const {
+    return name_;
+  }
+
+  MutexCounters GetCounters() const {
+    MutexCounters counters;
+    counters.num_acquisitions = num_acquisitions_.load(std::memory_order_relaxed);
+    counters.num_contended = num_contended_.load(std::memory_order_relaxed);
+    counters.nanos_wait = nanos_wait_.load(std::memory_order_relaxed);
+    return counters;
+  }
+
+ private:
+  //只在持有 mutex_ 时调用，读取者可以随时读到完整的值
+  static void Increment(std::atomic<uint64_t>& counter, uint64_t delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+  }
+
+  std::mutex mutex_;
+  const char* name_;
+  std::atomic<uint64_t> num_acquisitions_;
+  std::atomic<uint64_t> num_contended_;
+  std::atomic<uint64_t> nanos_wait_;
+};
+
+inline void MutexStats::Register(InstrumentedMutex* mutex) {
+  MutexStats& stats = Instance();
+  std::unique_lock<std::mutex> lock(stats.mutex_);
+  stats.mutexes_.push_back(mutex);
+}
+
+inline void MutexStats::Unregister(InstrumentedMutex* mutex) {
+  MutexStats& stats = Instance();
+  std::unique_lock<std::mutex> lock(stats.mutex_);
+  auto it = std::find(stats.mutexes_.begin(), stats.mutexes_.end(), mutex);
+  if (it == stats.mutexes_.end()) return;
+  *it = stats.mutexes_.back();
+  stats.mutexes_.pop_back();
+  stats.retired_[mutex->name()].Add(mutex->GetCounters());
+}
+
+inline std::map<std::string, MutexCounters> MutexStats::Snapshot() {
+  MutexStats& stats = Instance();
+  std::unique_lock<std::mutex> lock(stats.mutex_);
+  std::map<std::string, MutexCounters> snapshot = stats.retired_;
+  for (auto mutex: stats.mutexes_) snapshot[mutex->name()].Add(mutex->GetCounters());
+  return snapshot;
+}
+
+}  // namespace cdb
+
+#endif  // CUCKOODB_MUTEX_H_
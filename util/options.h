@@ -10,9 +10,15 @@
 #ifndef CUCKOODB_INCLUDE_OPTIONS_H_
 #define CUCKOODB_INCLUDE_OPTIONS_H_
 
+#include <string>
+#include <thread>
+#include <memory>
+#include <algorithm>
 
 namespace cdb{
 
+class Statistics;
+
 class Options{
  public:
   Options(){
@@ -22,6 +28,17 @@ class Options{
     error_if_exists = 0;
     create_if_missing = 1;
     internal__close_timeout = 500;
+    compaction__check_interval = 30000;
+    compaction__size_threshold = 256 * 1024 * 1024;
+    checkpoint__interval = 300000;
+    internal__num_threads_load = std::max(1u, std::thread::hardware_concurrency());
+    internal__lazy_load = false;
+    storage__fixed_entry_header = false;
+    storage__num_shards = 1;
+    storage__advise_random_reads = true;
+    storage__advise_sequential_scans = true;
+    storage__advise_dontneed_after_compaction = true;
+    storage__datafile_size = 0;
   }
 
   ~Options(){}
@@ -33,6 +50,29 @@ class Options{
   bool error_if_exists;
   bool create_if_missing;
   uint64_t internal__close_timeout;
+  //合并线程检查的间隔(毫秒) 以及触发合并的未合并数据量(字节)
+  uint64_t compaction__check_interval;
+  uint64_t compaction__size_threshold;
+  //保存索引快照的间隔(毫秒)，为0时不保存快照
+  uint64_t checkpoint__interval;
+  //打开数据库时 并行加载数据文件的线程数
+  uint32_t internal__num_threads_load;
+  //打开数据库时只扫描目录，数据文件在后台从新到旧加载，加载期间的读取直接查找未加载文件的 HintData
+  bool internal__lazy_load;
+  //新建的数据文件使用定长、8 字节对齐的 Entry 头部，解码不需要逐个读取 varint，但每个 Entry 多占 16~24 字节
+  bool storage__fixed_entry_header;
+  //按 hashed_key 把 key 分到多个分片，每个分片一个子目录，有独立的写线程和索引。为1时不分片
+  uint32_t storage__num_shards;
+  //数据文件映射的 madvise 策略：点查询的映射使用 MADV_RANDOM，避免预读用不到的相邻页；
+  //加载和合并顺序读取时使用 MADV_SEQUENTIAL 和 MADV_WILLNEED；合并完成后对输入文件使用 MADV_DONTNEED
+  bool storage__advise_random_reads;
+  bool storage__advise_sequential_scans;
+  bool storage__advise_dontneed_after_compaction;
+  //新数据文件写满的大小(字节)，为0时使用 SIZE_DATA_FILE。文件越小，打开数据库时要加载的文件越多
+  uint32_t storage__datafile_size;
+  //各组件共用的计数器和延迟直方图，CuckooDB 在为空时创建一个，通过 CuckooDB::GetProperty() 读取。
+  //不需要直方图时传入 new Statistics(false)，省去每次操作读取时钟
+  std::shared_ptr<Statistics> statistics;
 
 };
 
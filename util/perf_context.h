@@ -0,0 +1,199 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : perf_context.h
+ * Description   : 当前线程的操作计数和耗时。PerfContext 和 PerfLevel 都是 thread_local，
+ *                 记录时不需要原子操作和加锁；默认关闭，关闭时每个记录点只多一次判断。
+ *                 用法: SetPerfLevel(kPerfEnableTime); GetPerfContext()->Reset(); db->Get(...);
+ *                       printf("%s", GetPerfContext()->ToString().c_str());
+ * *******************************************************/
+#ifndef CUCKOODB_PERF_CONTEXT_H_
+#define CUCKOODB_PERF_CONTEXT_H_
+
+#include <stdint.h>
+#include <cinttypes>
+#include <cstdio>
+#include <chrono>
+#include <string>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+namespace cdb {
+
+enum PerfLevel : int {
+  kPerfDisable = 0,
+  //只记录计数
+  kPerfEnableCount = 1,
+  //另外记录各阶段的耗时，每个阶段读取两次时钟
+  kPerfEnableTime = 2,
+  //另外用 getrusage() 记录 StorageEngine 读取数据文件时的缺页，每次读取多两次系统调用
+  kPerfEnablePageFaults = 3
+};
+
+struct PerfContext {
+  //StorageEngine 查找时读取的索引条目数，以及其中 hashed_key 相同但 key 不同的条目数
+  uint64_t index_probes;
+  uint64_t hash_collisions;
+  //从 cache 或数据文件拷贝给调用者的 key 和 value 字节数
+  uint64_t bytes_copied;
+  //FilePool::GetFile() 次数，以及其中需要新建映射的次数
+  uint64_t filepool_lookups;
+  uint64_t filepool_mmaps;
+  //读取数据文件映射时发生的缺页，major 需要读磁盘
+  uint64_t page_faults_minor;
+  uint64_t page_faults_major;
+  //InstrumentedMutex 需要等待的次数和等待时间
+  uint64_t lock_waits;
+  uint64_t lock_wait_nanos;
+  //各阶段的耗时
+  uint64_t cache_get_nanos;
+  uint64_t storage_get_nanos;
+  uint64_t get_entry_nanos;
+  uint64_t cache_write_nanos;
+
+  void Reset() {
+    *this = PerfContext();
+  }
+
+  void Add(const PerfContext& other) {
+    index_probes += other.index_probes;
+    hash_collisions += other.hash_collisions;
+    bytes_copied += other.bytes_copied;
+    filepool_lookups += other.filepool_lookups;
+    filepool_mmaps += other.filepool_mmaps;
+    page_faults_minor += other.page_faults_minor;
+    page_faults_major += other.page_faults_major;
+    lock_waits += other.lock_waits;
+    lock_wait_nanos += other.lock_wait_nanos;
+    cache_get_nanos += other.cache_get_nanos;
+    storage_get_nanos += other.storage_get_nanos;
+    get_entry_nanos += other.get_entry_nanos;
+    cache_write_nanos += other.cache_write_nanos;
+  }
+
+  //exclude_zero 为 true 时不输出为 0 的字段
+  std::string ToString(bool exclude_zero=false) const {
+    std::string out;
+    Append(&out, "index_probes", index_probes, exclude_zero);
+    Append(&out, "hash_collisions", hash_collisions, exclude_zero);
+    Append(&out, "bytes_copied", bytes_copied, exclude_zero);
+    Append(&out, "filepool_lookups", filepool_lookups, exclude_zero);
+    Append(&out, "filepool_mmaps", filepool_mmaps, exclude_zero);
+    Append(&out, "page_faults_minor", page_faults_minor, exclude_zero);
+    Append(&out, "page_faults_major", page_faults_major, exclude_zero);
+    Append(&out, "lock_waits", lock_waits, exclude_zero);
+    Append(&out, "lock_wait_nanos", lock_wait_nanos, exclude_zero);
+    Append(&out, "cache_get_nanos", cache_get_nanos, exclude_zero);
+    Append(&out, "storage_get_nanos", storage_get_nanos, exclude_zero);
+    Append(&out, "get_entry_nanos", get_entry_nanos, exclude_zero);
+    Append(&out, "cache_write_nanos", cache_write_nanos, exclude_zero);
+    if (out.size() >= 2) out.resize(out.size() - 2);
+    return out;
+  }
+
+ private:
+  static void Append(std::string* out, const char* name, uint64_t value, bool exclude_zero) {
+    if (exclude_zero && value == 0) return;
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%s = %" PRIu64 ", ", name, value);
+    out->append(buffer);
+  }
+};
+
+inline PerfLevel& PerfLevelOfThread() {
+  static thread_local PerfLevel level = kPerfDisable;
+  return level;
+}
+
+inline void SetPerfLevel(PerfLevel level) {
+  PerfLevelOfThread() = level;
+}
+
+inline PerfLevel GetPerfLevel() {
+  return PerfLevelOfThread();
+}
+
+//PerfContext 没有构造函数，thread_local 变量是常量初始化的，访问时不需要检查是否已经初始化
+inline PerfContext* GetPerfContext() {
+  static thread_local PerfContext context = PerfContext();
+  return &context;
+}
+
+//PerfLevel 至少为 kPerfEnableCount 时增加当前线程的计数
+#define PERF_COUNTER_ADD(metric, value)                                  \
+  do {                                                                   \
+    if (cdb::GetPerfLevel() >= cdb::kPerfEnableCount) {                  \
+      cdb::GetPerfContext()->metric += (value);                          \
+    }                                                                    \
+  } while (0)
+
+//析构时把构造以来的时间加到 metric 上，PerfLevel 低于 kPerfEnableTime 时不读取时钟
+class PerfTimer {
+ public:
+  explicit PerfTimer(uint64_t* metric)
+      : metric_(GetPerfLevel() >= kPerfEnableTime ? metric : nullptr),
+        start_(metric_ != nullptr ? NowNanos() : 0) {}
+
+  ~PerfTimer() {
+    if (metric_ != nullptr) *metric_ += NowNanos() - start_;
+  }
+
+  PerfTimer(const PerfTimer&) = delete;
+  PerfTimer& operator=(const PerfTimer&) = delete;
+
+ private:
+  static uint64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  uint64_t* metric_;
+  uint64_t start_;
+};
+
+#define PERF_TIMER_GUARD(metric) cdb::PerfTimer perf_timer_ ## metric(&cdb::GetPerfContext()->metric)
+
+//析构时把构造以来当前线程的缺页数加到 PerfContext 上，PerfLevel 低于 kPerfEnablePageFaults 时不做任何事
+class PerfPageFaultGuard {
+ public:
+  PerfPageFaultGuard()
+      : enabled_(GetPerfLevel() >= kPerfEnablePageFaults) {
+    if (enabled_) GetFaults(&minor_, &major_);
+  }
+
+  ~PerfPageFaultGuard() {
+    if (!enabled_) return;
+    uint64_t minor = 0, major = 0;
+    GetFaults(&minor, &major);
+    GetPerfContext()->page_faults_minor += minor - minor_;
+    GetPerfContext()->page_faults_major += major - major_;
+  }
+
+  PerfPageFaultGuard(const PerfPageFaultGuard&) = delete;
+  PerfPageFaultGuard& operator=(const PerfPageFaultGuard&) = delete;
+
+ private:
+  static void GetFaults(uint64_t* minor, uint64_t* major) {
+    struct rusage usage;
+#ifdef RUSAGE_THREAD
+    int who = RUSAGE_THREAD;
+#else
+    //没有 RUSAGE_THREAD 时使用整个进程的缺页，其他线程的缺页也会计入
+    int who = RUSAGE_SELF;
+#endif
+    if (getrusage(who, &usage) != 0) {
+      *minor = *major = 0;
+      return;
+    }
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+  }
+
+  bool enabled_;
+  uint64_t minor_;
+  uint64_t major_;
+};
+
+}  // namespace cdb
+
+#endif  // CUCKOODB_PERF_CONTEXT_H_
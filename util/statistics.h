@@ -0,0 +1,330 @@
+/**********************************************************
+ * Copyright (c) 2019 The CuckooDB Authors. All rights reserved.
+ * Author        : Dongyuan Pan
+ * Email         : 641234230@qq.com
+ * Filename      : statistics.h
+ * Description   : 数据库的计数器 (ticker) 和各阶段的延迟直方图。每个线程固定使用一组计数器，
+ *                 不同的组在不同的缓存行上，记录时只有不会竞争的原子操作，不加锁；读取时把所有组相加。
+ *                 通过 Options::statistics 传给各个组件，CuckooDB::GetProperty() 读取
+ * *******************************************************/
+#ifndef CUCKOODB_STATISTICS_H_
+#define CUCKOODB_STATISTICS_H_
+
+#include <stdint.h>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace cdb {
+
+enum Ticker : uint32_t {
+  //Get 在哪里找到：live cache、swap cache、StorageEngine，或者没有找到 (包括已删除)
+  kGetHitLive = 0,
+  kGetHitSwap,
+  kGetHitStorage,
+  kGetMiss,
+  //用户写入和删除的 key 数，以及 key + value 的字节数；读取回传的 value 字节数
+  kKeysWritten,
+  kKeysDeleted,
+  kBytesWritten,
+  kBytesRead,
+  //数据文件：写缓冲刷到文件的次数和字节数 (包括合并)，fdatasync 次数，新建的文件数
+  kFlushes,
+  kBytesFlushed,
+  kFsyncs,
+  kFilesCreated,
+  //FilePool：不加锁命中、新建映射、淘汰映射
+  kFilePoolHits,
+  kFilePoolMisses,
+  kFilePoolEvictions,
+  //StorageEngine 查找时读取的索引条目数，以及其中 hashed_key 相同但 key 不同的条目数
+  kIndexProbes,
+  kHashCollisions,
+  kCompactions,
+  kCheckpoints,
+  kNumTickers
+};
+
+//延迟直方图，单位为纳秒
+enum HistogramType : uint32_t {
+  //用户操作的整个过程
+  kHistGet = 0,
+  kHistPut,
+  kHistDelete,
+  //Cache::Run() 等待 StorageEngine 把 swap cache 写入文件
+  kHistFlushCacheWait,
+  //DateFileManager::WriteEntrys()，包括写文件和 fdatasync
+  kHistWriteEntrys,
+  kHistFsync,
+  //RunIndex() 把一批写入的位置插入索引，包括每 internal__num_iterations_per_lock 次获取写锁的等待
+  kHistIndexUpdate,
+  //清空 swap cache 之前等待读取 swap cache 的线程结束
+  kHistClearCacheDrain,
+  //StorageEngine::GetEntry()：映射文件、解码 Entry 头部、拷贝 key 和 value
+  kHistGetEntry,
+  kNumHistograms
+};
+
+//从分桶的计数算出的直方图摘要，百分位数在桶内线性插值
+struct HistogramData {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  double average;
+  double p50;
+  double p90;
+  double p99;
+  double p999;
+  double p9999;
+};
+
+class Statistics {
+ public:
+  //measure_time 为 false 时 StopWatch 不读取时钟，只记录计数器
+  explicit Statistics(bool measure_time=true)
+      : measure_time_(measure_time) {
+    Reset();
+  }
+
+  //C++11 的 new 不保证 alignas(64) 的对齐
+  static void* operator new(size_t size) {
+    void* p = nullptr;
+    if (posix_memalign(&p, 64, size) != 0) throw std::bad_alloc();
+    return p;
+  }
+
+  static void operator delete(void* p) {
+    free(p);
+  }
+
+  Statistics(const Statistics&) = delete;
+  Statistics& operator=(const Statistics&) = delete;
+
+  void Record(Ticker ticker, uint64_t count=1) {
+    slots_[GetSlotIndex()].counters[ticker].fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void MeasureTime(HistogramType type, uint64_t nanos) {
+    HistogramSlot& slot = histograms_[GetSlotIndex() % kNumHistogramSlots][type];
+    slot.buckets[GetBucket(nanos)].fetch_add(1, std::memory_order_relaxed);
+    slot.sum.fetch_add(nanos, std::memory_order_relaxed);
+    uint64_t max = slot.max.load(std::memory_order_relaxed);
+    while (nanos > max && !slot.max.compare_exchange_weak(max, nanos, std::memory_order_relaxed)) {}
+  }
+
+  bool IsMeasureTime() const {
+    return measure_time_;
+  }
+
+  //各组之间不是同一时刻的值，但每个计数器只增不减
+  uint64_t Get(Ticker ticker) const {
+    uint64_t sum = 0;
+    for (auto& slot: slots_) sum += slot.counters[ticker].load(std::memory_order_relaxed);
+    return sum;
+  }
+
+  HistogramData GetHistogramData(HistogramType type) const {
+    std::vector<uint64_t> buckets(kNumBuckets, 0);
+    HistogramData data;
+    data.count = 0;
+    data.sum = 0;
+    data.max = 0;
+    for (auto& histograms: histograms_) {
+      const HistogramSlot& slot = histograms[type];
+      for (uint32_t b = 0; b < kNumBuckets; b++) buckets[b] += slot.buckets[b].load(std::memory_order_relaxed);
+      data.sum += slot.sum.load(std::memory_order_relaxed);
+      data.max = std::max(data.max, slot.max.load(std::memory_order_relaxed));
+    }
+    for (auto count: buckets) data.count += count;
+    data.average = data.count == 0 ? 0 : (double)data.sum / data.count;
+    data.p50 = Percentile(buckets, data.count, data.max, 50);
+    data.p90 = Percentile(buckets, data.count, data.max, 90);
+    data.p99 = Percentile(buckets, data.count, data.max, 99);
+    data.p999 = Percentile(buckets, data.count, data.max, 99.9);
+    data.p9999 = Percentile(buckets, data.count, data.max, 99.99);
+    return data;
+  }
+
+  void Reset() {
+    for (auto& slot: slots_) {
+      for (auto& counter: slot.counters) counter.store(0, std::memory_order_relaxed);
+    }
+    for (auto& histograms: histograms_) {
+      for (auto& slot: histograms) {
+        for (auto& bucket: slot.buckets) bucket.store(0, std::memory_order_relaxed);
+        slot.sum.store(0, std::memory_order_relaxed);
+        slot.max.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  //属性名为 "cdb." 加上这里的名字
+  static const char* GetTickerName(Ticker ticker) {
+    static const char* names[kNumTickers] = {
+      "get-hit-live",
+      "get-hit-swap",
+      "get-hit-storage",
+      "get-miss",
+      "keys-written",
+      "keys-deleted",
+      "bytes-written",
+      "bytes-read",
+      "flushes",
+      "bytes-flushed",
+      "fsyncs",
+      "files-created",
+      "filepool-hits",
+      "filepool-misses",
+      "filepool-evictions",
+      "index-probes",
+      "hash-collisions",
+      "compactions",
+      "checkpoints",
+    };
+    return names[ticker];
+  }
+
+  static const char* GetHistogramName(HistogramType type) {
+    static const char* names[kNumHistograms] = {
+      "get",
+      "put",
+      "delete",
+      "flush-cache-wait",
+      "write-entrys",
+      "fsync",
+      "index-update",
+      "clear-cache-drain",
+      "get-entry",
+    };
+    return names[type];
+  }
+
+  //每个直方图一行，单位为微秒，没有记录的直方图不输出
+  std::string HistogramsToString() const {
+    std::string out;
+    char buffer[256];
+    snprintf(buffer, sizeof(buffer), "%-18s %12s %10s %10s %10s %10s %10s %10s %10s\n",
+             "histogram(us)", "count", "avg", "p50", "p90", "p99", "p99.9", "p99.99", "max");
+    out.append(buffer);
+    for (uint32_t i = 0; i < kNumHistograms; i++) {
+      HistogramData data = GetHistogramData(static_cast<HistogramType>(i));
+      if (data.count == 0) continue;
+      snprintf(buffer, sizeof(buffer), "%-18s %12" PRIu64 " %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+               GetHistogramName(static_cast<HistogramType>(i)), data.count, data.average / 1000,
+               data.p50 / 1000, data.p90 / 1000, data.p99 / 1000, data.p999 / 1000, data.p9999 / 1000, data.max / 1000.0);
+      out.append(buffer);
+    }
+    return out;
+  }
+
+  std::string ToString() const {
+    std::string out;
+    char buffer[128];
+    for (uint32_t i = 0; i < kNumTickers; i++) {
+      snprintf(buffer, sizeof(buffer), "%-24s %20" PRIu64 "\n", GetTickerName(static_cast<Ticker>(i)), Get(static_cast<Ticker>(i)));
+      out.append(buffer);
+    }
+    return out;
+  }
+
+ private:
+  static const uint32_t kNumSlots = 32;
+  //直方图比计数器大得多，组数少一些，线程多时共用
+  static const uint32_t kNumHistogramSlots = 16;
+  //对数-线性分桶：小于 16 的值每个值一个桶，之后每个 2 的幂次分成 8 个桶，相对误差不超过 12.5%，
+  //最后一个桶包括所有大于 2^40 纳秒 (约 18 分钟) 的值
+  static const uint32_t kNumSubBuckets = 8;
+  static const uint32_t kNumBuckets = 2 * kNumSubBuckets + (40 - 4) * kNumSubBuckets;
+
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> counters[kNumTickers];
+  };
+
+  struct alignas(64) HistogramSlot {
+    std::atomic<uint64_t> buckets[kNumBuckets];
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+  };
+
+  static uint32_t GetBucket(uint64_t value) {
+    if (value < 2 * kNumSubBuckets) return value;
+    uint32_t msb = 63 - __builtin_clzll(value);
+    uint32_t sub = (value >> (msb - 3)) & (kNumSubBuckets - 1);
+    uint32_t bucket = 2 * kNumSubBuckets + (msb - 4) * kNumSubBuckets + sub;
+    return bucket < kNumBuckets ? bucket : kNumBuckets - 1;
+  }
+
+  static uint64_t GetBucketLowerBound(uint32_t bucket) {
+    if (bucket < 2 * kNumSubBuckets) return bucket;
+    uint32_t msb = (bucket - 2 * kNumSubBuckets) / kNumSubBuckets + 4;
+    uint32_t sub = (bucket - 2 * kNumSubBuckets) % kNumSubBuckets;
+    return (uint64_t)(kNumSubBuckets + sub) << (msb - 3);
+  }
+
+  static double Percentile(const std::vector<uint64_t>& buckets, uint64_t count, uint64_t max, double p) {
+    if (count == 0) return 0;
+    double threshold = count * (p / 100.0);
+    double sum = 0;
+    for (uint32_t b = 0; b < kNumBuckets; b++) {
+      if (buckets[b] == 0) continue;
+      sum += buckets[b];
+      if (sum < threshold) continue;
+      double left = GetBucketLowerBound(b);
+      double right = (b + 1 < kNumBuckets) ? GetBucketLowerBound(b + 1) : max;
+      double pos = (threshold - (sum - buckets[b])) / buckets[b];
+      return std::min<double>(max, left + (right - left) * pos);
+    }
+    return max;
+  }
+
+  //线程第一次记录时按顺序分配，线程数超过 kNumSlots 时共用
+  static uint32_t GetSlotIndex() {
+    static std::atomic<uint32_t> next_index(0);
+    thread_local uint32_t index = next_index.fetch_add(1, std::memory_order_relaxed) % kNumSlots;
+    return index;
+  }
+
+  bool measure_time_;
+  Slot slots_[kNumSlots];
+  HistogramSlot histograms_[kNumHistogramSlots][kNumHistograms];
+};
+
+//statistics 可以为空
+inline void RecordTick(Statistics* statistics, Ticker ticker, uint64_t count=1) {
+  if (statistics != nullptr) statistics->Record(ticker, count);
+}
+
+//析构时把构造以来的时间记录到直方图，statistics 为空或者不测量时间时不读取时钟
+class StopWatch {
+ public:
+  StopWatch(Statistics* statistics, HistogramType type)
+      : statistics_(statistics != nullptr && statistics->IsMeasureTime() ? statistics : nullptr),
+        type_(type),
+        start_(statistics_ != nullptr ? NowNanos() : 0) {}
+
+  ~StopWatch() {
+    if (statistics_ != nullptr) statistics_->MeasureTime(type_, NowNanos() - start_);
+  }
+
+  StopWatch(const StopWatch&) = delete;
+  StopWatch& operator=(const StopWatch&) = delete;
+
+  static uint64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+ private:
+  Statistics* statistics_;
+  HistogramType type_;
+  uint64_t start_;
+};
+
+}  // namespace cdb
+
+#endif  // CUCKOODB_STATISTICS_H_
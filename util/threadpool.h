@@ -4,7 +4,7 @@
  * Email         : dongyuanpan0@gmail.com
  * Last modified : 2019-10-22 11:28
  * Filename      : threadpool.h
- * Description   : 
+ * Description   :
  * *******************************************************/
 
 #ifndef CUCKOODB_THREADPOOL_H_
@@ -15,16 +15,18 @@
 #include <mutex>
 #include <condition_variable>
 #include <queue>
+#include <vector>
 
 
 namespace cdb{
 
 class Task{
+ public:
   Task(){}
-  virtual ~Task{}
-  virtual void RunInLock(std::thread::id tid) = 0;
-  virtual void run(std::thread::id tid) = 0;
-}
+  virtual ~Task(){}
+  virtual void RunInLock(std::thread::id /*tid*/) {}
+  virtual void Run(std::thread::id tid) = 0;
+};
 
 
 class ThreadPool{
@@ -32,68 +34,87 @@ class ThreadPool{
  public:
   ThreadPool(int thread_num):stop(false){
     thread_num_ = thread_num;
+    num_tasks_running_ = 0;
   }
 
   ~ThreadPool(){
-    {
-       std::unique_lock<std::mutex> lock(task_queue_mutex_);
-       stop = true;
-    }
-    cond_val.notify_all();
-    for (auto& thread:worker_threads_){
-      thread.join();
-    }
+    Stop();
   }
 
+  //线程池接管 task，执行完毕后释放
   bool Append(Task* task){
     std::unique_lock<std::mutex> lock(task_queue_mutex_);
+    if (stop) return false;
     task_queue_.push(task);
     cond_val.notify_one();
+    return true;
   }
 
 
   void Worker(){
-    while(!stop){
-      std::unique_lock<std:mutex> lock(task_queue_mutex_);
-      if (task_queue_.empty()){
+    while(true){
+      std::unique_lock<std::mutex> lock(task_queue_mutex_);
+      while (!stop && task_queue_.empty()){
         cond_val.wait(lock);
-	if (stop) continue;
       }
+      if (task_queue_.empty()) return;
 
-      if (task_queue_.empty()) continue;
       Task* task = task_queue_.front();
       task_queue_.pop();
+      ++num_tasks_running_;
       task->RunInLock(std::this_thread::get_id());
       lock.unlock();
       task->Run(std::this_thread::get_id());
-      if (!IsStopRequested()) delete task;
+      delete task;
 
+      lock.lock();
+      --num_tasks_running_;
+      if (task_queue_.empty() && num_tasks_running_ == 0) cond_done_.notify_all();
     }
   }
 
 
   int Start(){
     for (int i = 0; i < thread_num_; ++i){
-      worker_threads_.push_back(std::thread(&ThreadPool::Worker, this));          
-    } 
+      worker_threads_.push_back(std::thread(&ThreadPool::Worker, this));
+    }
     return 0;
   }
 
+  //阻塞直到所有已加入的 task 都执行完毕
+  void Wait(){
+    std::unique_lock<std::mutex> lock(task_queue_mutex_);
+    while (!task_queue_.empty() || num_tasks_running_ > 0){
+      cond_done_.wait(lock);
+    }
+  }
+
+  //执行完队列中剩余的 task 后退出所有线程
   void Stop(){
-    return 0;
+    {
+       std::unique_lock<std::mutex> lock(task_queue_mutex_);
+       stop = true;
+    }
+    cond_val.notify_all();
+    for (auto& thread:worker_threads_){
+      if (thread.joinable()) thread.join();
+    }
+    worker_threads_.clear();
   }
 
 
 
  public:
   int thread_num_;
+  int num_tasks_running_;
   std::queue<Task*> task_queue_;
   std::vector<std::thread> worker_threads_;
   std::mutex task_queue_mutex_;
   std::condition_variable cond_val;
+  std::condition_variable cond_done_;
   bool stop;
 
-}
+};
 
 }//namespace cdb
 